@@ -6,6 +6,27 @@ import argparse
 from typing import Text, Optional, List, Dict, Any, Set, BinaryIO
 
 
+MAX_HASH_PROBES = 16
+
+
+def splitmix64(x: int) -> int:
+    mask = (1 << 64) - 1
+    x = (x + 0x9e3779b97f4a7c15) & mask
+    x = ((x ^ (x >> 30)) * 0xbf58476d1ce4e5b9) & mask
+    x = ((x ^ (x >> 27)) * 0x94d049bb133111eb) & mask
+    return x ^ (x >> 31)
+
+
+def hashed_columns(column: int, num_buckets: int, num_probes: int, num_exact_columns: int) -> List[int]:
+    """The codebook columns of a vocabulary term after `smap create --hash-buckets`, as in `get_hashed_columns`"""
+    if column < num_exact_columns:
+        return [column]
+    return sorted({
+        num_exact_columns + splitmix64(column * MAX_HASH_PROBES + probe) % (num_buckets - num_exact_columns)
+        for probe in range(num_probes)
+    })
+
+
 class Codebook:
 
     def __init__(self, directoryname: Text):
@@ -13,17 +34,26 @@ class Codebook:
         print(f"Reading codebook from {codebook_filename}")
         with open(codebook_filename, "br") as codebook:
             self.format = int(np.fromfile(codebook, dtype=np.uint8, count=1)[0])
-            assert self.format == 0
+            # Formats 2 and 3 are formats 0 and 1 followed by checksums
+            if self.format in (1, 3):
+                raise ValueError(
+                    f"{codebook_filename} is compressed, please convert it with "
+                    f"`smap decompress {codebook_filename} <raw codebook.bin>` first"
+                )
+            assert self.format in (0, 2)
             self.height = int(np.fromfile(codebook, dtype=np.uint64, count=1)[0])
             self.width = int(np.fromfile(codebook, dtype=np.uint64, count=1)[0])
             self.vocab_size = int(np.fromfile(codebook, dtype=np.uint64, count=1)[0])
             self._codebook = np.reshape(
-                np.fromfile(codebook, dtype=np.float32, count=-1),
+                np.fromfile(codebook, dtype=np.float32, count=self.height * self.width * self.vocab_size),
                 (self.height, self.width, self.vocab_size)
             )
         readme_filename = Path(directoryname) / "README.md"
         print(f"Reading README from {readme_filename}")
         self.readme = ""
+        self.hash_buckets = 0
+        self.hash_probes = 1
+        self.exact_hash_columns = 0
         with open(readme_filename, "r") as readme:
             for line in readme:
                 self.readme += line
@@ -31,15 +61,29 @@ class Codebook:
                     self.local_topology = line[len("Local topology:"):].strip()
                 elif line.startswith("Global topology:"):
                     self.global_topology = line[len("Global topology:"):].strip()
+                elif line.startswith("Hash buckets:"):
+                    self.hash_buckets = int(line[len("Hash buckets:"):])
+                elif line.startswith("Hash probes:"):
+                    self.hash_probes = int(line[len("Hash probes:"):])
+                elif line.startswith("Exact hash columns:"):
+                    self.exact_hash_columns = int(line[len("Exact hash columns:"):])
 
     def __str__(self) -> str:
         return f"Codebook({np.shape(self._codebook)})"
 
+    def columns(self, i: int) -> List[int]:
+        """Codebook columns of vocabulary term `i`, which are its buckets if the vocabulary was hashed"""
+        if self.hash_buckets == 0:
+            return [i]
+        return hashed_columns(i, self.hash_buckets, self.hash_probes, self.exact_hash_columns)
+
     def fingerprint(self, i: int, size: int) -> List[int]:
-        assert 0 <= i < self.vocab_size
+        columns = self.columns(i)
+        assert all(0 <= column < self.vocab_size for column in columns)
         assert 0 < size < self.vocab_size
+        # A hashed term is the mean of its buckets, where terms that share one bucket differ in the others
         weights = np.reshape(
-            self._codebook[:, :, i],
+            np.mean(self._codebook[:, :, columns], axis=2),
             (-1, )
         )
         # Return the `size` largest values
@@ -51,12 +95,22 @@ def run(
     vocabulary_filename: Text,
     output_filename: Text,
     density: Optional[int] = None,
+    permutation_filename: Optional[Text] = None,
 ) -> None:
     codebook = Codebook(codebook_filename)
     vocab: List[Text] = []
     with open(vocabulary_filename, "r", encoding="utf-8") as file:
         for word in file:
             vocab.append(word.strip())
+    # Codebook column of every term, which differs from the vocabulary order after `smap reorder`
+    columns = list(range(len(vocab)))
+    if permutation_filename:
+        with open(permutation_filename, "r") as file:
+            original_columns = [int(line) for line in file]
+        if sorted(original_columns) != columns:
+            raise ValueError(f"{permutation_filename} is not a permutation of the vocabulary")
+        for column, original_column in enumerate(original_columns):
+            columns[original_column] = column
     print("Extracting semantic map...")
     semantic_map = dict()
     if density:
@@ -64,7 +118,7 @@ def run(
     else:
         size = max(codebook.width * codebook.height // 50, 5)
     for i, word in enumerate(vocab):
-        semantic_map[word] = codebook.fingerprint(i, size)
+        semantic_map[word] = codebook.fingerprint(columns[i], size)
     print(f"Exporting to {output_filename}")
     with open(output_filename, "w+") as file:
         json.dump(
@@ -120,6 +174,11 @@ if __name__ == "__main__":
         type=float_between_0_and_1_or_None,
         help="(Optional) Approximate density of the map",
     )
+    parser.add_argument(
+        "--permutation",
+        type=str,
+        help="(Optional) Output of `smap reorder --permutation-out`, if the vocabulary is the one of the original corpus",
+    )
 
     args = parser.parse_args()
 
@@ -128,5 +187,6 @@ if __name__ == "__main__":
         args.vocabulary,
         args.out,
         args.density,
+        args.permutation,
     )
 
@@ -0,0 +1,52 @@
+#!/usr/bin/env bash
+# Check that `smap-mpi` with several processes writes the same files as `smap create`.
+# Usage: scripts/mpi_test.sh build/smap build/smap-mpi
+# Set MPIRUN_FLAGS for additional arguments of mpirun, e.g. "--oversubscribe --allow-run-as-root".
+set -eu
+
+SMAP=$(realpath "$1")
+SMAP_MPI=$(realpath "$2")
+MPIRUN=${MPIRUN:-mpirun}
+MPIRUN_FLAGS=${MPIRUN_FLAGS:-}
+DIRECTORY=$(mktemp -d)
+trap 'rm -rf "$DIRECTORY"' EXIT
+cd "$DIRECTORY"
+
+# Every process trains with the same number of threads as the sequential run
+export OMP_NUM_THREADS=2
+ARGUMENTS="corpus.bin 12 12 --directory . --seed 1 --epochs 6 --threads 2 --dead-cell-update-strides 2"
+
+"$SMAP" synth corpus.bin --rows 3000 --vocab-size 2000 --clusters 8 --seed 5 > /dev/null
+"$SMAP" create $ARGUMENTS --name sequential > sequential.log
+# Cell shards initialize their cells with their own random numbers, so start from sampled snippets
+"$SMAP" create $ARGUMENTS --name sequential_sampled --codebook-init 1 > sequential_sampled.log
+
+status=0
+compare() {
+  # compare SEQUENTIAL_NAME NAME NUM_PROCESSES [OPTIONS...]
+  local sequential_name=$1 name=$2 num_processes=$3
+  shift 3
+  $MPIRUN $MPIRUN_FLAGS -np "$num_processes" "$SMAP_MPI" create $ARGUMENTS --name "$name" "$@" > "$name.log"
+  for file in codebook.bin neighbourhood.bin bmus.bin
+  do
+    if ! cmp -s "$sequential_name/$file" "$name/$file"
+    then
+      echo "FAILED: $file of $num_processes processes ($name) differs from the sequential run"
+      status=1
+    fi
+  done
+}
+
+compare sequential rows1 1
+compare sequential rows2 2
+compare sequential rows3 3
+# The codebook of several cell shards (over 1 MiB, so checksum blocks span the shards) gets the
+# same checksums as that of a single process
+compare sequential_sampled cells2 2 --codebook-init 1 --cell-shards 2
+compare sequential_sampled grid4 4 --codebook-init 1 --cell-shards 2
+
+if [ $status -eq 0 ]
+then
+  echo "All MPI outputs are identical to the sequential run"
+fi
+exit $status
@@ -0,0 +1,165 @@
+#include <map>
+#include <mutex>
+#include <new>
+#include <cstdint>
+#include <algorithm>
+
+#if defined(__linux__)
+  #include <sys/mman.h>
+#endif
+
+#include "arena.hpp"
+
+
+static HugePagePolicy huge_page_policy = HugePagePolicy::TRANSPARENT_HUGE_PAGES;
+
+// Start and length of every mapping of `allocate_huge_pages`, which may be longer than requested
+static std::mutex mapping_mutex;
+static std::map<void*, size_t> mapping_lengths;
+
+
+void set_huge_page_policy(const HugePagePolicy policy)
+{
+  if (policy < HugePagePolicy::NO_HUGE_PAGES || policy > HugePagePolicy::RESERVED_HUGE_PAGES)
+    std::__throw_invalid_argument("The huge-page policy must be 0 (none), 1 (transparent) or 2 (reserved)");
+  huge_page_policy = policy;
+}
+
+
+HugePagePolicy get_huge_page_policy()
+{
+  return huge_page_policy;
+}
+
+
+static inline size_t round_up(const size_t n, const size_t multiple)
+{
+  return (n + multiple - 1) / multiple * multiple;
+}
+
+
+#if defined(__linux__)
+// Reserved huge pages, where 1 GiB pages are only worth it if the array fills most of one
+static void* map_reserved_huge_pages(const size_t num_bytes, size_t& length)
+{
+  #if defined(MAP_HUGETLB) && defined(MAP_HUGE_SHIFT)
+  for (const int page_shift : {30, 21})
+  {
+    const size_t page_size = size_t(1) << page_shift;
+    if (page_size == GIGANTIC_HUGE_PAGE_SIZE && num_bytes < GIGANTIC_HUGE_PAGE_SIZE / 2)
+      continue;
+    length = round_up(num_bytes, page_size);
+    void* const data = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (page_shift << MAP_HUGE_SHIFT), -1, 0);
+    if (data != MAP_FAILED)
+      return data;
+  }
+  #else
+  (void) num_bytes;
+  (void) length;
+  #endif
+  return nullptr;
+}
+
+
+// Regular pages at a 2 MiB boundary, which the kernel can back with transparent huge pages
+static void* map_aligned_pages(const size_t num_bytes, size_t& length, const bool use_huge_pages)
+{
+  length = round_up(num_bytes, HUGE_PAGE_SIZE);
+  void* const mapping = mmap(nullptr, length + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED)
+    return nullptr;
+
+  // Unmap the unaligned head and the tail of the larger mapping
+  char* const start = static_cast<char*>(mapping);
+  char* const aligned = reinterpret_cast<char*>(round_up(reinterpret_cast<uintptr_t>(start), HUGE_PAGE_SIZE));
+  if (aligned > start)
+    munmap(start, aligned - start);
+  munmap(aligned + length, HUGE_PAGE_SIZE - (aligned - start));
+
+  madvise(aligned, length, use_huge_pages ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+  return aligned;
+}
+#endif
+
+
+void* allocate_huge_pages(const size_t num_bytes)
+{
+  if (num_bytes < HUGE_PAGE_SIZE)
+    return ::operator new(num_bytes, std::align_val_t(ARENA_ALIGNMENT));
+
+  #if defined(__linux__)
+  size_t length = 0;
+  void* data = nullptr;
+  if (huge_page_policy == HugePagePolicy::RESERVED_HUGE_PAGES)
+    data = map_reserved_huge_pages(num_bytes, length);
+  if (!data)
+    data = map_aligned_pages(num_bytes, length, huge_page_policy != HugePagePolicy::NO_HUGE_PAGES);
+  if (!data)
+    throw std::bad_alloc();
+
+  std::unique_lock<std::mutex> lock(mapping_mutex);
+  mapping_lengths[data] = length;
+  return data;
+  #else
+  return ::operator new(num_bytes, std::align_val_t(ARENA_ALIGNMENT));
+  #endif
+}
+
+
+void free_huge_pages(void* const data, const size_t num_bytes)
+{
+  if (!data)
+    return;
+
+  #if defined(__linux__)
+  if (num_bytes >= HUGE_PAGE_SIZE)
+  {
+    std::unique_lock<std::mutex> lock(mapping_mutex);
+    const auto mapping = mapping_lengths.find(data);
+    if (mapping == mapping_lengths.end())
+      std::__throw_invalid_argument("The memory was not allocated by allocate_huge_pages");
+    munmap(data, mapping->second);
+    mapping_lengths.erase(mapping);
+    return;
+  }
+  #endif
+  ::operator delete(data, std::align_val_t(ARENA_ALIGNMENT));
+}
+
+
+Arena::Arena(const size_t block_size) :
+  block_size(std::max<size_t>(1, block_size)),
+  offset(0)
+{}
+
+
+Arena::~Arena()
+{
+  for (const auto& block : this->blocks)
+    free_huge_pages(block.data, block.size);
+}
+
+
+void* Arena::allocate_bytes(const size_t num_bytes)
+{
+  const size_t aligned_num_bytes = round_up(std::max<size_t>(1, num_bytes), ARENA_ALIGNMENT);
+  if (this->blocks.empty() || this->offset + aligned_num_bytes > this->blocks.back().size)
+  {
+    const size_t size = std::max(this->block_size, aligned_num_bytes);
+    this->blocks.push_back({static_cast<char*>(allocate_huge_pages(size)), size});
+    this->offset = 0;
+  }
+  void* const data = this->blocks.back().data + this->offset;
+  this->offset += aligned_num_bytes;
+  return data;
+}
+
+
+void Arena::reset()
+{
+  for (size_t i = 1; i < this->blocks.size(); ++i)
+    free_huge_pages(this->blocks[i].data, this->blocks[i].size);
+  if (this->blocks.size() > 1)
+    this->blocks.resize(1);
+  this->offset = 0;
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+#include "data.hpp"
+
+
+#define HUGE_PAGE_SIZE (size_t(1) << 21)            // 2 MiB
+#define GIGANTIC_HUGE_PAGE_SIZE (size_t(1) << 30)   // 1 GiB
+#define ARENA_ALIGNMENT 64                          // Cache line
+
+
+// Page sizes of the large training arrays
+enum HugePagePolicy
+{
+  NO_HUGE_PAGES=0,           // Regular pages
+  TRANSPARENT_HUGE_PAGES=1,  // 2 MiB aligned memory advised for transparent huge pages (madvise)
+  RESERVED_HUGE_PAGES=2      // Reserved 1 GiB or 2 MiB pages (MAP_HUGETLB, see /proc/sys/vm/nr_hugepages),
+                             // falling back to transparent huge pages when none are left
+};
+
+// Only call this while no huge-page memory is allocated
+void set_huge_page_policy(const HugePagePolicy policy);
+HugePagePolicy get_huge_page_policy();
+
+// Memory for `num_bytes` aligned to at least `ARENA_ALIGNMENT`, which is not initialized.
+// Allocations of at least `HUGE_PAGE_SIZE` bytes are mapped according to the huge-page policy,
+// smaller ones come from `operator new`. Throws `std::bad_alloc` if there is no memory left.
+void* allocate_huge_pages(const size_t num_bytes);
+// Release the memory of `allocate_huge_pages` with the same `num_bytes`
+void free_huge_pages(void* const data, const size_t num_bytes);
+
+
+// Standard allocator on `allocate_huge_pages`, e.g. for the values of a codebook
+template<typename T> class HugePageAllocator
+{
+public:
+  typedef T value_type;
+
+  HugePageAllocator() = default;
+  template<typename U> HugePageAllocator(const HugePageAllocator<U>&) {}
+
+  inline T* allocate(const size_t count)
+  {
+    return static_cast<T*>(allocate_huge_pages(count * sizeof(T)));
+  }
+
+  inline void deallocate(T* const data, const size_t count)
+  {
+    free_huge_pages(data, count * sizeof(T));
+  }
+
+  template<typename U> inline bool operator==(const HugePageAllocator<U>&) const { return true; }
+  template<typename U> inline bool operator!=(const HugePageAllocator<U>&) const { return false; }
+};
+
+
+// Bump allocator for arrays with the same lifetime, which are all released with the arena.
+// Every block holds at least `block_size` bytes, so arrays that fit into one block share its huge pages.
+class Arena
+{
+public:
+  Arena(const size_t block_size = HUGE_PAGE_SIZE);
+  ~Arena();
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  // Uninitialized array of `count` elements aligned to `ARENA_ALIGNMENT`
+  template<typename T> inline T* allocate(const size_t count)
+  {
+    return static_cast<T*>(this->allocate_bytes(count * sizeof(T)));
+  }
+
+  // Release all arrays, but keep the first block for the next ones
+  void reset();
+
+private:
+  void* allocate_bytes(const size_t num_bytes);
+
+  struct Block
+  {
+    char* data;
+    size_t size;
+  };
+
+  size_t block_size;
+  std::vector<Block> blocks;
+  size_t offset;  // Of the first free byte in the last block
+};
+
+
+// Scratch space that is reused by every call and only grows, e.g. the per-thread sums of a loop
+template<typename T> class ScratchBuffer
+{
+public:
+  ScratchBuffer() : data(nullptr), capacity(0) {}
+  ~ScratchBuffer() { this->release(); }
+  ScratchBuffer(const ScratchBuffer&) = delete;
+  ScratchBuffer& operator=(const ScratchBuffer&) = delete;
+
+  // Uninitialized space for at least `count` elements, which invalidates earlier results
+  inline T* get(const size_t count)
+  {
+    if (count > this->capacity)
+    {
+      this->release();
+      this->data = static_cast<T*>(allocate_huge_pages(count * sizeof(T)));
+      this->capacity = count;
+    }
+    return this->data;
+  }
+
+  inline void release()
+  {
+    if (this->data)
+      free_huge_pages(this->data, this->capacity * sizeof(T));
+    this->data = nullptr;
+    this->capacity = 0;
+  }
+
+private:
+  T* data;
+  size_t capacity;
+};
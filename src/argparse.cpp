@@ -2,6 +2,7 @@
 #include "argparse.hpp"
 #include <algorithm>    // std::find
 #include <exception>
+#include <sstream>
 
 
 ArgParser::ArgParser(int &argc, char **argv)
@@ -11,6 +12,11 @@ ArgParser::ArgParser(int &argc, char **argv)
 }
 
 
+ArgParser::ArgParser(const std::vector<std::string>& tokens) :
+  tokens(tokens)
+{}
+
+
 const std::string& ArgParser::get_option(const uint position) const
 {
   if (this->tokens.size() <= position) 
@@ -70,6 +76,20 @@ float ArgParser::get_option_as_float(const std::string &name) const
 }
 
 
+std::vector<std::string> ArgParser::get_option_as_list(const std::string &name, const std::string &default_value) const
+{
+  std::vector<std::string> values;
+  std::stringstream stream(this->get_option(name, default_value));
+  std::string value;
+  while (std::getline(stream, value, ','))
+  {
+    if (!value.empty())
+      values.push_back(value);
+  }
+  return values;
+}
+
+
 bool ArgParser::option_exists(const std::string &option) const
 {
   return std::find(this->tokens.begin(), this->tokens.end(), option) != this->tokens.end();
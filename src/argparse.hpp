@@ -11,6 +11,7 @@ class ArgParser
 
   public:
     ArgParser (int &argc, char **argv);
+    ArgParser (const std::vector<std::string>& tokens);
 
     const std::string& get_option(const uint position) const;
     const std::string& get_option(const std::string &name, const std::string &default_value) const;
@@ -21,9 +22,13 @@ class ArgParser
     int get_option_as_int(const std::string &name) const;
     float get_option_as_float(const std::string &name, const float default_value) const;
     float get_option_as_float(const std::string &name) const;
+    // Comma-separated values of an option, e.g. "--sizes 8x8,16x16"
+    std::vector<std::string> get_option_as_list(const std::string &name, const std::string &default_value) const;
 
     bool option_exists(const std::string &option) const;
 
+    inline const std::vector<std::string>& get_tokens() const { return this->tokens; }
+
   private:
     std::vector <std::string> tokens;
 };
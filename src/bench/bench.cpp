@@ -0,0 +1,670 @@
+// Micro and macro benchmarks for the hot paths of the semantic map training
+//
+// Build with `make bench` and run `./build/smap-bench --help` for options.
+// Results are written as JSON (default) or TSV, one record per benchmark case,
+// with median, mean, variance, min and max of the wall-clock time in nanoseconds.
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdio>
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <iomanip>
+#include <cmath>
+#include <numeric>
+#include <limits>
+#include <memory>
+
+#if defined(_OPENMP)
+  #include <omp.h>
+#endif
+
+#include "../argparse.hpp"
+#include "../data.hpp"
+#include "../topo.hpp"
+#include "../som.hpp"
+#include "../smap.hpp"
+#include "../utils.hpp"
+#include "../synth.hpp"
+#include "../parallel.hpp"
+#include "../numa.hpp"
+
+
+struct BenchmarkResult
+{
+  std::string name;
+  CellIndexType height;
+  CellIndexType width;
+  IndexType vocab_size;
+  IndexPointerType num_rows;
+  std::string topology;
+  int num_threads;
+  std::vector<int64_t> samples;  // Nanoseconds
+
+  Double median() const
+  {
+    std::vector<int64_t> sorted(this->samples);
+    std::sort(sorted.begin(), sorted.end());
+    const size_t n = sorted.size();
+    return (n % 2 == 1) ? sorted[n / 2] : 0.5 * (sorted[n / 2 - 1] + sorted[n / 2]);
+  }
+
+  Double mean() const
+  {
+    Double sum = 0.;
+    for (auto sample : this->samples)
+      sum += sample;
+    return sum / this->samples.size();
+  }
+
+  Double variance() const
+  {
+    if (this->samples.size() < 2)
+      return 0.;
+    const Double m = this->mean();
+    Double sum = 0.;
+    for (auto sample : this->samples)
+      sum += squared(sample - m);
+    return sum / (this->samples.size() - 1);
+  }
+};
+
+
+// Number of training epochs after which the quantization error first reaches the target, per codebook initialization
+struct InitConvergenceResult
+{
+  std::string initialization;
+  CellIndexType height;
+  CellIndexType width;
+  IndexType vocab_size;
+  IndexPointerType num_rows;
+  Float target_error;
+  int epochs_to_target;    // -1 if the target was not reached
+  int saved_epochs;        // Compared to the random uniform initialization
+  Float final_error;
+};
+
+
+// Read bandwidth of the threads of one NUMA node from the memory of one node
+struct NumaBandwidthResult
+{
+  int cpu_node;
+  int memory_node;
+  int num_threads;
+  size_t num_bytes;
+  Double gigabytes_per_second;  // Best of all repetitions
+};
+
+
+static std::vector<int> parse_int_list(const std::string& text)
+{
+  std::vector<int> values;
+  std::stringstream stream(text);
+  std::string item;
+  while (std::getline(stream, item, ','))
+  {
+    if (!item.empty())
+      values.push_back(std::stoi(item));
+  }
+  return values;
+}
+
+
+static void set_num_threads(int num_threads)
+{
+  #if defined(_OPENMP)
+  omp_set_num_threads(num_threads);
+  #else
+  (void) num_threads;
+  #endif
+}
+
+
+static int max_num_threads()
+{
+  #if defined(_OPENMP)
+  return omp_get_max_threads();
+  #else
+  return 1;
+  #endif
+}
+
+
+// String with backslashes, double quotes and control characters escaped for JSON
+static std::string escape_json_string(const std::string& value)
+{
+  std::string escaped;
+  escaped.reserve(value.size());
+  for (const char c : value)
+  {
+    if (c == '\\')
+      escaped += "\\\\";
+    else if (c == '"')
+      escaped += "\\\"";
+    else if (static_cast<unsigned char>(c) < 0x20)
+    {
+      char code[7];
+      std::snprintf(code, sizeof(code), "\\u%04x", static_cast<unsigned char>(c));
+      escaped += code;
+    }
+    else
+      escaped += c;
+  }
+  return escaped;
+}
+
+
+static void save_init_convergence_json(std::ostream& os, const std::vector<InitConvergenceResult>& results)
+{
+  os << std::setprecision(6) << std::defaultfloat;
+  os << "  \"init_convergence\": [\n";
+  for (size_t i = 0; i < results.size(); ++i)
+  {
+    const auto& r = results[i];
+    os << "    {\"initialization\": \"" << escape_json_string(r.initialization) << "\""
+       << ", \"height\": " << r.height
+       << ", \"width\": " << r.width
+       << ", \"vocab_size\": " << r.vocab_size
+       << ", \"num_rows\": " << r.num_rows
+       << ", \"target_error\": " << r.target_error
+       << ", \"epochs_to_target\": " << r.epochs_to_target
+       << ", \"saved_epochs\": " << r.saved_epochs
+       << ", \"final_error\": " << r.final_error
+       << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+  }
+  os << "  ]";
+}
+
+
+static void save_init_convergence_tsv(std::ostream& os, const std::vector<InitConvergenceResult>& results)
+{
+  os << std::setprecision(6) << std::defaultfloat;
+  os << "Initialization\tHeight\tWidth\tVocabSize\tNumRows\tTargetError\tEpochsToTarget\tSavedEpochs\tFinalError" << std::endl;
+  for (const auto& r : results)
+  {
+    os << r.initialization
+       << "\t" << r.height
+       << "\t" << r.width
+       << "\t" << r.vocab_size
+       << "\t" << r.num_rows
+       << "\t" << r.target_error
+       << "\t" << r.epochs_to_target
+       << "\t" << r.saved_epochs
+       << "\t" << r.final_error
+       << std::endl;
+  }
+}
+
+
+static void save_numa_bandwidth_json(std::ostream& os, const std::vector<NumaBandwidthResult>& results)
+{
+  os << std::setprecision(6) << std::defaultfloat;
+  os << "  \"numa_bandwidth\": [\n";
+  for (size_t i = 0; i < results.size(); ++i)
+  {
+    const auto& r = results[i];
+    os << "    {\"cpu_node\": " << r.cpu_node
+       << ", \"memory_node\": " << r.memory_node
+       << ", \"num_threads\": " << r.num_threads
+       << ", \"num_bytes\": " << r.num_bytes
+       << ", \"gigabytes_per_second\": " << r.gigabytes_per_second
+       << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+  }
+  os << "  ]";
+}
+
+
+static void save_numa_bandwidth_tsv(std::ostream& os, const std::vector<NumaBandwidthResult>& results)
+{
+  os << std::setprecision(6) << std::defaultfloat;
+  os << "CpuNode\tMemoryNode\tNumThreads\tNumBytes\tGigabytesPerSecond" << std::endl;
+  for (const auto& r : results)
+  {
+    os << r.cpu_node
+       << "\t" << r.memory_node
+       << "\t" << r.num_threads
+       << "\t" << r.num_bytes
+       << "\t" << r.gigabytes_per_second
+       << std::endl;
+  }
+}
+
+
+// Stream `num_bytes` placed on every NUMA node with all threads of every node, which shows
+// how much bandwidth the placement of `--numa` saves compared to remote accesses
+static std::vector<NumaBandwidthResult> measure_numa_bandwidth(const size_t num_bytes, const int repetitions)
+{
+  std::vector<NumaBandwidthResult> results;
+  const size_t count = num_bytes / sizeof(uint64_t);
+  auto* const buffer = new uint64_t[count];
+  std::fill_n(buffer, count, 1);
+
+  for (int memory_node = 0; memory_node < get_num_numa_nodes(); ++memory_node)
+  {
+    if (get_num_numa_nodes() > 1 && !move_to_numa_node(buffer, count * sizeof(uint64_t), memory_node))
+      std::cerr << "WARNING: Unable to move the bandwidth buffer to node " << memory_node << std::endl;
+
+    for (int cpu_node = 0; cpu_node < get_num_numa_nodes(); ++cpu_node)
+    {
+      ParallelSettings settings;
+      settings.cpus = get_numa_node_cpus(cpu_node);
+      settings.num_threads = static_cast<int>(settings.cpus.size());
+      if (settings.cpus.empty())
+        continue;
+
+      std::cerr << "  numa_bandwidth cpu_node=" << cpu_node << " memory_node=" << memory_node << " threads=" << settings.num_threads << std::endl;
+      std::vector<uint64_t> sums(settings.num_threads, 0);
+      int64_t best_ns = std::numeric_limits<int64_t>::max();
+      for (int i = 0; i < repetitions; ++i)
+      {
+        const int64_t start_ns = get_nanoseconds();
+        parallel_for("numa_bandwidth", 0, count, [&](const size_t first, const size_t end, const int thread) {
+          uint64_t sum = 0;
+          for (size_t j = first; j < end; ++j)
+            sum += buffer[j];
+          sums[thread] += sum;
+        }, settings);
+        best_ns = std::min(best_ns, get_nanoseconds() - start_ns);
+      }
+      // The sums keep the reads from being optimized away
+      if (std::accumulate(sums.begin(), sums.end(), uint64_t(0)) != count * repetitions)
+        std::cerr << "WARNING: The bandwidth buffer changed" << std::endl;
+      results.push_back({cpu_node, memory_node, settings.num_threads, count * sizeof(uint64_t), static_cast<Double>(count * sizeof(uint64_t)) / std::max<int64_t>(1, best_ns)});
+    }
+  }
+  delete [] buffer;
+  return results;
+}
+
+
+class BenchmarkRunner
+{
+public:
+  BenchmarkRunner(int repetitions, int warmup) : repetitions(repetitions), warmup(warmup) {}
+
+  void run(BenchmarkResult result, const std::function<void()>& setup, const std::function<void()>& body)
+  {
+    std::cerr << "  " << result.name << " " << result.height << "x" << result.width
+              << " vocab=" << result.vocab_size << " " << result.topology
+              << " threads=" << result.num_threads << std::endl;
+
+    for (int i = 0; i < this->warmup + this->repetitions; ++i)
+    {
+      setup();
+      const auto begin = std::chrono::steady_clock::now();
+      body();
+      const auto end = std::chrono::steady_clock::now();
+      if (i >= this->warmup)
+        result.samples.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count());
+    }
+    this->results.push_back(result);
+  }
+
+  void add(const InitConvergenceResult& result)
+  {
+    this->init_results.push_back(result);
+  }
+
+  void add(const NumaBandwidthResult& result)
+  {
+    this->numa_results.push_back(result);
+  }
+
+  void save_json(std::ostream& os) const
+  {
+    os << std::fixed << std::setprecision(0);
+    os << "{\n  \"cpu\": \"" << escape_json_string(get_cpu_name()) << "\",\n"
+       << "  \"hardware_concurrency\": " << std::thread::hardware_concurrency() << ",\n"
+       << "  \"repetitions\": " << this->repetitions << ",\n"
+       << "  \"results\": [\n";
+    for (size_t i = 0; i < this->results.size(); ++i)
+    {
+      const auto& r = this->results[i];
+      os << "    {\"name\": \"" << escape_json_string(r.name) << "\""
+         << ", \"height\": " << r.height
+         << ", \"width\": " << r.width
+         << ", \"vocab_size\": " << r.vocab_size
+         << ", \"num_rows\": " << r.num_rows
+         << ", \"topology\": \"" << escape_json_string(r.topology) << "\""
+         << ", \"num_threads\": " << r.num_threads
+         << ", \"median_ns\": " << r.median()
+         << ", \"mean_ns\": " << r.mean()
+         << ", \"variance_ns2\": " << r.variance()
+         << ", \"min_ns\": " << *std::min_element(r.samples.begin(), r.samples.end())
+         << ", \"max_ns\": " << *std::max_element(r.samples.begin(), r.samples.end())
+         << "}" << (i + 1 < this->results.size() ? "," : "") << "\n";
+    }
+    os << "  ]";
+    if (!this->init_results.empty())
+    {
+      os << ",\n";
+      save_init_convergence_json(os, this->init_results);
+    }
+    if (!this->numa_results.empty())
+    {
+      os << ",\n";
+      save_numa_bandwidth_json(os, this->numa_results);
+    }
+    os << "\n}" << std::endl;
+  }
+
+  void save_tsv(std::ostream& os) const
+  {
+    os << std::fixed << std::setprecision(0);
+    os << "Name\tHeight\tWidth\tVocabSize\tNumRows\tTopology\tNumThreads\tMedianNs\tMeanNs\tVarianceNs2\tMinNs\tMaxNs" << std::endl;
+    for (const auto& r : this->results)
+    {
+      os << r.name
+         << "\t" << r.height
+         << "\t" << r.width
+         << "\t" << r.vocab_size
+         << "\t" << r.num_rows
+         << "\t" << r.topology
+         << "\t" << r.num_threads
+         << "\t" << r.median()
+         << "\t" << r.mean()
+         << "\t" << r.variance()
+         << "\t" << *std::min_element(r.samples.begin(), r.samples.end())
+         << "\t" << *std::max_element(r.samples.begin(), r.samples.end())
+         << std::endl;
+    }
+    if (!this->init_results.empty())
+    {
+      os << std::endl;
+      save_init_convergence_tsv(os, this->init_results);
+    }
+    if (!this->numa_results.empty())
+    {
+      os << std::endl;
+      save_numa_bandwidth_tsv(os, this->numa_results);
+    }
+  }
+
+private:
+  int repetitions;
+  int warmup;
+  std::vector<BenchmarkResult> results;
+  std::vector<InitConvergenceResult> init_results;
+  std::vector<NumaBandwidthResult> numa_results;
+};
+
+
+static const char* initialization_string(CodebookInitialization initialization)
+{
+  switch (initialization)
+  {
+  case CodebookInitialization::SAMPLED_ROWS:
+    return "sampled_rows";
+  case CodebookInitialization::PRINCIPAL_COMPONENTS:
+    return "principal_components";
+  default:
+    return "random_uniform";
+  }
+}
+
+
+// Quantization errors of the initial codebook (index 0) and after every training epoch
+static std::vector<Float> train_and_record_errors(
+  CorpusDataset& data,
+  const CodebookInitialization initialization,
+  const CellIndexType side,
+  const unsigned int num_epochs
+)
+{
+  Codebook codebook(side, side, data.num_cols, GlobalTopology::TORUS, LocalTopology::HEXA);
+  codebook.init(data, initialization, 1);
+  // The update exponent of `smap create`
+  const Float update_exponent = std::pow(std::log(1.5), 1. / num_epochs) / std::pow(std::log(std::max<Float>(side, 2)), 1. / num_epochs);
+  Neighbourhood neighbourhood(side, side, GlobalTopology::TORUS, LocalTopology::HEXA, update_exponent, side);
+
+  std::ofstream convergence_log_stream("/dev/null");
+  std::vector<Float> errors;
+  Trainer trainer(codebook, neighbourhood, data, num_epochs, convergence_log_stream);
+  while (!trainer.is_done())
+  {
+    trainer.begin_epoch();
+    trainer.find_best_matching_units();
+    trainer.end_epoch();
+    errors.push_back(trainer.get_quantization_error());
+  }
+  return errors;
+}
+
+
+static int epochs_to_reach(const std::vector<Float>& errors, const Float target_error)
+{
+  for (size_t epoch = 0; epoch < errors.size(); ++epoch)
+    if (errors[epoch] <= target_error)
+      return static_cast<int>(epoch);
+  return -1;
+}
+
+
+static std::string topology_string(GlobalTopology global_topology, LocalTopology local_topology)
+{
+  const std::string global_name = global_topology == GlobalTopology::TORUS ? "torus" : "plane";
+  switch (local_topology)
+  {
+  case LocalTopology::RECT:
+    return global_name + "-rect";
+  case LocalTopology::HEXA:
+    return global_name + "-hexa";
+  default:
+    return global_name + "-circ";
+  }
+}
+
+
+int main(int argc, char* argv[])
+{
+  ArgParser args(argc, argv);
+
+  if (args.option_exists("--help") || args.option_exists("-h"))
+  {
+    std::cout << "Usage: smap-bench [options]" << std::endl
+              << "  --map-sizes 8,16,32       Side lengths of the (square) maps" << std::endl
+              << "  --vocab-sizes 1000,10000  Vocabulary sizes of the generated corpora" << std::endl
+              << "  --threads 1,N             Thread counts (default: 1 and all available)" << std::endl
+              << "  --topologies all|default  Benchmark all 6 topologies or torus-hexa and plane-circ" << std::endl
+              << "  --rows 4000               Number of snippets in the generated corpora" << std::endl
+              << "  --row-length 20           Mean number of distinct terms per snippet" << std::endl
+              << "  --zipf-exponent 1.0       Exponent of the Zipf distribution of term frequencies" << std::endl
+              << "  --clusters 16             Number of planted topical clusters" << std::endl
+              << "  --repetitions 5           Timed repetitions per case" << std::endl
+              << "  --warmup 1                Untimed repetitions per case" << std::endl
+              << "  --init-epochs 10          Epochs to compare the codebook initializations (0 to skip)" << std::endl
+              << "  --init-target-error 0     Quantization error to reach (0: that of random init after all epochs)" << std::endl
+              << "  --bandwidth-size 256      MiB streamed by the threads of every NUMA node from every node (0 to skip)" << std::endl
+              << "  --format json|tsv         Output format" << std::endl
+              << "  --out bench.json          Output filename" << std::endl;
+    return 0;
+  }
+
+  const auto map_sizes = parse_int_list(args.get_option("--map-sizes", "8,16,32"));
+  const auto vocab_sizes = parse_int_list(args.get_option("--vocab-sizes", "1000,10000"));
+  auto thread_counts = parse_int_list(args.get_option("--threads", ""));
+  if (thread_counts.empty())
+  {
+    thread_counts.push_back(1);
+    if (max_num_threads() > 1)
+      thread_counts.push_back(max_num_threads());
+  }
+  SyntheticCorpusSettings corpus_settings;
+  corpus_settings.num_rows = static_cast<IndexPointerType>(args.get_option_as_int("--rows", 4000));
+  corpus_settings.mean_row_length = static_cast<IndexType>(args.get_option_as_int("--row-length", 20));
+  corpus_settings.zipf_exponent = args.get_option_as_float("--zipf-exponent", 1.0);
+  corpus_settings.num_clusters = static_cast<IndexType>(args.get_option_as_int("--clusters", 16));
+  corpus_settings.seed = 42;
+  const int repetitions = args.get_option_as_int("--repetitions", 5);
+  const int warmup = args.get_option_as_int("--warmup", 1);
+  const auto init_epochs = static_cast<unsigned int>(args.get_option_as_int("--init-epochs", 10));
+  const Float init_target_error = args.get_option_as_float("--init-target-error", 0.);
+  const auto bandwidth_size = static_cast<size_t>(args.get_option_as_int("--bandwidth-size", 256));
+  const std::string format = args.get_option("--format", "json");
+  const std::string output_filename = args.get_option("--out", format == "tsv" ? "bench.tsv" : "bench.json");
+
+  std::vector<std::pair<GlobalTopology, LocalTopology>> topologies;
+  if (args.get_option("--topologies", "default") == "all")
+  {
+    for (auto global_topology : {GlobalTopology::TORUS, GlobalTopology::PLANE})
+      for (auto local_topology : {LocalTopology::CIRC, LocalTopology::HEXA, LocalTopology::RECT})
+        topologies.push_back({global_topology, local_topology});
+  }
+  else
+  {
+    topologies.push_back({GlobalTopology::TORUS, LocalTopology::HEXA});
+    topologies.push_back({GlobalTopology::PLANE, LocalTopology::CIRC});
+  }
+
+  if (repetitions < 1)
+    std::__throw_invalid_argument("The number of repetitions must be at least 1");
+
+  // Silence the progress messages of the library
+  std::ofstream null_stream;
+  auto* cout_buffer = std::cout.rdbuf(null_stream.rdbuf());
+
+  BenchmarkRunner runner(repetitions, warmup);
+  const std::string corpus_filename = std::string(std::tmpnam(nullptr)) + ".bin";
+
+  for (const auto vocab_size : vocab_sizes)
+  {
+    std::cerr << "Vocabulary size " << vocab_size << std::endl;
+    corpus_settings.vocab_size = static_cast<IndexType>(vocab_size);
+    write_synthetic_corpus(corpus_filename, corpus_settings);
+
+    // Corpus loading is single threaded
+    CorpusDataset* data = nullptr;
+    runner.run(
+      {"corpus_load", 0, 0, corpus_settings.vocab_size, corpus_settings.num_rows, "-", 1, {}},
+      [&]() { delete data; data = nullptr; },
+      [&]() { data = new CorpusDataset(corpus_filename); }
+    );
+    data->init_sum_of_squares();
+
+    auto* best_matching_units = new CellIndexType[data->num_rows];
+    auto* next_best_matching_units = new CellIndexType[data->num_rows];
+    auto* distances = new Float[data->num_rows];
+    auto* next_distances = new Float[data->num_rows];
+
+    for (const auto map_size : map_sizes)
+    {
+      const auto side = static_cast<CellIndexType>(map_size);
+      for (const auto num_threads : thread_counts)
+      {
+        set_num_threads(num_threads);
+
+        // The best matching unit search does not depend on the topology
+        Codebook codebook(side, side, data->num_cols, GlobalTopology::TORUS, LocalTopology::HEXA);
+        codebook.init(1, true);
+
+        runner.run(
+          {"find_best_matching_units", side, side, data->num_cols, data->num_rows, "-", num_threads, {}},
+          []() {},
+          [&]() { codebook.find_best_matching_units(*data, best_matching_units, distances, 0, true); }
+        );
+
+        runner.run(
+          {"find_best_and_next_best_matching_units", side, side, data->num_cols, data->num_rows, "-", num_threads, {}},
+          []() {},
+          [&]() { codebook.find_best_and_next_best_matching_units(*data, best_matching_units, distances, next_best_matching_units, next_distances, 0); }
+        );
+
+        for (const auto& topology : topologies)
+        {
+          const auto global_topology = topology.first;
+          const auto local_topology = topology.second;
+          const std::string name = topology_string(global_topology, local_topology);
+          Codebook topo_codebook(side, side, data->num_cols, global_topology, local_topology);
+          topo_codebook.init(1, true);
+          topo_codebook.find_best_and_next_best_matching_units(*data, best_matching_units, distances, next_best_matching_units, next_distances, 0);
+          const auto make_neighbourhood = [&]() {
+            return std::unique_ptr<Neighbourhood>(new Neighbourhood(side, side, global_topology, local_topology, 0.95, std::max(1, map_size / 2)));
+          };
+          auto neighbourhood = make_neighbourhood();
+
+          runner.run(
+            {"apply_batch_som_update", side, side, data->num_cols, data->num_rows, name, num_threads, {}},
+            [&]() { topo_codebook.init(1, true); },
+            [&]() { topo_codebook.apply_batch_som_update(*data, *neighbourhood, best_matching_units); }
+          );
+
+          // Every repetition updates the initial radii, so all repetitions do similar work
+          runner.run(
+            {"neighbourhood_update", side, side, data->num_cols, data->num_rows, name, num_threads, {}},
+            [&]() { neighbourhood = make_neighbourhood(); },
+            [&]() { neighbourhood->update(best_matching_units, next_best_matching_units, data->num_rows, true); }
+          );
+        }
+
+        for (const auto initialization : {CodebookInitialization::RANDOM_UNIFORM, CodebookInitialization::SAMPLED_ROWS, CodebookInitialization::PRINCIPAL_COMPONENTS})
+        {
+          Codebook init_codebook(side, side, data->num_cols, GlobalTopology::TORUS, LocalTopology::HEXA);
+          runner.run(
+            {std::string("init_codebook_") + initialization_string(initialization), side, side, data->num_cols, data->num_rows, "-", num_threads, {}},
+            []() {},
+            [&]() { init_codebook.init(*data, initialization, 1); }
+          );
+        }
+
+        // Compare how many epochs each initialization needs to reach the same quantization error
+        if (init_epochs >= 2 && num_threads == thread_counts.front())
+        {
+          std::vector<std::vector<Float>> errors;
+          for (const auto initialization : {CodebookInitialization::RANDOM_UNIFORM, CodebookInitialization::SAMPLED_ROWS, CodebookInitialization::PRINCIPAL_COMPONENTS})
+            errors.push_back(train_and_record_errors(*data, initialization, side, init_epochs));
+          const Float target_error = init_target_error > 0 ? init_target_error : errors[0].back();
+          const int uniform_epochs = epochs_to_reach(errors[0], target_error);
+          for (int initialization = CodebookInitialization::RANDOM_UNIFORM; initialization <= CodebookInitialization::PRINCIPAL_COMPONENTS; ++initialization)
+          {
+            const int epochs = epochs_to_reach(errors[initialization], target_error);
+            runner.add({
+              initialization_string(static_cast<CodebookInitialization>(initialization)), side, side, data->num_cols, data->num_rows,
+              target_error, epochs, (epochs >= 0 && uniform_epochs >= 0) ? uniform_epochs - epochs : 0, errors[initialization].back()
+            });
+          }
+        }
+
+        SemanticMap* semantic_map = nullptr;
+        runner.run(
+          {"build_counts", side, side, data->num_cols, data->num_rows, "-", num_threads, {}},
+          [&]() { delete semantic_map; semantic_map = new SemanticMap(); },
+          [&]() { semantic_map->build(*data, best_matching_units, side, side); }
+        );
+        delete semantic_map;
+      }
+    }
+
+    delete [] best_matching_units;
+    delete [] next_best_matching_units;
+    delete [] distances;
+    delete [] next_distances;
+    delete data;
+  }
+  std::remove(corpus_filename.c_str());
+
+  if (bandwidth_size > 0)
+  {
+    std::cerr << "NUMA nodes " << get_num_numa_nodes() << std::endl;
+    for (const auto& result : measure_numa_bandwidth(bandwidth_size << 20, repetitions))
+      runner.add(result);
+  }
+
+  std::cout.rdbuf(cout_buffer);
+
+  std::ofstream output(output_filename);
+  if (!output.is_open())
+    std::__throw_runtime_error("Unable to write benchmark results");
+  if (format == "tsv")
+    runner.save_tsv(output);
+  else
+    runner.save_json(output);
+  output.close();
+
+  std::cerr << "Saved benchmark results to '" << output_filename << "'" << std::endl;
+  return 0;
+}
@@ -0,0 +1,307 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <memory>
+#include <cstring>
+#include <assert.h>
+#include "checkpoint.hpp"
+#include "utils.hpp"
+#include "compress.hpp"
+
+
+TrainingCheckpoint::TrainingCheckpoint() :
+  seed(0),
+  epoch(0),
+  num_epochs(0),
+  update_exponent(0.f),
+  height(0),
+  width(0),
+  input_dim(0),
+  is_codebook_compressed(false),
+  growth_stage(0),
+  radius_scale(1.f),
+  num_scheduled_epochs(0)
+{}
+
+
+TrainingCheckpoint::TrainingCheckpoint(const std::string& filename) :
+  TrainingCheckpoint()
+{
+  this->load_from_file(filename);
+}
+
+
+void TrainingCheckpoint::capture(
+  const unsigned int epoch,
+  const Codebook& codebook,
+  const Neighbourhood& neighbourhood,
+  const CellIndexType* const previous_best_matching_units,
+  const IndexPointerType num_rows,
+  const unsigned int num_scheduled_epochs,
+  const EarlyStopping* const early_stopping
+)
+{
+  this->epoch = epoch;
+  this->num_scheduled_epochs = num_scheduled_epochs;
+  if (early_stopping)
+    this->early_stopping = early_stopping->get_state();
+  this->update_exponent = neighbourhood.get_update_exponent();
+  this->radius_scale = neighbourhood.get_radius_scale();
+  this->height = codebook.get_height();
+  this->width = codebook.get_width();
+  this->input_dim = codebook.get_input_dim();
+  this->codebook_values.assign(codebook.get_values().begin(), codebook.get_values().end());
+  this->radii.assign(neighbourhood.get_values(), neighbourhood.get_values() + neighbourhood.get_num_cells());
+  this->previous_best_matching_units.assign(previous_best_matching_units, previous_best_matching_units + num_rows);
+}
+
+
+void TrainingCheckpoint::restore(Codebook& codebook, Neighbourhood& neighbourhood, CellIndexType* const previous_best_matching_units) const
+{
+  if (codebook.get_height() != this->height || codebook.get_width() != this->width || codebook.get_input_dim() != this->input_dim)
+    std::__throw_runtime_error("Checkpoint does not match the codebook dimensions");
+  if (neighbourhood.get_num_cells() != this->radii.size() || neighbourhood.get_radius_scale() != this->radius_scale)
+    std::__throw_runtime_error("Checkpoint does not match the neighbourhood dimensions");
+
+  codebook.set_values(this->codebook_values);
+  neighbourhood.set_values(this->radii.data());
+  std::copy(this->previous_best_matching_units.begin(), this->previous_best_matching_units.end(), previous_best_matching_units);
+}
+
+
+// Copy `num_bytes` at `data` into `bytes` at `offset`, and advance the offset
+static void put_bytes(std::vector<char>& bytes, size_t& offset, const void* const data, const size_t num_bytes)
+{
+  assert(offset + num_bytes <= bytes.size());
+  if (num_bytes > 0)
+    std::memcpy(bytes.data() + offset, data, num_bytes);
+  offset += num_bytes;
+}
+
+
+static void put_uint64(std::vector<char>& bytes, size_t& offset, const uint64_t value)
+{
+  put_bytes(bytes, offset, &value, sizeof(value));
+}
+
+
+std::vector<char> TrainingCheckpoint::to_bytes() const
+{
+  // Format 0 has 2 bytes per best matching unit, format 1 has 4 bytes for maps with more cells,
+  // formats 2 and 3 are the same with a compressed codebook, and formats 4 to 7 are formats 0 to 3
+  // followed by the growth stage and the radius scale, and formats 8 to 11 are formats 4 to 7 followed
+  // by the scheduled epochs and the state of the early stopping
+  const uint8_t index_size = get_cell_index_file_size(static_cast<uint64_t>(this->height) * this->width);
+  const uint8_t format = (index_size == 2 ? 0 : 1) + (this->is_codebook_compressed ? 2 : 0) + 8;
+  std::vector<char> compressed_values;
+  if (this->is_codebook_compressed)
+    compressed_values = compress_codebook_values(this->codebook_values.data(), static_cast<uint64_t>(this->height) * this->width, this->input_dim);
+
+  // The file is serialized into one buffer of its final size
+  size_t num_bytes = sizeof(format) + sizeof(uint64_t);
+  for (const auto& argument : this->arguments)
+    num_bytes += sizeof(uint64_t) + argument.size();
+  num_bytes += 6 * sizeof(uint64_t) + sizeof(this->update_exponent);
+  if (this->is_codebook_compressed)
+    num_bytes += sizeof(uint64_t) + compressed_values.size();
+  else
+    num_bytes += this->codebook_values.size() * sizeof(Float);
+  num_bytes += this->radii.size() * sizeof(Float);
+  num_bytes += sizeof(uint64_t) + this->previous_best_matching_units.size() * index_size;
+  num_bytes += sizeof(uint64_t) + sizeof(this->radius_scale);
+  num_bytes += sizeof(uint64_t) + sizeof(this->early_stopping.best_diffusion_error) + 3 * sizeof(uint64_t) + this->early_stopping.reason.size();
+
+  std::vector<char> bytes(num_bytes);
+  size_t offset = 0;
+  put_bytes(bytes, offset, &format, sizeof(format));
+  put_uint64(bytes, offset, this->arguments.size());
+  for (const auto& argument : this->arguments)
+  {
+    put_uint64(bytes, offset, argument.size());
+    put_bytes(bytes, offset, argument.data(), argument.size());
+  }
+  put_uint64(bytes, offset, this->seed);
+  put_uint64(bytes, offset, this->epoch);
+  put_uint64(bytes, offset, this->num_epochs);
+  put_bytes(bytes, offset, &this->update_exponent, sizeof(this->update_exponent));
+  put_uint64(bytes, offset, this->height);
+  put_uint64(bytes, offset, this->width);
+  put_uint64(bytes, offset, this->input_dim);
+  if (this->is_codebook_compressed)
+  {
+    put_uint64(bytes, offset, compressed_values.size());
+    put_bytes(bytes, offset, compressed_values.data(), compressed_values.size());
+  }
+  else
+    put_bytes(bytes, offset, this->codebook_values.data(), this->codebook_values.size() * sizeof(Float));
+  put_bytes(bytes, offset, this->radii.data(), this->radii.size() * sizeof(Float));
+  put_uint64(bytes, offset, this->previous_best_matching_units.size());
+  write_cell_indices(bytes.data() + offset, this->previous_best_matching_units.data(), this->previous_best_matching_units.size(), index_size);
+  offset += this->previous_best_matching_units.size() * index_size;
+  put_uint64(bytes, offset, this->growth_stage);
+  put_bytes(bytes, offset, &this->radius_scale, sizeof(this->radius_scale));
+  put_uint64(bytes, offset, this->num_scheduled_epochs);
+  put_bytes(bytes, offset, &this->early_stopping.best_diffusion_error, sizeof(this->early_stopping.best_diffusion_error));
+  put_uint64(bytes, offset, this->early_stopping.num_converged_epochs);
+  put_uint64(bytes, offset, this->early_stopping.stopped_epoch);
+  put_uint64(bytes, offset, this->early_stopping.reason.size());
+  put_bytes(bytes, offset, this->early_stopping.reason.data(), this->early_stopping.reason.size());
+  assert(offset == bytes.size());
+
+  return bytes;
+}
+
+
+void TrainingCheckpoint::save_to_file(const std::string& filename) const
+{
+  std::cout << "Saving checkpoint of epoch " << this->epoch << " to '" << filename << "'" << std::endl;
+  const std::vector<char> bytes = this->to_bytes();
+  write_file(filename, bytes.data(), bytes.size(), FsyncPolicy::FSYNC_FILES, true);
+}
+
+
+void TrainingCheckpoint::load_from_file(const std::string& filename)
+{
+  std::cout << "Loading checkpoint from '" << filename << "'" << std::endl;
+  std::ifstream file;
+  file.open(filename, std::ios::binary);
+
+  if (!file.is_open())
+    std::__throw_runtime_error("Unable to load checkpoint from file");
+
+  file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+
+  const uint8_t format = read_uint8(file);
+  if (format > 11)
+    std::__throw_runtime_error("Stored checkpoint has unknown format");
+  this->is_codebook_compressed = format % 4 >= 2;
+  const uint64_t num_arguments = read_uint64(file);
+  this->arguments.resize(num_arguments);
+  for (auto& argument : this->arguments)
+  {
+    argument.resize(read_uint64(file));
+    file.read(&argument[0], argument.size());
+  }
+  this->seed = read_uint64(file);
+  this->epoch = static_cast<unsigned int>(read_uint64(file));
+  this->num_epochs = static_cast<unsigned int>(read_uint64(file));
+  file.read((char*) &this->update_exponent, sizeof(this->update_exponent));
+  const uint64_t height = read_uint64(file);
+  const uint64_t width = read_uint64(file);
+  const size_t num_cells = get_num_map_cells(height, width);
+  this->height = static_cast<CellIndexType>(height);
+  this->width = static_cast<CellIndexType>(width);
+  this->input_dim = static_cast<IndexType>(read_uint64(file));
+  this->codebook_values.resize(num_cells * this->input_dim);
+  if (this->is_codebook_compressed)
+  {
+    std::vector<char> bytes(read_uint64(file));
+    file.read(bytes.data(), bytes.size());
+    decompress_codebook_values(bytes.data(), bytes.size(), num_cells, this->input_dim, this->codebook_values.data(), 0, num_cells);
+  }
+  else
+    file.read((char*) this->codebook_values.data(), this->codebook_values.size() * sizeof(Float));
+  this->radii.resize(num_cells);
+  file.read((char*) this->radii.data(), this->radii.size() * sizeof(Float));
+  this->previous_best_matching_units.resize(read_uint64(file));
+  read_cell_indices(file, this->previous_best_matching_units.data(), this->previous_best_matching_units.size(), format % 2 == 0 ? 2 : 4);
+  // Older formats are never written with growth stages
+  if (format >= 4)
+  {
+    this->growth_stage = static_cast<unsigned int>(read_uint64(file));
+    file.read((char*) &this->radius_scale, sizeof(this->radius_scale));
+  }
+  // Nor with early stopping
+  if (format >= 8)
+  {
+    this->num_scheduled_epochs = static_cast<unsigned int>(read_uint64(file));
+    file.read((char*) &this->early_stopping.best_diffusion_error, sizeof(this->early_stopping.best_diffusion_error));
+    this->early_stopping.num_converged_epochs = static_cast<unsigned int>(read_uint64(file));
+    this->early_stopping.stopped_epoch = static_cast<unsigned int>(read_uint64(file));
+    this->early_stopping.reason.resize(read_uint64(file));
+    file.read(&this->early_stopping.reason[0], this->early_stopping.reason.size());
+  }
+  file.close();
+}
+
+
+Checkpointer::Checkpointer(const std::string& filename, const TrainingCheckpoint& settings, const unsigned int strides, AsyncWriter& writer) :
+  filename(filename),
+  strides(strides),
+  settings(settings),
+  writer(writer)
+{}
+
+
+Checkpointer::~Checkpointer()
+{
+  // The errors of other files stay with the writer for its next flush
+  this->writer.wait();
+  this->report_error();
+}
+
+
+void Checkpointer::checkpoint(
+  const unsigned int epoch,
+  const Codebook& codebook,
+  const Neighbourhood& neighbourhood,
+  const CellIndexType* const previous_best_matching_units,
+  const IndexPointerType num_rows,
+  const unsigned int num_scheduled_epochs,
+  const EarlyStopping* const early_stopping
+)
+{
+  if (this->strides == 0 || epoch % this->strides != 0)
+    return;
+
+  // The training only copies its state into a snapshot, which the writer serializes (and compresses)
+  // in the background, and frees once the file is written
+  auto snapshot = std::make_shared<TrainingCheckpoint>(this->settings);
+  snapshot->capture(epoch, codebook, neighbourhood, previous_best_matching_units, num_rows, num_scheduled_epochs, early_stopping);
+  const size_t num_bytes = (snapshot->codebook_values.size() + snapshot->radii.size()) * sizeof(Float)
+    + snapshot->previous_best_matching_units.size() * sizeof(CellIndexType);
+  std::cout << "Saving checkpoint of epoch " << epoch << " to '" << this->filename << "'" << std::endl;
+  this->writer.write(this->filename, num_bytes, [snapshot]() { return snapshot->to_bytes(); }, true);
+}
+
+
+void Checkpointer::wait()
+{
+  this->writer.wait();
+  this->report_error();
+  this->writer.flush();
+}
+
+
+void Checkpointer::report_error()
+{
+  // A failed checkpoint does not stop the training, which can still finish without it
+  const std::string error = this->writer.take_error(this->filename);
+  if (!error.empty())
+    std::cerr << "WARNING: Failed to save checkpoint (" << error << ")" << std::endl;
+}
+
+
+void truncate_training_log(const std::string& filename, const unsigned int epoch)
+{
+  std::ifstream input(filename);
+  if (!input.is_open())
+    return;
+
+  std::stringstream kept;
+  std::string line;
+  bool is_header = true;
+  while (std::getline(input, line))
+  {
+    if (line.empty())
+      continue;
+    if (is_header || std::stoul(line.substr(0, line.find('\t'))) < epoch)
+      kept << line << std::endl;
+    is_header = false;
+  }
+  input.close();
+
+  std::ofstream output(filename, std::ios::trunc);
+  output << kept.str();
+  output.close();
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "data.hpp"
+#include "som.hpp"
+#include "stopping.hpp"
+#include "writer.hpp"
+
+
+// Complete state of `train()` after an epoch, from which the training continues bit-for-bit
+class TrainingCheckpoint
+{
+public:
+  TrainingCheckpoint();
+  TrainingCheckpoint(const std::string& filename);
+
+  // Copy the current training state (can be written in the background afterwards)
+  void capture(
+    const unsigned int epoch,
+    const Codebook& codebook,
+    const Neighbourhood& neighbourhood,
+    const CellIndexType* const previous_best_matching_units,
+    const IndexPointerType num_rows,
+    const unsigned int num_scheduled_epochs = 0,
+    const EarlyStopping* const early_stopping = nullptr
+  );
+  void restore(Codebook& codebook, Neighbourhood& neighbourhood, CellIndexType* const previous_best_matching_units) const;
+
+  // Serialized file contents
+  std::vector<char> to_bytes() const;
+  // Write to a temporary file, flush it to disk, and then rename it, so the file is always complete
+  void save_to_file(const std::string& filename) const;
+
+  std::vector<std::string> arguments;    // Command line arguments of `smap create`
+  uint64_t seed;                         // Seed of the codebook initialization
+  unsigned int epoch;                    // Number of completed epochs
+  unsigned int num_epochs;
+  Float update_exponent;
+  CellIndexType height;
+  CellIndexType width;
+  IndexType input_dim;
+  std::vector<Float> codebook_values;
+  std::vector<Float> radii;
+  std::vector<CellIndexType> previous_best_matching_units;
+  bool is_codebook_compressed;           // Store the codebook values with `compress_codebook_values`
+  unsigned int growth_stage;             // Growth stage of the codebook, or the number of stages at full size
+  Float radius_scale;                    // Of the neighbourhood, which is not one on the maps of the growth stages
+  unsigned int num_scheduled_epochs;     // Last epoch of the training, once early stopping has shortened it (0 if unknown)
+  EarlyStoppingState early_stopping;
+
+protected:
+  void load_from_file(const std::string& filename);
+};
+
+
+// Writes a checkpoint every few epochs with the background `writer`
+class Checkpointer
+{
+public:
+  Checkpointer(const std::string& filename, const TrainingCheckpoint& settings, const unsigned int strides, AsyncWriter& writer);
+  ~Checkpointer();
+
+  // Capture the training state if the epoch is due, and queue serializing and writing it
+  void checkpoint(
+    const unsigned int epoch,
+    const Codebook& codebook,
+    const Neighbourhood& neighbourhood,
+    const CellIndexType* const previous_best_matching_units,
+    const IndexPointerType num_rows,
+    const unsigned int num_scheduled_epochs = 0,
+    const EarlyStopping* const early_stopping = nullptr
+  );
+  // Wait until the last checkpoint is on disk, and throw if writing another queued file failed
+  void wait();
+  // Record the growth stage of the following checkpoints
+  inline void set_growth_stage(const unsigned int growth_stage) { this->settings.growth_stage = growth_stage; }
+
+private:
+  // Warn if writing the checkpoint failed
+  void report_error();
+
+  std::string filename;
+  unsigned int strides;
+  TrainingCheckpoint settings;           // Arguments, seed and number of epochs of every snapshot
+  AsyncWriter& writer;
+};
+
+
+// Remove all lines of a tab-separated training log whose first column is not smaller than `epoch`
+void truncate_training_log(const std::string& filename, const unsigned int epoch);
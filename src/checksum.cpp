@@ -0,0 +1,422 @@
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#if defined(__x86_64__)
+  #include <nmmintrin.h>
+#endif
+#include "checksum.hpp"
+#include "parallel.hpp"
+
+
+const size_t TRAILER_END_SIZE = sizeof(uint64_t) + sizeof(uint32_t);  // Size of the contents and the checksum of the trailer
+const uint64_t VERIFIED_READ_BLOCKS = 16;  // Blocks that a `VerifyingFileBuffer` reads and checks at once
+
+static bool is_verification_enabled = false;
+
+
+// Tables of the slicing-by-8 software CRC32C, for the reflected polynomial 0x82f63b78
+class Crc32cTables
+{
+public:
+  Crc32cTables()
+  {
+    for (uint32_t byte = 0; byte < 256; ++byte)
+    {
+      uint32_t crc = byte;
+      for (int bit = 0; bit < 8; ++bit)
+        crc = (crc >> 1) ^ (0x82f63b78u & (0u - (crc & 1)));
+      this->tables[0][byte] = crc;
+    }
+    for (int table = 1; table < 8; ++table)
+      for (uint32_t byte = 0; byte < 256; ++byte)
+        this->tables[table][byte] = (this->tables[table - 1][byte] >> 8) ^ this->tables[0][this->tables[table - 1][byte] & 0xff];
+  }
+
+  uint32_t tables[8][256];
+};
+
+
+static uint32_t crc32c_software(const uint8_t* data, size_t num_bytes, uint32_t crc)
+{
+  static const Crc32cTables crc_tables;
+  const auto& t = crc_tables.tables;
+  while (num_bytes >= 8)
+  {
+    uint32_t low, high;
+    std::memcpy(&low, data, sizeof(low));
+    std::memcpy(&high, data + 4, sizeof(high));
+    low ^= crc;
+    crc = t[7][low & 0xff] ^ t[6][(low >> 8) & 0xff] ^ t[5][(low >> 16) & 0xff] ^ t[4][low >> 24]
+        ^ t[3][high & 0xff] ^ t[2][(high >> 8) & 0xff] ^ t[1][(high >> 16) & 0xff] ^ t[0][high >> 24];
+    data += 8;
+    num_bytes -= 8;
+  }
+  while (num_bytes-- > 0)
+    crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xff];
+  return crc;
+}
+
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hardware(const uint8_t* data, size_t num_bytes, uint32_t crc)
+{
+  uint64_t crc64 = crc;
+  while (num_bytes >= 8)
+  {
+    uint64_t word;
+    std::memcpy(&word, data, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+    data += 8;
+    num_bytes -= 8;
+  }
+  crc = static_cast<uint32_t>(crc64);
+  while (num_bytes-- > 0)
+    crc = _mm_crc32_u8(crc, *data++);
+  return crc;
+}
+#endif
+
+
+bool has_hardware_crc32c()
+{
+#if defined(__x86_64__)
+  static const bool has_sse42 = __builtin_cpu_supports("sse4.2");
+  return has_sse42;
+#else
+  return false;
+#endif
+}
+
+
+uint32_t crc32c(const void* const data, const size_t num_bytes, const uint32_t crc)
+{
+  const auto* const bytes = static_cast<const uint8_t*>(data);
+#if defined(__x86_64__)
+  if (has_hardware_crc32c())
+    return ~crc32c_hardware(bytes, num_bytes, ~crc);
+#endif
+  return ~crc32c_software(bytes, num_bytes, ~crc);
+}
+
+
+uint32_t crc32c_without_hardware(const void* const data, const size_t num_bytes, const uint32_t crc)
+{
+  return ~crc32c_software(static_cast<const uint8_t*>(data), num_bytes, ~crc);
+}
+
+
+// Product of the 32x32 matrix over GF(2) with the columns `matrix` and `vector`
+static uint32_t multiply_gf2_matrix(const uint32_t* const matrix, uint32_t vector)
+{
+  uint32_t product = 0;
+  for (int column = 0; vector != 0; ++column, vector >>= 1)
+  {
+    if (vector & 1)
+      product ^= matrix[column];
+  }
+  return product;
+}
+
+
+static void square_gf2_matrix(uint32_t* const square, const uint32_t* const matrix)
+{
+  for (int column = 0; column < 32; ++column)
+    square[column] = multiply_gf2_matrix(matrix, matrix[column]);
+}
+
+
+uint32_t crc32c_combine(uint32_t crc, const uint32_t next_crc, uint64_t num_next_bytes)
+{
+  // Append `num_next_bytes` zero bytes to `crc` by repeatedly squaring the operator of one zero
+  // bit, as in zlib's `crc32_combine`, and add the checksum of the next bytes
+  if (num_next_bytes == 0)
+    return crc;
+  uint32_t even[32];
+  uint32_t odd[32];
+  odd[0] = 0x82f63b78u;
+  for (int column = 1; column < 32; ++column)
+    odd[column] = 1u << (column - 1);
+  square_gf2_matrix(even, odd);  // Two zero bits
+  square_gf2_matrix(odd, even);  // Four zero bits
+  while (true)
+  {
+    square_gf2_matrix(even, odd);
+    if (num_next_bytes & 1)
+      crc = multiply_gf2_matrix(even, crc);
+    num_next_bytes >>= 1;
+    if (num_next_bytes == 0)
+      break;
+    square_gf2_matrix(odd, even);
+    if (num_next_bytes & 1)
+      crc = multiply_gf2_matrix(odd, crc);
+    num_next_bytes >>= 1;
+    if (num_next_bytes == 0)
+      break;
+  }
+  return crc ^ next_crc;
+}
+
+
+std::string make_checksum_trailer(const std::vector<uint32_t>& checksums, const uint64_t num_content_bytes)
+{
+  std::string trailer(checksums.size() * sizeof(uint32_t) + TRAILER_END_SIZE, '\0');
+  if (!checksums.empty())
+    std::memcpy(&trailer[0], checksums.data(), checksums.size() * sizeof(uint32_t));
+  std::memcpy(&trailer[checksums.size() * sizeof(uint32_t)], &num_content_bytes, sizeof(num_content_bytes));
+  const uint32_t trailer_checksum = crc32c(trailer.data(), trailer.size() - sizeof(uint32_t));
+  std::memcpy(&trailer[trailer.size() - sizeof(uint32_t)], &trailer_checksum, sizeof(trailer_checksum));
+  return trailer;
+}
+
+
+static uint64_t get_num_blocks(const uint64_t num_bytes)
+{
+  return (num_bytes + CHECKSUM_BLOCK_SIZE - 1) / CHECKSUM_BLOCK_SIZE;
+}
+
+
+std::vector<uint32_t> get_partial_block_checksums(const std::string& header, const void* const data, const size_t num_bytes, const uint64_t offset)
+{
+  const uint64_t num_part_bytes = header.size() + num_bytes;
+  if (num_part_bytes == 0)
+    return {};
+  const uint64_t first_block = offset / CHECKSUM_BLOCK_SIZE;
+  std::vector<uint32_t> checksums((offset + num_part_bytes - 1) / CHECKSUM_BLOCK_SIZE + 1 - first_block);
+  parallel_for("get_partial_block_checksums", 0, checksums.size(), [&](const size_t first_index, const size_t end_index, const int) {
+    for (size_t index = first_index; index < end_index; ++index)
+    {
+      // A block may start in the header and end in the data, and start or end outside of the part
+      const uint64_t begin = std::max<uint64_t>((first_block + index) * CHECKSUM_BLOCK_SIZE, offset) - offset;
+      const uint64_t end = std::min<uint64_t>((first_block + index + 1) * CHECKSUM_BLOCK_SIZE - offset, num_part_bytes);
+      uint32_t crc = 0;
+      if (begin < header.size())
+        crc = crc32c(header.data() + begin, std::min<uint64_t>(end, header.size()) - begin, crc);
+      if (end > header.size())
+      {
+        const uint64_t data_begin = std::max<uint64_t>(begin, header.size()) - header.size();
+        crc = crc32c(static_cast<const char*>(data) + data_begin, end - header.size() - data_begin, crc);
+      }
+      checksums[index] = crc;
+    }
+  });
+  return checksums;
+}
+
+
+std::string get_checksum_trailer(const std::string& header, const void* const data, const size_t num_bytes)
+{
+  return make_checksum_trailer(get_partial_block_checksums(header, data, num_bytes, 0), header.size() + num_bytes);
+}
+
+
+// Read `num_bytes` at `offset` of the file, and throw if the file ends before
+static void read_fully(const int file_descriptor, void* const data, const size_t num_bytes, const uint64_t offset, const std::string& filename)
+{
+  size_t num_read = 0;
+  while (num_read < num_bytes)
+  {
+    const ssize_t result = ::pread(file_descriptor, static_cast<char*>(data) + num_read, num_bytes - num_read, offset + num_read);
+    if (result < 0 && errno == EINTR)
+      continue;
+    if (result <= 0)
+      std::__throw_runtime_error(("Failed reading '" + filename + "'").c_str());
+    num_read += result;
+  }
+}
+
+
+// CRC32C of every block of the first `num_content_bytes` of the file, read in parallel
+static std::vector<uint32_t> compute_file_checksums(const int file_descriptor, const uint64_t num_content_bytes, const std::string& filename)
+{
+  std::vector<uint32_t> checksums(get_num_blocks(num_content_bytes));
+  std::vector<std::vector<char>> buffers(get_num_parallel_threads());
+  parallel_for("compute_file_checksums", 0, checksums.size(), [&](const size_t first_block, const size_t end_block, const int thread) {
+    auto& buffer = buffers[thread];
+    buffer.resize(CHECKSUM_BLOCK_SIZE);
+    for (size_t block = first_block; block < end_block; ++block)
+    {
+      const uint64_t begin = block * CHECKSUM_BLOCK_SIZE;
+      const size_t size = static_cast<size_t>(std::min<uint64_t>(CHECKSUM_BLOCK_SIZE, num_content_bytes - begin));
+      read_fully(file_descriptor, buffer.data(), size, begin, filename);
+      checksums[block] = crc32c(buffer.data(), size);
+    }
+  });
+  return checksums;
+}
+
+
+void append_checksum_trailer(const std::string& filename)
+{
+  const int file_descriptor = ::open(filename.c_str(), O_RDWR);
+  if (file_descriptor < 0)
+    std::__throw_runtime_error(("Unable to open '" + filename + "'").c_str());
+  try {
+    struct stat status;
+    if (::fstat(file_descriptor, &status) != 0)
+      std::__throw_runtime_error(("Unable to get the size of '" + filename + "'").c_str());
+    const uint64_t num_content_bytes = status.st_size;
+    const std::string trailer = make_checksum_trailer(compute_file_checksums(file_descriptor, num_content_bytes, filename), num_content_bytes);
+    if (::pwrite(file_descriptor, trailer.data(), trailer.size(), num_content_bytes) != static_cast<ssize_t>(trailer.size()))
+      std::__throw_runtime_error(("Failed writing the checksums of '" + filename + "'").c_str());
+  } catch (const std::exception&) {
+    ::close(file_descriptor);
+    throw;
+  }
+  if (::close(file_descriptor) != 0)
+    std::__throw_runtime_error(("Failed closing '" + filename + "'").c_str());
+}
+
+
+void set_checksum_verification(const bool is_enabled)
+{
+  is_verification_enabled = is_enabled;
+}
+
+
+bool is_checksum_verification_enabled()
+{
+  return is_verification_enabled;
+}
+
+
+// Size of the contents of a checksummed file, whose checksum of every block is put into `checksums`
+static uint64_t read_checksums(const std::string& filename, std::vector<uint32_t>& checksums)
+{
+  const int file_descriptor = ::open(filename.c_str(), O_RDONLY);
+  if (file_descriptor < 0)
+    std::__throw_runtime_error(("Unable to open '" + filename + "'").c_str());
+
+  uint64_t num_content_bytes = 0;
+  try {
+    struct stat status;
+    if (::fstat(file_descriptor, &status) != 0)
+      std::__throw_runtime_error(("Unable to get the size of '" + filename + "'").c_str());
+    const uint64_t file_size = status.st_size;
+    const std::string truncated_error = "'" + filename + "' is truncated or its checksums are corrupt";
+    if (file_size < TRAILER_END_SIZE)
+      std::__throw_runtime_error(truncated_error.c_str());
+
+    read_fully(file_descriptor, &num_content_bytes, sizeof(num_content_bytes), file_size - TRAILER_END_SIZE, filename);
+    if (num_content_bytes > file_size || file_size - num_content_bytes != get_num_blocks(num_content_bytes) * sizeof(uint32_t) + TRAILER_END_SIZE)
+      std::__throw_runtime_error(truncated_error.c_str());
+
+    // The trailer is small and always checked
+    checksums.resize(get_num_blocks(num_content_bytes));
+    read_fully(file_descriptor, checksums.data(), checksums.size() * sizeof(uint32_t), num_content_bytes, filename);
+    uint32_t trailer_checksum;
+    read_fully(file_descriptor, &trailer_checksum, sizeof(trailer_checksum), file_size - sizeof(uint32_t), filename);
+    const std::string trailer = make_checksum_trailer(checksums, num_content_bytes);
+    if (std::memcmp(trailer.data() + trailer.size() - sizeof(uint32_t), &trailer_checksum, sizeof(uint32_t)) != 0)
+      std::__throw_runtime_error(truncated_error.c_str());
+  } catch (const std::exception&) {
+    ::close(file_descriptor);
+    throw;
+  }
+  ::close(file_descriptor);
+  return num_content_bytes;
+}
+
+
+uint64_t check_checksummed_file(const std::string& filename)
+{
+  std::vector<uint32_t> checksums;
+  return read_checksums(filename, checksums);
+}
+
+
+uint64_t check_checksummed_file(const std::string& filename, std::istream& file, std::unique_ptr<std::streambuf>& buffer)
+{
+  std::vector<uint32_t> checksums;
+  const uint64_t num_content_bytes = read_checksums(filename, checksums);
+  if (!is_verification_enabled)
+    return num_content_bytes;
+
+  const auto position = file.tellg();
+  buffer.reset(new VerifyingFileBuffer(filename, checksums, num_content_bytes));
+  buffer->pubseekpos(position, std::ios::in);
+  file.rdbuf(buffer.get());
+  // The stream rethrows the errors of the buffer, instead of only failing
+  file.exceptions(file.exceptions() | std::ios::badbit);
+  return num_content_bytes;
+}
+
+
+VerifyingFileBuffer::VerifyingFileBuffer(const std::string& filename, const std::vector<uint32_t>& checksums, const uint64_t num_content_bytes) :
+  filename(filename),
+  file_descriptor(::open(filename.c_str(), O_RDONLY)),
+  checksums(checksums),
+  num_content_bytes(num_content_bytes),
+  buffer_offset(0)
+{
+  if (this->file_descriptor < 0)
+    std::__throw_runtime_error(("Unable to open '" + filename + "'").c_str());
+  this->setg(this->buffer.data(), this->buffer.data(), this->buffer.data());
+}
+
+
+VerifyingFileBuffer::~VerifyingFileBuffer()
+{
+  ::close(this->file_descriptor);
+}
+
+
+VerifyingFileBuffer::int_type VerifyingFileBuffer::underflow()
+{
+  const uint64_t position = this->buffer_offset + (this->gptr() - this->eback());
+  if (position >= this->num_content_bytes)
+    return traits_type::eof();
+
+  // Read the blocks from the one of the position on, and check them in parallel
+  const uint64_t first_block = position / CHECKSUM_BLOCK_SIZE;
+  const uint64_t end_block = std::min<uint64_t>(first_block + VERIFIED_READ_BLOCKS, this->checksums.size());
+  const uint64_t begin = first_block * CHECKSUM_BLOCK_SIZE;
+  const size_t num_bytes = static_cast<size_t>(std::min<uint64_t>(end_block * CHECKSUM_BLOCK_SIZE, this->num_content_bytes) - begin);
+  this->buffer.resize(num_bytes);
+  read_fully(this->file_descriptor, this->buffer.data(), num_bytes, begin, this->filename);
+  const auto actual_checksums = get_partial_block_checksums("", this->buffer.data(), num_bytes, begin);
+  for (uint64_t block = first_block; block < end_block; ++block)
+  {
+    if (actual_checksums[block - first_block] != this->checksums[block])
+      std::__throw_runtime_error(("'" + this->filename + "' is corrupt: the bytes from " + std::to_string(block * CHECKSUM_BLOCK_SIZE) + " on do not match their checksum").c_str());
+  }
+
+  this->buffer_offset = begin;
+  this->setg(this->buffer.data(), this->buffer.data() + (position - begin), this->buffer.data() + num_bytes);
+  return traits_type::to_int_type(*this->gptr());
+}
+
+
+VerifyingFileBuffer::pos_type VerifyingFileBuffer::seekoff(off_type offset, std::ios_base::seekdir direction, std::ios_base::openmode mode)
+{
+  uint64_t base = 0;
+  if (direction == std::ios_base::cur)
+    base = this->buffer_offset + (this->gptr() - this->eback());
+  else if (direction == std::ios_base::end)
+    base = this->num_content_bytes;
+  return this->seekpos(static_cast<off_type>(base) + offset, mode);
+}
+
+
+VerifyingFileBuffer::pos_type VerifyingFileBuffer::seekpos(pos_type position, std::ios_base::openmode mode)
+{
+  const off_type target = position;
+  if (!(mode & std::ios_base::in) || target < 0 || static_cast<uint64_t>(target) > this->num_content_bytes)
+    return pos_type(off_type(-1));
+
+  // Within the buffer, only the read position moves, and otherwise the next read loads the blocks
+  const uint64_t end = this->buffer_offset + (this->egptr() - this->eback());
+  if (static_cast<uint64_t>(target) >= this->buffer_offset && static_cast<uint64_t>(target) <= end)
+    this->setg(this->eback(), this->eback() + (target - this->buffer_offset), this->egptr());
+  else
+  {
+    this->buffer_offset = target;
+    this->setg(this->buffer.data(), this->buffer.data(), this->buffer.data());
+  }
+  return position;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <memory>
+#include <istream>
+#include <streambuf>
+
+
+#define CHECKSUM_BLOCK_SIZE (1 << 20)  // Bytes of a checksummed file per CRC32C
+
+
+// CRC32C (Castagnoli) of `num_bytes` at `data`, continuing the checksum `crc` of the bytes before.
+// Uses the SSE4.2 instruction if the CPU has it, and a table otherwise.
+uint32_t crc32c(const void* const data, const size_t num_bytes, const uint32_t crc = 0);
+bool has_hardware_crc32c();
+// The table-driven CRC32C that `crc32c` falls back to
+uint32_t crc32c_without_hardware(const void* const data, const size_t num_bytes, const uint32_t crc = 0);
+// CRC32C of bytes with the checksum `crc` followed by `num_next_bytes` with the checksum `next_crc`
+uint32_t crc32c_combine(uint32_t crc, const uint32_t next_crc, uint64_t num_next_bytes);
+
+// A checksummed file is its contents followed by a trailer with the CRC32C of every block of
+// `CHECKSUM_BLOCK_SIZE` bytes of the contents (uint32 each), the size of the contents (uint64),
+// and the CRC32C of the trailer up to there (uint32). The trailer tells a truncated file apart
+// without reading the contents, and the blocks are verified in parallel.
+
+// Trailer of contents that are `header` followed by `num_bytes` at `data`, computed in parallel
+std::string get_checksum_trailer(const std::string& header, const void* const data, const size_t num_bytes);
+// Append the trailer of the whole file, e.g. after it was written in a stream
+void append_checksum_trailer(const std::string& filename);
+// Trailer of contents of `num_content_bytes` with the given checksum of every block
+std::string make_checksum_trailer(const std::vector<uint32_t>& checksums, const uint64_t num_content_bytes);
+// Checksums of the parts of all blocks that a part of the contents covers, where the part is
+// `header` followed by `num_bytes` at `data`, and starts at byte `offset` of the contents. The
+// parts of a block are combined with `crc32c_combine` in their order.
+std::vector<uint32_t> get_partial_block_checksums(const std::string& header, const void* const data, const size_t num_bytes, const uint64_t offset);
+
+// With verification (`--verify`), loading a checksummed file checks all blocks that it reads.
+// Otherwise only the trailer and the size of the file are checked.
+void set_checksum_verification(const bool is_enabled);
+bool is_checksum_verification_enabled();
+
+// Size of the contents of a checksummed file. Throws if the file is shorter or longer than its
+// trailer says.
+uint64_t check_checksummed_file(const std::string& filename);
+// The same for a file that is loaded from `file`. With verification, `file` continues to read
+// the contents through `buffer`, which checks the blocks as it reads them, so the contents are
+// read only once. A block that does not match its checksum throws from the read.
+uint64_t check_checksummed_file(const std::string& filename, std::istream& file, std::unique_ptr<std::streambuf>& buffer);
+
+// Stream buffer of the contents of a checksummed file, which reads a few blocks at once and
+// checks their checksums in parallel
+class VerifyingFileBuffer : public std::streambuf
+{
+public:
+  VerifyingFileBuffer(const std::string& filename, const std::vector<uint32_t>& checksums, const uint64_t num_content_bytes);
+  ~VerifyingFileBuffer();
+
+protected:
+  int_type underflow() override;
+  pos_type seekoff(off_type offset, std::ios_base::seekdir direction, std::ios_base::openmode mode) override;
+  pos_type seekpos(pos_type position, std::ios_base::openmode mode) override;
+
+private:
+  std::string filename;
+  int file_descriptor;
+  std::vector<uint32_t> checksums;
+  uint64_t num_content_bytes;
+  std::vector<char> buffer;
+  uint64_t buffer_offset;                // Of the first byte of the buffer in the file
+};
@@ -0,0 +1,324 @@
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include "compress.hpp"
+#include "parallel.hpp"
+
+
+static_assert(sizeof(Float) == sizeof(uint32_t), "The compression shuffles the four bytes of every Float");
+
+const uint32_t RANS_SCALE_BITS = 12;                    // The frequencies of a plane sum up to 2^12
+const uint32_t RANS_SCALE = 1u << RANS_SCALE_BITS;
+const uint32_t RANS_LOWER_BOUND = 1u << 23;             // The coder state stays in [2^23, 2^31)
+const size_t FREQUENCY_TABLE_SIZE = 256 * sizeof(uint16_t);
+
+
+enum PlaneCoding
+{
+  RAW_PLANE=0, RANS_PLANE=1
+};
+
+
+static inline void append_uint64(std::vector<char>& bytes, const uint64_t value)
+{
+  const char* const begin = reinterpret_cast<const char*>(&value);
+  bytes.insert(bytes.end(), begin, begin + sizeof(value));
+}
+
+
+// Reads the compressed bytes and throws instead of reading past their end
+class ByteReader
+{
+public:
+  ByteReader(const char* const begin, const char* const end) : position(begin), end(end) {}
+
+  const char* take(const size_t num_bytes)
+  {
+    if (num_bytes > static_cast<size_t>(this->end - this->position))
+      std::__throw_runtime_error("Compressed codebook is truncated");
+    const char* const bytes = this->position;
+    this->position += num_bytes;
+    return bytes;
+  }
+
+  uint64_t take_uint64()
+  {
+    uint64_t value;
+    std::memcpy(&value, this->take(sizeof(value)), sizeof(value));
+    return value;
+  }
+
+  bool is_at_end() const { return this->position == this->end; }
+
+private:
+  const char* position;
+  const char* end;
+};
+
+
+// Scale the symbol counts of a plane to frequencies that sum up to `RANS_SCALE`,
+// where every symbol that occurs keeps a frequency of at least 1
+static void normalize_frequencies(const uint64_t* const counts, const uint64_t num_symbols, uint32_t* const frequencies)
+{
+  int64_t total = 0;
+  for (int symbol = 0; symbol < 256; ++symbol)
+  {
+    frequencies[symbol] = counts[symbol] == 0 ? 0 : std::max<uint32_t>(1, static_cast<uint32_t>(counts[symbol] * RANS_SCALE / num_symbols));
+    total += frequencies[symbol];
+  }
+  // Take the rounding error from the most frequent symbols, which it affects least
+  while (total != RANS_SCALE)
+  {
+    const auto largest = std::max_element(frequencies, frequencies + 256) - frequencies;
+    const int64_t change = total < RANS_SCALE ? RANS_SCALE - total : -std::min<int64_t>(total - RANS_SCALE, frequencies[largest] - 1);
+    frequencies[largest] += change;
+    total += change;
+  }
+}
+
+
+// Append the coding, the frequency table if any, and the code of the `num_symbols` bytes at `plane`
+static void encode_plane(const uint8_t* const plane, const size_t num_symbols, std::vector<char>& output)
+{
+  uint64_t counts[256] = {0};
+  for (size_t i = 0; i < num_symbols; ++i)
+    ++counts[plane[i]];
+
+  // The code must be smaller than the raw plane, including its frequency table
+  std::vector<uint8_t> code(num_symbols > FREQUENCY_TABLE_SIZE + 2 * sizeof(uint64_t) ? num_symbols - FREQUENCY_TABLE_SIZE - sizeof(uint64_t) : 0);
+  uint8_t* const code_begin = code.data();
+  uint8_t* const code_end = code.data() + code.size();
+  uint8_t* position = code_end;
+  bool is_coded = code.size() > sizeof(uint32_t);
+
+  uint32_t frequencies[256];
+  uint32_t starts[256];
+  if (is_coded)
+  {
+    normalize_frequencies(counts, num_symbols, frequencies);
+    uint32_t start = 0;
+    for (int symbol = 0; symbol < 256; ++symbol)
+    {
+      starts[symbol] = start;
+      start += frequencies[symbol];
+    }
+
+    // rANS codes the symbols in reverse, so that they are decoded in order
+    uint32_t state = RANS_LOWER_BOUND;
+    for (size_t i = num_symbols; i-- > 0 && is_coded;)
+    {
+      const uint32_t frequency = frequencies[plane[i]];
+      const uint32_t max_state = ((RANS_LOWER_BOUND >> RANS_SCALE_BITS) << 8) * frequency;
+      while (state >= max_state)
+      {
+        if (position == code_begin)
+        {
+          is_coded = false;
+          break;
+        }
+        *--position = static_cast<uint8_t>(state & 0xff);
+        state >>= 8;
+      }
+      state = ((state / frequency) << RANS_SCALE_BITS) + (state % frequency) + starts[plane[i]];
+    }
+    if (is_coded && position - code_begin >= static_cast<std::ptrdiff_t>(sizeof(uint32_t)))
+    {
+      position -= sizeof(uint32_t);
+      std::memcpy(position, &state, sizeof(uint32_t));
+    }
+    else
+      is_coded = false;
+  }
+
+  if (!is_coded)
+  {
+    output.push_back(static_cast<char>(PlaneCoding::RAW_PLANE));
+    output.insert(output.end(), reinterpret_cast<const char*>(plane), reinterpret_cast<const char*>(plane) + num_symbols);
+    return;
+  }
+  output.push_back(static_cast<char>(PlaneCoding::RANS_PLANE));
+  for (int symbol = 0; symbol < 256; ++symbol)
+  {
+    const uint16_t frequency = static_cast<uint16_t>(frequencies[symbol]);
+    output.insert(output.end(), reinterpret_cast<const char*>(&frequency), reinterpret_cast<const char*>(&frequency) + sizeof(frequency));
+  }
+  append_uint64(output, code_end - position);
+  output.insert(output.end(), reinterpret_cast<const char*>(position), reinterpret_cast<const char*>(code_end));
+}
+
+
+// Decode `num_symbols` bytes of a plane from `encode_plane` into `plane`
+static void decode_plane(ByteReader& input, uint8_t* const plane, const size_t num_symbols)
+{
+  const auto coding = static_cast<PlaneCoding>(*input.take(1));
+  if (coding == PlaneCoding::RAW_PLANE)
+  {
+    std::memcpy(plane, input.take(num_symbols), num_symbols);
+    return;
+  }
+  if (coding != PlaneCoding::RANS_PLANE)
+    std::__throw_runtime_error("Compressed codebook has an unknown plane coding");
+
+  uint32_t frequencies[256];
+  uint32_t starts[256];
+  uint8_t symbols[RANS_SCALE];
+  const char* const table = input.take(FREQUENCY_TABLE_SIZE);
+  uint32_t start = 0;
+  for (int symbol = 0; symbol < 256; ++symbol)
+  {
+    uint16_t frequency;
+    std::memcpy(&frequency, table + symbol * sizeof(uint16_t), sizeof(uint16_t));
+    if (frequency > RANS_SCALE - start)
+      std::__throw_runtime_error("Compressed codebook has corrupt frequencies");
+    frequencies[symbol] = frequency;
+    starts[symbol] = start;
+    std::fill(symbols + start, symbols + start + frequency, static_cast<uint8_t>(symbol));
+    start += frequency;
+  }
+  if (start != RANS_SCALE)
+    std::__throw_runtime_error("Compressed codebook has corrupt frequencies");
+
+  const uint64_t code_size = input.take_uint64();
+  if (code_size < sizeof(uint32_t))
+    std::__throw_runtime_error("Compressed codebook is truncated");
+  const auto* position = reinterpret_cast<const uint8_t*>(input.take(code_size));
+  const uint8_t* const code_end = position + code_size;
+  uint32_t state;
+  std::memcpy(&state, position, sizeof(uint32_t));
+  position += sizeof(uint32_t);
+
+  for (size_t i = 0; i < num_symbols; ++i)
+  {
+    const uint32_t slot = state & (RANS_SCALE - 1);
+    const uint8_t symbol = symbols[slot];
+    plane[i] = symbol;
+    state = frequencies[symbol] * (state >> RANS_SCALE_BITS) + slot - starts[symbol];
+    while (state < RANS_LOWER_BOUND)
+    {
+      if (position == code_end)
+        std::__throw_runtime_error("Compressed codebook is truncated");
+      state = (state << 8) | *position++;
+    }
+  }
+  // The encoder started from the lower bound and used up all bytes
+  if (state != RANS_LOWER_BOUND || position != code_end)
+    std::__throw_runtime_error("Compressed codebook is corrupt");
+}
+
+
+// Columns of every chunk, such that a chunk has about `COMPRESSION_CHUNK_SIZE` values
+static uint64_t get_chunk_columns(const uint64_t num_cells, const uint64_t input_dim)
+{
+  return std::max<uint64_t>(1, std::min<uint64_t>(input_dim, COMPRESSION_CHUNK_SIZE / std::max<uint64_t>(num_cells, 1)));
+}
+
+
+std::vector<char> compress_codebook_values(const Float* const values, const uint64_t num_cells, const uint64_t input_dim)
+{
+  const uint64_t chunk_columns = get_chunk_columns(num_cells, input_dim);
+  const uint64_t num_chunks = (input_dim + chunk_columns - 1) / chunk_columns;
+  std::vector<std::vector<char>> chunks(num_chunks);
+
+  parallel_for("compress_codebook_values", 0, num_chunks, [&](const size_t first_chunk, const size_t end_chunk, const int) {
+    std::vector<uint8_t> planes;
+    for (size_t chunk = first_chunk; chunk < end_chunk; ++chunk)
+    {
+      const uint64_t first_column = chunk * chunk_columns;
+      const uint64_t num_columns = std::min(chunk_columns, input_dim - first_column);
+      const size_t num_values = num_cells * num_columns;
+      planes.resize(4 * num_values);
+      for (uint64_t cell = 0; cell < num_cells; ++cell)
+        for (uint64_t column = 0; column < num_columns; ++column)
+        {
+          uint32_t bits, previous_bits = 0;
+          std::memcpy(&bits, values + cell * input_dim + first_column + column, sizeof(bits));
+          if (cell > 0)
+            std::memcpy(&previous_bits, values + (cell - 1) * input_dim + first_column + column, sizeof(previous_bits));
+          const uint32_t difference = bits ^ previous_bits;
+          const size_t i = cell * num_columns + column;
+          for (int byte = 0; byte < 4; ++byte)
+            planes[byte * num_values + i] = static_cast<uint8_t>(difference >> (8 * byte));
+        }
+      for (int byte = 0; byte < 4; ++byte)
+        encode_plane(planes.data() + byte * num_values, num_values, chunks[chunk]);
+    }
+  });
+
+  std::vector<char> bytes;
+  size_t num_bytes = 2 * sizeof(uint64_t) + num_chunks * sizeof(uint64_t);
+  for (const auto& chunk : chunks)
+    num_bytes += chunk.size();
+  bytes.reserve(num_bytes);
+  append_uint64(bytes, chunk_columns);
+  append_uint64(bytes, num_chunks);
+  for (const auto& chunk : chunks)
+    append_uint64(bytes, chunk.size());
+  for (auto& chunk : chunks)
+  {
+    bytes.insert(bytes.end(), chunk.begin(), chunk.end());
+    std::vector<char>().swap(chunk);
+  }
+  return bytes;
+}
+
+
+void decompress_codebook_values(
+  const char* const bytes,
+  const size_t num_bytes,
+  const uint64_t num_cells,
+  const uint64_t input_dim,
+  Float* const values,
+  const uint64_t first_cell,
+  const uint64_t end_cell
+)
+{
+  if (first_cell > end_cell || end_cell > num_cells)
+    std::__throw_invalid_argument("The decompressed cells must be a range of the codebook cells");
+
+  ByteReader header(bytes, bytes + num_bytes);
+  const uint64_t chunk_columns = header.take_uint64();
+  const uint64_t num_chunks = header.take_uint64();
+  if (chunk_columns == 0 || num_chunks != (input_dim + chunk_columns - 1) / chunk_columns)
+    std::__throw_runtime_error("Compressed codebook does not match the codebook dimensions");
+  std::vector<const char*> chunk_begins(num_chunks + 1);
+  std::vector<uint64_t> chunk_sizes(num_chunks);
+  for (auto& size : chunk_sizes)
+    size = header.take_uint64();
+  for (uint64_t chunk = 0; chunk < num_chunks; ++chunk)
+    chunk_begins[chunk] = header.take(chunk_sizes[chunk]);
+  if (!header.is_at_end())
+    std::__throw_runtime_error("Compressed codebook has trailing bytes");
+
+  parallel_for("decompress_codebook_values", 0, num_chunks, [&](const size_t first_chunk, const size_t end_chunk, const int) {
+    std::vector<uint8_t> planes;
+    std::vector<uint32_t> previous_bits;
+    for (size_t chunk = first_chunk; chunk < end_chunk; ++chunk)
+    {
+      const uint64_t first_column = chunk * chunk_columns;
+      const uint64_t num_columns = std::min(chunk_columns, input_dim - first_column);
+      const size_t num_values = num_cells * num_columns;
+      planes.resize(4 * num_values);
+      ByteReader input(chunk_begins[chunk], chunk_begins[chunk] + chunk_sizes[chunk]);
+      for (int byte = 0; byte < 4; ++byte)
+        decode_plane(input, planes.data() + byte * num_values, num_values);
+      if (!input.is_at_end())
+        std::__throw_runtime_error("Compressed codebook is corrupt");
+
+      // Every cell is the XOR of its difference with the previous cell, so the cells before
+      // `first_cell` are decoded as well
+      previous_bits.assign(num_columns, 0);
+      for (uint64_t cell = 0; cell < end_cell; ++cell)
+        for (uint64_t column = 0; column < num_columns; ++column)
+        {
+          const size_t i = cell * num_columns + column;
+          uint32_t bits = 0;
+          for (int byte = 0; byte < 4; ++byte)
+            bits |= static_cast<uint32_t>(planes[byte * num_values + i]) << (8 * byte);
+          bits ^= previous_bits[column];
+          previous_bits[column] = bits;
+          if (cell >= first_cell)
+            std::memcpy(values + (cell - first_cell) * input_dim + first_column + column, &bits, sizeof(bits));
+        }
+    }
+  });
+}
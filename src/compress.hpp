@@ -0,0 +1,32 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "data.hpp"
+
+
+#define COMPRESSION_CHUNK_SIZE (1 << 20)  // Number of Floats that are compressed together, at most (unless a column has more cells)
+
+
+// Lossless compression of the values of a codebook, whose `num_cells` cells of `input_dim` Floats
+// follow each other. The columns are split into chunks of about `COMPRESSION_CHUNK_SIZE` values,
+// which are compressed independently and in parallel:
+// 1. Every value is XORed with the same column of the previous cell, which is its neighbour in the
+//    map and has a similar value, so the sign, exponent and leading mantissa bits mostly cancel.
+// 2. The four bytes of the results are shuffled into four planes, from the lowest to the highest byte.
+// 3. Every plane is coded with a static order-0 rANS entropy coder (Duda, arXiv:1311.2540), or is
+//    stored as it is if that is not smaller.
+// The output starts with the number of columns per chunk, the number of chunks and their sizes.
+std::vector<char> compress_codebook_values(const Float* const values, const uint64_t num_cells, const uint64_t input_dim);
+
+// Decompress the cells [first_cell, end_cell) of the `num_bytes` at `bytes` from `compress_codebook_values`
+// into `values`, which holds `(end_cell - first_cell) * input_dim` Floats. Throws if the bytes are corrupt.
+void decompress_codebook_values(
+  const char* const bytes,
+  const size_t num_bytes,
+  const uint64_t num_cells,
+  const uint64_t input_dim,
+  Float* const values,
+  const uint64_t first_cell,
+  const uint64_t end_cell
+);
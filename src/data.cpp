@@ -1,12 +1,24 @@
 
 #include <fstream>
 #include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
 #include "data.hpp"
 #include "utils.hpp"
+#include "numa.hpp"
+#include "checksum.hpp"
 
 
-CorpusDataset::CorpusDataset(const std::string& filename)
+CorpusDataset::CorpusDataset(const std::string& filename) :
+	CorpusDataset(filename, 0, 1)
+{}
+
+
+CorpusDataset::CorpusDataset(const std::string& filename, const IndexPointerType shard, const IndexPointerType num_shards)
 {
+	if (shard >= num_shards)
+		std::__throw_invalid_argument("The shard index must be smaller than the number of shards");
 	std::cout << "Load corpus data from " << filename << std::endl;
 	if (!file_exists(filename))
 		std::__throw_runtime_error("File does not exist");
@@ -24,14 +36,23 @@ CorpusDataset::CorpusDataset(const std::string& filename)
 	switch (format_version)
 	{
 	case 2:
+	case 4:
+	case 6:
 		this->_has_weights = true;
 		break;
 	case 3:
+	case 5:
+	case 7:
 		this->_has_weights = false;
 		break;	
 	default:
-		std::__throw_runtime_error("Expected file format version 2 or 3");
+		std::__throw_runtime_error("Expected file format version 2 to 7");
 	}
+	// Versions 4 and 5 end with checksums, and versions 6 and 7 of `smap reorder` also record its cutoff
+	const bool has_checksums = format_version >= 4;
+	this->is_reordered = format_version >= 6;
+	std::unique_ptr<std::streambuf> verifying_buffer;  // With --verify, checks the blocks that the loader reads
+	const uint64_t num_content_bytes = has_checksums ? check_checksummed_file(filename, file, verifying_buffer) : 0;
 
 	// Read total number of entries in the matrix in this file
 	file.read((char*)buffer_8byte, sizeof(uint64_t));
@@ -41,9 +62,42 @@ CorpusDataset::CorpusDataset(const std::string& filename)
 
 	// Read matrix size
 	file.read((char*)buffer_4byte, sizeof(uint32_t));
-	this->num_rows = int(buffer_4byte[0]);	
+	this->num_total_rows = int(buffer_4byte[0]);
 	file.read((char*)buffer_4byte, sizeof(uint32_t));
 	this->num_cols = int(buffer_4byte[0]);
+	this->reordered_train_vocab_cutoff = 0;
+	if (this->is_reordered)
+	{
+		file.read((char*)buffer_4byte, sizeof(uint32_t));
+		this->reordered_train_vocab_cutoff = buffer_4byte[0];
+	}
+
+	// Rows of this shard
+	this->first_row = static_cast<IndexPointerType>(static_cast<uint64_t>(this->num_total_rows) * shard / num_shards);
+	const auto end_row = static_cast<IndexPointerType>(static_cast<uint64_t>(this->num_total_rows) * (shard + 1) / num_shards);
+	this->num_rows = end_row - this->first_row;
+	if (num_shards > 1)
+	{
+		const std::streamoff bytes_per_entry = sizeof(IndexType) + (this->has_weights() ? sizeof(WeightType) : 0);
+
+		// Skip the rows of all previous shards
+		for (IndexPointerType row = 0; row < this->first_row; ++row)
+		{
+			file.read((char*)buffer_4byte, sizeof(IndexType));
+			file.seekg(buffer_4byte[0] * bytes_per_entry, std::ios::cur);
+		}
+
+		// Count the entries in this shard
+		const auto shard_start = file.tellg();
+		this->num_non_zero = 0;
+		for (IndexPointerType row = 0; row < this->num_rows; ++row)
+		{
+			file.read((char*)buffer_4byte, sizeof(IndexType));
+			file.seekg(buffer_4byte[0] * bytes_per_entry, std::ios::cur);
+			this->num_non_zero += buffer_4byte[0];
+		}
+		file.seekg(shard_start);
+	}
 
 	// Read the data
 	this->indices.reserve(this->num_non_zero);
@@ -58,7 +112,10 @@ CorpusDataset::CorpusDataset(const std::string& filename)
 		// Read number of entries in this row
 		file.read((char*)buffer_4byte, sizeof(IndexType));
 		entires_in_row = reinterpret_cast<IndexType>(buffer_4byte[0]);
-
+		if (!file)
+			std::__throw_runtime_error("Corpus file is truncated");
+		if (static_cast<uint64_t>(index_pointer) + entires_in_row > this->num_non_zero)
+			std::__throw_runtime_error("Corpus file has more entries than its header says");
 
 		// Set index pointer for beginning of the next row (or end of the data)
 		this->index_pointers[row + 1] = index_pointer + entires_in_row;
@@ -88,6 +145,11 @@ CorpusDataset::CorpusDataset(const std::string& filename)
 		}
 	}
 
+	if (!file)
+		std::__throw_runtime_error("Corpus file is truncated");
+	// The last shard ends where the checksums begin
+	if (has_checksums && shard + 1 == num_shards && static_cast<uint64_t>(file.tellg()) != num_content_bytes)
+		std::__throw_runtime_error("Corpus file does not match its header");
 	file.close();
 	delete [] buffer_8byte;
 	delete [] buffer_4byte;
@@ -95,6 +157,57 @@ CorpusDataset::CorpusDataset(const std::string& filename)
 }
 
 
+CorpusHeader read_corpus_header(const std::string& filename)
+{
+	if (!file_exists(filename))
+		std::__throw_runtime_error("File does not exist");
+
+	std::ifstream file(filename, std::ios::binary);
+	uint8_t format_version = 0;
+	uint64_t num_non_zero = 0;
+	uint32_t num_rows = 0, num_cols = 0, reordered_train_vocab_cutoff = 0;
+	file.read((char*)&format_version, sizeof(uint8_t));
+	file.read((char*)&num_non_zero, sizeof(uint64_t));
+	file.read((char*)&num_rows, sizeof(uint32_t));
+	file.read((char*)&num_cols, sizeof(uint32_t));
+	if (format_version >= 6)
+		file.read((char*)&reordered_train_vocab_cutoff, sizeof(uint32_t));
+	if (!file)
+		std::__throw_runtime_error("Cannot read the corpus header");
+	if (format_version < 2 || format_version > 7)
+		std::__throw_runtime_error("Expected file format version 2 to 7");
+	if (num_non_zero > MAX_INDEX_POINTER_SIZE)
+		std::__throw_runtime_error("Too many entries in training data");
+
+	CorpusHeader header;
+	header.has_weights = format_version % 2 == 0;
+	header.num_non_zero = num_non_zero;
+	header.num_rows = num_rows;
+	header.num_cols = num_cols;
+	header.is_reordered = format_version >= 6;
+	header.reordered_train_vocab_cutoff = reordered_train_vocab_cutoff;
+	return header;
+}
+
+
+void add_corpus_checksums(const std::string& filename)
+{
+	const auto header = read_corpus_header(filename);
+	std::fstream file(filename, std::ios::in | std::ios::out | std::ios::binary);
+	uint8_t format_version = 0;
+	file.read((char*)&format_version, sizeof(uint8_t));
+	if (format_version >= 4)
+		std::__throw_invalid_argument("The corpus already has checksums");
+	// Version 2 becomes 4 and version 3 becomes 5
+	file.seekp(0);
+	write_uint8(file, header.has_weights ? 4 : 5);
+	file.close();
+	if (!file)
+		std::__throw_runtime_error("Cannot write the corpus version");
+	append_checksum_trailer(filename);
+}
+
+
 IndexType BinarySparseMatrix::min_word_index_to_avoid_empty_row()
 {
 	IndexType max_first_word_index = 0;
@@ -113,6 +226,98 @@ IndexType BinarySparseMatrix::min_word_index_to_avoid_empty_row()
 }
 
 
+void BinarySparseMatrix::place_on_numa_nodes() const
+{
+	if (get_num_numa_nodes() < 2)
+		return;
+
+	const auto boundaries = split_by_numa_node(this->num_rows);
+	for (size_t node = 0; node + 1 < boundaries.size(); ++node)
+	{
+		const IndexPointerType first = this->index_pointers[boundaries[node]];
+		const IndexPointerType end = this->index_pointers[boundaries[node + 1]];
+		move_to_numa_node(this->indices.data() + first, (end - first) * sizeof(IndexType), static_cast<int>(node));
+		if (this->has_weights())
+			move_to_numa_node(this->weights.data() + first, (end - first) * sizeof(WeightType), static_cast<int>(node));
+	}
+	split_over_numa_nodes(this->index_pointers.data(), this->num_rows, sizeof(IndexPointerType));
+	if (this->_sum_of_squares)
+		split_over_numa_nodes(this->_sum_of_squares, this->num_rows, sizeof(IndexType));
+}
+
+
+static inline uint64_t splitmix64(uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+
+IndexType get_hashed_columns(const FeatureHashing& hashing, const IndexType column, IndexType* const buckets)
+{
+	if (column < hashing.num_exact_columns)
+	{
+		buckets[0] = column;
+		return 1;
+	}
+	const uint64_t num_hashed_buckets = hashing.num_buckets - hashing.num_exact_columns;
+	for (IndexType probe = 0; probe < hashing.num_probes; ++probe)
+		buckets[probe] = hashing.num_exact_columns + static_cast<IndexType>(splitmix64(static_cast<uint64_t>(column) * MAX_HASH_PROBES + probe) % num_hashed_buckets);
+	std::sort(buckets, buckets + hashing.num_probes);
+	return std::unique(buckets, buckets + hashing.num_probes) - buckets;
+}
+
+
+void BinarySparseMatrix::hash_columns(const FeatureHashing& hashing)
+{
+	if (this->_sum_of_squares)
+		std::__throw_logic_error("Hash the columns before computing the sums of squares");
+	if (hashing.num_exact_columns >= hashing.num_buckets)
+		std::__throw_invalid_argument("The hashed columns need more buckets than the training vocabulary cutoff");
+	if (hashing.num_probes < 1 || hashing.num_probes > MAX_HASH_PROBES)
+		std::__throw_invalid_argument("The number of hash probes must be between 1 and 16");
+
+	std::vector<IndexPointerType> index_pointers(this->num_rows + 1, 0);
+	std::vector<IndexType> indices;
+	std::vector<WeightType> weights;
+	std::vector<std::pair<IndexType, WeightType>> entries;
+	IndexType buckets[MAX_HASH_PROBES];
+	for (IndexPointerType row = 0; row < this->num_rows; ++row)
+	{
+		entries.clear();
+		const IndexType* const row_indices = this->indices_in_row(row);
+		for (IndexType i = 0; i < this->num_indices_in_row(row); ++i)
+		{
+			const WeightType weight = this->has_weights() ? this->weights_in_row(row)[i] : 1;
+			const IndexType num_buckets = get_hashed_columns(hashing, row_indices[i], buckets);
+			for (IndexType j = 0; j < num_buckets; ++j)
+				entries.push_back({buckets[j], weight});
+		}
+		// Sorted by bucket with the largest weight last
+		std::sort(entries.begin(), entries.end());
+		for (size_t i = 0; i < entries.size(); ++i)
+		{
+			if (i + 1 < entries.size() && entries[i + 1].first == entries[i].first)
+				continue;
+			if (static_cast<uint64_t>(indices.size()) >= MAX_INDEX_POINTER_SIZE)
+				std::__throw_runtime_error("Too many entries in training data");
+			indices.push_back(entries[i].first);
+			if (this->has_weights())
+				weights.push_back(entries[i].second);
+		}
+		index_pointers[row + 1] = indices.size();
+	}
+
+	this->index_pointers.swap(index_pointers);
+	this->indices.swap(indices);
+	this->weights.swap(weights);
+	this->num_cols = hashing.num_buckets;
+	this->num_non_zero = this->index_pointers[this->num_rows];
+}
+
+
 void BinarySparseMatrix::init_sum_of_squares()
 {
 	this->_sum_of_squares = new IndexType[this->num_rows];
@@ -136,3 +341,85 @@ void BinarySparseMatrix::init_sum_of_squares()
 		
 	}
 }
+
+
+#define CELL_INDEX_BUFFER_SIZE 65536  // Cell indices converted at once between the file and memory sizes
+
+
+void write_cell_indices(char* const bytes, const CellIndexType* const cell_indices, const size_t count, const uint8_t index_size)
+{
+	if (index_size == sizeof(CellIndexType))
+	{
+		if (count > 0)
+			std::memcpy(bytes, cell_indices, count * sizeof(CellIndexType));
+		return;
+	}
+	if (index_size != 2 && index_size != 4)
+		std::__throw_invalid_argument("Cell indices must have 2 or 4 bytes");
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (index_size == 2)
+		{
+			if (cell_indices[i] > std::numeric_limits<uint16_t>::max())
+				std::__throw_overflow_error("Cell index does not fit into 2 bytes");
+			const uint16_t cell_index = static_cast<uint16_t>(cell_indices[i]);
+			std::memcpy(bytes + i * index_size, &cell_index, index_size);
+		}
+		else
+		{
+			const uint32_t cell_index = static_cast<uint32_t>(cell_indices[i]);
+			std::memcpy(bytes + i * index_size, &cell_index, index_size);
+		}
+	}
+}
+
+
+void write_cell_indices(std::ostream& file, const CellIndexType* const cell_indices, const size_t count, const uint8_t index_size)
+{
+	if (index_size == sizeof(CellIndexType))
+	{
+		file.write((const char*) cell_indices, count * sizeof(CellIndexType));
+		return;
+	}
+	if (index_size != 2 && index_size != 4)
+		std::__throw_invalid_argument("Cell indices must have 2 or 4 bytes");
+
+	std::vector<char> buffer(CELL_INDEX_BUFFER_SIZE * index_size);
+	for (size_t offset = 0; offset < count; offset += CELL_INDEX_BUFFER_SIZE)
+	{
+		const size_t chunk_size = std::min<size_t>(CELL_INDEX_BUFFER_SIZE, count - offset);
+		write_cell_indices(buffer.data(), cell_indices + offset, chunk_size, index_size);
+		file.write(buffer.data(), chunk_size * index_size);
+	}
+}
+
+
+void read_cell_indices(std::istream& file, CellIndexType* const cell_indices, const size_t count, const uint8_t index_size)
+{
+	if (index_size == sizeof(CellIndexType))
+	{
+		file.read((char*) cell_indices, count * sizeof(CellIndexType));
+		if (!file)
+			std::__throw_runtime_error("Stored cell indices are truncated");
+		return;
+	}
+	if (index_size != 2 && index_size != 4)
+		std::__throw_runtime_error("Stored cell indices must have 2 or 4 bytes");
+
+	std::vector<char> buffer(CELL_INDEX_BUFFER_SIZE * index_size);
+	for (size_t offset = 0; offset < count; offset += CELL_INDEX_BUFFER_SIZE)
+	{
+		const size_t chunk_size = std::min<size_t>(CELL_INDEX_BUFFER_SIZE, count - offset);
+		file.read(buffer.data(), chunk_size * index_size);
+		if (!file)
+			std::__throw_runtime_error("Stored cell indices are truncated");
+		for (size_t i = 0; i < chunk_size; ++i)
+		{
+			const uint64_t cell_index = index_size == 2 ? reinterpret_cast<const uint16_t*>(buffer.data())[i] : reinterpret_cast<const uint32_t*>(buffer.data())[i];
+			if (cell_index > MAX_NUM_CELLS)
+				std::__throw_runtime_error("Stored cell index exceeds the cells of this build (see SMAP_CELL_INDEX_BITS)");
+			cell_indices[offset + i] = static_cast<CellIndexType>(cell_index);
+		}
+	}
+}
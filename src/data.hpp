@@ -9,7 +9,16 @@
 
 typedef uint32_t IndexType;					// Can enumerate the vocabulary
 typedef uint32_t IndexPointerType;	// Can enumerate all training data
-typedef uint16_t CellIndexType;			// Can enumerate all cells in the map (e.g. 128**2)
+#if !defined(SMAP_CELL_INDEX_BITS)
+  #define SMAP_CELL_INDEX_BITS 16
+#endif
+#if SMAP_CELL_INDEX_BITS == 16
+typedef uint16_t CellIndexType;			// Can enumerate all cells in the map (at most 65535, e.g. 256x255)
+#elif SMAP_CELL_INDEX_BITS == 32
+typedef uint32_t CellIndexType;			// Can enumerate the cells of larger maps (e.g. 1024**2), at twice the memory per snippet
+#else
+  #error "SMAP_CELL_INDEX_BITS must be 16 or 32"
+#endif
 typedef uint32_t CountType;					// Can represent the largest number of snippets that contain a specific term and are associated with a cell
 typedef uint8_t WeightType;					// Can enumerate all weight classes (document title to text body)
 typedef _Float32 Float;							// Regular precision floats
@@ -20,6 +29,7 @@ const Float MAX_INTEGER_DISTANCE = std::numeric_limits<CellIndexType>::max();
 const CountType MAX_COUNT = std::numeric_limits<CountType>::max();
 const IndexType MAX_INDEX_SIZE = std::numeric_limits<IndexType>::max();
 const IndexPointerType MAX_INDEX_POINTER_SIZE = std::numeric_limits<IndexPointerType>::max();
+const uint64_t MAX_NUM_CELLS = std::numeric_limits<CellIndexType>::max();
 
 
 inline bool file_exists (const std::string& filename) 
@@ -42,7 +52,7 @@ inline bool is_big_endian()
 }
 
 
-template<typename T> inline void write_uint64(std::ofstream& file, const T value)
+template<typename T> inline void write_uint64(std::ostream& file, const T value)
 {
 	uint64_t _value = static_cast<uint64_t>(value);
 	file.write((const char*) &_value, sizeof(uint64_t));
@@ -65,16 +75,52 @@ inline uint64_t read_uint64(std::ifstream& file)
 }
 
 
-template<typename T> inline void write_uint8(std::ofstream& file, const T value)
+template<typename T> inline void write_uint8(std::ostream& file, const T value)
 {
 	uint8_t _value = static_cast<uint8_t>(value);
 	file.write((const char*) &_value, sizeof(uint8_t));
 }
 
 
+// Bytes per cell index in the files of a map with `num_cells` cells. This is 2 wherever the indices
+// fit, so the files of small maps are the same with either `SMAP_CELL_INDEX_BITS`.
+inline uint8_t get_cell_index_file_size(const uint64_t num_cells)
+{
+	return num_cells <= std::numeric_limits<uint16_t>::max() ? 2 : 4;
+}
+
+// Write `count` cell indices with `index_size` (2 or 4) bytes each
+void write_cell_indices(std::ostream& file, const CellIndexType* const cell_indices, const size_t count, const uint8_t index_size);
+// Same into the `count * index_size` bytes at `bytes`
+void write_cell_indices(char* const bytes, const CellIndexType* const cell_indices, const size_t count, const uint8_t index_size);
+// Read `count` cell indices with `index_size` (2 or 4) bytes each, which must fit into `CellIndexType`
+void read_cell_indices(std::istream& file, CellIndexType* const cell_indices, const size_t count, const uint8_t index_size);
+
+
+#define MAX_HASH_PROBES 16
+
+
+// Folding of an open vocabulary into a fixed number of columns (feature hashing)
+struct FeatureHashing
+{
+	IndexType num_buckets = 0;        // Number of columns after hashing (0 to disable)
+	IndexType num_probes = 1;         // Buckets of every hashed term, so that two terms rarely share all of them
+	IndexType num_exact_columns = 0;  // The columns below this keep their index, e.g. the training vocabulary
+
+	inline bool is_enabled() const { return this->num_buckets > 0; }
+};
+
+// Write the distinct buckets of `column` in ascending order to `buckets`, which has room for
+// `MAX_HASH_PROBES`, and return their number. Bucket `p` of a hashed column is
+// `num_exact_columns + splitmix64(MAX_HASH_PROBES * column + p) % (num_buckets - num_exact_columns)`,
+// which `codebook_to_json.py` repeats to recover the fingerprints of the terms.
+IndexType get_hashed_columns(const FeatureHashing& hashing, const IndexType column, IndexType* const buckets);
+
+
 class BinarySparseMatrix
 {
 public:
+	BinarySparseMatrix() : _sum_of_squares(nullptr) {}
 	~BinarySparseMatrix()
 	{
 		if (this->_sum_of_squares) 
@@ -83,6 +129,12 @@ public:
 
 	void init_sum_of_squares();
 	IndexType min_word_index_to_avoid_empty_row();
+	// Replace every column by its buckets, where the largest weight of the terms in a bucket wins.
+	// Call this before `init_sum_of_squares`.
+	void hash_columns(const FeatureHashing& hashing);
+	// Move the rows to the NUMA nodes as split by `split_by_numa_node`, which the threads of the
+	// parallel loops over the rows mostly read when pinned to `get_cpus_by_numa_node()`
+	void place_on_numa_nodes() const;
 
 	std::vector<IndexType> indices;
 	std::vector<IndexPointerType> index_pointers;
@@ -137,6 +189,31 @@ class CorpusDataset : public BinarySparseMatrix
 {
 public:
 	CorpusDataset(const std::string& filename);                   // Load from filename
+	// Load only the `shard`-th of `num_shards` contiguous blocks of rows
+	CorpusDataset(const std::string& filename, const IndexPointerType shard, const IndexPointerType num_shards);
 	CorpusDataset(const CorpusDataset&) = delete;                 // Disable copy
 	CorpusDataset& operator=(const CorpusDataset&) = delete;      // Disable assignment
+
+	IndexPointerType first_row;       // Index of the first loaded row in the whole corpus
+	IndexPointerType num_total_rows;  // Number of rows in the whole corpus
+	bool is_reordered;                // Whether `smap reorder` renumbered the columns (format versions 6 and 7)
+	IndexType reordered_train_vocab_cutoff;  // The cutoff whose terms `smap reorder` kept below it
 };
+
+
+// Sizes from the header of a corpus file, which can be read without loading the corpus
+struct CorpusHeader
+{
+	bool has_weights;
+	uint64_t num_non_zero;
+	IndexPointerType num_rows;
+	IndexType num_cols;
+	bool is_reordered;
+	IndexType reordered_train_vocab_cutoff;
+};
+
+CorpusHeader read_corpus_header(const std::string& filename);
+
+// Convert a corpus of format version 2 or 3, e.g. from `text_to_binary.py`, to version 4 or 5
+// with checksums (see `check_checksummed_file`) in place
+void add_corpus_checksums(const std::string& filename);
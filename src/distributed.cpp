@@ -0,0 +1,511 @@
+#include <climits>
+#include <cstring>
+#include <stdexcept>
+#include <cstdlib>
+#include <fstream>
+
+#if defined(SMAP_MPI)
+  #define OMPI_SKIP_MPICXX  // Only the C interface is used
+  #define MPICH_SKIP_MPICXX
+  #include <mpi.h>
+#endif
+
+#include "distributed.hpp"
+#include "checksum.hpp"
+
+
+#if defined(SMAP_MPI)
+// Largest number of elements passed to a single MPI call, since MPI counts are `int`s
+static const size_t MAX_MPI_COUNT = 1 << 28;
+
+// Processes with the same cells (to reduce over the rows) and with the same rows (to reduce over the cells)
+static MPI_Comm rows_communicator = MPI_COMM_NULL;
+static MPI_Comm cells_communicator = MPI_COMM_NULL;
+#endif
+static int num_cell_shards = 1;
+
+
+#if defined(SMAP_MPI)
+// Best and next-best matching unit of a row among a range of cells
+struct BestMatchingUnitCandidate
+{
+  Float distance;
+  Float next_distance;
+  CellIndexType cell;
+  CellIndexType next_cell;
+};
+
+
+static void check_mpi(const int result)
+{
+  if (result != MPI_SUCCESS)
+    std::__throw_runtime_error("MPI operation failed");
+}
+
+
+static bool is_mpi_active()
+{
+  int initialized = 0;
+  int finalized = 0;
+  MPI_Initialized(&initialized);
+  MPI_Finalized(&finalized);
+  return initialized && !finalized;
+}
+
+
+template<typename T> static void all_reduce_in_chunks(T* const values, const size_t count, const MPI_Datatype type, const MPI_Op operation)
+{
+  for (size_t offset = 0; offset < count; offset += MAX_MPI_COUNT)
+  {
+    const int chunk_size = static_cast<int>(std::min(MAX_MPI_COUNT, count - offset));
+    check_mpi(MPI_Allreduce(MPI_IN_PLACE, values + offset, chunk_size, type, operation, rows_communicator));
+  }
+}
+
+
+// Counts and displacements in bytes of the contributions of all processes
+static void get_byte_layout(const size_t num_bytes, std::vector<int>& counts, std::vector<int>& displacements)
+{
+  const int num_processes = get_num_row_shards();
+  unsigned long long _num_bytes = num_bytes;
+  std::vector<unsigned long long> all_num_bytes(num_processes);
+  check_mpi(MPI_Allgather(&_num_bytes, 1, MPI_UNSIGNED_LONG_LONG, all_num_bytes.data(), 1, MPI_UNSIGNED_LONG_LONG, rows_communicator));
+
+  counts.resize(num_processes);
+  displacements.resize(num_processes);
+  unsigned long long total = 0;
+  for (int process = 0; process < num_processes; ++process)
+  {
+    if (total + all_num_bytes[process] > INT_MAX)
+      std::__throw_length_error("Too much data to gather from all processes");
+    counts[process] = static_cast<int>(all_num_bytes[process]);
+    displacements[process] = static_cast<int>(total);
+    total += all_num_bytes[process];
+  }
+}
+
+
+// Continue the search of the cells in `lower` with the cells in `higher`, see `Codebook::find_best_and_next_best_matching_units`
+static void merge_candidates(void* lower, void* higher, int* count, MPI_Datatype*)
+{
+  const auto* const in = static_cast<const BestMatchingUnitCandidate*>(lower);
+  auto* const inout = static_cast<BestMatchingUnitCandidate*>(higher);
+  for (int i = 0; i < *count; ++i)
+  {
+    if (inout[i].distance < in[i].distance)
+    {
+      // The best cell among the higher cells is the overall best one. The previous best cell
+      // is the best one of the lower cells, unless the higher cells found a better one before.
+      if (!(inout[i].next_distance < in[i].distance))
+      {
+        inout[i].next_cell = in[i].cell;
+        inout[i].next_distance = in[i].distance;
+      }
+    }
+    else
+    {
+      inout[i] = in[i];
+    }
+  }
+}
+#endif
+
+
+void init_distributed(int* argc, char*** argv)
+{
+  #if defined(SMAP_MPI)
+    // Only the main thread communicates, the OpenMP threads do not
+    int provided;
+    check_mpi(MPI_Init_thread(argc, argv, MPI_THREAD_FUNNELED, &provided));
+    rows_communicator = MPI_COMM_WORLD;
+    cells_communicator = MPI_COMM_SELF;
+  #else
+    (void) argc;
+    (void) argv;
+  #endif
+}
+
+
+void init_process_grid(const int _num_cell_shards)
+{
+  if (_num_cell_shards < 1 || get_num_processes() % _num_cell_shards != 0)
+    std::__throw_invalid_argument("The number of cell shards must divide the number of processes");
+  num_cell_shards = _num_cell_shards;
+  #if defined(SMAP_MPI)
+    if (!is_mpi_active())
+      return;
+    const int rank = get_process_rank();
+    check_mpi(MPI_Comm_split(MPI_COMM_WORLD, rank % num_cell_shards, rank / num_cell_shards, &rows_communicator));
+    check_mpi(MPI_Comm_split(MPI_COMM_WORLD, rank / num_cell_shards, rank % num_cell_shards, &cells_communicator));
+  #endif
+}
+
+
+void finalize_distributed()
+{
+  #if defined(SMAP_MPI)
+    if (is_mpi_active())
+      MPI_Finalize();
+  #endif
+}
+
+
+void abort_distributed(const int error_code)
+{
+  #if defined(SMAP_MPI)
+    if (is_mpi_active())
+      MPI_Abort(MPI_COMM_WORLD, error_code);
+  #endif
+  std::exit(error_code);
+}
+
+
+int get_process_rank()
+{
+  #if defined(SMAP_MPI)
+    if (!is_mpi_active())
+      return 0;
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    return rank;
+  #else
+    return 0;
+  #endif
+}
+
+
+int get_num_processes()
+{
+  #if defined(SMAP_MPI)
+    if (!is_mpi_active())
+      return 1;
+    int size;
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+    return size;
+  #else
+    return 1;
+  #endif
+}
+
+
+int get_row_shard()
+{
+  return get_process_rank() / num_cell_shards;
+}
+
+
+int get_num_row_shards()
+{
+  return get_num_processes() / num_cell_shards;
+}
+
+
+int get_cell_shard()
+{
+  return get_process_rank() % num_cell_shards;
+}
+
+
+int get_num_cell_shards()
+{
+  return num_cell_shards;
+}
+
+
+void get_cell_range(const size_t num_cells, size_t& first_cell, size_t& end_cell)
+{
+  first_cell = num_cells * get_cell_shard() / num_cell_shards;
+  end_cell = num_cells * (get_cell_shard() + 1) / num_cell_shards;
+}
+
+
+void all_reduce_sum(Float* const values, const size_t count)
+{
+  #if defined(SMAP_MPI)
+    static_assert(sizeof(Float) == sizeof(float), "Float must be a single precision float");
+    if (are_rows_distributed())
+      all_reduce_in_chunks(reinterpret_cast<float*>(values), count, MPI_FLOAT, MPI_SUM);
+  #else
+    (void) values;
+    (void) count;
+  #endif
+}
+
+
+void all_reduce_sum(Double* const values, const size_t count)
+{
+  #if defined(SMAP_MPI)
+    static_assert(sizeof(Double) == sizeof(double), "Double must be a double precision float");
+    if (are_rows_distributed())
+      all_reduce_in_chunks(reinterpret_cast<double*>(values), count, MPI_DOUBLE, MPI_SUM);
+  #else
+    (void) values;
+    (void) count;
+  #endif
+}
+
+
+void all_reduce_sum(uint64_t* const values, const size_t count)
+{
+  #if defined(SMAP_MPI)
+    if (are_rows_distributed())
+      all_reduce_in_chunks(values, count, MPI_UINT64_T, MPI_SUM);
+  #else
+    (void) values;
+    (void) count;
+  #endif
+}
+
+
+void all_reduce_or(bool* const values, const size_t count)
+{
+  #if defined(SMAP_MPI)
+    if (are_rows_distributed())
+      all_reduce_in_chunks(values, count, MPI_CXX_BOOL, MPI_LOR);
+  #else
+    (void) values;
+    (void) count;
+  #endif
+}
+
+
+uint64_t exclusive_prefix_sum(const uint64_t value)
+{
+  #if defined(SMAP_MPI)
+    if (!are_rows_distributed())
+      return 0;
+    uint64_t _value = value;
+    uint64_t result = 0;
+    check_mpi(MPI_Exscan(&_value, &result, 1, MPI_UINT64_T, MPI_SUM, rows_communicator));
+    // The result of the first process is undefined
+    return get_row_shard() == 0 ? 0 : result;
+  #else
+    (void) value;
+    return 0;
+  #endif
+}
+
+
+void broadcast(Float* const values, const size_t count, const int root)
+{
+  #if defined(SMAP_MPI)
+    if (!are_rows_distributed())
+      return;
+    for (size_t offset = 0; offset < count; offset += MAX_MPI_COUNT)
+    {
+      const int chunk_size = static_cast<int>(std::min(MAX_MPI_COUNT, count - offset));
+      check_mpi(MPI_Bcast(values + offset, chunk_size, MPI_FLOAT, root, rows_communicator));
+    }
+  #else
+    (void) values;
+    (void) count;
+    (void) root;
+  #endif
+}
+
+
+void receive_from_previous_process(Float* const values, const size_t count)
+{
+  #if defined(SMAP_MPI)
+    const int row_shard = get_row_shard();
+    if (row_shard == 0)
+      return;
+    for (size_t offset = 0; offset < count; offset += MAX_MPI_COUNT)
+    {
+      const int chunk_size = static_cast<int>(std::min(MAX_MPI_COUNT, count - offset));
+      check_mpi(MPI_Recv(values + offset, chunk_size, MPI_FLOAT, row_shard - 1, 0, rows_communicator, MPI_STATUS_IGNORE));
+    }
+  #else
+    (void) values;
+    (void) count;
+  #endif
+}
+
+
+void send_to_next_process(const Float* const values, const size_t count)
+{
+  #if defined(SMAP_MPI)
+    const int row_shard = get_row_shard();
+    if (row_shard == get_num_row_shards() - 1)
+      return;
+    for (size_t offset = 0; offset < count; offset += MAX_MPI_COUNT)
+    {
+      const int chunk_size = static_cast<int>(std::min(MAX_MPI_COUNT, count - offset));
+      check_mpi(MPI_Send(values + offset, chunk_size, MPI_FLOAT, row_shard + 1, 0, rows_communicator));
+    }
+  #else
+    (void) values;
+    (void) count;
+  #endif
+}
+
+
+std::vector<char> all_gather_bytes(const void* const data, const size_t num_bytes)
+{
+  const char* const bytes = static_cast<const char*>(data);
+  #if defined(SMAP_MPI)
+    if (are_rows_distributed())
+    {
+      std::vector<int> counts, displacements;
+      get_byte_layout(num_bytes, counts, displacements);
+      std::vector<char> result(static_cast<size_t>(displacements.back()) + counts.back());
+      check_mpi(MPI_Allgatherv(bytes, static_cast<int>(num_bytes), MPI_BYTE, result.data(), counts.data(), displacements.data(), MPI_BYTE, rows_communicator));
+      return result;
+    }
+  #endif
+  return std::vector<char>(bytes, bytes + num_bytes);
+}
+
+
+std::vector<char> gather_bytes_to_root(const void* const data, const size_t num_bytes)
+{
+  const char* const bytes = static_cast<const char*>(data);
+  #if defined(SMAP_MPI)
+    if (are_rows_distributed())
+    {
+      std::vector<int> counts, displacements;
+      get_byte_layout(num_bytes, counts, displacements);
+      std::vector<char> result(get_row_shard() == 0 ? static_cast<size_t>(displacements.back()) + counts.back() : 0);
+      check_mpi(MPI_Gatherv(bytes, static_cast<int>(num_bytes), MPI_BYTE, result.data(), counts.data(), displacements.data(), MPI_BYTE, 0, rows_communicator));
+      return result;
+    }
+  #endif
+  return std::vector<char>(bytes, bytes + num_bytes);
+}
+
+
+void merge_best_matching_units(
+  CellIndexType* const best_matching_units,
+  Float* const distances,
+  CellIndexType* const next_best_matching_units,
+  Float* const next_distances,
+  const size_t num_rows
+)
+{
+  #if defined(SMAP_MPI)
+    if (!are_cells_distributed())
+      return;
+
+    std::vector<BestMatchingUnitCandidate> candidates(num_rows);
+    #pragma omp parallel for
+    for (size_t row = 0; row < num_rows; ++row)
+    {
+      candidates[row].distance = distances[row];
+      candidates[row].cell = best_matching_units[row];
+      candidates[row].next_distance = next_distances ? next_distances[row] : MAX_REAL_DISTANCE;
+      candidates[row].next_cell = next_best_matching_units ? next_best_matching_units[row] : 0;
+    }
+
+    // The merge is associative but not commutative, so MPI applies it in the order of the cell shards
+    MPI_Datatype candidate_type;
+    MPI_Op merge_operation;
+    check_mpi(MPI_Type_contiguous(sizeof(BestMatchingUnitCandidate), MPI_BYTE, &candidate_type));
+    check_mpi(MPI_Type_commit(&candidate_type));
+    check_mpi(MPI_Op_create(merge_candidates, 0, &merge_operation));
+    for (size_t offset = 0; offset < num_rows; offset += MAX_MPI_COUNT)
+    {
+      const int chunk_size = static_cast<int>(std::min(MAX_MPI_COUNT, num_rows - offset));
+      check_mpi(MPI_Allreduce(MPI_IN_PLACE, candidates.data() + offset, chunk_size, candidate_type, merge_operation, cells_communicator));
+    }
+    MPI_Op_free(&merge_operation);
+    MPI_Type_free(&candidate_type);
+
+    #pragma omp parallel for
+    for (size_t row = 0; row < num_rows; ++row)
+    {
+      distances[row] = candidates[row].distance;
+      best_matching_units[row] = candidates[row].cell;
+      if (next_distances)
+        next_distances[row] = candidates[row].next_distance;
+      if (next_best_matching_units)
+        next_best_matching_units[row] = candidates[row].next_cell;
+    }
+  #else
+    (void) best_matching_units;
+    (void) distances;
+    (void) next_best_matching_units;
+    (void) next_distances;
+    (void) num_rows;
+  #endif
+}
+
+
+void write_cell_shards_to_file(const std::string& filename, const std::string& header, const void* const data, const size_t num_bytes)
+{
+  #if defined(SMAP_MPI)
+    if (are_cells_distributed())
+    {
+      // Each cell shard writes its part at the end of the parts of all previous cell shards
+      const bool has_header = get_cell_shard() == 0;
+      uint64_t local_bytes = num_bytes + (has_header ? header.size() : 0);
+      uint64_t offset = 0;
+      check_mpi(MPI_Exscan(&local_bytes, &offset, 1, MPI_UINT64_T, MPI_SUM, cells_communicator));
+      if (has_header)
+        offset = 0;
+
+      // The first cell shard combines the checksums of the parts of every block into the trailer
+      const std::vector<uint32_t> checksums = get_partial_block_checksums(has_header ? header : std::string(), data, num_bytes, offset);
+      const int num_checksums = static_cast<int>(checksums.size());
+      const int num_shards = get_num_cell_shards();
+      std::vector<int> counts(has_header ? num_shards : 0);
+      std::vector<uint64_t> part_offsets(has_header ? num_shards : 0);
+      std::vector<uint64_t> part_bytes(has_header ? num_shards : 0);
+      check_mpi(MPI_Gather(&num_checksums, 1, MPI_INT, counts.data(), 1, MPI_INT, 0, cells_communicator));
+      check_mpi(MPI_Gather(&offset, 1, MPI_UINT64_T, part_offsets.data(), 1, MPI_UINT64_T, 0, cells_communicator));
+      check_mpi(MPI_Gather(&local_bytes, 1, MPI_UINT64_T, part_bytes.data(), 1, MPI_UINT64_T, 0, cells_communicator));
+      std::vector<int> displacements(counts.size(), 0);
+      for (size_t shard = 1; shard < counts.size(); ++shard)
+        displacements[shard] = displacements[shard - 1] + counts[shard - 1];
+      std::vector<uint32_t> all_checksums(has_header ? displacements.back() + counts.back() : 0);
+      check_mpi(MPI_Gatherv(checksums.data(), num_checksums, MPI_UINT32_T, all_checksums.data(), counts.data(), displacements.data(), MPI_UINT32_T, 0, cells_communicator));
+      std::string trailer;
+      const uint64_t num_content_bytes = has_header ? part_offsets.back() + part_bytes.back() : 0;
+      if (has_header)
+      {
+        std::vector<uint32_t> block_checksums((num_content_bytes + CHECKSUM_BLOCK_SIZE - 1) / CHECKSUM_BLOCK_SIZE, 0);
+        std::vector<bool> has_checksum(block_checksums.size(), false);
+        for (int shard = 0; shard < num_shards; ++shard)
+          for (int i = 0; i < counts[shard]; ++i)
+          {
+            const uint64_t block = part_offsets[shard] / CHECKSUM_BLOCK_SIZE + i;
+            const uint64_t begin = std::max<uint64_t>(block * CHECKSUM_BLOCK_SIZE, part_offsets[shard]);
+            const uint64_t end = std::min<uint64_t>((block + 1) * CHECKSUM_BLOCK_SIZE, part_offsets[shard] + part_bytes[shard]);
+            const uint32_t crc = all_checksums[displacements[shard] + i];
+            block_checksums[block] = has_checksum[block] ? crc32c_combine(block_checksums[block], crc, end - begin) : crc;
+            has_checksum[block] = true;
+          }
+        trailer = make_checksum_trailer(block_checksums, num_content_bytes);
+      }
+
+      MPI_File file;
+      if (MPI_File_open(cells_communicator, filename.c_str(), MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &file) != MPI_SUCCESS)
+        std::__throw_runtime_error("Unable to open file for writing");
+      check_mpi(MPI_File_set_size(file, 0));
+      check_mpi(MPI_Barrier(cells_communicator));
+      if (has_header)
+      {
+        check_mpi(MPI_File_write_at(file, 0, header.data(), static_cast<int>(header.size()), MPI_BYTE, MPI_STATUS_IGNORE));
+        offset += header.size();
+      }
+      const char* const bytes = static_cast<const char*>(data);
+      for (size_t chunk_offset = 0; chunk_offset < num_bytes; chunk_offset += MAX_MPI_COUNT)
+      {
+        const int chunk_size = static_cast<int>(std::min(MAX_MPI_COUNT, num_bytes - chunk_offset));
+        check_mpi(MPI_File_write_at(file, offset + chunk_offset, bytes + chunk_offset, chunk_size, MPI_BYTE, MPI_STATUS_IGNORE));
+      }
+      if (has_header)
+        check_mpi(MPI_File_write_at(file, num_content_bytes, trailer.data(), static_cast<int>(trailer.size()), MPI_BYTE, MPI_STATUS_IGNORE));
+      check_mpi(MPI_File_close(&file));
+      return;
+    }
+  #endif
+  std::ofstream file;
+  file.open(filename, std::ios::binary);
+  if (!file.is_open())
+    std::__throw_runtime_error("Unable to open file for writing");
+  file.write(header.data(), header.size());
+  file.write(static_cast<const char*>(data), num_bytes);
+  const std::string trailer = get_checksum_trailer(header, data, num_bytes);
+  file.write(trailer.data(), trailer.size());
+  file.close();
+}
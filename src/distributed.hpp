@@ -0,0 +1,120 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include "data.hpp"
+
+
+// Collective operations for distributed training with MPI (`make mpi`).
+// Without SMAP_MPI, there is exactly one process and all operations leave their arguments unchanged.
+//
+// The processes form a grid of row shards times cell shards. All processes of a row shard load the
+// same rows of the corpus, and each of them owns a contiguous range of cells of the codebook
+// (model parallelism). All processes of a cell shard own the same cells, and each of them loads
+// a contiguous block of rows (data parallelism). Process `rank` belongs to row shard
+// `rank / num_cell_shards` and to cell shard `rank % num_cell_shards`.
+//
+// Unless stated otherwise, the collective operations below combine the processes of the same
+// cell shard, i.e. they reduce over the rows, and must be called by all of them in the same order.
+
+void init_distributed(int* argc, char*** argv);
+// Arrange the processes in a grid, where `num_cell_shards` must divide the number of processes
+void init_process_grid(const int num_cell_shards);
+void finalize_distributed();
+// Terminate all processes, e.g. when one of them fails
+void abort_distributed(const int error_code);
+
+int get_process_rank();
+int get_num_processes();
+int get_row_shard();
+int get_num_row_shards();
+int get_cell_shard();
+int get_num_cell_shards();
+
+inline bool is_distributed()
+{
+  return get_num_processes() > 1;
+}
+
+inline bool is_root_process()
+{
+  return get_process_rank() == 0;
+}
+
+// Whether the rows of the corpus are split over several processes
+inline bool are_rows_distributed()
+{
+  return get_num_row_shards() > 1;
+}
+
+// Whether the cells of the codebook are split over several processes
+inline bool are_cells_distributed()
+{
+  return get_num_cell_shards() > 1;
+}
+
+// Range [first_cell, end_cell) of the cells owned by this process
+void get_cell_range(const size_t num_cells, size_t& first_cell, size_t& end_cell);
+
+// Replace `values` on every process by their element-wise sum (or disjunction) over all row shards
+void all_reduce_sum(Float* const values, const size_t count);
+void all_reduce_sum(Double* const values, const size_t count);
+void all_reduce_sum(uint64_t* const values, const size_t count);
+void all_reduce_or(bool* const values, const size_t count);
+
+// Sum of `value` over all row shards before this one
+uint64_t exclusive_prefix_sum(const uint64_t value);
+
+// Copy `values` of row shard `root` to all other row shards
+void broadcast(Float* const values, const size_t count, const int root = 0);
+
+// Point-to-point transfers along the row shards, e.g. to continue a sum over the rows in their order.
+// The first row shard receives nothing, and the last row shard sends nothing.
+void receive_from_previous_process(Float* const values, const size_t count);
+void send_to_next_process(const Float* const values, const size_t count);
+
+// Concatenation of the `num_bytes` bytes at `data` of all row shards in their order
+std::vector<char> all_gather_bytes(const void* const data, const size_t num_bytes);
+// Like `all_gather_bytes`, but only the first row shard receives the result
+std::vector<char> gather_bytes_to_root(const void* const data, const size_t num_bytes);
+
+// Combine the best and next-best matching units that every cell shard found among its own cells
+// into those among all cells, as if all cells had been searched in order by a single process.
+// This reduces over the cell shards of a row shard, and compares the distances unclamped, like
+// the sequential search. `next_best_matching_units` and `next_distances` may be null.
+void merge_best_matching_units(
+  CellIndexType* const best_matching_units,
+  Float* const distances,
+  CellIndexType* const next_best_matching_units,
+  Float* const next_distances,
+  const size_t num_rows
+);
+
+// Write the `header` of the first cell shard, followed by the `num_bytes` at `data` of all
+// cell shards in their order and the trailer of `get_checksum_trailer`, to `filename`. Every cell
+// shard checksums its own part. This is collective over the cell shards of a row shard.
+void write_cell_shards_to_file(const std::string& filename, const std::string& header, const void* const data, const size_t num_bytes);
+
+
+// `T` must be trivially copyable, but need not be default constructible
+template<typename T> std::vector<T> from_bytes(const std::vector<char>& bytes)
+{
+  std::vector<T> result;
+  result.reserve(bytes.size() / sizeof(T));
+  for (size_t offset = 0; offset + sizeof(T) <= bytes.size(); offset += sizeof(T))
+    result.push_back(*reinterpret_cast<const T*>(&bytes[offset]));
+  return result;
+}
+
+
+template<typename T> std::vector<T> all_gather(const std::vector<T>& values)
+{
+  return from_bytes<T>(all_gather_bytes(values.data(), values.size() * sizeof(T)));
+}
+
+
+template<typename T> std::vector<T> gather_to_root(const T* const values, const size_t count)
+{
+  return from_bytes<T>(gather_bytes_to_root(values, count * sizeof(T)));
+}
@@ -5,10 +5,12 @@
 
 #include <iostream>
 #include <vector>
+#include <memory>
 #include <iterator>
 #include <algorithm>
 #include <assert.h>
 #include <fstream>
+#include <sstream>
 #include <filesystem>
 #include <thread>
 #include "argparse.hpp"
@@ -17,14 +19,137 @@
 #include "som.hpp"
 #include "smap.hpp"
 #include "utils.hpp"
+#include "synth.hpp"
+#include "trace.hpp"
+#include "checkpoint.hpp"
+#include "checksum.hpp"
+#include "stopping.hpp"
+#include "distributed.hpp"
+#include "telemetry.hpp"
+#include "parallel.hpp"
+#include "numa.hpp"
+#include "memory.hpp"
+#include "reorder.hpp"
 
 
 namespace fs = std::filesystem;
 
 
-void create_semantic_map(ArgParser& args) {
+// A smaller map that is trained for some epochs before it grows to the next size
+struct GrowthStage
+{
+  CellIndexType width;
+  CellIndexType height;
+  unsigned int num_epochs;
+};
+
+
+// Check the size of a map before it is narrowed to `CellIndexType`
+void check_map_size(const int width, const int height)
+{
+  if (width < 1 || height < 1)
+    std::__throw_invalid_argument("The map width or height must be at least 1");
+  get_num_map_cells(height, width);
+}
+
+
+// Parse growth stages of the form <width>x<height>:<epochs>
+std::vector<GrowthStage> parse_growth_stages(const std::vector<std::string>& values)
+{
+  std::vector<GrowthStage> stages;
+  for (const auto& value : values)
+  {
+    const size_t separator = value.find('x');
+    const size_t epochs_separator = value.find(':');
+    if (separator == std::string::npos || epochs_separator == std::string::npos || epochs_separator < separator)
+      std::__throw_invalid_argument("Growth stages must have the form <width>x<height>:<epochs>");
+    const int width = std::stoi(value.substr(0, separator));
+    const int height = std::stoi(value.substr(separator + 1, epochs_separator - separator - 1));
+    check_map_size(width, height);
+    stages.push_back({
+      static_cast<CellIndexType>(width),
+      static_cast<CellIndexType>(height),
+      static_cast<unsigned int>(std::stoi(value.substr(epochs_separator + 1)))
+    });
+  }
+  return stages;
+}
+
+
+EarlyStoppingSettings parse_early_stopping_settings(const ArgParser& args)
+{
+  EarlyStoppingSettings settings;
+  settings.patience = static_cast<unsigned int>(args.get_option_as_int("--stop-patience", settings.patience));
+  settings.min_relative_improvement = args.get_option_as_float("--stop-min-improvement", settings.min_relative_improvement);
+  settings.max_diffusion_error = args.get_option_as_float("--stop-max-diffusion-error", settings.max_diffusion_error);
+  settings.max_topographic_error = args.get_option_as_float("--stop-max-topographic-error", settings.max_topographic_error);
+  settings.max_gap_error = args.get_option_as_float("--stop-max-gap-error", settings.max_gap_error);
+  settings.num_final_epochs = static_cast<unsigned int>(args.get_option_as_int("--stop-final-epochs", settings.num_final_epochs));
+
+  if (settings.min_relative_improvement < 0.f || settings.min_relative_improvement > 1.f)
+    std::__throw_invalid_argument("The minimal improvement for early stopping must be between 0 and 1");
+  return settings;
+}
+
+
+// Process-wide settings of the parallel loops of the training
+void set_parallel_settings(const ArgParser& args)
+{
+  ParallelSettings settings;
+  settings.backend = static_cast<ParallelBackend>(args.get_option_as_int("--parallel-backend", ParallelBackend::OPENMP_BACKEND));  // 1 runs the training loops on a work-stealing thread pool instead of OpenMP
+  settings.num_threads = args.get_option_as_int("--threads", 0);  // If not zero, the number of threads of the training loops
+  settings.cpus = parse_cpu_list(args.get_option("--cpu-affinity", ""));  // e.g. 0-3,8 pins thread k of every training loop to the k-th of these CPUs
+  settings.grain_size = static_cast<size_t>(args.get_option_as_int("--parallel-grain-size", 0));  // If not zero, the iterations per task of the thread pool
+  const bool use_numa = args.option_exists("--numa");  // Pin the threads node by node, split the snippets over the NUMA nodes and interleave the codebooks
+  if (use_numa && settings.cpus.empty())
+    settings.cpus = get_cpus_by_numa_node();
+  if (use_numa && settings.num_threads == 0)
+    settings.num_threads = static_cast<int>(settings.cpus.size());
+  set_default_parallel_settings(settings);
+  set_numa_placement(use_numa);
+}
+
+
+// Live metrics of the root process if requested with --telemetry-file or --telemetry-port, else null
+Telemetry* create_telemetry(const ArgParser& args)
+{
+  const std::string filename = args.get_option("--telemetry-file", "");  // Write the metrics in the Prometheus text format to this file
+  const int port = args.get_option_as_int("--telemetry-port", 0);  // Serve the metrics on http://127.0.0.1:<port>/metrics
+  const Double interval_seconds = args.get_option_as_float("--telemetry-interval", 5.);  // Seconds between writes of the file
+  if (!is_root_process() || (filename.empty() && port <= 0))
+    return nullptr;
+  return new Telemetry(filename, port, interval_seconds);
+}
+
+
+void write_early_stopping(std::ostream& os, const EarlyStopping& early_stopping, const unsigned int num_epochs)
+{
+  os << "## Early Stopping" << std::endl;
+  if (early_stopping.has_stopped())
+    os << "Converged after epoch: " << early_stopping.get_stopped_epoch() << std::endl
+       << "Trained epochs:        " << std::min(num_epochs, early_stopping.get_stopped_epoch() + early_stopping.get_settings().num_final_epochs) << " of " << num_epochs << std::endl
+       << "Reason:                " << early_stopping.get_reason() << std::endl;
+  else
+    os << "Trained all " << num_epochs << " epochs without converging" << std::endl;
+  os << std::endl;
+}
+
+
+// `smap reorder` only keeps the terms below its cutoff together, so another cutoff trains on other terms
+void check_reordered_train_vocab_cutoff(const CorpusHeader& header, const IndexType train_vocab_cutoff)
+{
+  if (header.is_reordered && header.reordered_train_vocab_cutoff != train_vocab_cutoff)
+    std::__throw_invalid_argument((
+      "The corpus was reordered for the training vocabulary cutoff " + std::to_string(header.reordered_train_vocab_cutoff)
+      + ", so it must be trained with the same cutoff"
+    ).c_str());
+}
+
+
+void create_semantic_map(ArgParser& args, const TrainingCheckpoint* const resume_checkpoint = nullptr) {
   // Determine settings
   const std::string training_data_filename = args.get_option(1);
+  check_map_size(args.get_option_as_int(2), args.get_option_as_int(3));
   const CellIndexType width = args.get_option_as_int(2);
   const CellIndexType height = args.get_option_as_int(3);
   const fs::path directory = args.get_option("--directory", "");
@@ -36,13 +161,40 @@ void create_semantic_map(ArgParser& args) {
   const auto global_topology = static_cast<GlobalTopology>(args.get_option_as_int("--global-topology", GlobalTopology::TORUS));
   const auto local_topology = static_cast<LocalTopology>(args.get_option_as_int("--local-topology", LocalTopology::CIRC));
   const bool verbose = args.option_exists("--verbose");
+  const bool use_perf_counters = args.option_exists("--perf-counters");  // Record hardware performance counters per training phase in perf.tsv
+  const bool use_tracing = args.option_exists("--trace");  // Record per-thread events of all training phases and parallel regions in trace.json
+  const auto trace_buffer_size = static_cast<size_t>(args.get_option_as_int("--trace-buffer-size", 1 << 20));  // Number of most recent events kept per thread
   const bool respect_lower_bound = !args.option_exists("--non-adaptive");
   const auto train_vocab_cutoff = static_cast<IndexType>(args.get_option_as_int("--train-vocab-cutoff", 0));  // If not zero, ignore all vocab indices above this when finding best matching units
   const auto dead_cell_update_strides = static_cast<IndexType>(args.get_option_as_int("--dead-cell-update-strides", 0));  // If not zero, assign dead cells to most distant inputs every nth epoch
+  const auto metrics_sample_strides = static_cast<IndexPointerType>(args.get_option_as_int("--metrics-sample-strides", 1));  // If greater than one, estimate the quantization and diffusion errors from every nth snippet
+  const auto checkpoint_strides = static_cast<unsigned int>(args.get_option_as_int("--checkpoint-strides", 0));  // If not zero, save a checkpoint to resume from every nth epoch
+  const auto num_cell_shards = static_cast<int>(args.get_option_as_int("--cell-shards", 1));  // With MPI, split the codebook cells over this many processes
+  const uint64_t seed = resume_checkpoint ? resume_checkpoint->seed : static_cast<uint64_t>(args.get_option_as_int("--seed", static_cast<int>(get_unix_time())));
+  const auto growth_stages = parse_growth_stages(args.get_option_as_list("--growth-stages", ""));  // e.g. 32x32:6,64x64:2 trains smaller maps for 8 epochs before the given --epochs at full size
+  const auto early_stopping_settings = parse_early_stopping_settings(args);  // With --stop-patience, end the training once the error metrics settle
+  const auto codebook_initialization = static_cast<CodebookInitialization>(args.get_option_as_int("--codebook-init", CodebookInitialization::RANDOM_UNIFORM));  // 1 starts from sampled snippets, 2 from the principal components of the corpus
+  const auto fsync_policy = static_cast<FsyncPolicy>(args.get_option_as_int("--fsync-policy", FsyncPolicy::NO_FSYNC));  // 1 flushes every output file to disk, 2 also its directory
+  const auto write_queue_size = static_cast<size_t>(args.get_option_as_int("--write-queue-size", 1024));  // MiB of outputs queued for the background writer before the training waits
+  const auto memory_budget = static_cast<uint64_t>(args.get_option_as_int("--memory-budget", 0));  // MiB that each process may use; if zero, the limit of its cgroup or the physical memory
+  const bool compress_codebook = args.option_exists("--compress-codebook");  // Save codebook.bin and the checkpoints losslessly compressed
+  FeatureHashing hashing;
+  hashing.num_buckets = static_cast<IndexType>(args.get_option_as_int("--hash-buckets", 0));  // If not zero, fold the vocabulary above the training vocabulary cutoff into this many columns
+  hashing.num_probes = static_cast<IndexType>(args.get_option_as_int("--hash-probes", 1));  // Buckets of every hashed term, so that fewer terms share all of their buckets
+  hashing.num_exact_columns = train_vocab_cutoff;
+  set_parallel_settings(args);  // --parallel-backend, --threads, --cpu-affinity and --parallel-grain-size
+  set_huge_page_policy(static_cast<HugePagePolicy>(args.get_option_as_int("--huge-pages", HugePagePolicy::TRANSPARENT_HUGE_PAGES)));  // 0 keeps the large arrays on regular pages, 2 uses reserved huge pages (MAP_HUGETLB)
+
+  unsigned int num_growth_epochs = 0;
+  for (const auto& stage : growth_stages)
+    num_growth_epochs += stage.num_epochs;
+  const unsigned int num_total_epochs = num_growth_epochs + num_epochs;
 
   if (!args.option_exists("--update-exponent"))
     // Choose the update exponent such that the the minimal radius at the final epoch is 1.5
-    update_exponent = std::pow(std::log(1.5), 1. / num_epochs) / std::pow(std::log(initial_radius), 1. / num_epochs);
+    update_exponent = std::pow(std::log(1.5), 1. / num_total_epochs) / std::pow(std::log(initial_radius), 1. / num_total_epochs);
+  if (resume_checkpoint)
+    update_exponent = resume_checkpoint->update_exponent;
 
   // Check settings
   if (name.empty())
@@ -59,6 +211,83 @@ void create_semantic_map(ArgParser& args) {
     std::__throw_invalid_argument("The update exponent must be a real number between 0 and 1");
   if (local_topology == LocalTopology::HEXA && (height&1) == 1)
     std::__throw_invalid_argument("For a hexagonal grid the number of rows has to be even");
+  if (is_distributed() && (checkpoint_strides > 0 || resume_checkpoint))
+    std::__throw_invalid_argument("Checkpoints are not supported with several MPI processes");
+  if (static_cast<uint64_t>(num_cell_shards) > static_cast<uint64_t>(width) * height)
+    std::__throw_invalid_argument("The number of cell shards must not exceed the number of cells");
+  for (size_t stage = 0; stage < growth_stages.size(); ++stage)
+  {
+    const auto& next = stage + 1 < growth_stages.size() ? growth_stages[stage + 1] : GrowthStage{width, height, num_epochs};
+    if (growth_stages[stage].width < 1 || growth_stages[stage].height < 1 || growth_stages[stage].num_epochs < 1)
+      std::__throw_invalid_argument("Every growth stage needs a map size and at least one epoch");
+    if (growth_stages[stage].width > next.width || growth_stages[stage].height > next.height)
+      std::__throw_invalid_argument("The maps of the growth stages must not shrink");
+    if (local_topology == LocalTopology::HEXA && (growth_stages[stage].height&1) == 1)
+      std::__throw_invalid_argument("For a hexagonal grid the number of rows has to be even");
+  }
+  if (compress_codebook && num_cell_shards > 1)
+    std::__throw_invalid_argument("Compressed codebooks are not supported with cell shards");
+  if (!growth_stages.empty() && (!prior_name.empty() || num_cell_shards > 1))
+    std::__throw_invalid_argument("Growth stages do not support prior maps or cell shards");
+  // A checkpoint continues in its growth stage, whose map has the size of the checkpoint
+  const size_t first_stage = resume_checkpoint ? resume_checkpoint->growth_stage : 0;
+  if (first_stage > growth_stages.size())
+    std::__throw_invalid_argument("The checkpoint does not match the growth stages");
+  const auto& resumed_stage = first_stage < growth_stages.size() ? growth_stages[first_stage] : GrowthStage{width, height, num_epochs};
+  if (resume_checkpoint && (resume_checkpoint->width != resumed_stage.width || resume_checkpoint->height != resumed_stage.height))
+    std::__throw_invalid_argument("The checkpoint does not match the map size of its growth stage");
+  if (fsync_policy < FsyncPolicy::NO_FSYNC || fsync_policy > FsyncPolicy::FSYNC_FILES_AND_DIRECTORIES)
+    std::__throw_invalid_argument("The fsync policy must be 0, 1 or 2");
+  if (codebook_initialization < CodebookInitialization::RANDOM_UNIFORM || codebook_initialization > CodebookInitialization::PRINCIPAL_COMPONENTS)
+    std::__throw_invalid_argument("The codebook initialization must be 0, 1 or 2");
+  if (hashing.is_enabled() && hashing.num_buckets <= train_vocab_cutoff)
+    std::__throw_invalid_argument("The number of hash buckets must be larger than the training vocabulary cutoff");
+  if (hashing.num_probes < 1 || hashing.num_probes > MAX_HASH_PROBES)
+    std::__throw_invalid_argument("The number of hash probes must be between 1 and 16");
+  init_process_grid(num_cell_shards);
+
+  // With MPI, only the root process writes files
+  const bool is_root = is_root_process();
+
+  // Estimate the peak memory from the corpus header, and fail before loading anything if it does not fit
+  const auto corpus_header = read_corpus_header(training_data_filename);
+  check_reordered_train_vocab_cutoff(corpus_header, train_vocab_cutoff);
+  MemoryPlanSettings memory_settings;
+  // With MPI, the entries of a row shard are estimated from its share of the rows
+  memory_settings.num_total_rows = corpus_header.num_rows;
+  memory_settings.num_rows = memory_settings.num_total_rows * (get_row_shard() + 1) / get_num_row_shards() - memory_settings.num_total_rows * get_row_shard() / get_num_row_shards();
+  memory_settings.num_non_zero = corpus_header.num_rows == 0 ? 0 : static_cast<uint64_t>(static_cast<Double>(corpus_header.num_non_zero) * memory_settings.num_rows / corpus_header.num_rows);
+  memory_settings.num_cols = corpus_header.num_cols;
+  if (hashing.is_enabled())
+  {
+    // At most one entry per probe of every term
+    memory_settings.num_non_zero *= hashing.num_probes;
+    memory_settings.num_cols = hashing.num_buckets;
+  }
+  memory_settings.has_weights = corpus_header.has_weights;
+  memory_settings.num_cells = static_cast<uint64_t>(width) * height;
+  size_t first_local_cell, end_local_cell;
+  get_cell_range(memory_settings.num_cells, first_local_cell, end_local_cell);
+  memory_settings.num_local_cells = end_local_cell - first_local_cell;
+  memory_settings.num_growth_cells = growth_stages.empty() ? 0 : static_cast<uint64_t>(growth_stages.back().width) * growth_stages.back().height;
+  memory_settings.num_threads = get_num_parallel_threads();
+  memory_settings.num_row_shards = get_num_row_shards();
+  memory_settings.is_root = is_root;
+  memory_settings.has_dead_cell_updates = dead_cell_update_strides > 0;
+  memory_settings.has_checkpoints = checkpoint_strides > 0;
+  memory_settings.is_codebook_compressed = compress_codebook;
+  memory_settings.is_resumed = resume_checkpoint != nullptr;
+  memory_settings.has_preliminary_outputs = verbose;
+  // The background writer records its own trace events
+  memory_settings.trace_bytes = use_tracing ? (memory_settings.num_threads + 1) * trace_buffer_size * sizeof(TraceEvent) : 0;
+  memory_settings.write_queue_bytes = write_queue_size << 20;
+  const auto memory_plan = plan_memory(memory_settings, memory_budget > 0 ? memory_budget << 20 : get_memory_limit());
+  if (!memory_plan.fits())
+  {
+    std::ostringstream breakdown;
+    memory_plan.print(breakdown);
+    std::__throw_runtime_error(("The semantic map does not fit into the memory budget (--memory-budget):\n" + breakdown.str()).c_str());
+  }
 
   const fs::path codebook_save_filename = directory / name / fs::path("codebook.bin");
   const fs::path codebook_load_filename = prior_name.empty() ? "" : directory / prior_name / fs::path("codebook.bin");
@@ -66,14 +295,28 @@ void create_semantic_map(ArgParser& args) {
   const fs::path neighbourhood_save_filename = directory / name / fs::path("neighbourhood.bin");
   const fs::path counts_save_filename = directory / name / fs::path("counts.bin");
   const fs::path convergence_log_filename = directory / name / fs::path("convergence.tsv");
+  const fs::path timing_log_filename = directory / name / fs::path("timing.tsv");
+  const fs::path perf_log_filename = directory / name / fs::path("perf.tsv");
+  const fs::path trace_filename = directory / name / fs::path(is_root ? "trace.json" : "trace." + std::to_string(get_process_rank()) + ".json");
   const fs::path readme_log_filename = directory / name / fs::path("README.md");
+  const fs::path checkpoint_filename = directory / name / fs::path("checkpoint.bin");
   const fs::path preliminary_output_directory = directory / name;
 
-  if (!fs::exists(directory / name))
+  if (is_root && !fs::exists(directory / name))
     fs::create_directory(directory / name);
 
+  // When resuming, continue the logs from the checkpoint on
+  const auto log_mode = resume_checkpoint ? std::ofstream::app : std::ofstream::out;
+  if (resume_checkpoint)
+  {
+    truncate_training_log(convergence_log_filename.string(), resume_checkpoint->epoch);
+    truncate_training_log(timing_log_filename.string(), resume_checkpoint->epoch);
+    truncate_training_log(perf_log_filename.string(), resume_checkpoint->epoch);
+  }
+
   std::ofstream readme;
-  readme.open(readme_log_filename.c_str(), std::ofstream::out);
+  if (is_root)
+    readme.open(readme_log_filename.c_str(), log_mode);
 
   // Print settings
   std::cout << "Creating a semantic map '" << name << "' with " << std::endl
@@ -85,9 +328,24 @@ void create_semantic_map(ArgParser& args) {
             << "Global topology:       " << get_global_topology_string(global_topology) << std::endl
             << "Training vocab cutoff: " << train_vocab_cutoff << std::endl
             << "Number of epochs:      " << num_epochs << std::endl
+            << "Growth stages:         " << args.get_option("--growth-stages", "none") << std::endl
+            << "Early stop patience:   " << early_stopping_settings.patience << std::endl
             << "Dead cell updates:     " << dead_cell_update_strides << std::endl
-            << std::endl;
+            << "Seed:                  " << seed << std::endl
+            << std::endl
+            << "Memory estimate:" << std::endl;
+  memory_plan.print(std::cout);
+  std::cout << std::endl;
 
+  if (resume_checkpoint)
+  {
+    readme << "## Resumed" << std::endl
+           << "Resumed after epoch:   " << resume_checkpoint->epoch << std::endl
+           << "Resumed at UnixTime:   " << get_unix_time() << std::endl
+           << std::endl;
+  }
+  else
+  {
   readme << "# Semantic Map " << name << std::endl
     << std::endl
     << "Semantic Map version:  " << VERSION_MAJOR << "." << VERSION_MINOR << "." << VERSION_PATCH << std::endl
@@ -103,32 +361,80 @@ void create_semantic_map(ArgParser& args) {
     << "Global topology:       " << get_global_topology_string(global_topology) << std::endl
     << "Training vocab cutoff: " << train_vocab_cutoff << std::endl
     << "Number of epochs:      " << num_epochs << std::endl
+    << "Growth stages:         " << args.get_option("--growth-stages", "none") << std::endl
+    << "Early stop patience:   " << early_stopping_settings.patience << std::endl
     << "Dead cell updates:     " << dead_cell_update_strides << std::endl
+    << "Metrics sample:        " << metrics_sample_strides << std::endl
+    << "Seed:                  " << seed << std::endl
+    << "Codebook init:         " << codebook_initialization << std::endl
+    << "Checkpoint strides:    " << checkpoint_strides << std::endl
+    << "Compressed codebook:   " << compress_codebook << std::endl
     << std::endl
     << "## Machine" << std::endl
     << "CPU:                   " << get_cpu_name() << std::endl
     << "Max. parallel threads: " << std::thread::hardware_concurrency() << std::endl
-    << std::endl;
+    << "Training threads:      " << get_num_parallel_threads() << (resolve_parallel_settings().backend == ParallelBackend::THREAD_POOL_BACKEND ? " (thread pool)" : " (OpenMP)") << std::endl
+    << "NUMA nodes:            " << get_num_numa_nodes() << (is_numa_placement_enabled() ? " (placed)" : "") << std::endl
+    << "Huge pages:            " << get_huge_page_policy() << std::endl
+    << "Cell index bits:       " << 8 * sizeof(CellIndexType) << std::endl
+    << "MPI processes:         " << get_num_processes() << std::endl
+    << "Cell shards:           " << get_num_cell_shards() << std::endl
+    << std::endl
+    << "## Memory" << std::endl;
+  memory_plan.print(readme);
+  readme << std::endl;
+  }
 
   std::ofstream convergence_log_stream;
-  convergence_log_stream.open(convergence_log_filename.c_str(), std::ofstream::out);
+  std::ofstream timing_log_stream;
+  if (is_root)
+  {
+    convergence_log_stream.open(convergence_log_filename.c_str(), log_mode);
+    timing_log_stream.open(timing_log_filename.c_str(), log_mode);
+  }
+
+  if (use_tracing)
+    enable_tracing(trace_buffer_size);
 
   // Create semantic map
   auto stop_watch = StopWatch();
   stop_watch.start();
-  auto* data = new CorpusDataset(training_data_filename);
-  auto min_word_index_to_avoid_empty_row = data->min_word_index_to_avoid_empty_row();
+  HierarchicalTimer timer;
+  timer.start("create");
+  timer.start("load_corpus");
+  // With MPI, every row shard loads and trains on its own block of rows
+  auto* data = new CorpusDataset(training_data_filename, get_row_shard(), get_num_row_shards());
+  const IndexType original_vocab_size = data->num_cols;
+  if (hashing.is_enabled())
+  {
+    if (train_vocab_cutoff > original_vocab_size)
+      std::__throw_invalid_argument("The vocabulary size is smaller than the training vocabulary cutoff.");
+    data->hash_columns(hashing);
+  }
+  const auto all_min_word_indices = all_gather(std::vector<IndexType>{data->min_word_index_to_avoid_empty_row()});
+  const auto min_word_index_to_avoid_empty_row = *std::max_element(all_min_word_indices.begin(), all_min_word_indices.end());
+  uint64_t num_tokens = data->num_non_zero;
+  all_reduce_sum(&num_tokens, 1);
 
-  std::cout << "Number of snippets:     " << data->num_rows << std::endl
+  std::cout << "Number of snippets:     " << data->num_total_rows << std::endl
             << "Vocabulary size:        " << data->num_cols << std::endl
             << "Longest leading zeros:  " << min_word_index_to_avoid_empty_row << std::endl
-            << "Total number of tokens: " << data->num_non_zero << std::endl;
+            << "Total number of tokens: " << num_tokens << std::endl;
 
+  if (!resume_checkpoint)
   readme  << "## Dataset" << std::endl
-          << "Number of snippets:     " << data->num_rows << std::endl
+          << "Number of snippets:     " << data->num_total_rows << std::endl
           << "Vocabulary size:        " << data->num_cols << std::endl
           << "Longest leading zeros:  " << min_word_index_to_avoid_empty_row << std::endl
-          << "Total number of tokens: " << data->num_non_zero << std::endl
+          << "Total number of tokens: " << num_tokens << std::endl
+          << std::endl;
+
+  if (hashing.is_enabled() && !resume_checkpoint)
+  readme  << "## Feature Hashing" << std::endl
+          << "Original vocabulary size: " << original_vocab_size << std::endl
+          << "Hash buckets:             " << hashing.num_buckets << std::endl
+          << "Hash probes:              " << hashing.num_probes << std::endl
+          << "Exact hash columns:       " << hashing.num_exact_columns << std::endl
           << std::endl;
 
   if (train_vocab_cutoff > 0 && min_word_index_to_avoid_empty_row > train_vocab_cutoff)
@@ -138,50 +444,631 @@ void create_semantic_map(ArgParser& args) {
     std::__throw_invalid_argument("The vocabulary size is smaller than the training vocabulary cutoff.");
 
   data->init_sum_of_squares();
+  if (is_numa_placement_enabled())
+    data->place_on_numa_nodes();
+  timer.stop();
 
+  timer.start("init_codebook");
   Codebook* codebook;
-  if (!codebook_load_filename.empty()) {
+  if (resume_checkpoint) {
+    // The values are restored from the checkpoint in `train`
+    codebook = new Codebook(resumed_stage.height, resumed_stage.width, data->num_cols, global_topology, local_topology);
+  } else if (!codebook_load_filename.empty()) {
     std::cout << "Loading prior codebook from " << codebook_load_filename << std::endl;
-    codebook = new Codebook(codebook_load_filename);
+    codebook = new Codebook(codebook_load_filename, global_topology, local_topology);
+    if (codebook->get_height() != height || codebook->get_width() != width || codebook->get_input_dim() != data->num_cols)
+      std::__throw_invalid_argument("The prior codebook does not match the map dimensions and the vocabulary size");
+  } else if (!growth_stages.empty()) {
+    // Start with the smallest map
+    codebook = new Codebook(growth_stages[0].height, growth_stages[0].width, data->num_cols, global_topology, local_topology);
+    codebook->init(*data, codebook_initialization, static_cast<int>(seed), train_vocab_cutoff);
   } else {
     codebook = new Codebook(height, width, data->num_cols, global_topology, local_topology);
-    codebook->init();
+    codebook->init(*data, codebook_initialization, static_cast<int>(seed), train_vocab_cutoff);
+  }
+  Neighbourhood* neighbourhood;
+  if (resume_checkpoint)
+  {
+    // The radii are restored from the checkpoint in `train`
+    neighbourhood = new Neighbourhood(resumed_stage.height, resumed_stage.width, global_topology, local_topology, update_exponent, initial_radius, resume_checkpoint->radius_scale);
+  }
+  else if (growth_stages.empty())
+  {
+    neighbourhood = new Neighbourhood(height, width, global_topology, local_topology, update_exponent, initial_radius);
+  }
+  else
+  {
+    const Float scale = 0.5f * (static_cast<Float>(height) / growth_stages[0].height + static_cast<Float>(width) / growth_stages[0].width);
+    const auto stage_initial_radius = std::max<CellIndexType>(1, static_cast<CellIndexType>(std::round(initial_radius / scale)));
+    neighbourhood = new Neighbourhood(growth_stages[0].height, growth_stages[0].width, global_topology, local_topology, update_exponent, stage_initial_radius, 1.f / scale);
+  }
+  timer.stop();
+
+  PerfCounters* perf_counters = nullptr;
+  std::ofstream perf_log_stream;
+  if (use_perf_counters)
+  {
+    perf_counters = new PerfCounters();
+    if (perf_counters->open())
+    {
+      if (is_root)
+        perf_log_stream.open(perf_log_filename.c_str(), log_mode);
+    }
+    else
+    {
+      std::cout << "WARNING: Hardware performance counters are unavailable (" << perf_counters->get_error() << ")" << std::endl;
+      delete perf_counters;
+      perf_counters = nullptr;
+    }
+  }
+
+  // Checkpoints, preliminary and final outputs are written in the background
+  AsyncWriter writer(memory_plan.write_queue_bytes, fsync_policy);
+  Checkpointer* checkpointer = nullptr;
+  if (checkpoint_strides > 0)
+  {
+    TrainingCheckpoint settings;
+    settings.arguments = args.get_tokens();
+    settings.seed = seed;
+    settings.num_epochs = num_epochs;
+    settings.is_codebook_compressed = compress_codebook;
+    checkpointer = new Checkpointer(checkpoint_filename.string(), settings, checkpoint_strides, writer);
+  }
+
+  Telemetry* telemetry = create_telemetry(args);
+  TrainingProfiler profiler(timer, &timing_log_stream, perf_counters, &perf_log_stream, telemetry, name.string());
+  EarlyStopping early_stopping(early_stopping_settings);
+
+  // Train the smaller maps of the growth stages and grow them to the next size
+  unsigned int first_epoch = 1;
+  for (size_t stage = 0; stage < first_stage; ++stage)
+    first_epoch += growth_stages[stage].num_epochs;
+  for (size_t stage = first_stage; stage < growth_stages.size(); ++stage)
+  {
+    if (checkpointer)
+      checkpointer->set_growth_stage(static_cast<unsigned int>(stage));
+    train(
+      *codebook,
+      *neighbourhood,
+      *data,
+      num_total_epochs,
+      convergence_log_stream,
+      verbose ? preliminary_output_directory.string() + "/" : "",
+      respect_lower_bound,
+      train_vocab_cutoff,
+      dead_cell_update_strides,
+      &profiler,
+      stage == first_stage ? resume_checkpoint : nullptr,
+      checkpointer,
+      first_epoch,
+      first_epoch + growth_stages[stage].num_epochs - 1,
+      nullptr,
+      &writer,
+      metrics_sample_strides
+    );
+    first_epoch += growth_stages[stage].num_epochs;
+
+    timer.start("grow_map");
+    const auto& next = stage + 1 < growth_stages.size() ? growth_stages[stage + 1] : GrowthStage{width, height, num_epochs};
+    auto* grown_codebook = new Codebook(*codebook, next.height, next.width);
+    delete codebook;
+    codebook = grown_codebook;
+    auto* grown_neighbourhood = new Neighbourhood(*neighbourhood, next.height, next.width);
+    delete neighbourhood;
+    neighbourhood = grown_neighbourhood;
+    timer.stop();
   }
-  Neighbourhood* neighbourhood = new Neighbourhood(height, width, global_topology, local_topology, update_exponent, initial_radius);
+
+  if (checkpointer)
+    checkpointer->set_growth_stage(static_cast<unsigned int>(growth_stages.size()));
   train(
     *codebook,
     *neighbourhood,
     *data,
-    num_epochs,
+    num_total_epochs,
     convergence_log_stream,
     verbose ? preliminary_output_directory.string() + "/" : "",
     respect_lower_bound,
     train_vocab_cutoff,
-    dead_cell_update_strides
+    dead_cell_update_strides,
+    &profiler,
+    first_stage == growth_stages.size() ? resume_checkpoint : nullptr,
+    checkpointer,
+    first_epoch,
+    0,
+    &early_stopping,
+    &writer,
+    metrics_sample_strides
   );
+  if (checkpointer)
+    delete checkpointer;
+  if (early_stopping.is_enabled())
+    write_early_stopping(readme, early_stopping, num_total_epochs);
 
-  neighbourhood->save_to_file(neighbourhood_save_filename.string());
+  timer.start("save");
+  if (is_root)
+    neighbourhood->save_to_file(neighbourhood_save_filename.string(), writer);
+  timer.stop();
   delete neighbourhood;
 
-  auto* semantic_map = new SemanticMap(*data, *codebook, train_vocab_cutoff);
+  timer.start("build_semantic_map");
+  auto* semantic_map = new SemanticMap(*data, *codebook, train_vocab_cutoff, memory_plan.with_counts);
+  timer.stop();
   delete data;
 
-  codebook->save_to_file(codebook_save_filename.string());
+  timer.start("save");
+  // With MPI, the processes of the first row shard write their cells. The codebook is freed right
+  // after, so it is saved directly rather than copied into the background writer.
+  if (get_row_shard() == 0)
+    codebook->save_to_file(codebook_save_filename.string(), compress_codebook);
   delete codebook;
 
   semantic_map->save_best_matching_units_to_file(best_matching_units_save_filename.string());
+  writer.flush();
+  timer.stop();
   delete semantic_map;
 
+  // The checkpoint is superseded by the final output
+  if (is_root && fs::exists(checkpoint_filename))
+    fs::remove(checkpoint_filename);
+
+  timer.stop();
   stop_watch.stop();
+
+  if (use_tracing)
+  {
+    save_trace_to_file(trace_filename.string());
+    disable_tracing();
+  }
   std::cout << "Creating the semantic map took " << stop_watch << std::endl;
 
   readme << "## Timing" << std::endl
          << "Creation started at UnixTime:   " << stop_watch.get_start_unix_time() << std::endl
          << "Creation ended at UnixTime:     " << get_unix_time() << std::endl
-         << "Creating the semantic map took: " << stop_watch << std::endl;
+         << "Creating the semantic map took: " << stop_watch << std::endl
+         << std::endl
+         << "### Breakdown" << std::endl;
+  timer.print(readme);
+
+  if (perf_counters)
+  {
+    readme << std::endl
+           << "### Performance Counters" << std::endl;
+    profiler.print_perf_summary(readme);
+    perf_log_stream.close();
+    delete perf_counters;
+  }
 
   readme.close();
   convergence_log_stream.close();
+  timing_log_stream.close();
+  if (telemetry)
+    delete telemetry;
+}
+
+
+// One map of `smap sweep` with its settings and training state
+struct SweepMap
+{
+  fs::path name;
+  CellIndexType width;
+  CellIndexType height;
+  CellIndexType initial_radius;
+  Float update_exponent;
+  GlobalTopology global_topology;
+  LocalTopology local_topology;
+  IndexType train_vocab_cutoff;
+
+  std::ofstream readme;
+  std::ofstream convergence_log_stream;
+  std::ofstream timing_log_stream;
+  HierarchicalTimer timer;
+  TrainingProfiler* profiler;
+  EarlyStopping* early_stopping;
+  Codebook* codebook;
+  Neighbourhood* neighbourhood;
+  Trainer* trainer;
+};
+
+
+void sweep_semantic_maps(ArgParser& args) {
+  // Determine settings shared by all maps
+  const std::string training_data_filename = args.get_option(1);
+  const fs::path directory = args.get_option("--directory", "");
+  const std::string name = args.get_option("--name", "");
+  const unsigned int num_epochs = args.get_option_as_int("--epochs", 2);
+  const bool verbose = args.option_exists("--verbose");
+  const bool respect_lower_bound = !args.option_exists("--non-adaptive");
+  const auto dead_cell_update_strides = static_cast<IndexType>(args.get_option_as_int("--dead-cell-update-strides", 0));
+  const auto metrics_sample_strides = static_cast<IndexPointerType>(args.get_option_as_int("--metrics-sample-strides", 1));
+  const auto num_cell_shards = static_cast<int>(args.get_option_as_int("--cell-shards", 1));
+  const uint64_t seed = static_cast<uint64_t>(args.get_option_as_int("--seed", static_cast<int>(get_unix_time())));
+  const auto early_stopping_settings = parse_early_stopping_settings(args);
+  const auto codebook_initialization = static_cast<CodebookInitialization>(args.get_option_as_int("--codebook-init", CodebookInitialization::RANDOM_UNIFORM));
+  const auto fsync_policy = static_cast<FsyncPolicy>(args.get_option_as_int("--fsync-policy", FsyncPolicy::NO_FSYNC));
+  const auto write_queue_size = static_cast<size_t>(args.get_option_as_int("--write-queue-size", 1024));
+  const bool compress_codebook = args.option_exists("--compress-codebook");
+  set_parallel_settings(args);
+  set_huge_page_policy(static_cast<HugePagePolicy>(args.get_option_as_int("--huge-pages", HugePagePolicy::TRANSPARENT_HUGE_PAGES)));
+
+  // Every combination of the following settings is one map
+  const auto sizes = args.get_option_as_list("--sizes", "");  // e.g. 8x8,16x16
+  const auto global_topologies = args.get_option_as_list("--global-topologies", std::to_string(GlobalTopology::TORUS));
+  const auto local_topologies = args.get_option_as_list("--local-topologies", std::to_string(LocalTopology::CIRC));
+  const auto update_exponents = args.get_option_as_list("--update-exponents", "0");  // Zero chooses the exponent as `smap create` does
+  const auto train_vocab_cutoffs = args.get_option_as_list("--train-vocab-cutoffs", "0");
+
+  // Check settings
+  if (name.empty())
+    std::__throw_invalid_argument("Please provide a name with --name");
+  if (directory.empty())
+    std::__throw_invalid_argument("Please provide a base directory name with --directory");
+  if (sizes.empty())
+    std::__throw_invalid_argument("Please provide the map sizes with --sizes, e.g. --sizes 8x8,16x16");
+  if (num_epochs < 2)
+    std::__throw_invalid_argument("The number of epochs must be at least 2");
+  if (fsync_policy < FsyncPolicy::NO_FSYNC || fsync_policy > FsyncPolicy::FSYNC_FILES_AND_DIRECTORIES)
+    std::__throw_invalid_argument("The fsync policy must be 0, 1 or 2");
+  if (codebook_initialization < CodebookInitialization::RANDOM_UNIFORM || codebook_initialization > CodebookInitialization::PRINCIPAL_COMPONENTS)
+    std::__throw_invalid_argument("The codebook initialization must be 0, 1 or 2");
+
+  // The maps are freed when a check of their settings or the corpus throws
+  std::vector<std::unique_ptr<SweepMap>> maps;
+  for (const auto& size : sizes)
+  for (const auto& global_topology : global_topologies)
+  for (const auto& local_topology : local_topologies)
+  for (const auto& update_exponent : update_exponents)
+  for (const auto& train_vocab_cutoff : train_vocab_cutoffs)
+  {
+    auto map = std::make_unique<SweepMap>();
+    map->name = name + "-" + std::to_string(maps.size());
+    const size_t separator = size.find('x');
+    if (separator == std::string::npos)
+      std::__throw_invalid_argument("Map sizes must have the form <width>x<height>");
+    check_map_size(std::stoi(size.substr(0, separator)), std::stoi(size.substr(separator + 1)));
+    map->width = static_cast<CellIndexType>(std::stoi(size.substr(0, separator)));
+    map->height = static_cast<CellIndexType>(std::stoi(size.substr(separator + 1)));
+    map->initial_radius = args.get_option_as_int("--initial-radius", (map->width + map->height) / 2);
+    map->global_topology = static_cast<GlobalTopology>(std::stoi(global_topology));
+    map->local_topology = static_cast<LocalTopology>(std::stoi(local_topology));
+    map->update_exponent = std::stof(update_exponent);
+    if (map->update_exponent == 0.f)
+      map->update_exponent = std::pow(std::log(1.5), 1. / num_epochs) / std::pow(std::log(map->initial_radius), 1. / num_epochs);
+    map->train_vocab_cutoff = static_cast<IndexType>(std::stoi(train_vocab_cutoff));
+
+    if (map->width < 1 || map->height < 1)
+      std::__throw_invalid_argument("The map width or height must be at least 1");
+    if (map->initial_radius < 1.f)
+      std::__throw_invalid_argument("The initial radius must be at least 1");
+    if (map->update_exponent <= 0.f || map->update_exponent > 1.f)
+      std::__throw_invalid_argument("The update exponent must be a real number between 0 and 1");
+    if (map->local_topology == LocalTopology::HEXA && (map->height&1) == 1)
+      std::__throw_invalid_argument("For a hexagonal grid the number of rows has to be even");
+    if (static_cast<uint64_t>(num_cell_shards) > static_cast<uint64_t>(map->width) * map->height)
+      std::__throw_invalid_argument("The number of cell shards must not exceed the number of cells");
+    maps.push_back(std::move(map));
+  }
+  if (compress_codebook && num_cell_shards > 1)
+    std::__throw_invalid_argument("Compressed codebooks are not supported with cell shards");
+  init_process_grid(num_cell_shards);
+
+  // With MPI, only the root process writes files
+  const bool is_root = is_root_process();
+
+  std::cout << "Sweeping " << maps.size() << " semantic maps '" << name << "-*' with " << std::endl
+            << "Number of epochs:      " << num_epochs << std::endl
+            << "Dead cell updates:     " << dead_cell_update_strides << std::endl
+            << "Seed:                  " << seed << std::endl
+            << std::endl;
+
+  auto stop_watch = StopWatch();
+  stop_watch.start();
+  HierarchicalTimer load_timer;
+  load_timer.start("load_corpus");
+  const auto corpus_header = read_corpus_header(training_data_filename);
+  for (const auto& map : maps)
+    check_reordered_train_vocab_cutoff(corpus_header, map->train_vocab_cutoff);
+  auto* data = new CorpusDataset(training_data_filename, get_row_shard(), get_num_row_shards());
+  const auto all_min_word_indices = all_gather(std::vector<IndexType>{data->min_word_index_to_avoid_empty_row()});
+  const auto min_word_index_to_avoid_empty_row = *std::max_element(all_min_word_indices.begin(), all_min_word_indices.end());
+  uint64_t num_tokens = data->num_non_zero;
+  all_reduce_sum(&num_tokens, 1);
+  data->init_sum_of_squares();
+  if (is_numa_placement_enabled())
+    data->place_on_numa_nodes();
+  load_timer.stop();
+
+  std::cout << "Number of snippets:     " << data->num_total_rows << std::endl
+            << "Vocabulary size:        " << data->num_cols << std::endl
+            << "Longest leading zeros:  " << min_word_index_to_avoid_empty_row << std::endl
+            << "Total number of tokens: " << num_tokens << std::endl;
+
+  for (auto& map : maps)
+  {
+    if (map->train_vocab_cutoff > data->num_cols)
+      std::__throw_invalid_argument("The vocabulary size is smaller than the training vocabulary cutoff.");
+    if (map->train_vocab_cutoff > 0 && min_word_index_to_avoid_empty_row > map->train_vocab_cutoff)
+      std::cout << "WARNING: Some training snippets of " << map->name << " are empty." << std::endl;
+  }
+
+  // The outputs of all maps share one background writer, and their metrics one telemetry
+  AsyncWriter writer(write_queue_size << 20, fsync_policy);
+  Telemetry* telemetry = create_telemetry(args);
+  for (auto& map : maps)
+  {
+    const fs::path map_directory = directory / map->name;
+    if (is_root && !fs::exists(map_directory))
+      fs::create_directory(map_directory);
+    if (is_root)
+    {
+      map->readme.open((map_directory / "README.md").c_str());
+      map->convergence_log_stream.open((map_directory / "convergence.tsv").c_str());
+      map->timing_log_stream.open((map_directory / "timing.tsv").c_str());
+    }
+
+    map->readme << "# Semantic Map " << map->name << std::endl
+      << std::endl
+      << "Semantic Map version:  " << VERSION_MAJOR << "." << VERSION_MINOR << "." << VERSION_PATCH << std::endl
+      << "Verbose:               " << verbose << std::endl
+      << "Sweep:                 " << name << " (" << maps.size() << " maps)" << std::endl
+      << std::endl
+      << "## Hyperparameters" << std::endl
+      << "Dimensions:            " << map->width << " x " << map->height << std::endl
+      << "Initial update radius: " << map->initial_radius << std::endl
+      << "Update exponent:       " << map->update_exponent << std::endl
+      << "Respect lower bound:   " << respect_lower_bound << std::endl
+      << "Local topology:        " << get_local_topology_string(map->local_topology)  << std::endl
+      << "Global topology:       " << get_global_topology_string(map->global_topology) << std::endl
+      << "Training vocab cutoff: " << map->train_vocab_cutoff << std::endl
+      << "Number of epochs:      " << num_epochs << std::endl
+      << "Early stop patience:   " << early_stopping_settings.patience << std::endl
+      << "Dead cell updates:     " << dead_cell_update_strides << std::endl
+      << "Metrics sample:        " << metrics_sample_strides << std::endl
+      << "Seed:                  " << seed << std::endl
+      << "Codebook init:         " << codebook_initialization << std::endl
+      << "Compressed codebook:   " << compress_codebook << std::endl
+      << std::endl
+      << "## Machine" << std::endl
+      << "CPU:                   " << get_cpu_name() << std::endl
+      << "Max. parallel threads: " << std::thread::hardware_concurrency() << std::endl
+      << "Training threads:      " << get_num_parallel_threads() << (resolve_parallel_settings().backend == ParallelBackend::THREAD_POOL_BACKEND ? " (thread pool)" : " (OpenMP)") << std::endl
+      << "NUMA nodes:            " << get_num_numa_nodes() << (is_numa_placement_enabled() ? " (placed)" : "") << std::endl
+      << "Huge pages:            " << get_huge_page_policy() << std::endl
+      << "Cell index bits:       " << 8 * sizeof(CellIndexType) << std::endl
+      << "MPI processes:         " << get_num_processes() << std::endl
+      << "Cell shards:           " << get_num_cell_shards() << std::endl
+      << std::endl
+      << "## Dataset" << std::endl
+      << "Number of snippets:     " << data->num_total_rows << std::endl
+      << "Vocabulary size:        " << data->num_cols << std::endl
+      << "Longest leading zeros:  " << min_word_index_to_avoid_empty_row << std::endl
+      << "Total number of tokens: " << num_tokens << std::endl
+      << std::endl;
+
+    map->timer.start("create");
+    map->timer.start("init_codebook");
+    map->codebook = new Codebook(map->height, map->width, data->num_cols, map->global_topology, map->local_topology);
+    map->codebook->init(*data, codebook_initialization, static_cast<int>(seed), map->train_vocab_cutoff);
+    map->neighbourhood = new Neighbourhood(map->height, map->width, map->global_topology, map->local_topology, map->update_exponent, map->initial_radius);
+    map->timer.stop();
+
+    map->profiler = new TrainingProfiler(map->timer, &map->timing_log_stream, nullptr, nullptr, telemetry, map->name.string());
+    map->early_stopping = new EarlyStopping(early_stopping_settings);
+    map->trainer = new Trainer(
+      *map->codebook,
+      *map->neighbourhood,
+      *data,
+      num_epochs,
+      map->convergence_log_stream,
+      verbose ? map_directory.string() + "/" : "",
+      respect_lower_bound,
+      map->train_vocab_cutoff,
+      dead_cell_update_strides,
+      map->profiler,
+      nullptr,
+      nullptr,
+      1,
+      map->early_stopping,
+      &writer,
+      metrics_sample_strides
+    );
+  }
+
+  // Train all maps in lockstep, so they share every pass over the corpus.
+  // With early stopping, the maps that have converged drop out.
+  while (true)
+  {
+    std::vector<Trainer*> trainers;
+    for (auto& map : maps)
+    {
+      if (!map->trainer->is_done())
+        trainers.push_back(map->trainer);
+    }
+    if (trainers.empty())
+      break;
+    for (auto* trainer : trainers)
+      trainer->begin_epoch();
+    Trainer::find_best_matching_units(trainers);
+    for (auto* trainer : trainers)
+      trainer->end_epoch();
+  }
+
+  std::ofstream summary;
+  if (is_root)
+  {
+    summary.open((directory / (name + "-sweep.tsv")).c_str());
+    summary << "Name\tWidth\tHeight\tGlobalTopology\tLocalTopology\tUpdateExponent\tTrainVocabCutoff\tEpochs\tQuantizationError\tTopographicError" << std::endl;
+  }
+
+  for (auto& map : maps)
+  {
+    const fs::path map_directory = directory / map->name;
+    summary << map->name.string()
+      << "\t" << map->width
+      << "\t" << map->height
+      << "\t" << map->global_topology
+      << "\t" << map->local_topology
+      << "\t" << map->update_exponent
+      << "\t" << map->train_vocab_cutoff
+      << "\t" << map->trainer->get_num_epochs()
+      << "\t" << map->trainer->get_quantization_error()
+      << "\t" << map->trainer->get_topographic_error()
+      << std::endl;
+    delete map->trainer;
+    delete map->profiler;
+    if (map->early_stopping->is_enabled())
+      write_early_stopping(map->readme, *map->early_stopping, num_epochs);
+    delete map->early_stopping;
+
+    map->timer.start("save");
+    if (is_root)
+      map->neighbourhood->save_to_file((map_directory / "neighbourhood.bin").string(), writer);
+    map->timer.stop();
+    delete map->neighbourhood;
+
+    map->timer.start("build_semantic_map");
+    auto* semantic_map = new SemanticMap(*data, *map->codebook, map->train_vocab_cutoff);
+    map->timer.stop();
+
+    map->timer.start("save");
+    if (get_row_shard() == 0)
+      map->codebook->save_to_file((map_directory / "codebook.bin").string(), compress_codebook);
+    delete map->codebook;
+    semantic_map->save_best_matching_units_to_file((map_directory / "bmus.bin").string());
+    writer.flush();
+    map->timer.stop();
+    delete semantic_map;
+    map->timer.stop();
+
+    map->readme << "## Timing" << std::endl
+                << "Sweep started at UnixTime:      " << stop_watch.get_start_unix_time() << std::endl
+                << "Map ended at UnixTime:          " << get_unix_time() << std::endl
+                << std::endl
+                << "### Breakdown" << std::endl
+                << "The search for the best matching units is shared by all maps of the sweep." << std::endl;
+    load_timer.print(map->readme);
+    map->timer.print(map->readme);
+    map->readme.close();
+    map->convergence_log_stream.close();
+    map->timing_log_stream.close();
+    map.reset();
+  }
+  summary.close();
+  delete data;
+  if (telemetry)
+    delete telemetry;
+
+  stop_watch.stop();
+  std::cout << "Sweeping the semantic maps took " << stop_watch << std::endl;
+}
+
+
+void create_synthetic_corpus(ArgParser& args) {
+  // Determine settings
+  const std::string output_filename = args.get_option(1);
+  SyntheticCorpusSettings settings;
+  settings.num_rows = static_cast<IndexPointerType>(args.get_option_as_int("--rows", settings.num_rows));
+  settings.vocab_size = static_cast<IndexType>(args.get_option_as_int("--vocab-size", settings.vocab_size));
+  settings.seed = static_cast<uint64_t>(args.get_option_as_int("--seed", settings.seed));
+  settings.zipf_exponent = args.get_option_as_float("--zipf-exponent", settings.zipf_exponent);
+  settings.row_length_distribution = static_cast<RowLengthDistribution>(args.get_option_as_int("--row-length-distribution", settings.row_length_distribution));
+  settings.mean_row_length = static_cast<IndexType>(args.get_option_as_int("--row-length", settings.mean_row_length));
+  settings.max_row_length = static_cast<IndexType>(args.get_option_as_int("--max-row-length", settings.max_row_length));
+  settings.num_clusters = static_cast<IndexType>(args.get_option_as_int("--clusters", settings.num_clusters));
+  settings.cluster_strength = args.get_option_as_float("--cluster-strength", settings.cluster_strength);
+  settings.heading_probability = args.get_option_as_float("--heading-probability", settings.heading_probability);
+  settings.with_weights = !args.option_exists("--no-weights");
+
+  // Check settings
+  if (settings.row_length_distribution != RowLengthDistribution::POISSON &&
+      settings.row_length_distribution != RowLengthDistribution::GEOMETRIC &&
+      settings.row_length_distribution != RowLengthDistribution::UNIFORM)
+    std::__throw_invalid_argument("The row length distribution must be 0 (Poisson), 1 (geometric), or 2 (uniform)");
+  if (settings.heading_probability < 0. || settings.heading_probability > 1.)
+    std::__throw_invalid_argument("The heading probability must be between 0 and 1");
+
+  std::cout << "Creating a synthetic corpus '" << output_filename << "' with " << std::endl
+            << "Number of snippets:     " << settings.num_rows << std::endl
+            << "Vocabulary size:        " << settings.vocab_size << std::endl
+            << "Seed:                   " << settings.seed << std::endl
+            << "Zipf exponent:          " << settings.zipf_exponent << std::endl
+            << "Row length:             " << settings.mean_row_length << " (max. " << settings.max_row_length << ")" << std::endl
+            << "Topical clusters:       " << settings.num_clusters << std::endl
+            << "Cluster strength:       " << settings.cluster_strength << std::endl
+            << "Weights:                " << settings.with_weights << std::endl
+            << std::endl;
+
+  auto stop_watch = StopWatch();
+  stop_watch.start();
+  const auto num_tokens = write_synthetic_corpus(output_filename, settings);
+  stop_watch.stop();
+
+  std::cout << "Total number of tokens: " << num_tokens << std::endl
+            << "Creating the corpus took " << stop_watch << std::endl;
+}
+
+
+void reorder_vocabulary(ArgParser& args) {
+  // Determine settings
+  const std::string input_filename = args.get_option(1);
+  const std::string output_filename = args.get_option(2);
+  const std::string vocabulary_filename = args.get_option("--vocabulary", "");  // vocab.txt of the corpus, one term per line
+  const std::string vocabulary_output_filename = args.get_option("--vocabulary-out", "");  // Reordered vocab.txt that belongs to the output corpus
+  const std::string permutation_filename = args.get_option("--permutation-out", "");  // If given, write the original column of every new column, one per line
+  ColumnOrderSettings settings;
+  const bool has_train_vocab_cutoff = args.option_exists("--train-vocab-cutoff");
+  settings.train_vocab_cutoff = static_cast<IndexType>(args.get_option_as_int("--train-vocab-cutoff", settings.train_vocab_cutoff));  // The terms below this index stay below it, and `smap create` must use the same cutoff (0: no cutoff)
+  settings.window_size = static_cast<IndexType>(args.get_option_as_int("--window-size", settings.window_size));
+  settings.max_samples = static_cast<IndexPointerType>(args.get_option_as_int("--samples", settings.max_samples));
+  set_parallel_settings(args);
+
+  // Check settings
+  if (input_filename == output_filename)
+    std::__throw_invalid_argument("The reordered corpus must not overwrite the input corpus");
+  if (vocabulary_filename.empty() != vocabulary_output_filename.empty())
+    std::__throw_invalid_argument("Please provide both --vocabulary and --vocabulary-out, or neither");
+  // Without them, the fingerprints of the reordered corpus cannot be mapped back to the terms
+  if (vocabulary_output_filename.empty() && permutation_filename.empty())
+    std::__throw_invalid_argument("Please provide --vocabulary-out or --permutation-out to keep the terms of the reordered columns");
+  // The order keeps only the terms below this cutoff, so the training has to use the same one
+  if (!has_train_vocab_cutoff)
+    std::__throw_invalid_argument("Please provide the --train-vocab-cutoff of the training (0 for none)");
+
+  std::cout << "Reordering the vocabulary of '" << input_filename << "' with " << std::endl
+            << "Training vocab cutoff:  " << settings.train_vocab_cutoff << std::endl
+            << "Window size:            " << settings.window_size << std::endl
+            << "Samples per term:       " << settings.max_samples << std::endl
+            << std::endl;
+
+  auto stop_watch = StopWatch();
+  stop_watch.start();
+  CorpusDataset data(input_filename);
+  const auto new_columns = compute_column_order(data, settings);
+
+  // A cache line holds 16 and a page 1024 values of a codebook cell
+  const std::vector<IndexType> original_columns;
+  std::cout << "Cache lines per snippet: " << get_mean_blocks_per_row(data, original_columns, 16, settings.train_vocab_cutoff)
+            << " -> " << get_mean_blocks_per_row(data, new_columns, 16, settings.train_vocab_cutoff) << std::endl
+            << "Pages per snippet:       " << get_mean_blocks_per_row(data, original_columns, 1024, settings.train_vocab_cutoff)
+            << " -> " << get_mean_blocks_per_row(data, new_columns, 1024, settings.train_vocab_cutoff) << std::endl;
+
+  std::cout << "Writing reordered corpus to '" << output_filename << "'" << std::endl;
+  write_permuted_corpus(output_filename, data, new_columns, settings.train_vocab_cutoff);
+  if (!vocabulary_filename.empty())
+  {
+    std::cout << "Writing reordered vocabulary to '" << vocabulary_output_filename << "'" << std::endl;
+    write_permuted_vocabulary(vocabulary_filename, vocabulary_output_filename, new_columns);
+  }
+  if (!permutation_filename.empty())
+  {
+    std::ofstream permutation(permutation_filename);
+    if (!permutation.is_open())
+      std::__throw_runtime_error("Cannot write the permutation");
+    for (const IndexType column : invert_permutation(new_columns))
+      permutation << column << "\n";
+  }
+  stop_watch.stop();
+  std::cout << "Reordering the vocabulary took " << stop_watch << std::endl;
 }
 
 
@@ -194,12 +1081,39 @@ int main(int argc, char* argv[])
     return 1;
   }
 
+  init_distributed(&argc, &argv);
+  // With MPI, only the root process prints its progress
+  if (!is_root_process())
+    std::cout.rdbuf(nullptr);
+
   try
   {
     ArgParser args(argc, argv);
     std::string mode = args.get_option(0);
+    set_checksum_verification(args.option_exists("--verify"));  // Check the CRC32C of every block of the checksummed input files, not only their sizes
     if (mode == "create") {
       create_semantic_map(args);
+    } else if (mode == "resume") {
+      // Continue an interrupted `smap create` run from the checkpoint in <directory>/<name>
+      const fs::path checkpoint_filename = fs::path(args.get_option(1)) / fs::path(args.get_option(2)) / fs::path("checkpoint.bin");
+      TrainingCheckpoint checkpoint(checkpoint_filename.string());
+      ArgParser checkpoint_args(checkpoint.arguments);
+      create_semantic_map(checkpoint_args, &checkpoint);
+    } else if (mode == "sweep") {
+      sweep_semantic_maps(args);
+    } else if (mode == "synth") {
+      create_synthetic_corpus(args);
+    } else if (mode == "reorder") {
+      reorder_vocabulary(args);
+    } else if (mode == "checksum") {
+      // Add checksums to a corpus of format version 2 or 3, e.g. from text_to_binary.py
+      set_parallel_settings(args);
+      add_corpus_checksums(args.get_option(1));
+    } else if (mode == "decompress") {
+      // Convert a compressed codebook.bin (--compress-codebook) to the raw format, e.g. for codebook_to_json.py
+      set_parallel_settings(args);
+      Codebook codebook(args.get_option(1));
+      codebook.save_to_file(args.get_option(2));
     } else if (mode == "--author") {
       std::cout << "Created by Johannes E. M. Mosig (j.mosig@rasa.com)" << std::endl;
     } else if (mode == "--version") {
@@ -212,7 +1126,11 @@ int main(int argc, char* argv[])
 
   } catch (const std::exception &exc) {
       std::cerr << exc.what() << std::endl;
+      // The other processes would wait forever for this one
+      if (is_distributed())
+        abort_distributed(1);
   }
 
+  finalize_distributed();
   return 0;
 }
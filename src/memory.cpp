@@ -0,0 +1,256 @@
+#include <limits>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <unistd.h>
+#include "memory.hpp"
+#include "som.hpp"
+
+
+const uint64_t UNLIMITED_MEMORY = std::numeric_limits<uint64_t>::max();
+
+
+// Memory that `allocate_huge_pages` maps for `num_bytes`, assuming 2 MiB pages
+static uint64_t get_huge_page_bytes(const uint64_t num_bytes)
+{
+  if (num_bytes < HUGE_PAGE_SIZE)
+    return num_bytes;
+  return (num_bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+}
+
+
+// Codebook, radii and best matching units of a training checkpoint
+static uint64_t get_checkpoint_bytes(const MemoryPlanSettings& settings)
+{
+  return settings.num_local_cells * settings.num_cols * sizeof(Float) + settings.num_cells * sizeof(Float) + settings.num_rows * sizeof(CellIndexType);
+}
+
+
+// Largest file that is queued for the background writer at once. The final codebook is saved
+// directly, so only the radii and the checkpoints are queued.
+static uint64_t get_largest_output_bytes(const MemoryPlanSettings& settings)
+{
+  const uint64_t radii_bytes = settings.num_cells * sizeof(Float);
+  return std::max(radii_bytes, settings.has_checkpoints ? get_checkpoint_bytes(settings) : 0);
+}
+
+
+// The queue holds at most its size or one larger file, and the caller waits with the next snapshot.
+// Without outputs during the training, only the final radii are ever queued.
+static uint64_t get_write_queue_item_bytes(const MemoryPlanSettings& settings, const uint64_t write_queue_bytes)
+{
+  const uint64_t largest_output_bytes = get_largest_output_bytes(settings);
+  const uint64_t queued_bytes = std::max(write_queue_bytes, largest_output_bytes) + largest_output_bytes;
+  if (settings.has_checkpoints || settings.has_preliminary_outputs)
+    return queued_bytes;
+  return std::min(queued_bytes, settings.num_cells * sizeof(Float));
+}
+
+
+static std::vector<MemoryItem> estimate_memory_items(const MemoryPlanSettings& settings, const bool with_counts, const uint64_t write_queue_bytes)
+{
+  const int ALL_PHASES = TRAINING_PHASE | SEMANTIC_MAP_PHASE | SAVING_PHASE;
+  const uint64_t rows = settings.num_rows;
+  const uint64_t cells = settings.num_cells;
+  std::vector<MemoryItem> items;
+
+  const uint64_t entry_bytes = sizeof(IndexType) + (settings.has_weights ? sizeof(WeightType) : 0);
+  items.push_back({"Corpus", settings.num_non_zero * entry_bytes + (rows + 1) * sizeof(IndexPointerType) + rows * sizeof(IndexType), TRAINING_PHASE | SEMANTIC_MAP_PHASE});
+  items.push_back({"Codebook", get_huge_page_bytes(settings.num_local_cells * settings.num_cols * sizeof(Float)), ALL_PHASES});
+  // The codebook of the last growth stage is alive while the map grows to its final size
+  if (settings.num_growth_cells > 0)
+    items.push_back({"Growth stage codebook", get_huge_page_bytes(settings.num_growth_cells * settings.num_cols * sizeof(Float)), TRAINING_PHASE});
+  items.push_back({"Neighbourhood", (cells + settings.num_growth_cells) * sizeof(Float), TRAINING_PHASE});
+  // Arena of the best and next best matching units and their distances
+  items.push_back({"Training arrays", get_huge_page_bytes(rows * (3 * sizeof(CellIndexType) + 2 * sizeof(Float)) + 5 * ARENA_ALIGNMENT), TRAINING_PHASE});
+  // With MPI, a block of cells with their denominators, as in `Codebook::apply_distributed_batch_som_update`
+  const uint64_t values_per_cell = settings.num_cols + 1;
+  const uint64_t cells_per_block = std::max<uint64_t>(1, std::min<uint64_t>(
+    MAX_DISTRIBUTED_UPDATE_BLOCK_SIZE / values_per_cell,
+    (settings.num_local_cells + 4 * settings.num_row_shards - 1) / (4 * settings.num_row_shards)
+  ));
+  const uint64_t update_bytes = settings.num_row_shards > 1
+    ? cells_per_block * values_per_cell * sizeof(Float)
+    : settings.num_threads * settings.num_cols * sizeof(Float);
+  items.push_back({"Batch update numerators", update_bytes, TRAINING_PHASE});
+  // Scratch of the error metrics in the same arena: the cells in use per thread and of all threads,
+  // and the largest distances per thread when assigning dead cells
+  const uint64_t metrics_bytes = settings.num_threads * cells * (sizeof(char) + (settings.has_dead_cell_updates ? 2 * sizeof(Float) : 0)) + cells * sizeof(bool);
+  items.push_back({"Error metrics", metrics_bytes, TRAINING_PHASE});
+  if (settings.has_checkpoints)
+    items.push_back({"Checkpoint snapshot", 2 * get_checkpoint_bytes(settings), TRAINING_PHASE});
+  // The compressed chunks and their concatenation, about as large as the values at most, while the
+  // writer serializes a checkpoint and while the final codebook is saved
+  if (settings.is_codebook_compressed)
+    items.push_back({"Codebook compression", 2 * settings.num_local_cells * settings.num_cols * sizeof(Float), (settings.has_checkpoints ? TRAINING_PHASE : 0) | SAVING_PHASE});
+  if (settings.is_resumed)
+    items.push_back({"Resumed checkpoint", get_checkpoint_bytes(settings), ALL_PHASES});
+
+  items.push_back({"Final best matching units", rows * (sizeof(CellIndexType) + sizeof(Float)), SEMANTIC_MAP_PHASE | SAVING_PHASE});
+  if (with_counts)
+  {
+    items.push_back({"Association counts", get_huge_page_bytes(cells * settings.num_cols * sizeof(CountType)), SEMANTIC_MAP_PHASE | SAVING_PHASE});
+    items.push_back({"Rows grouped by cell", rows * sizeof(IndexPointerType) + 2 * (cells + 1) * sizeof(IndexPointerType), SEMANTIC_MAP_PHASE});
+  }
+  // The root process receives the best matching units of all processes and converts them
+  if (settings.num_row_shards > 1 && settings.is_root)
+    items.push_back({"Gathered best matching units", 2 * settings.num_total_rows * sizeof(CellIndexType), SAVING_PHASE});
+
+  if (settings.trace_bytes > 0)
+    items.push_back({"Trace buffers", settings.trace_bytes, ALL_PHASES});
+  items.push_back({"Write queue", get_write_queue_item_bytes(settings, write_queue_bytes), ALL_PHASES});
+  return items;
+}
+
+
+uint64_t MemoryPlan::get_phase_bytes(const int phase) const
+{
+  uint64_t num_bytes = 0;
+  for (const auto& item : this->items)
+  {
+    if (item.phases & phase)
+      num_bytes += item.num_bytes;
+  }
+  return num_bytes;
+}
+
+
+uint64_t MemoryPlan::get_peak_bytes() const
+{
+  return std::max({
+    this->get_phase_bytes(TRAINING_PHASE),
+    this->get_phase_bytes(SEMANTIC_MAP_PHASE),
+    this->get_phase_bytes(SAVING_PHASE)
+  });
+}
+
+
+static std::string format_mebibytes(const uint64_t num_bytes)
+{
+  std::ostringstream stream;
+  stream << std::fixed << std::setprecision(1) << num_bytes / 1048576. << " MiB";
+  return stream.str();
+}
+
+
+static std::string format_phases(const int phases)
+{
+  std::string result;
+  for (const auto& phase : {std::make_pair(TRAINING_PHASE, "training"), std::make_pair(SEMANTIC_MAP_PHASE, "semantic map"), std::make_pair(SAVING_PHASE, "saving")})
+  {
+    if (phases & phase.first)
+      result += (result.empty() ? "" : ", ") + std::string(phase.second);
+  }
+  return result;
+}
+
+
+void MemoryPlan::print(std::ostream& os) const
+{
+  for (const auto& item : this->items)
+    os << "- " << item.name << ": " << format_mebibytes(item.num_bytes) << " (" << format_phases(item.phases) << ")" << std::endl;
+
+  int peak_phase = TRAINING_PHASE;
+  for (const int phase : {SEMANTIC_MAP_PHASE, SAVING_PHASE})
+  {
+    if (this->get_phase_bytes(phase) > this->get_phase_bytes(peak_phase))
+      peak_phase = phase;
+  }
+  os << "Peak memory:           " << format_mebibytes(this->get_peak_bytes()) << " (" << format_phases(peak_phase) << ")" << std::endl
+     << "Memory budget:         " << (this->budget > 0 ? format_mebibytes(this->budget) : "unlimited") << std::endl
+     << "Association counts:    " << (this->with_counts ? "dense" : "left out") << std::endl
+     << "Write queue:           " << format_mebibytes(this->write_queue_bytes) << std::endl;
+}
+
+
+// Value of a cgroup memory limit file, which is `max` (v2) or a huge number (v1) without a limit
+static uint64_t read_cgroup_limit(const std::string& filename)
+{
+  std::ifstream file(filename);
+  uint64_t limit = 0;
+  if (!(file >> limit))
+    return UNLIMITED_MEMORY;
+  return limit;
+}
+
+
+// Smallest memory limit of the cgroup of this process and of its ancestors
+static uint64_t get_cgroup_memory_limit()
+{
+  uint64_t limit = UNLIMITED_MEMORY;
+  std::ifstream cgroups("/proc/self/cgroup");
+  std::string line;
+  while (std::getline(cgroups, line))
+  {
+    // Lines are `hierarchy:controllers:path`, where the single v2 hierarchy has no controllers
+    const auto first_colon = line.find(':');
+    const auto second_colon = first_colon == std::string::npos ? std::string::npos : line.find(':', first_colon + 1);
+    if (second_colon == std::string::npos)
+      continue;
+    const std::string controllers = "," + line.substr(first_colon + 1, second_colon - first_colon - 1) + ",";
+    std::string path = line.substr(second_colon + 1);
+    std::string mount, filename;
+    if (controllers == ",,")
+    {
+      mount = "/sys/fs/cgroup";
+      filename = "/memory.max";
+    }
+    else if (controllers.find(",memory,") != std::string::npos)
+    {
+      mount = "/sys/fs/cgroup/memory";
+      filename = "/memory.limit_in_bytes";
+    }
+    else
+      continue;
+
+    // In a container, the mount shows only the part of the hierarchy below its own cgroup
+    while (true)
+    {
+      limit = std::min(limit, read_cgroup_limit(mount + (path == "/" ? "" : path) + filename));
+      if (path.empty() || path == "/")
+        break;
+      path = path.substr(0, path.rfind('/'));
+    }
+  }
+  return limit;
+}
+
+
+uint64_t get_memory_limit()
+{
+  uint64_t limit = get_cgroup_memory_limit();
+  const long num_pages = sysconf(_SC_PHYS_PAGES);
+  const long page_size = sysconf(_SC_PAGESIZE);
+  if (num_pages > 0 && page_size > 0)
+    limit = std::min(limit, static_cast<uint64_t>(num_pages) * static_cast<uint64_t>(page_size));
+  return limit == UNLIMITED_MEMORY ? 0 : limit;
+}
+
+
+MemoryPlan plan_memory(const MemoryPlanSettings& settings, const uint64_t budget)
+{
+  MemoryPlan plan;
+  plan.budget = budget;
+  plan.write_queue_bytes = settings.write_queue_bytes;
+  plan.items = estimate_memory_items(settings, true, plan.write_queue_bytes);
+  if (plan.fits())
+    return plan;
+
+  plan.with_counts = false;
+  plan.items = estimate_memory_items(settings, false, plan.write_queue_bytes);
+  if (plan.fits())
+    return plan;
+
+  // The queue is alive in every phase, so the peak shrinks along with it until only the largest
+  // output fits into the queue
+  const uint64_t queue_item_bytes = get_write_queue_item_bytes(settings, plan.write_queue_bytes);
+  const uint64_t other_peak_bytes = plan.get_peak_bytes() - queue_item_bytes;
+  const uint64_t largest_output_bytes = get_largest_output_bytes(settings);
+  if (other_peak_bytes + 2 * largest_output_bytes <= budget)
+    plan.write_queue_bytes = std::min(plan.write_queue_bytes, budget - other_peak_bytes - largest_output_bytes);
+  else
+    plan.write_queue_bytes = 0;
+  plan.items = estimate_memory_items(settings, false, plan.write_queue_bytes);
+  return plan;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include "data.hpp"
+
+
+// Phases of `smap create` in which a structure is alive
+enum MemoryPhase
+{
+  TRAINING_PHASE=1,      // Epochs, including the growth stages
+  SEMANTIC_MAP_PHASE=2,  // Best matching units and association counts of the final map
+  SAVING_PHASE=4         // Final outputs, after the corpus is freed
+};
+
+
+// Sizes that determine the memory of `smap create` in one process
+struct MemoryPlanSettings
+{
+  uint64_t num_rows = 0;                 // Rows loaded by this process
+  uint64_t num_total_rows = 0;           // Rows of the whole corpus
+  uint64_t num_non_zero = 0;             // Entries loaded by this process
+  uint64_t num_cols = 0;                 // Vocabulary size
+  bool has_weights = false;
+  uint64_t num_cells = 0;                // Cells of the final map
+  uint64_t num_local_cells = 0;          // Cells of the final map stored by this process
+  uint64_t num_growth_cells = 0;         // Cells of the largest growth stage, or zero without growth stages
+  uint64_t num_threads = 1;
+  uint64_t num_row_shards = 1;           // With MPI, processes that share the cells
+  bool is_root = true;                   // Gathers the best matching units of all processes
+  bool has_dead_cell_updates = false;
+  bool has_checkpoints = false;
+  bool is_codebook_compressed = false;   // Saves the codebook and the checkpoints compressed
+  bool is_resumed = false;
+  bool has_preliminary_outputs = false;  // Writes outputs after every epoch (`--verbose`)
+  uint64_t trace_bytes = 0;              // Trace buffers of all threads
+  uint64_t write_queue_bytes = 0;        // Requested size of the background writer queue
+};
+
+
+// Estimated memory of one structure
+struct MemoryItem
+{
+  std::string name;
+  uint64_t num_bytes;
+  int phases;  // Disjunction of `MemoryPhase`
+};
+
+
+// Peak memory estimate of `smap create` and the layouts chosen to fit the budget
+struct MemoryPlan
+{
+  std::vector<MemoryItem> items;
+  uint64_t budget = 0;               // Zero if unlimited
+  bool with_counts = true;           // Whether the semantic map allocates the dense association counts
+  uint64_t write_queue_bytes = 0;    // Size of the background writer queue
+
+  uint64_t get_phase_bytes(const int phase) const;
+  uint64_t get_peak_bytes() const;
+  inline bool fits() const { return this->budget == 0 || this->get_peak_bytes() <= this->budget; }
+  // Breakdown of the items, the peak and the budget
+  void print(std::ostream& os) const;
+};
+
+
+// Memory that this process may use: the limit of its cgroup (v2 or v1), but at most the physical memory.
+// Zero if unknown.
+uint64_t get_memory_limit();
+
+// Estimate the peak memory with the requested layouts. If it exceeds a non-zero `budget`, leave out
+// the association counts, which `smap create` does not save, and then shrink the writer queue.
+// The result does not fit if even these layouts exceed the budget.
+MemoryPlan plan_memory(const MemoryPlanSettings& settings, const uint64_t budget);
@@ -0,0 +1,193 @@
+#include <fstream>
+#include <string>
+#include <thread>
+#include <stdexcept>
+#include <unistd.h>
+
+#if defined(__linux__)
+  #include <sched.h>
+  #include <sys/syscall.h>
+  #include <linux/mempolicy.h>
+#endif
+
+#include "numa.hpp"
+#include "parallel.hpp"
+
+
+#define MAX_NUMA_NODES 1024  // Bits of the node masks passed to the kernel
+
+
+static bool numa_placement_enabled = false;
+
+
+void set_numa_placement(const bool is_enabled)
+{
+  numa_placement_enabled = is_enabled;
+}
+
+
+bool is_numa_placement_enabled()
+{
+  return numa_placement_enabled;
+}
+
+
+// Parse a sysfs list like "0-3,8", which is empty if the file is missing
+static std::vector<int> read_sysfs_list(const std::string& filename)
+{
+  std::ifstream file(filename);
+  std::string line;
+  if (!std::getline(file, line))
+    return {};
+  try {
+    return parse_cpu_list(line);
+  } catch (const std::invalid_argument&) {
+    return {};
+  }
+}
+
+
+int get_num_numa_nodes()
+{
+  static const int num_nodes = []() {
+    const auto nodes = read_sysfs_list("/sys/devices/system/node/online");
+    return nodes.empty() ? 1 : nodes.back() + 1;
+  }();
+  return num_nodes;
+}
+
+
+std::vector<int> get_numa_node_cpus(const int node)
+{
+  auto cpus = read_sysfs_list("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+  if (cpus.empty() && node == 0 && get_num_numa_nodes() == 1)
+  {
+    for (unsigned int cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); ++cpu)
+      cpus.push_back(static_cast<int>(cpu));
+  }
+
+  #if defined(__linux__)
+  // Leave out the CPUs that the affinity mask (e.g. taskset or a container) excludes
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+  {
+    std::vector<int> allowed_cpus;
+    for (const int cpu : cpus)
+    {
+      if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+        allowed_cpus.push_back(cpu);
+    }
+    cpus = allowed_cpus;
+  }
+  #endif
+  return cpus;
+}
+
+
+std::vector<int> get_cpus_by_numa_node()
+{
+  std::vector<int> cpus;
+  for (int node = 0; node < get_num_numa_nodes(); ++node)
+  {
+    const auto node_cpus = get_numa_node_cpus(node);
+    cpus.insert(cpus.end(), node_cpus.begin(), node_cpus.end());
+  }
+  return cpus;
+}
+
+
+std::vector<size_t> split_by_numa_node(const size_t count)
+{
+  const int num_nodes = get_num_numa_nodes();
+  std::vector<size_t> num_cpus_before(num_nodes + 1, 0);
+  for (int node = 0; node < num_nodes; ++node)
+    num_cpus_before[node + 1] = num_cpus_before[node] + get_numa_node_cpus(node).size();
+
+  std::vector<size_t> boundaries(num_nodes + 1, count);
+  boundaries[0] = 0;
+  if (num_cpus_before[num_nodes] == 0)
+    return boundaries;
+  for (int node = 1; node < num_nodes; ++node)
+    boundaries[node] = static_cast<size_t>(static_cast<unsigned __int128>(count) * num_cpus_before[node] / num_cpus_before[num_nodes]);
+  return boundaries;
+}
+
+
+#if defined(__linux__)
+// Apply `mode` with the nodes of `node_mask` to the whole pages in the range, and move the pages in memory
+static bool bind_pages(const void* const data, const size_t num_bytes, const int mode, const unsigned long* const node_mask)
+{
+  const auto page_size = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+  const auto start = (reinterpret_cast<uintptr_t>(data) + page_size - 1) / page_size * page_size;
+  const auto end = (reinterpret_cast<uintptr_t>(data) + num_bytes) / page_size * page_size;
+  if (!data || end <= start)
+    return false;
+  return syscall(SYS_mbind, start, end - start, mode, node_mask, MAX_NUMA_NODES + 1, MPOL_MF_MOVE) == 0;
+}
+#endif
+
+
+bool interleave_on_numa_nodes(const void* const data, const size_t num_bytes)
+{
+  #if defined(__linux__)
+  if (get_num_numa_nodes() < 2)
+    return false;
+  unsigned long node_mask[MAX_NUMA_NODES / (8 * sizeof(unsigned long))] = {};
+  for (const int node : read_sysfs_list("/sys/devices/system/node/has_memory"))
+  {
+    if (node < MAX_NUMA_NODES)
+      node_mask[node / (8 * sizeof(unsigned long))] |= 1ul << (node % (8 * sizeof(unsigned long)));
+  }
+  return bind_pages(data, num_bytes, MPOL_INTERLEAVE, node_mask);
+  #else
+  (void) data;
+  (void) num_bytes;
+  return false;
+  #endif
+}
+
+
+bool move_to_numa_node(const void* const data, const size_t num_bytes, const int node)
+{
+  #if defined(__linux__)
+  if (node < 0 || node >= MAX_NUMA_NODES)
+    return false;
+  unsigned long node_mask[MAX_NUMA_NODES / (8 * sizeof(unsigned long))] = {};
+  node_mask[node / (8 * sizeof(unsigned long))] = 1ul << (node % (8 * sizeof(unsigned long)));
+  // Unlike binding, the preference falls back to other nodes when this one is full
+  return bind_pages(data, num_bytes, MPOL_PREFERRED, node_mask);
+  #else
+  (void) data;
+  (void) num_bytes;
+  return node == 0;
+  #endif
+}
+
+
+bool split_over_numa_nodes(const void* const data, const size_t count, const size_t item_size)
+{
+  if (get_num_numa_nodes() < 2)
+    return false;
+  const auto boundaries = split_by_numa_node(count);
+  bool is_placed = true;
+  for (size_t node = 0; node + 1 < boundaries.size(); ++node)
+  {
+    if (boundaries[node + 1] > boundaries[node])
+      is_placed &= move_to_numa_node(static_cast<const char*>(data) + boundaries[node] * item_size, (boundaries[node + 1] - boundaries[node]) * item_size, static_cast<int>(node));
+  }
+  return is_placed;
+}
+
+
+int get_numa_node_of_address(const void* const address)
+{
+  #if defined(__linux__)
+  int node = -1;
+  if (syscall(SYS_get_mempolicy, &node, nullptr, 0, address, MPOL_F_NODE | MPOL_F_ADDR) != 0)
+    return -1;
+  return node;
+  #else
+  (void) address;
+  return 0;
+  #endif
+}
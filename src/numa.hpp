@@ -0,0 +1,32 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+
+
+// NUMA topology from sysfs and page placement with the `mbind` system call, so smap needs no libnuma.
+// The placement only affects the whole pages within the given range, and moves pages that are
+// already in memory. Without Linux, the machine counts as a single node and nothing is moved.
+
+int get_num_numa_nodes();
+// CPUs of `node` on which this process may run
+std::vector<int> get_numa_node_cpus(const int node);
+// CPUs of all nodes in the order of the nodes, so that consecutive threads share a node
+std::vector<int> get_cpus_by_numa_node();
+// Boundaries 0 = b_0 <= b_1 <= ... <= b_{num_nodes} = count that split `count` items over the nodes
+// in proportion to their CPUs. Threads pinned to `get_cpus_by_numa_node()` with a static schedule
+// over the items then mostly work on items of their own node.
+std::vector<size_t> split_by_numa_node(const size_t count);
+
+// Spread the pages of the `num_bytes` at `data` round-robin over all nodes
+bool interleave_on_numa_nodes(const void* const data, const size_t num_bytes);
+// Place the pages of the `num_bytes` at `data` on `node`
+bool move_to_numa_node(const void* const data, const size_t num_bytes, const int node);
+// Place the `count` items of `item_size` bytes at `data` on the nodes as split by `split_by_numa_node`
+bool split_over_numa_nodes(const void* const data, const size_t count, const size_t item_size);
+// Node of the page at `address`, which is touched if it is not in memory yet, or -1 if unknown
+int get_numa_node_of_address(const void* const address);
+
+// Whether the training places its arrays on the NUMA nodes (`--numa`)
+void set_numa_placement(const bool is_enabled);
+bool is_numa_placement_enabled();
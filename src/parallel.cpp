@@ -0,0 +1,434 @@
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+
+#if defined(__linux__)
+  #include <sched.h>
+  #include <pthread.h>
+#endif
+
+#if defined(_OPENMP)
+  #include <omp.h>
+#endif
+
+#include "parallel.hpp"
+#include "trace.hpp"
+
+
+#define POOL_TASKS_PER_THREAD 16  // Tasks per thread of the thread pool unless the grain size is set
+#define POOL_SPIN_ITERATIONS 4096  // Polls of an idle worker for the next loop before it sleeps
+
+
+static ParallelSettings default_parallel_settings = {ParallelBackend::OPENMP_BACKEND, 0, {}, 0};
+static thread_local bool is_inside_parallel_for = false;
+
+
+void set_default_parallel_settings(const ParallelSettings& settings)
+{
+  if (settings.backend != ParallelBackend::DEFAULT_PARALLEL_BACKEND && settings.backend != ParallelBackend::OPENMP_BACKEND && settings.backend != ParallelBackend::THREAD_POOL_BACKEND)
+    std::__throw_invalid_argument("The parallel backend must be 0 (OpenMP) or 1 (thread pool)");
+  if (settings.num_threads < 0)
+    std::__throw_invalid_argument("The number of threads must not be negative");
+  for (const int cpu : settings.cpus)
+  {
+    if (cpu < 0)
+      std::__throw_invalid_argument("CPU numbers must not be negative");
+  }
+  default_parallel_settings = resolve_parallel_settings(settings);
+}
+
+
+ParallelSettings resolve_parallel_settings(const ParallelSettings& settings)
+{
+  ParallelSettings result = settings;
+  if (result.backend == ParallelBackend::DEFAULT_PARALLEL_BACKEND)
+    result.backend = default_parallel_settings.backend;
+  if (result.num_threads <= 0)
+    result.num_threads = default_parallel_settings.num_threads;
+  if (result.num_threads <= 0)
+  {
+    #if defined(_OPENMP)
+    result.num_threads = omp_get_max_threads();
+    #else
+    result.num_threads = 1;
+    #endif
+  }
+  if (result.cpus.empty())
+    result.cpus = default_parallel_settings.cpus;
+  if (result.grain_size == 0)
+    result.grain_size = default_parallel_settings.grain_size;
+  return result;
+}
+
+
+int get_num_parallel_threads(const ParallelSettings& settings)
+{
+  return resolve_parallel_settings(settings).num_threads;
+}
+
+
+// Pins the calling thread to one CPU of `cpus` until destruction, if `cpus` is not empty
+class AffinityScope
+{
+public:
+  AffinityScope(const std::vector<int>& cpus, const int thread) :
+    is_pinned(false)
+  {
+    #if defined(__linux__)
+    if (cpus.empty() || pthread_getaffinity_np(pthread_self(), sizeof(this->previous), &this->previous) != 0)
+      return;
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(cpus[thread % cpus.size()], &cpu_set);
+    this->is_pinned = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) == 0;
+    if (!this->is_pinned && !has_warned.exchange(true))
+      std::cerr << "WARNING: Unable to pin a thread to CPU " << cpus[thread % cpus.size()] << std::endl;
+    #else
+    (void) cpus;
+    (void) thread;
+    #endif
+  }
+
+  ~AffinityScope()
+  {
+    #if defined(__linux__)
+    if (this->is_pinned)
+      pthread_setaffinity_np(pthread_self(), sizeof(this->previous), &this->previous);
+    #endif
+  }
+
+private:
+  bool is_pinned;
+  #if defined(__linux__)
+  cpu_set_t previous;
+  #endif
+  static std::atomic<bool> has_warned;
+};
+
+std::atomic<bool> AffinityScope::has_warned(false);
+
+
+// Iterations [next, end) that one thread of the pool has yet to run. The owner takes tasks from the
+// front, and idle threads steal half of the rest from the back.
+struct alignas(64) WorkRange
+{
+  std::mutex mutex;
+  size_t next = 0;
+  size_t end = 0;
+};
+
+
+// One `parallel_for` on the thread pool
+struct PoolLoop
+{
+  PoolLoop(const int num_threads) :
+    ranges(num_threads)
+  {}
+
+  const char* name;
+  const std::function<void(size_t, size_t, int)>* body;
+  const std::vector<int>* cpus;
+  size_t grain_size;
+  std::vector<WorkRange> ranges;  // One per thread
+  std::atomic<int> num_running_workers;
+  std::atomic<bool> has_failed;
+  std::mutex error_mutex;
+  std::exception_ptr error;
+};
+
+
+static bool take_task(WorkRange& range, const size_t grain_size, size_t& first, size_t& end)
+{
+  std::unique_lock<std::mutex> lock(range.mutex);
+  if (range.next >= range.end)
+    return false;
+  first = range.next;
+  end = std::min(range.end, first + grain_size);
+  range.next = end;
+  return true;
+}
+
+
+// Move half of the remaining iterations of another thread to the empty range of `thread`
+static bool steal_tasks(PoolLoop& loop, const int thread)
+{
+  const int num_threads = static_cast<int>(loop.ranges.size());
+  for (int offset = 1; offset < num_threads; ++offset)
+  {
+    WorkRange& victim = loop.ranges[(thread + offset) % num_threads];
+    size_t first, end;
+    {
+      std::unique_lock<std::mutex> lock(victim.mutex);
+      const size_t num_remaining = victim.end - std::min(victim.next, victim.end);
+      if (num_remaining == 0)
+        continue;
+      const size_t num_stolen = num_remaining > loop.grain_size ? num_remaining / 2 : num_remaining;
+      end = victim.end;
+      first = end - num_stolen;
+      victim.end = first;
+    }
+    WorkRange& own = loop.ranges[thread];
+    std::unique_lock<std::mutex> lock(own.mutex);
+    own.next = first;
+    own.end = end;
+    return true;
+  }
+  return false;
+}
+
+
+static void run_pool_tasks(PoolLoop& loop, const int thread)
+{
+  AffinityScope affinity_scope(*loop.cpus, thread);
+  TraceScope trace_scope(loop.name);
+  is_inside_parallel_for = true;
+  WorkRange& own = loop.ranges[thread];
+  size_t first, end;
+  while (!loop.has_failed.load(std::memory_order_relaxed) && (take_task(own, loop.grain_size, first, end) || (steal_tasks(loop, thread) && take_task(own, loop.grain_size, first, end))))
+  {
+    try {
+      (*loop.body)(first, end, thread);
+    } catch (...) {
+      std::unique_lock<std::mutex> lock(loop.error_mutex);
+      if (!loop.error)
+        loop.error = std::current_exception();
+      loop.has_failed.store(true);
+    }
+  }
+  is_inside_parallel_for = false;
+}
+
+
+// Persistent worker threads, which join the thread calling `run` as threads 1, 2, ...
+class ThreadPool
+{
+public:
+  ThreadPool() :
+    loop(nullptr),
+    generation(0),
+    should_stop(false)
+  {}
+
+  ~ThreadPool()
+  {
+    {
+      std::unique_lock<std::mutex> lock(this->mutex);
+      this->should_stop = true;
+      this->generation.fetch_add(1);
+    }
+    this->loop_started.notify_all();
+    for (auto& worker : this->workers)
+      worker.join();
+  }
+
+  void run(PoolLoop& loop)
+  {
+    // Loops of several calling threads take turns
+    std::unique_lock<std::mutex> run_lock(this->run_mutex);
+    const int num_threads = static_cast<int>(loop.ranges.size());
+    loop.num_running_workers.store(num_threads - 1);
+    {
+      std::unique_lock<std::mutex> lock(this->mutex);
+      while (static_cast<int>(this->workers.size()) < num_threads - 1)
+        this->workers.emplace_back(&ThreadPool::work, this, static_cast<int>(this->workers.size()) + 1, this->generation.load());
+      this->loop = &loop;
+      this->generation.fetch_add(1, std::memory_order_release);
+    }
+    this->loop_started.notify_all();
+
+    run_pool_tasks(loop, 0);
+
+    for (int i = 0; i < POOL_SPIN_ITERATIONS && loop.num_running_workers.load(std::memory_order_acquire) > 0; ++i)
+      std::this_thread::yield();
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->loop_finished.wait(lock, [&]() { return loop.num_running_workers.load(std::memory_order_acquire) == 0; });
+    this->loop = nullptr;
+  }
+
+private:
+  void work(const int thread, uint64_t seen_generation)
+  {
+    while (true)
+    {
+      // Poll for a while, since the training runs many short loops back to back
+      for (int i = 0; i < POOL_SPIN_ITERATIONS && this->generation.load(std::memory_order_acquire) == seen_generation; ++i)
+        std::this_thread::yield();
+
+      PoolLoop* loop;
+      {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->loop_started.wait(lock, [&]() { return this->generation.load() != seen_generation; });
+        seen_generation = this->generation.load();
+        if (this->should_stop)
+          return;
+        loop = this->loop;
+      }
+      if (!loop || thread >= static_cast<int>(loop->ranges.size()))
+        continue;
+
+      run_pool_tasks(*loop, thread);
+      if (loop->num_running_workers.fetch_sub(1, std::memory_order_acq_rel) == 1)
+      {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->loop_finished.notify_all();
+      }
+    }
+  }
+
+  std::vector<std::thread> workers;
+  PoolLoop* loop;
+  std::atomic<uint64_t> generation;
+  bool should_stop;
+  std::mutex mutex;
+  std::mutex run_mutex;
+  std::condition_variable loop_started;
+  std::condition_variable loop_finished;
+};
+
+
+static void run_on_thread_pool(
+  const char* name,
+  const size_t begin,
+  const size_t end,
+  const std::function<void(size_t, size_t, int)>& body,
+  const ParallelSettings& settings
+)
+{
+  static ThreadPool thread_pool;
+
+  const size_t num_iterations = end - begin;
+  const int num_threads = static_cast<int>(std::min<size_t>(settings.num_threads, num_iterations));
+  PoolLoop loop(num_threads);
+  loop.name = name;
+  loop.body = &body;
+  loop.cpus = &settings.cpus;
+  loop.grain_size = settings.grain_size > 0 ? settings.grain_size : std::max<size_t>(1, num_iterations / (POOL_TASKS_PER_THREAD * num_threads));
+  loop.has_failed.store(false);
+  // Like a static schedule, every thread starts on its own contiguous block
+  for (int thread = 0; thread < num_threads; ++thread)
+  {
+    loop.ranges[thread].next = begin + num_iterations * thread / num_threads;
+    loop.ranges[thread].end = begin + num_iterations * (thread + 1) / num_threads;
+  }
+
+  thread_pool.run(loop);
+  if (loop.error)
+    std::rethrow_exception(loop.error);
+}
+
+
+static void run_on_openmp(
+  const char* name,
+  const size_t begin,
+  const size_t end,
+  const std::function<void(size_t, size_t, int)>& body,
+  const ParallelSettings& settings
+)
+{
+  const size_t num_iterations = end - begin;
+  std::exception_ptr error;
+
+  #pragma omp parallel num_threads(settings.num_threads)
+  {
+    #if defined(_OPENMP)
+    const int thread = omp_get_thread_num();
+    const int num_threads = omp_get_num_threads();
+    #else
+    const int thread = 0;
+    const int num_threads = 1;
+    #endif
+    AffinityScope affinity_scope(settings.cpus, thread);
+    TraceScope trace_scope(name);
+    is_inside_parallel_for = true;
+    const size_t first = begin + num_iterations * thread / num_threads;
+    const size_t last = begin + num_iterations * (thread + 1) / num_threads;
+    try {
+      if (first < last)
+        body(first, last, thread);
+    } catch (...) {
+      #pragma omp critical
+      {
+        if (!error)
+          error = std::current_exception();
+      }
+    }
+    is_inside_parallel_for = false;
+  }
+
+  if (error)
+    std::rethrow_exception(error);
+}
+
+
+void parallel_for(
+  const char* name,
+  const size_t begin,
+  const size_t end,
+  const std::function<void(size_t, size_t, int)>& body,
+  const ParallelSettings& settings
+)
+{
+  if (begin >= end)
+    return;
+
+  #if defined(_OPENMP)
+  const bool is_nested = is_inside_parallel_for || omp_in_parallel();
+  #else
+  const bool is_nested = is_inside_parallel_for;
+  #endif
+  const ParallelSettings resolved = resolve_parallel_settings(settings);
+  if (is_nested || resolved.num_threads == 1)
+  {
+    // Affinity and tracing as for a parallel loop, but without starting any thread
+    if (is_nested)
+    {
+      body(begin, end, 0);
+      return;
+    }
+    AffinityScope affinity_scope(resolved.cpus, 0);
+    TraceScope trace_scope(name);
+    is_inside_parallel_for = true;
+    try {
+      body(begin, end, 0);
+    } catch (...) {
+      is_inside_parallel_for = false;
+      throw;
+    }
+    is_inside_parallel_for = false;
+    return;
+  }
+
+  if (resolved.backend == ParallelBackend::THREAD_POOL_BACKEND)
+    run_on_thread_pool(name, begin, end, body, resolved);
+  else
+    run_on_openmp(name, begin, end, body, resolved);
+}
+
+
+std::vector<int> parse_cpu_list(const std::string& text)
+{
+  std::vector<int> cpus;
+  std::stringstream stream(text);
+  std::string item;
+  while (std::getline(stream, item, ','))
+  {
+    if (item.empty())
+      continue;
+    const size_t dash = item.find('-');
+    try {
+      const int first = std::stoi(item.substr(0, dash));
+      const int last = dash == std::string::npos ? first : std::stoi(item.substr(dash + 1));
+      if (first < 0 || last < first)
+        std::__throw_invalid_argument("");
+      for (int cpu = first; cpu <= last; ++cpu)
+        cpus.push_back(cpu);
+    } catch (const std::logic_error&) {
+      std::__throw_invalid_argument(("Invalid CPU list '" + text + "', expected e.g. 0-3,8").c_str());
+    }
+  }
+  return cpus;
+}
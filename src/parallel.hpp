@@ -0,0 +1,51 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <functional>
+#include "data.hpp"
+
+
+// Implementation of `parallel_for`
+enum ParallelBackend
+{
+  DEFAULT_PARALLEL_BACKEND=-1,  // The process-wide default
+  OPENMP_BACKEND=0,             // One contiguous range per OpenMP thread, like `#pragma omp for schedule(static)`
+  THREAD_POOL_BACKEND=1         // Tasks of `grain_size` iterations on a work-stealing pool of threads owned by smap
+};
+
+
+// Settings of a parallel loop, where unset members take the process-wide default
+// of `set_default_parallel_settings`
+struct ParallelSettings
+{
+  ParallelBackend backend = ParallelBackend::DEFAULT_PARALLEL_BACKEND;
+  int num_threads = 0;         // 0: as many threads as the OpenMP runtime (OMP_NUM_THREADS)
+  std::vector<int> cpus = {};  // Thread k runs on CPU cpus[k % cpus.size()]; empty: the affinity of the process
+  size_t grain_size = 0;       // Iterations per task of the thread pool; 0: about 16 tasks per thread
+};
+
+
+// The default of all loops that leave members of their settings unset, e.g. from the command line.
+// Only call this while no loop runs.
+void set_default_parallel_settings(const ParallelSettings& settings);
+// `settings` with all unset members replaced by the process-wide default
+ParallelSettings resolve_parallel_settings(const ParallelSettings& settings = ParallelSettings());
+// Number of distinct thread indices that `parallel_for` passes to its body
+int get_num_parallel_threads(const ParallelSettings& settings = ParallelSettings());
+
+// Call `body(first, end, thread)` on disjoint ranges that cover [begin, end), and return once all
+// calls have ended. Calls with the same `thread` in [0, get_num_parallel_threads(settings)) never run
+// concurrently, so the body can use per-thread buffers. Every thread records a trace event `name`,
+// which must be a string literal. Loops within a body or an OpenMP parallel region run sequentially
+// as thread 0. The first exception of a body is rethrown once all running calls have ended.
+void parallel_for(
+  const char* name,
+  const size_t begin,
+  const size_t end,
+  const std::function<void(size_t, size_t, int)>& body,
+  const ParallelSettings& settings = ParallelSettings()
+);
+
+// Parse a list of CPUs like "0-3,8,10-11"
+std::vector<int> parse_cpu_list(const std::string& text);
@@ -0,0 +1,151 @@
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+
+#if defined(__linux__)
+  #include <sys/syscall.h>
+  #include <sys/ioctl.h>
+  #include <linux/perf_event.h>
+#endif
+
+#if defined(_OPENMP)
+  #include <omp.h>
+#endif
+
+#include "perf.hpp"
+
+
+#if defined(__linux__)
+static int open_counter(PerfCounter counter)
+{
+  perf_event_attr attr;
+  std::memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.disabled = 0;
+  attr.exclude_kernel = 1;  // Allowed for unprivileged users with perf_event_paranoid <= 2
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+  switch (counter)
+  {
+  case PerfCounter::CYCLES:
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    break;
+  case PerfCounter::INSTRUCTIONS:
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    break;
+  case PerfCounter::LLC_MISSES:
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    break;
+  case PerfCounter::DTLB_MISSES:
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    break;
+  default:
+    return -1;
+  }
+
+  // Count the calling thread on any CPU
+  return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+}
+#endif
+
+
+PerfCounters::PerfCounters() :
+  num_threads(0),
+  available{false, false, false, false}
+{}
+
+
+PerfCounters::~PerfCounters()
+{
+  this->close();
+}
+
+
+bool PerfCounters::open()
+{
+  this->close();
+
+  #if defined(__linux__)
+    #if defined(_OPENMP)
+    this->num_threads = omp_get_max_threads();
+    #else
+    this->num_threads = 1;
+    #endif
+    this->file_descriptors.assign(this->num_threads * PerfCounter::NUM_PERF_COUNTERS, -1);
+
+    // Every thread has to open its own counters, since they are bound to the calling thread
+    #pragma omp parallel num_threads(this->num_threads)
+    {
+      #if defined(_OPENMP)
+      const int thread = omp_get_thread_num();
+      #else
+      const int thread = 0;
+      #endif
+      for (int counter = 0; counter < PerfCounter::NUM_PERF_COUNTERS; ++counter)
+        this->file_descriptors[thread * PerfCounter::NUM_PERF_COUNTERS + counter] = open_counter(static_cast<PerfCounter>(counter));
+    }
+    const int open_errno = errno;
+
+    bool any_available = false;
+    for (int counter = 0; counter < PerfCounter::NUM_PERF_COUNTERS; ++counter)
+    {
+      this->available[counter] = true;
+      for (int thread = 0; thread < this->num_threads; ++thread)
+        this->available[counter] &= this->file_descriptors[thread * PerfCounter::NUM_PERF_COUNTERS + counter] >= 0;
+      any_available |= this->available[counter];
+    }
+
+    if (!any_available)
+    {
+      this->error = std::string("perf_event_open failed: ") + std::strerror(open_errno);
+      if (open_errno == EACCES || open_errno == EPERM)
+        this->error += " (check /proc/sys/kernel/perf_event_paranoid)";
+      this->close();
+    }
+    return any_available;
+  #else
+    this->error = "Performance counters are only supported on Linux";
+    return false;
+  #endif
+}
+
+
+void PerfCounters::close()
+{
+  for (int file_descriptor : this->file_descriptors)
+  {
+    if (file_descriptor >= 0)
+      ::close(file_descriptor);
+  }
+  this->file_descriptors.clear();
+  for (int counter = 0; counter < PerfCounter::NUM_PERF_COUNTERS; ++counter)
+    this->available[counter] = false;
+}
+
+
+PerfCounterValues PerfCounters::read() const
+{
+  PerfCounterValues result;
+  for (int counter = 0; counter < PerfCounter::NUM_PERF_COUNTERS; ++counter)
+  {
+    if (!this->available[counter])
+      continue;
+    for (int thread = 0; thread < this->num_threads; ++thread)
+    {
+      // Value, time enabled, time running
+      uint64_t buffer[3];
+      const int file_descriptor = this->file_descriptors[thread * PerfCounter::NUM_PERF_COUNTERS + counter];
+      if (::read(file_descriptor, buffer, sizeof(buffer)) != sizeof(buffer))
+        continue;
+      if (buffer[2] > 0 && buffer[2] < buffer[1])
+        buffer[0] = static_cast<uint64_t>(static_cast<Double>(buffer[0]) * buffer[1] / buffer[2]);
+      result.values[counter] += buffer[0];
+    }
+  }
+  return result;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "data.hpp"
+
+
+enum PerfCounter
+{
+  CYCLES=0, INSTRUCTIONS=1, LLC_MISSES=2, DTLB_MISSES=3, NUM_PERF_COUNTERS=4
+};
+
+inline std::string get_perf_counter_string(PerfCounter counter)
+{
+  switch (counter)
+  {
+  case PerfCounter::CYCLES:
+    return "Cycles";
+  case PerfCounter::INSTRUCTIONS:
+    return "Instructions";
+  case PerfCounter::LLC_MISSES:
+    return "LLCMisses";
+  case PerfCounter::DTLB_MISSES:
+    return "DTLBMisses";
+  default:
+    return "UNKNOWN";
+  }
+}
+
+
+struct PerfCounterValues
+{
+  uint64_t values[PerfCounter::NUM_PERF_COUNTERS] = {0, 0, 0, 0};
+};
+
+
+// Linux hardware performance counters (perf_event_open) for every OpenMP thread.
+// Counters that the kernel or the CPU does not provide are not available, and the profiles show them as NA.
+class PerfCounters
+{
+public:
+  PerfCounters();
+  ~PerfCounters();
+
+  // Open the counters on all threads; returns false if no counter is available
+  bool open();
+  void close();
+
+  inline bool is_available(PerfCounter counter) const {
+    return this->available[counter];
+  }
+  inline const std::string& get_error() const {
+    return this->error;
+  }
+
+  // Sum of the current counts of all threads, scaled for time multiplexing.
+  // The scaled counts are estimates, so a later read may return less than an earlier one.
+  PerfCounterValues read() const;
+
+private:
+  int num_threads;
+  std::vector<int> file_descriptors;  // One per thread and counter
+  bool available[PerfCounter::NUM_PERF_COUNTERS];
+  std::string error;
+};
@@ -0,0 +1,344 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <assert.h>
+#include "profile.hpp"
+#include "utils.hpp"
+#include "trace.hpp"
+#include "telemetry.hpp"
+
+
+HierarchicalTimer::HierarchicalTimer() :
+  current(-1)
+{}
+
+
+int HierarchicalTimer::find_child(int parent, const std::string& name) const
+{
+  for (size_t i = 0; i < this->sections.size(); ++i)
+  {
+    if (this->sections[i].parent == parent && this->sections[i].name == name)
+      return i;
+  }
+  return -1;
+}
+
+
+void HierarchicalTimer::start(const std::string& name)
+{
+  int section = this->find_child(this->current, name);
+  if (section < 0)
+  {
+    this->sections.push_back({name, this->current, 0, 0, 0});
+    section = this->sections.size() - 1;
+  }
+  this->sections[section].start_ns = get_nanoseconds();
+  this->current = section;
+}
+
+
+void HierarchicalTimer::stop()
+{
+  assert (this->current >= 0);
+  auto& section = this->sections[this->current];
+  section.total_ns += get_nanoseconds() - section.start_ns;
+  section.num_calls += 1;
+  this->current = section.parent;
+}
+
+
+int64_t HierarchicalTimer::get_total_ns(const std::string& path) const
+{
+  int section = -1;
+  std::stringstream stream(path);
+  std::string name;
+  while (std::getline(stream, name, '/'))
+  {
+    section = this->find_child(section, name);
+    if (section < 0)
+      return 0;
+  }
+  return section < 0 ? 0 : this->sections[section].total_ns;
+}
+
+
+int64_t HierarchicalTimer::get_child_total_ns(const std::string& name) const
+{
+  const int section = this->find_child(this->current, name);
+  return section < 0 ? 0 : this->sections[section].total_ns;
+}
+
+
+void HierarchicalTimer::print(std::ostream& os) const
+{
+  for (size_t i = 0; i < this->sections.size(); ++i)
+  {
+    if (this->sections[i].parent < 0)
+      this->print(os, i, 0);
+  }
+}
+
+
+void HierarchicalTimer::print(std::ostream& os, int section, int depth) const
+{
+  const auto& s = this->sections[section];
+  const int64_t parent_ns = s.parent < 0 ? s.total_ns : this->sections[s.parent].total_ns;
+  os << std::string(2 * depth, ' ') << "- " << s.name << ": "
+     << std::fixed << std::setprecision(3) << s.total_ns * 1e-9 << "s"
+     << " (" << std::setprecision(1) << (parent_ns > 0 ? 100. * s.total_ns / parent_ns : 100.) << "%"
+     << ", " << s.num_calls << " calls)" << std::endl;
+  for (size_t i = 0; i < this->sections.size(); ++i)
+  {
+    if (this->sections[i].parent == section)
+      this->print(os, i, depth + 1);
+  }
+}
+
+
+TrainingProfiler::TrainingProfiler(
+    HierarchicalTimer& timer,
+    std::ofstream* timing_log_stream,
+    const PerfCounters* perf_counters,
+    std::ofstream* perf_log_stream,
+    Telemetry* telemetry,
+    const std::string& telemetry_name
+  ) :
+  timer(timer),
+  timing_log_stream(timing_log_stream),
+  epoch(0),
+  epoch_start_ns(0),
+  num_rows(0),
+  num_non_zero(0),
+  has_weights(false),
+  num_cells(0),
+  input_dim(0),
+  perf_counters(perf_counters),
+  perf_log_stream(perf_log_stream),
+  current_phase(TrainingPhase::NUM_TRAINING_PHASES),
+  phase_start_ns(0),
+  total_rows{0, 0, 0, 0, 0, 0},
+  telemetry(telemetry),
+  telemetry_name(telemetry_name)
+{}
+
+
+void TrainingProfiler::begin_training(const BinarySparseMatrix& data, CellIndexType num_cells, IndexType input_dim, bool write_header)
+{
+  this->num_rows = data.num_rows;
+  this->num_non_zero = data.num_non_zero;
+  this->has_weights = data.has_weights();
+  this->num_cells = num_cells;
+  this->input_dim = input_dim;
+
+  if (this->timing_log_stream && write_header)
+  {
+    *this->timing_log_stream << "Epoch\tEpochNs";
+    for (int phase = 0; phase < TrainingPhase::NUM_TRAINING_PHASES; ++phase)
+      *this->timing_log_stream << "\t" << get_training_phase_string(static_cast<TrainingPhase>(phase)) << "Ns";
+    *this->timing_log_stream << "\tRowsPerSecond\tEstimatedBandwidthGBs" << std::endl;
+  }
+  if (this->perf_counters && this->perf_log_stream && write_header)
+  {
+    *this->perf_log_stream << "Epoch\tPhase";
+    for (int counter = 0; counter < PerfCounter::NUM_PERF_COUNTERS; ++counter)
+      *this->perf_log_stream << "\t" << get_perf_counter_string(static_cast<PerfCounter>(counter));
+    *this->perf_log_stream << "\tInstructionsPerCycle\tLLCMissesPerRow\tDTLBMissesPerRow" << std::endl;
+  }
+  if (this->telemetry)
+    this->telemetry->begin_training(this->telemetry_name, this->num_rows);
+  this->timer.start("train");
+}
+
+
+void TrainingProfiler::begin_epoch(unsigned int epoch)
+{
+  this->epoch = epoch;
+  this->timer.start("epoch");
+  for (int phase = 0; phase < TrainingPhase::NUM_TRAINING_PHASES; ++phase)
+    this->phase_start_total_ns[phase] = this->timer.get_child_total_ns(get_training_phase_string(static_cast<TrainingPhase>(phase)));
+  for (auto& values : this->epoch_values)
+    values = PerfCounterValues();
+  if (this->telemetry)
+    this->telemetry->begin_epoch(this->telemetry_name, epoch);
+  this->epoch_start_ns = get_nanoseconds();
+}
+
+
+void TrainingProfiler::begin_phase(TrainingPhase phase)
+{
+  this->timer.start(get_training_phase_string(phase));
+  this->current_phase = phase;
+  if (this->telemetry)
+    this->telemetry->begin_phase(this->telemetry_name, phase);
+  if (this->perf_counters)
+    this->phase_start_values = this->perf_counters->read();
+  this->phase_start_ns = get_nanoseconds();
+}
+
+
+void TrainingProfiler::end_phase()
+{
+  if (is_tracing_enabled())
+    record_trace_event(get_training_phase_string(this->current_phase), this->phase_start_ns, get_nanoseconds());
+  if (this->perf_counters)
+  {
+    const PerfCounterValues end_values = this->perf_counters->read();
+    for (int counter = 0; counter < PerfCounter::NUM_PERF_COUNTERS; ++counter)
+    {
+      // The estimates of multiplexed counters can decrease, which must not wrap around
+      const uint64_t start = this->phase_start_values.values[counter];
+      const uint64_t delta = end_values.values[counter] > start ? end_values.values[counter] - start : 0;
+      this->epoch_values[this->current_phase].values[counter] += delta;
+      this->total_values[this->current_phase].values[counter] += delta;
+    }
+    this->total_rows[this->current_phase] += this->num_rows;
+  }
+  if (this->telemetry)
+    this->telemetry->end_phase(this->telemetry_name);
+  this->current_phase = TrainingPhase::NUM_TRAINING_PHASES;
+  this->timer.stop();
+}
+
+
+void TrainingProfiler::end_epoch()
+{
+  const int64_t epoch_ns = get_nanoseconds() - this->epoch_start_ns;
+  if (is_tracing_enabled())
+    record_trace_event("Epoch", this->epoch_start_ns, this->epoch_start_ns + epoch_ns);
+  int64_t phase_ns[TrainingPhase::NUM_TRAINING_PHASES];
+  for (int phase = 0; phase < TrainingPhase::NUM_TRAINING_PHASES; ++phase)
+  {
+    const int64_t total_ns = this->timer.get_child_total_ns(get_training_phase_string(static_cast<TrainingPhase>(phase)));
+    phase_ns[phase] = total_ns - this->phase_start_total_ns[phase];
+  }
+  if (this->telemetry)
+    this->telemetry->end_epoch(this->telemetry_name, epoch_ns, phase_ns);
+  if (this->timing_log_stream)
+  {
+    const Double epoch_seconds = std::max<Double>(epoch_ns * 1e-9, 1e-9);
+    *this->timing_log_stream << this->epoch - 1 << "\t" << epoch_ns;
+    for (int phase = 0; phase < TrainingPhase::NUM_TRAINING_PHASES; ++phase)
+      *this->timing_log_stream << "\t" << phase_ns[phase];
+    const Double traffic_bytes =
+      (phase_ns[TrainingPhase::BEST_MATCHING_UNITS] > 0 ? this->estimated_search_traffic_bytes() : 0.) +
+      (phase_ns[TrainingPhase::BATCH_UPDATE] > 0 ? this->estimated_update_traffic_bytes() : 0.);
+    *this->timing_log_stream
+      << "\t" << this->num_rows / epoch_seconds
+      << "\t" << traffic_bytes / epoch_seconds * 1e-9
+      << std::endl;
+  }
+  if (this->perf_counters && this->perf_log_stream)
+  {
+    for (int phase = 0; phase < TrainingPhase::NUM_TRAINING_PHASES; ++phase)
+    {
+      *this->perf_log_stream << this->epoch - 1 << "\t" << get_training_phase_string(static_cast<TrainingPhase>(phase)) << "\t";
+      this->print_perf_values(*this->perf_log_stream, this->epoch_values[phase], this->num_rows, "\t");
+      *this->perf_log_stream << std::endl;
+    }
+  }
+  this->timer.stop();
+}
+
+
+void TrainingProfiler::end_training()
+{
+  if (this->telemetry)
+    this->telemetry->end_training(this->telemetry_name);
+  this->timer.stop();
+}
+
+
+void TrainingProfiler::record_errors(
+  const unsigned int num_epochs,
+  const Float radius_min,
+  const Float radius_max,
+  const Float quantization_error,
+  const Float topographic_error,
+  const Float gap_error,
+  const Float diffusion_error
+)
+{
+  if (this->telemetry)
+    this->telemetry->record_errors(
+      this->telemetry_name, num_epochs, radius_min, radius_max, quantization_error, topographic_error, gap_error, diffusion_error
+    );
+}
+
+
+void TrainingProfiler::print_perf_values(std::ostream& os, const PerfCounterValues& values, const Double num_rows, const std::string& separator) const
+{
+  // Unavailable counters are written as "NA" instead of zero
+  for (int counter = 0; counter < PerfCounter::NUM_PERF_COUNTERS; ++counter)
+  {
+    if (this->perf_counters->is_available(static_cast<PerfCounter>(counter)))
+      os << values.values[counter] << separator;
+    else
+      os << "NA" << separator;
+  }
+
+  const uint64_t cycles = values.values[PerfCounter::CYCLES];
+  const bool has_ipc = this->perf_counters->is_available(PerfCounter::CYCLES) && this->perf_counters->is_available(PerfCounter::INSTRUCTIONS) && cycles > 0;
+  if (has_ipc)
+    os << static_cast<Double>(values.values[PerfCounter::INSTRUCTIONS]) / cycles << separator;
+  else
+    os << "NA" << separator;
+
+  for (auto counter : {PerfCounter::LLC_MISSES, PerfCounter::DTLB_MISSES})
+  {
+    if (this->perf_counters->is_available(counter) && num_rows > 0)
+      os << values.values[counter] / num_rows;
+    else
+      os << "NA";
+    if (counter != PerfCounter::DTLB_MISSES)
+      os << separator;
+  }
+}
+
+
+void TrainingProfiler::print_perf_summary(std::ostream& os) const
+{
+  if (!this->perf_counters)
+    return;
+
+  os << std::fixed << std::setprecision(3);
+  os << "| Phase | ";
+  for (int counter = 0; counter < PerfCounter::NUM_PERF_COUNTERS; ++counter)
+    os << get_perf_counter_string(static_cast<PerfCounter>(counter)) << " | ";
+  os << "InstructionsPerCycle | LLCMissesPerRow | DTLBMissesPerRow |" << std::endl
+     << "|---|---|---|---|---|---|---|---|" << std::endl;
+  for (int phase = 0; phase < TrainingPhase::NUM_TRAINING_PHASES; ++phase)
+  {
+    os << "| " << get_training_phase_string(static_cast<TrainingPhase>(phase)) << " | ";
+    this->print_perf_values(os, this->total_values[phase], this->total_rows[phase], " | ");
+    os << " |" << std::endl;
+  }
+}
+
+
+// The traffic estimates are rough lower bounds of the bytes streamed from memory,
+// assuming that neither the corpus nor the codebook fit into the last level cache.
+
+Double TrainingProfiler::estimated_corpus_bytes() const
+{
+  const Double row_bytes = sizeof(IndexPointerType) + sizeof(IndexType);  // Index pointer and sum of squares
+  const Double token_bytes = sizeof(IndexType) + (this->has_weights ? sizeof(WeightType) : 0);
+  return this->num_rows * row_bytes + this->num_non_zero * token_bytes;
+}
+
+
+Double TrainingProfiler::estimated_search_traffic_bytes() const
+{
+  // The best matching unit search streams the corpus and the (best and next best) units and
+  // distances once per cell, and gathers one codebook value per token
+  const Double codebook_bytes = static_cast<Double>(this->num_cells) * this->input_dim * sizeof(Float);
+  const Double results_bytes = this->num_rows * 2 * (sizeof(CellIndexType) + sizeof(Float));
+  return this->num_cells * (this->estimated_corpus_bytes() + results_bytes + this->num_non_zero * sizeof(Float)) + codebook_bytes;
+}
+
+
+Double TrainingProfiler::estimated_update_traffic_bytes() const
+{
+  // The batch update streams the corpus and best matching units once per cell, and writes the codebook
+  const Double codebook_bytes = static_cast<Double>(this->num_cells) * this->input_dim * sizeof(Float);
+  return this->num_cells * (this->estimated_corpus_bytes() + this->num_rows * sizeof(CellIndexType)) + codebook_bytes;
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include "data.hpp"
+#include "perf.hpp"
+
+
+class Telemetry;
+
+
+enum TrainingPhase
+{
+  BEST_MATCHING_UNITS=0, DEAD_CELLS=1, ERROR_METRICS=2, SNAPSHOT_IO=3, BATCH_UPDATE=4, NEIGHBOURHOOD_UPDATE=5, NUM_TRAINING_PHASES=6
+};
+
+inline const char* get_training_phase_string(TrainingPhase phase)
+{
+  switch (phase)
+  {
+  case TrainingPhase::BEST_MATCHING_UNITS:
+    return "BestMatchingUnits";
+  case TrainingPhase::DEAD_CELLS:
+    return "DeadCells";
+  case TrainingPhase::ERROR_METRICS:
+    return "ErrorMetrics";
+  case TrainingPhase::SNAPSHOT_IO:
+    return "SnapshotIO";
+  case TrainingPhase::BATCH_UPDATE:
+    return "BatchUpdate";
+  case TrainingPhase::NEIGHBOURHOOD_UPDATE:
+    return "NeighbourhoodUpdate";
+  default:
+    return "UNKNOWN";
+  }
+}
+
+
+// Nanosecond resolution timer for nested, named sections.
+// Sections started while another section is running become its children,
+// so the same name can appear in different branches of the tree.
+class HierarchicalTimer
+{
+public:
+  struct Section
+  {
+    std::string name;
+    int parent;
+    int64_t total_ns;
+    int64_t start_ns;
+    uint64_t num_calls;
+  };
+
+  HierarchicalTimer();
+
+  void start(const std::string& name);
+  void stop();
+
+  // Total time of the section with the given '/'-separated path, e.g. "train/epoch"
+  int64_t get_total_ns(const std::string& path) const;
+  // Total time of a direct child of the currently running section
+  int64_t get_child_total_ns(const std::string& name) const;
+
+  void print(std::ostream& os) const;
+
+private:
+  int find_child(int parent, const std::string& name) const;
+  void print(std::ostream& os, int section, int depth) const;
+
+  std::vector<Section> sections;
+  int current;
+};
+
+
+// Collects per-phase measurements of `train()` and writes one line per epoch to a timing log.
+// If performance counters are given, it also writes one line per epoch and phase to a perf log.
+// If telemetry is given, it reports the progress as the map `telemetry_name`.
+class TrainingProfiler
+{
+public:
+  TrainingProfiler(
+    HierarchicalTimer& timer,
+    std::ofstream* timing_log_stream = nullptr,
+    const PerfCounters* perf_counters = nullptr,
+    std::ofstream* perf_log_stream = nullptr,
+    Telemetry* telemetry = nullptr,
+    const std::string& telemetry_name = ""
+  );
+
+  void begin_training(const BinarySparseMatrix& data, CellIndexType num_cells, IndexType input_dim, bool write_header = true);
+  void begin_epoch(unsigned int epoch);
+  void begin_phase(TrainingPhase phase);
+  void end_phase();
+  void end_epoch();
+  void end_training();
+  // Report the error metrics and radii of the epoch to the telemetry, before `end_epoch`
+  void record_errors(
+    const unsigned int num_epochs,
+    const Float radius_min,
+    const Float radius_max,
+    const Float quantization_error,
+    const Float topographic_error,
+    const Float gap_error,
+    const Float diffusion_error
+  );
+
+  // Counter totals, instructions per cycle and misses per row for each phase of the training
+  void print_perf_summary(std::ostream& os) const;
+
+private:
+  void print_perf_values(std::ostream& os, const PerfCounterValues& values, const Double num_rows, const std::string& separator) const;
+  Double estimated_corpus_bytes() const;
+  Double estimated_search_traffic_bytes() const;
+  Double estimated_update_traffic_bytes() const;
+
+  HierarchicalTimer& timer;
+  std::ofstream* timing_log_stream;
+  unsigned int epoch;
+  int64_t epoch_start_ns;
+  int64_t phase_start_total_ns[TrainingPhase::NUM_TRAINING_PHASES];
+  IndexPointerType num_rows;
+  IndexPointerType num_non_zero;
+  bool has_weights;
+  CellIndexType num_cells;
+  IndexType input_dim;
+
+  const PerfCounters* perf_counters;
+  std::ofstream* perf_log_stream;
+  TrainingPhase current_phase;
+  int64_t phase_start_ns;
+  PerfCounterValues phase_start_values;
+  PerfCounterValues epoch_values[TrainingPhase::NUM_TRAINING_PHASES];
+  PerfCounterValues total_values[TrainingPhase::NUM_TRAINING_PHASES];
+  uint64_t total_rows[TrainingPhase::NUM_TRAINING_PHASES];
+
+  Telemetry* telemetry;
+  std::string telemetry_name;
+};
+
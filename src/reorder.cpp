@@ -0,0 +1,277 @@
+#include <fstream>
+#include <numeric>
+#include <utility>
+#include <algorithm>
+#include <stdexcept>
+#include "reorder.hpp"
+#include "parallel.hpp"
+#include "checksum.hpp"
+
+
+const IndexType NO_TERM = MAX_INDEX_SIZE;
+
+
+// Terms in lists by their score, which moves a term up or down by one in constant time (the unit heap of Gorder)
+class ScoreBuckets
+{
+public:
+  ScoreBuckets(const IndexType num_terms, const size_t max_score) :
+    scores(num_terms, 0),
+    next(num_terms, NO_TERM),
+    previous(num_terms, NO_TERM),
+    heads(max_score + 1, NO_TERM),
+    top_score(0)
+  {}
+
+  // Add a term with score zero
+  void insert(const IndexType term)
+  {
+    this->scores[term] = 0;
+    this->link(term);
+  }
+
+  void remove(const IndexType term)
+  {
+    const IndexType score = this->scores[term];
+    if (this->previous[term] != NO_TERM)
+      this->next[this->previous[term]] = this->next[term];
+    else
+      this->heads[score] = this->next[term];
+    if (this->next[term] != NO_TERM)
+      this->previous[this->next[term]] = this->previous[term];
+  }
+
+  void increment(const IndexType term)
+  {
+    this->remove(term);
+    this->scores[term] += 1;
+    this->link(term);
+    this->top_score = std::max<size_t>(this->top_score, this->scores[term]);
+  }
+
+  void decrement(const IndexType term)
+  {
+    this->remove(term);
+    this->scores[term] -= 1;
+    this->link(term);
+  }
+
+  // The most recently raised term with the highest score, or `NO_TERM` if all scores are zero
+  IndexType get_top()
+  {
+    while (this->top_score > 0 && this->heads[this->top_score] == NO_TERM)
+      --this->top_score;
+    return this->top_score > 0 ? this->heads[this->top_score] : NO_TERM;
+  }
+
+private:
+  void link(const IndexType term)
+  {
+    const IndexType head = this->heads[this->scores[term]];
+    this->next[term] = head;
+    this->previous[term] = NO_TERM;
+    if (head != NO_TERM)
+      this->previous[head] = term;
+    this->heads[this->scores[term]] = term;
+  }
+
+  std::vector<IndexType> scores;
+  std::vector<IndexType> next;
+  std::vector<IndexType> previous;
+  std::vector<IndexType> heads;
+  size_t top_score;
+};
+
+
+std::vector<IndexType> compute_column_order(const BinarySparseMatrix& data, const ColumnOrderSettings& settings)
+{
+  const IndexType num_cols = data.num_cols;
+  if (settings.train_vocab_cutoff > num_cols)
+    std::__throw_invalid_argument("The vocabulary size is smaller than the training vocabulary cutoff.");
+  if (settings.window_size < 1 || settings.max_samples < 1)
+    std::__throw_invalid_argument("The window and the number of samples must be at least 1");
+
+  // Rows of every term, in the order of the corpus
+  std::vector<IndexPointerType> first_row_of_term(static_cast<size_t>(num_cols) + 1, 0);
+  for (IndexPointerType row = 0; row < data.num_rows; ++row)
+  {
+    const IndexType* const indices = data.indices_in_row(row);
+    for (IndexType i = 0; i < data.num_indices_in_row(row); ++i)
+      ++first_row_of_term[indices[i] + 1];
+  }
+  for (IndexType term = 0; term < num_cols; ++term)
+    first_row_of_term[term + 1] += first_row_of_term[term];
+  std::vector<IndexPointerType> rows_of_term(first_row_of_term[num_cols]);
+  std::vector<IndexPointerType> next_row_of_term(first_row_of_term.begin(), first_row_of_term.end() - 1);
+  for (IndexPointerType row = 0; row < data.num_rows; ++row)
+  {
+    const IndexType* const indices = data.indices_in_row(row);
+    for (IndexType i = 0; i < data.num_indices_in_row(row); ++i)
+      rows_of_term[next_row_of_term[indices[i]]++] = row;
+  }
+
+  std::vector<IndexType> new_columns(num_cols, NO_TERM);
+  ScoreBuckets buckets(num_cols, static_cast<size_t>(settings.window_size) * settings.max_samples);
+  std::vector<IndexType> window(settings.window_size, NO_TERM);
+  IndexType next_column = 0;
+  const IndexType bounds[3] = {0, settings.train_vocab_cutoff, num_cols};
+
+  for (int part = 0; part < 2; ++part)
+  {
+    const IndexType begin = bounds[part];
+    const IndexType end = bounds[part + 1];
+    for (IndexType term = begin; term < end; ++term)
+      buckets.insert(term);
+    std::fill(window.begin(), window.end(), NO_TERM);
+
+    // Raise or lower the scores of the unplaced terms in this part that co-occur with `term` in its sampled rows
+    auto update_scores = [&](const IndexType term, const bool is_increment) {
+      const uint64_t num_rows = first_row_of_term[term + 1] - first_row_of_term[term];
+      const uint64_t num_samples = std::min<uint64_t>(num_rows, settings.max_samples);
+      for (uint64_t sample = 0; sample < num_samples; ++sample)
+      {
+        const IndexPointerType row = rows_of_term[first_row_of_term[term] + sample * num_rows / num_samples];
+        const IndexType* const indices = data.indices_in_row(row);
+        for (IndexType i = 0; i < data.num_indices_in_row(row) && indices[i] < end; ++i)
+        {
+          const IndexType other = indices[i];
+          if (other < begin || new_columns[other] != NO_TERM)
+            continue;
+          if (is_increment)
+            buckets.increment(other);
+          else
+            buckets.decrement(other);
+        }
+      }
+    };
+
+    IndexType next_frequent_term = begin;
+    for (IndexType position = 0; position < end - begin; ++position)
+    {
+      IndexType term = buckets.get_top();
+      if (term == NO_TERM)
+      {
+        while (new_columns[next_frequent_term] != NO_TERM)
+          ++next_frequent_term;
+        term = next_frequent_term;
+      }
+      buckets.remove(term);
+      new_columns[term] = next_column++;
+
+      IndexType& slot = window[position % settings.window_size];
+      if (slot != NO_TERM)
+        update_scores(slot, false);
+      slot = term;
+      update_scores(term, true);
+    }
+  }
+  return new_columns;
+}
+
+
+std::vector<IndexType> invert_permutation(const std::vector<IndexType>& permutation)
+{
+  std::vector<IndexType> inverse(permutation.size(), NO_TERM);
+  for (size_t i = 0; i < permutation.size(); ++i)
+  {
+    if (permutation[i] >= permutation.size() || inverse[permutation[i]] != NO_TERM)
+      std::__throw_invalid_argument("Not a permutation");
+    inverse[permutation[i]] = static_cast<IndexType>(i);
+  }
+  return inverse;
+}
+
+
+void write_permuted_corpus(const std::string& filename, const BinarySparseMatrix& data, const std::vector<IndexType>& new_columns, const IndexType train_vocab_cutoff)
+{
+  if (new_columns.size() != data.num_cols)
+    std::__throw_invalid_argument("The permutation must have one entry per column");
+
+  std::ofstream file(filename, std::ios::binary);
+  if (!file.is_open())
+    std::__throw_runtime_error("Cannot write the reordered corpus");
+
+  // Versions 6 and 7 are versions 4 and 5 with the cutoff after the number of columns
+  write_uint8(file, data.has_weights() ? 6 : 7);
+  write_uint64(file, data.num_non_zero);
+  const uint32_t header[3] = {data.num_rows, data.num_cols, train_vocab_cutoff};
+  file.write((const char*) header, sizeof(header));
+
+  std::vector<std::pair<IndexType, WeightType>> entries;
+  std::vector<IndexType> indices;
+  std::vector<WeightType> weights;
+  for (IndexPointerType row = 0; row < data.num_rows; ++row)
+  {
+    const uint32_t row_length = data.num_indices_in_row(row);
+    entries.resize(row_length);
+    for (IndexType i = 0; i < row_length; ++i)
+      entries[i] = {new_columns[data.indices_in_row(row)[i]], data.has_weights() ? data.weights_in_row(row)[i] : WeightType(1)};
+    std::sort(entries.begin(), entries.end());
+
+    indices.resize(row_length);
+    weights.resize(row_length);
+    for (IndexType i = 0; i < row_length; ++i)
+    {
+      indices[i] = entries[i].first;
+      weights[i] = entries[i].second;
+    }
+    file.write((const char*) &row_length, sizeof(row_length));
+    file.write((const char*) indices.data(), row_length * sizeof(IndexType));
+    if (data.has_weights())
+      file.write((const char*) weights.data(), row_length * sizeof(WeightType));
+  }
+
+  file.close();
+  if (!file)
+    std::__throw_runtime_error("Cannot write the reordered corpus");
+  append_checksum_trailer(filename);
+}
+
+
+void write_permuted_vocabulary(const std::string& input_filename, const std::string& output_filename, const std::vector<IndexType>& new_columns)
+{
+  std::ifstream input(input_filename);
+  if (!input.is_open())
+    std::__throw_runtime_error("Cannot open vocabulary file");
+  std::vector<std::string> terms;
+  std::string line;
+  while (std::getline(input, line))
+    terms.push_back(line);
+  if (terms.size() != new_columns.size())
+    std::__throw_invalid_argument("The vocabulary must have one line per column of the corpus");
+
+  std::ofstream output(output_filename);
+  if (!output.is_open())
+    std::__throw_runtime_error("Cannot write the reordered vocabulary");
+  for (const IndexType column : invert_permutation(new_columns))
+    output << terms[column] << "\n";
+}
+
+
+Double get_mean_blocks_per_row(
+    const BinarySparseMatrix& data,
+    const std::vector<IndexType>& new_columns,
+    const IndexType block_size,
+    const IndexType train_vocab_cutoff
+  )
+{
+  const IndexType effective_input_dim = train_vocab_cutoff > 0 ? train_vocab_cutoff : data.num_cols;
+  std::vector<uint64_t> num_blocks(get_num_parallel_threads(), 0);
+  parallel_for("get_mean_blocks_per_row", 0, data.num_rows, [&](const size_t first_row, const size_t end_row, const int thread) {
+    std::vector<IndexType> blocks;
+    for (size_t row = first_row; row < end_row; ++row)
+    {
+      blocks.clear();
+      const IndexType* const indices = data.indices_in_row(row);
+      for (IndexType i = 0; i < data.num_indices_in_row(row); ++i)
+      {
+        const IndexType column = new_columns.empty() ? indices[i] : new_columns[indices[i]];
+        if (column < effective_input_dim)
+          blocks.push_back(column / block_size);
+      }
+      std::sort(blocks.begin(), blocks.end());
+      num_blocks[thread] += std::unique(blocks.begin(), blocks.end()) - blocks.begin();
+    }
+  });
+  return data.num_rows > 0 ? static_cast<Double>(std::accumulate(num_blocks.begin(), num_blocks.end(), uint64_t(0))) / data.num_rows : 0.;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "data.hpp"
+
+
+struct ColumnOrderSettings
+{
+  IndexType train_vocab_cutoff = 0;    // If not zero, the terms below this index stay below it
+  IndexType window_size = 16;          // Number of recently placed terms whose co-occurrences attract the next term (a cache line of Floats)
+  IndexPointerType max_samples = 64;   // Rows per term, evenly spaced over its occurrences, that are searched for co-occurring terms
+};
+
+
+// New index of every vocabulary column, such that terms that occur in the same snippets get nearby
+// indices. This is the greedy window ordering of Gorder (Wei et al., DOI 10.1145/2882903.2915220) on
+// the co-occurrences of the terms: every next term co-occurs most often with the last `window_size`
+// terms, and without any co-occurrence, the most frequent remaining term (the lowest index) follows.
+// The prefix below the training vocabulary cutoff and the rest of the vocabulary are ordered separately.
+// The result only depends on the corpus and the settings.
+std::vector<IndexType> compute_column_order(const BinarySparseMatrix& data, const ColumnOrderSettings& settings);
+
+// Inverse of a permutation, e.g. the original column of every new column
+std::vector<IndexType> invert_permutation(const std::vector<IndexType>& permutation);
+
+// Write `data` in the corpus format with column `c` renamed to `new_columns[c]`,
+// keeping the indices of every row sorted along with their weights. The file records the
+// `train_vocab_cutoff` of the order, since other cutoffs select other terms.
+void write_permuted_corpus(const std::string& filename, const BinarySparseMatrix& data, const std::vector<IndexType>& new_columns, const IndexType train_vocab_cutoff);
+
+// Write the lines of the vocabulary file, one term per column, in the order of the new columns
+void write_permuted_vocabulary(const std::string& input_filename, const std::string& output_filename, const std::vector<IndexType>& new_columns);
+
+// Mean number of distinct blocks of `block_size` columns in a row below the training vocabulary cutoff,
+// that is the cache lines (16 Floats) or pages (1024 Floats) that a row touches in every cell, after
+// column `c` is renamed to `new_columns[c]` (unless `new_columns` is empty)
+Double get_mean_blocks_per_row(
+  const BinarySparseMatrix& data,
+  const std::vector<IndexType>& new_columns,
+  const IndexType block_size,
+  const IndexType train_vocab_cutoff = 0
+);
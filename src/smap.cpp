@@ -1,10 +1,15 @@
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <algorithm>  // fill_n
 #include <assert.h>
 #include <exception>
+#include <atomic>
+#include <vector>
 #include "smap.hpp"
+#include "distributed.hpp"
+#include "checksum.hpp"
 
 
 SemanticMap::SemanticMap() :
@@ -38,13 +43,13 @@ SemanticMap::SemanticMap(const std::string& counts_filename, const std::string&
 }
 
 
-SemanticMap::SemanticMap(const CorpusDataset& data, const Codebook& codebook, const IndexType train_vocab_cutoff) :
+SemanticMap::SemanticMap(const CorpusDataset& data, const Codebook& codebook, const IndexType train_vocab_cutoff, const bool with_counts) :
   counts(nullptr),
   best_matching_units(nullptr),
   vocabulary(nullptr),
   should_cleanup_best_matching_units(true)
 {
-  this->build(data, codebook, train_vocab_cutoff);
+  this->build(data, codebook, train_vocab_cutoff, with_counts);
 }
 
 
@@ -52,7 +57,7 @@ SemanticMap::~SemanticMap()
 {
   if (this->counts)
   {
-    delete [] this->counts;
+    free_huge_pages(this->counts, static_cast<size_t>(this->num_cells) * this->vocabulary_size * sizeof(CountType));
     this->counts = nullptr;
   }
   if (this->best_matching_units && this->should_cleanup_best_matching_units)
@@ -72,7 +77,7 @@ void SemanticMap::delete_counts()
 {
   if (this->counts)
   {
-    delete [] this->counts;
+    free_huge_pages(this->counts, static_cast<size_t>(this->num_cells) * this->vocabulary_size * sizeof(CountType));
     this->counts = nullptr;
   }
 }
@@ -86,7 +91,7 @@ void SemanticMap::build(const CorpusDataset& data, CellIndexType* best_matching_
 
   this->vocabulary_size = data.num_cols;
   this->dataset_size = data.num_rows;
-  this->num_cells = _height * _width;
+  this->num_cells = get_num_map_cells(_height, _width);
   this->height = _height;
   this->width = _width;
 
@@ -97,7 +102,7 @@ void SemanticMap::build(const CorpusDataset& data, CellIndexType* best_matching_
 }
 
 
-void SemanticMap::build(const CorpusDataset& data, const Codebook& codebook, IndexType train_vocab_cutoff)
+void SemanticMap::build(const CorpusDataset& data, const Codebook& codebook, IndexType train_vocab_cutoff, const bool with_counts)
 {
   assert (!this->counts);
   assert (data.num_cols == codebook.get_input_dim());
@@ -119,7 +124,8 @@ void SemanticMap::build(const CorpusDataset& data, const Codebook& codebook, Ind
   codebook.find_best_matching_units(data, this->best_matching_units, distances, effective_input_dim, false);
   delete [] distances;
 
-  this->build_counts(data);
+  if (with_counts)
+    this->build_counts(data);
 }
 
 
@@ -127,29 +133,53 @@ void SemanticMap::build_counts(const CorpusDataset& data)
 {
   // Create and initialize int array with one entry for each cell in the map and each term in the vocabulary
   if (!this->counts)
-    this->counts = new CountType[this->num_cells * this->vocabulary_size];
-  std::fill_n(this->counts, this->num_cells * this->vocabulary_size, 0);
+    this->counts = static_cast<CountType*>(allocate_huge_pages(static_cast<size_t>(this->num_cells) * this->vocabulary_size * sizeof(CountType)));
+  std::fill_n(this->counts, static_cast<size_t>(this->num_cells) * this->vocabulary_size, 0);
 
   // For each word in each snippet, add 1 to the cell that corresponds to this word (word index) and this snippet (best_matching_unit)
   std::cout << "  Count associations" << std::endl;
+
+  // Group the rows by their best matching unit, so that all counts of a cell are written by one thread
+  std::vector<IndexPointerType> first_row_of_cell(this->num_cells + 1, 0);
   for (size_t row = 0; row < data.num_rows; ++row)
   {
-    const CellIndexType best_matching_unit = this->best_matching_units[row];
-    assert (best_matching_unit < num_cells);
-
-    const IndexType* const indices = data.indices_in_row(row);     // Address of the beginning of the array of columns-with-value-1-indices
-    const IndexType num_non_zero_in_row = data.num_indices_in_row(row);
+    assert (this->best_matching_units[row] < num_cells);
+    ++first_row_of_cell[this->best_matching_units[row] + 1];
+  }
+  for (CellIndexType cell = 0; cell < this->num_cells; ++cell)
+    first_row_of_cell[cell + 1] += first_row_of_cell[cell];
+  std::vector<IndexPointerType> rows_by_cell(data.num_rows);
+  std::vector<IndexPointerType> next_row_of_cell(first_row_of_cell.begin(), first_row_of_cell.end() - 1);
+  for (size_t row = 0; row < data.num_rows; ++row)
+    rows_by_cell[next_row_of_cell[this->best_matching_units[row]]++] = row;
 
-    for (IndexType i = 0; i < num_non_zero_in_row; ++i) {
-      const IndexType vocab_index = indices[i];
-      if (this->counts[this->num_cells * vocab_index + best_matching_unit] >= MAX_COUNT - 1)
+  std::atomic<bool> exceeds_max_count(false);
+  parallel_for("SemanticMap::build_counts", 0, this->num_cells, [&](const size_t first_cell, const size_t end_cell, int) {
+    for (size_t cell = first_cell; cell < end_cell; ++cell)
+    {
+      for (IndexPointerType i_row = first_row_of_cell[cell]; i_row < first_row_of_cell[cell + 1]; ++i_row)
       {
-        std::cerr << "Exceding MAX_COUNT of " << MAX_COUNT << std::endl;  // ToDo: Implement solution to MAX_COUNT excess
-        this->delete_counts();
-        return;
+        const IndexPointerType row = rows_by_cell[i_row];
+        const IndexType* const indices = data.indices_in_row(row);     // Address of the beginning of the array of columns-with-value-1-indices
+        const IndexType num_non_zero_in_row = data.num_indices_in_row(row);
+
+        for (IndexType i = 0; i < num_non_zero_in_row; ++i) {
+          CountType& count = this->counts[static_cast<size_t>(this->num_cells) * indices[i] + cell];
+          if (count >= MAX_COUNT - 1)
+          {
+            exceeds_max_count.store(true);
+            return;
+          }
+          count += 1;
+        }
       }
-      this->counts[this->num_cells * vocab_index + best_matching_unit] += 1;
     }
+  }, this->parallel_settings);
+
+  if (exceeds_max_count.load())
+  {
+    std::cerr << "Exceding MAX_COUNT of " << MAX_COUNT << std::endl;  // ToDo: Implement solution to MAX_COUNT excess
+    this->delete_counts();
   }
 }
 
@@ -203,6 +233,19 @@ void SemanticMap::save_best_matching_units_to_file(const std::string& filename)
 {
   assert (this->best_matching_units);
 
+  // With MPI, the root process writes the best matching units of all row shards
+  const CellIndexType* best_matching_units = this->best_matching_units;
+  uint64_t dataset_size = this->dataset_size;
+  std::vector<CellIndexType> all_best_matching_units;
+  if (are_rows_distributed())
+  {
+    all_best_matching_units = gather_to_root(this->best_matching_units, this->dataset_size);
+    best_matching_units = all_best_matching_units.data();
+    dataset_size = all_best_matching_units.size();
+  }
+  if (!is_root_process())
+    return;
+
   std::cout << "Saving best matching units to '" << filename << "'" << std::endl;
   std::ofstream file;
   file.open(filename, std::ios::binary);
@@ -210,16 +253,32 @@ void SemanticMap::save_best_matching_units_to_file(const std::string& filename)
   if (!file.is_open())
     std::__throw_runtime_error("Cannot save best matching units");
 
-  uint8_t _format = 0;
-  assert (sizeof(*this->best_matching_units) == 2);
-
-  write_uint8(file, _format);
-  write_uint64(file, this->height);
-  write_uint64(file, this->width);
-  write_uint64(file, this->vocabulary_size);
-  write_uint64(file, this->dataset_size);
-  file.write((const char*) this->best_matching_units, this->dataset_size * sizeof(*this->best_matching_units));
+  // Format 0 has 2 bytes per best matching unit, format 1 has 4 bytes for maps with more cells,
+  // and formats 2 and 3 are the same followed by the trailer of `get_checksum_trailer`
+  const uint8_t index_size = get_cell_index_file_size(this->num_cells);
+  const uint8_t _format = index_size == 2 ? 2 : 3;
+
+  std::ostringstream header_stream(std::ios::binary);
+  write_uint8(header_stream, _format);
+  write_uint64(header_stream, this->height);
+  write_uint64(header_stream, this->width);
+  write_uint64(header_stream, this->vocabulary_size);
+  write_uint64(header_stream, dataset_size);
+  const std::string header = header_stream.str();
+  file.write(header.data(), header.size());
+  write_cell_indices(file, best_matching_units, dataset_size, index_size);
+  // Indices stored at their own size are checksummed in memory, narrowed ones from the file
+  const bool is_stored_as_is = index_size == sizeof(CellIndexType);
+  if (is_stored_as_is)
+  {
+    const std::string trailer = get_checksum_trailer(header, best_matching_units, dataset_size * sizeof(CellIndexType));
+    file.write(trailer.data(), trailer.size());
+  }
   file.close();
+  if (!file)
+    std::__throw_runtime_error("Cannot save best matching units");
+  if (!is_stored_as_is)
+    append_checksum_trailer(filename);
 }
 
 
@@ -247,18 +306,18 @@ void SemanticMap::load_counts_from_file(const std::string& filename)
   file.read((char*)&_width, sizeof(_width));
   file.read((char*)&_vocabulary_size, sizeof(_vocabulary_size));
 
+  this->num_cells = get_num_map_cells(_height, _width);
   this->height = static_cast<CellIndexType>(_height);
   this->width = static_cast<CellIndexType>(_width);
   this->vocabulary_size = static_cast<IndexType>(_vocabulary_size);
 
-  this->num_cells = this->height * this->width;
-  this->counts = new CountType[this->num_cells * this->vocabulary_size];
+  this->counts = static_cast<CountType*>(allocate_huge_pages(static_cast<size_t>(this->num_cells) * this->vocabulary_size * sizeof(CountType)));
   try {
-    file.read((char*) this->counts, this->num_cells * this->vocabulary_size * sizeof(*this->counts));
+    file.read((char*) this->counts, static_cast<size_t>(this->num_cells) * this->vocabulary_size * sizeof(*this->counts));
   } catch ( std::exception const & e ) {
     std::cerr << "Failed reading counts" << std::endl;
     if (this->counts)
-      delete [] this->counts;
+      free_huge_pages(this->counts, static_cast<size_t>(this->num_cells) * this->vocabulary_size * sizeof(CountType));
     this->counts = nullptr;
     file.close();
     throw e;
@@ -280,34 +339,38 @@ void SemanticMap::load_best_matching_units_from_file(const std::string& filename
   if (!file.is_open())
     std::__throw_runtime_error("Unable to load best matching units from file");
 
-  bool _big;
   uint8_t _format;
   uint64_t _height, _width, _vocabulary_size, _dataset_size;
 
-  file.read((char*)&_big, sizeof(_big));
   file.read((char*)&_format, sizeof(_format));
-  if (_format != 0)
+  if (_format > 3)
     std::__throw_runtime_error("Stored BMU array has unknown format");
+  const uint8_t index_size = _format % 2 == 0 ? 2 : 4;
+  const bool has_checksums = _format >= 2;
+  std::unique_ptr<std::streambuf> verifying_buffer;  // With --verify, checks the blocks that the loader reads
+  const uint64_t num_content_bytes = has_checksums ? check_checksummed_file(filename, file, verifying_buffer) : 0;
   file.read((char*)&_height, sizeof(_height));
   file.read((char*)&_width, sizeof(_width));
   file.read((char*)&_vocabulary_size, sizeof(_vocabulary_size));
   file.read((char*)&_dataset_size, sizeof(_dataset_size));
 
+  this->num_cells = get_num_map_cells(_height, _width);
   this->height = static_cast<CellIndexType>(_height);
   this->width = static_cast<CellIndexType>(_width);
   this->vocabulary_size = static_cast<IndexType>(_vocabulary_size);
   this->dataset_size = static_cast<IndexPointerType>(_dataset_size);
+  if (has_checksums && num_content_bytes != sizeof(_format) + 4 * sizeof(uint64_t) + _dataset_size * index_size)
+    std::__throw_runtime_error("Stored BMU array does not match its header");
 
-  this->num_cells = this->height * this->width;
   this->best_matching_units = new CellIndexType[this->dataset_size];
   try {
-    file.read((char*)this->best_matching_units, this->dataset_size * sizeof(*this->best_matching_units));
-  } catch ( std::exception const & e ) {
+    read_cell_indices(file, this->best_matching_units, this->dataset_size, index_size);
+  } catch ( std::exception const & ) {
     if (best_matching_units)
       delete [] this->best_matching_units;
     this->best_matching_units = nullptr;
     file.close();
-    throw e;
+    throw;  // Keep the type and message of the error
   }
 
   file.close();
@@ -320,7 +383,7 @@ CountType SemanticMap::get_counts(const CellIndexType row, const CellIndexType c
   CountType count = 0;
   for (IndexType vocab_index = 0; vocab_index < this->vocabulary_size; ++vocab_index)
   {
-    count += this->counts[this->num_cells * vocab_index + cell_index];
+    count += this->counts[static_cast<size_t>(this->num_cells) * vocab_index + cell_index];
   }
   return count;
 }
@@ -328,5 +391,5 @@ CountType SemanticMap::get_counts(const CellIndexType row, const CellIndexType c
 
 CountType* SemanticMap::get_counts(const IndexType vocab_index) const
 {
-  return &this->counts[this->num_cells * vocab_index];
+  return &this->counts[static_cast<size_t>(this->num_cells) * vocab_index];
 }
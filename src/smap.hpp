@@ -12,12 +12,13 @@ public:
   SemanticMap();
   SemanticMap(const std::string& counts_filename);
   SemanticMap(const std::string& counts_filename, const std::string& best_matching_units_filename);
-  SemanticMap(const CorpusDataset& data, const Codebook& codebook, const IndexType train_vocab_cutoff);
+  SemanticMap(const CorpusDataset& data, const Codebook& codebook, const IndexType train_vocab_cutoff, const bool with_counts = true);
   ~SemanticMap();
 
   void delete_counts();
 
-  void build(const CorpusDataset& data, const Codebook& codebook, IndexType train_vocab_cutoff);
+  // Without counts, only the best matching units are found, e.g. when the counts do not fit into memory
+  void build(const CorpusDataset& data, const Codebook& codebook, IndexType train_vocab_cutoff, const bool with_counts = true);
   void build(const CorpusDataset& data, CellIndexType* best_matching_units, const CellIndexType _height, const CellIndexType _width);
   std::vector<size_t> find_snippets(const CorpusDataset& data, CellIndexType map_row, CellIndexType map_col);
   
@@ -29,6 +30,9 @@ public:
   CountType get_counts(const CellIndexType row, const CellIndexType col) const;
   CountType* get_counts(const IndexType vocab_index) const;
 
+  // Parallel loop of the association counts
+  ParallelSettings parallel_settings;
+
 protected:
   void load_counts_from_file(const std::string& filename);
   void load_best_matching_units_from_file(const std::string& filename);
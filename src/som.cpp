@@ -7,18 +7,25 @@
 #include <random>
 #include <assert.h>
 #include <algorithm>  // fill_n
-
-#if defined(_OPENMP)
-  #include <omp.h>
-#endif
+#include <utility>    // as_const
 
 #include "som.hpp"
 #include "topo.hpp"
 #include "utils.hpp"
 #include "smap.hpp"
+#include "checkpoint.hpp"
+#include "stopping.hpp"
+#include "distributed.hpp"
+#include "numa.hpp"
+#include "compress.hpp"
+#include "checksum.hpp"
 
 
 #define SQRT_E 1.6487212707001281468486507878142
+#define MULTI_CODEBOOK_ROW_BLOCK_SIZE 256  // Number of rows compared with all codebooks at once when searching several maps
+#define PCA_NUM_EXTRA_VECTORS 4  // Oversampling of the randomized subspace iteration for the principal components
+#define PCA_NUM_ITERATIONS 4  // Power iterations of the randomized subspace iteration
+#define PCA_GRID_SPAN 2.  // Standard deviations along each principal component from the mean to the outermost cells
 
 
 Neighbourhood::Neighbourhood(
@@ -27,24 +34,71 @@ Neighbourhood::Neighbourhood(
     const GlobalTopology golbal_topology, 
     const LocalTopology local_topology, 
     const Float update_exponent,
-    const CellIndexType initial_radius
+    const CellIndexType initial_radius,
+    const Float radius_scale
   ) :
   height(height),
   width(width),
+  global_topology(golbal_topology),
+  local_topology(local_topology),
   distance(distance_function(golbal_topology, local_topology)),
   update_exponent(update_exponent),
   initial_radius(initial_radius),
+  radius_scale(radius_scale),
   radius_min(initial_radius),
   radius_max(initial_radius),
   values(nullptr)
 {
-  this->num_cells = this->height * this->width;
+  this->num_cells = get_num_map_cells(this->height, this->width);
   this->values = new Float[this->num_cells];
   // ToDo: Randomize initial radii?
   std::fill_n(this->values, this->num_cells, static_cast<Float>(initial_radius));
 }
 
 
+Neighbourhood::Neighbourhood(
+    const Neighbourhood& coarse,
+    const CellIndexType height, 
+    const CellIndexType width
+  ) :
+  parallel_settings(coarse.parallel_settings),
+  height(height),
+  width(width),
+  global_topology(coarse.global_topology),
+  local_topology(coarse.local_topology),
+  distance(coarse.distance),
+  update_exponent(coarse.update_exponent),
+  initial_radius(coarse.initial_radius),
+  values(nullptr)
+{
+  assert (height >= coarse.height && width >= coarse.width);
+  this->num_cells = get_num_map_cells(this->height, this->width);
+  this->values = new Float[this->num_cells];
+
+  // A radius of r coarse cells spans about r * scale finer cells
+  const Float scale = 0.5f * (static_cast<Float>(height) / coarse.height + static_cast<Float>(width) / coarse.width);
+  this->radius_scale = coarse.radius_scale / scale;
+
+  parallel_for("Neighbourhood::grow", 0, this->num_cells, [&](const size_t first_cell, const size_t end_cell, int) {
+    for (CellIndexType cell_index = first_cell; cell_index < end_cell; ++cell_index)
+    {
+      CellIndexType coarse_cells[4];
+      Float weights[4];
+      upsampling_weights(
+        cell_index / width, cell_index % width, height, width, coarse.height, coarse.width, 
+        this->global_topology, this->local_topology, coarse_cells, weights
+      );
+      Float radius = 0.f;
+      for (int k = 0; k < 4; ++k)
+        radius += weights[k] * coarse.values[coarse_cells[k]];
+      this->values[cell_index] = std::max(1.f, radius * scale);
+    }
+  }, this->parallel_settings);
+  this->radius_min = *std::min_element(this->values, this->values + this->num_cells);
+  this->radius_max = *std::max_element(this->values, this->values + this->num_cells);
+}
+
+
 Neighbourhood::~Neighbourhood()
 {
   if (this->values)
@@ -55,6 +109,14 @@ Neighbourhood::~Neighbourhood()
 }
 
 
+void Neighbourhood::set_values(const Float* const values)
+{
+  std::copy(values, values + this->num_cells, this->values);
+  this->radius_min = *std::min_element(this->values, this->values + this->num_cells);
+  this->radius_max = *std::max_element(this->values, this->values + this->num_cells);
+}
+
+
 Float Neighbourhood::influence(const CellIndexType source_cell, const CellIndexType target_cell) const
 {
   assert (this->values);
@@ -76,12 +138,20 @@ Float Neighbourhood::update(
   const bool respect_lower_bound
 )
 {
-  const auto discontinuities = this->topographic_discontinuities(best_matching_units, next_best_matching_units, num_rows);
-  this->radius_min = MAX_REAL_DISTANCE;
-  this->radius_max = 0.f;
-
-  #pragma omp parallel for
-  for (CellIndexType cell_index = 0; cell_index < this->num_cells; ++cell_index) 
+  auto discontinuities = this->topographic_discontinuities(best_matching_units, next_best_matching_units, num_rows);
+  // The radii depend on the discontinuities of all rows, not only of those of this process
+  if (are_rows_distributed())
+    discontinuities = all_gather(discontinuities);
+  uint64_t num_total_rows = num_rows;
+  all_reduce_sum(&num_total_rows, 1);
+  const int num_threads = get_num_parallel_threads(this->parallel_settings);
+  std::vector<Float> thread_radius_min(num_threads, MAX_REAL_DISTANCE);
+  std::vector<Float> thread_radius_max(num_threads, 0.f);
+
+  parallel_for("Neighbourhood::update", 0, this->num_cells, [&](const size_t first_cell, const size_t end_cell, const int thread) {
+  Float radius_min = thread_radius_min[thread];
+  Float radius_max = thread_radius_max[thread];
+  for (CellIndexType cell_index = first_cell; cell_index < end_cell; ++cell_index) 
   {
     Float radius_lower_bound = 1.f;
     for (auto const& discontinuity : std::as_const(discontinuities))
@@ -96,21 +166,26 @@ Float Neighbourhood::update(
     {
       this->values[cell_index] = std::max(
         radius_lower_bound,
-        std::pow(this->values[cell_index], this->update_exponent)
+        std::pow(this->values[cell_index] * this->radius_scale, this->update_exponent) / this->radius_scale
       );
     }
     else
     {
-      this->values[cell_index] = std::pow(this->values[cell_index], this->update_exponent);
+      this->values[cell_index] = std::pow(this->values[cell_index] * this->radius_scale, this->update_exponent) / this->radius_scale;
     }
 
-    this->radius_min = std::min(this->radius_min, this->values[cell_index]);
-    this->radius_max = std::max(this->radius_max, this->values[cell_index]);
+    radius_min = std::min(radius_min, this->values[cell_index]);
+    radius_max = std::max(radius_max, this->values[cell_index]);
     
   }
+  thread_radius_min[thread] = radius_min;
+  thread_radius_max[thread] = radius_max;
+  }, this->parallel_settings);
+  this->radius_min = *std::min_element(thread_radius_min.begin(), thread_radius_min.end());
+  this->radius_max = *std::max_element(thread_radius_max.begin(), thread_radius_max.end());
 
   // Return the topographic error
-  return static_cast<Float>(discontinuities.size() + 1) / num_rows;
+  return static_cast<Float>(discontinuities.size() + 1) / num_total_rows;
 }
 
 
@@ -173,6 +248,19 @@ std::vector<TopographicDiscontinuity> Neighbourhood::topographic_discontinuities
 }
 
 
+std::string Neighbourhood::get_file_header() const
+{
+  std::ostringstream header;
+  // Format 0 has no checksums, format 1 ends with the trailer of `get_checksum_trailer`
+  const uint8_t format = 1;
+  assert (sizeof(*this->values) == 4);
+  write_uint8(header, format);
+  write_uint64(header, this->height);
+  write_uint64(header, this->width);
+  return header.str();
+}
+
+
 void Neighbourhood::save_to_file(const std::string& filename) const
 {
   std::cout << "Saving neighbourhood to '" << filename << "'" << std::endl;
@@ -182,18 +270,26 @@ void Neighbourhood::save_to_file(const std::string& filename) const
   if (!file.is_open())
     std::__throw_runtime_error("Unable to save neighbourhood to file");
 
-  const uint8_t format = 0;
-  assert (sizeof(*this->values) == 4);
-
-  write_uint8(file, format);
-  write_uint64(file, this->height);
-  write_uint64(file, this->width);
-  file.write((const char*) this->values, this->height * this->width * sizeof(*this->values));
+  const std::string header = this->get_file_header();
+  const size_t num_bytes = this->height * this->width * sizeof(*this->values);
+  file.write(header.data(), header.size());
+  file.write((const char*) this->values, num_bytes);
+  const std::string trailer = get_checksum_trailer(header, this->values, num_bytes);
+  file.write(trailer.data(), trailer.size());
 
   file.close();
 }
 
 
+void Neighbourhood::save_to_file(const std::string& filename, AsyncWriter& writer) const
+{
+  std::cout << "Saving neighbourhood to '" << filename << "' in the background" << std::endl;
+  const std::string header = this->get_file_header();
+  const size_t num_bytes = this->num_cells * sizeof(*this->values);
+  writer.write(filename, make_snapshot(header, this->values, num_bytes, get_checksum_trailer(header, this->values, num_bytes)));
+}
+
+
 Codebook::Codebook(
     CellIndexType height, 
     CellIndexType width, 
@@ -207,8 +303,9 @@ Codebook::Codebook(
     global_topology(global_topology),
     local_topology(local_topology)
 {
-  this->num_cells = height * width;
-  this->size = this->num_cells * input_dim;
+  this->num_cells = get_num_map_cells(height, width);
+  this->init_cell_range();
+  this->size = static_cast<size_t>(this->num_local_cells) * input_dim;
   size_t required_bytes = this->size * sizeof(Float);
 
   this->distance = distance_function(global_topology, local_topology);
@@ -223,77 +320,488 @@ Codebook::Codebook(
 
 
 Codebook::Codebook(
-    const std::string& filename
+    const std::string& filename,
+    GlobalTopology global_topology,
+    LocalTopology local_topology
   ) : 
     width(0),
     height(0),
     input_dim(0),
     num_cells(0),
+    first_cell(0),
+    num_local_cells(0),
     size(0),
-    global_topology(GlobalTopology::PLANE),
-    local_topology(LocalTopology::CIRC)
+    global_topology(global_topology),
+    local_topology(local_topology)
 {
+  this->distance = distance_function(global_topology, local_topology);
   this->load_from_file(filename);
 }
 
 
+Codebook::Codebook(
+    const Codebook& coarse,
+    CellIndexType height, 
+    CellIndexType width
+  ) :
+  Codebook(height, width, coarse.input_dim, coarse.global_topology, coarse.local_topology)
+{
+  assert (height >= coarse.height && width >= coarse.width);
+  if (are_cells_distributed())
+    std::__throw_invalid_argument("Growing a codebook is not supported with several cell shards");
+
+  std::cout << "Growing codebook from " << coarse.width << " x " << coarse.height << " to " << width << " x " << height << std::endl;
+  this->parallel_settings = coarse.parallel_settings;
+  this->array.resize(this->size);
+
+  parallel_for("Codebook::grow", 0, this->num_cells, [&](const size_t first_cell, const size_t end_cell, int) {
+    for (CellIndexType cell_index = first_cell; cell_index < end_cell; ++cell_index)
+    {
+      CellIndexType coarse_cells[4];
+      Float weights[4];
+      upsampling_weights(
+        cell_index / width, cell_index % width, height, width, coarse.height, coarse.width, 
+        this->global_topology, this->local_topology, coarse_cells, weights
+      );
+      Float* const w = &this->array[static_cast<size_t>(cell_index) * this->input_dim];
+      std::fill_n(w, this->input_dim, 0.f);
+      for (int k = 0; k < 4; ++k)
+      {
+        const Float* const coarse_w = &coarse.array[static_cast<size_t>(coarse_cells[k]) * coarse.input_dim];
+        for (IndexType i = 0; i < this->input_dim; ++i)
+          w[i] += weights[k] * coarse_w[i];
+      }
+    }
+  }, this->parallel_settings);
+}
+
+
 Codebook::~Codebook()
 {}
 
 
+void Codebook::init_cell_range()
+{
+  size_t first_cell, end_cell;
+  get_cell_range(this->num_cells, first_cell, end_cell);
+  this->first_cell = static_cast<CellIndexType>(first_cell);
+  this->num_local_cells = static_cast<CellIndexType>(end_cell - first_cell);
+}
+
+
 void Codebook::init(int _seed, bool _increment_seed_by_thread_number)
 {
   std::cout << "Initializing codebook" << std::endl;
   int seed = _seed;
   this->array.resize(this->size);
 
-  #pragma omp parallel firstprivate(seed)
+  // Every thread fills one block of values with its own random numbers. With MPI, each cell shard
+  // initializes its own cells, with other seeds than the threads of the other shards.
+  const size_t num_blocks = get_num_parallel_threads(this->parallel_settings);
+  seed += get_cell_shard() * static_cast<int>(num_blocks);
+
+  parallel_for("Codebook::init", 0, num_blocks, [&](const size_t first_block, const size_t end_block, int) {
+    for (size_t block = first_block; block < end_block; ++block)
+    {
+      // Set a unique seed for each block
+      std::default_random_engine random_number_generator(_increment_seed_by_thread_number ? seed + static_cast<int>(block) : seed);
+      std::uniform_real_distribution<Float> uniform(0.f, 1.f);
+      for (size_t i = this->size * block / num_blocks; i < this->size * (block + 1) / num_blocks; i++)
+      {
+          this->array[i] = uniform(random_number_generator);
+      }
+    }
+  }, this->parallel_settings);
+
+  // All row shards start from the codebook of the first one
+  broadcast(this->array.data(), this->size);
+}
+
+
+void Codebook::init()
+{
+  this->init(static_cast<int>(get_unix_time()), true);
+}
+
+
+void Codebook::init(
+  const CorpusDataset& data,
+  const CodebookInitialization initialization,
+  int _seed,
+  const IndexType train_vocab_cutoff
+)
+{
+  const auto effective_input_dim = (train_vocab_cutoff > 0 ? std::min(train_vocab_cutoff, this->input_dim) : this->input_dim);
+  switch (initialization)
   {
-    #if defined(_OPENMP)
-    // Set a unique seed for each thread
-    if (_increment_seed_by_thread_number)
-      seed += omp_get_thread_num();
-    #endif
+  case CodebookInitialization::RANDOM_UNIFORM:
+    this->init(_seed, true);
+    break;
+  case CodebookInitialization::SAMPLED_ROWS:
+    this->init_from_sampled_rows(data, _seed, effective_input_dim);
+    break;
+  case CodebookInitialization::PRINCIPAL_COMPONENTS:
+    this->init_from_principal_components(data, _seed, effective_input_dim);
+    break;
+  default:
+    std::__throw_invalid_argument("Unknown codebook initialization");
+  }
+}
 
-    std::default_random_engine random_number_generator(seed);
-    std::uniform_real_distribution<Float> uniform(0.f, 1.f);
 
-    #pragma omp for
-    for (IndexPointerType i = 0; i < this->size; i++)
+void Codebook::init_from_sampled_rows(const CorpusDataset& data, const int seed, const IndexType effective_input_dim)
+{
+  std::cout << "Initializing codebook with sampled snippets" << std::endl;
+  if (data.num_total_rows == 0)
+    std::__throw_invalid_argument("Cannot sample snippets of an empty corpus");
+
+  // Draw the rows of all cells, so every cell shard and row shard agrees on them
+  std::default_random_engine random_number_generator(seed);
+  std::uniform_int_distribution<IndexPointerType> uniform(0, data.num_total_rows - 1);
+  std::vector<IndexPointerType> rows(this->num_cells);
+  for (auto& row : rows)
+    row = uniform(random_number_generator);
+
+  this->array.assign(this->size, 0.f);
+
+  parallel_for("Codebook::init_from_sampled_rows", 0, this->num_local_cells, [&](const size_t first_cell, const size_t end_cell, int) {
+    for (CellIndexType local_cell = first_cell; local_cell < end_cell; ++local_cell)
     {
-        this->array[i] = uniform(random_number_generator);
+      // With MPI, only the row shard that loaded the row fills in its values
+      const IndexPointerType row = rows[this->first_cell + local_cell];
+      if (row < data.first_row || row >= data.first_row + data.num_rows)
+        continue;
+
+      Float* const w = &this->array[static_cast<size_t>(local_cell) * this->input_dim];
+      const IndexType* const indices = data.indices_in_row(row - data.first_row);
+      const IndexType num_non_zero_in_row = data.num_indices_in_row(row - data.first_row);
+      for (IndexType i = 0; i < num_non_zero_in_row && indices[i] < effective_input_dim; ++i)
+        w[indices[i]] = 1.f;  // Like the batch update, which treats the input data as binary
+    }
+  }, this->parallel_settings);
+
+  // Adding the zeros of the other row shards is exact
+  all_reduce_sum(this->array.data(), this->size);
+}
+
+
+// Orthonormalize the `num_vectors` vectors of length `dim`, stored one after another
+static void orthonormalize(std::vector<Double>& vectors, const size_t dim, const size_t num_vectors)
+{
+  for (size_t j = 0; j < num_vectors; ++j)
+  {
+    Double* const v = &vectors[j * dim];
+    for (size_t k = 0; k < j; ++k)
+    {
+      const Double* const u = &vectors[k * dim];
+      Double dot = 0.;
+      for (size_t i = 0; i < dim; ++i)
+        dot += u[i] * v[i];
+      for (size_t i = 0; i < dim; ++i)
+        v[i] -= dot * u[i];
     }
+    Double norm = 0.;
+    for (size_t i = 0; i < dim; ++i)
+      norm += v[i] * v[i];
+    norm = std::sqrt(norm);
+    // A degenerate direction, e.g. of a tiny vocabulary, is dropped
+    for (size_t i = 0; i < dim; ++i)
+      v[i] = norm > 0. ? v[i] / norm : 0.;
   }
 }
 
 
-void Codebook::init()
+// Multiply the `num_vectors` vectors of length `dim` by the scatter matrix C^T C of the centered 
+// data C = X - 1 mean^T, using only sparse products with X. With MPI, the rows of all row shards count.
+static std::vector<Double> multiply_by_scatter_matrix(
+  const BinarySparseMatrix& data,
+  const std::vector<Double>& mean,
+  const std::vector<Double>& vectors,
+  const size_t dim,
+  const size_t num_vectors,
+  const ParallelSettings& parallel_settings
+)
 {
-  this->init(static_cast<int>(get_unix_time()), true);
+  std::vector<Double> mean_products(num_vectors, 0.);
+  for (size_t j = 0; j < num_vectors; ++j)
+    for (size_t i = 0; i < dim; ++i)
+      mean_products[j] += mean[i] * vectors[j * dim + i];
+
+  // The last `num_vectors` values are the sums of the centered products over all rows.
+  // Every block of rows is summed separately, and the sums are added in order, so the result is reproducible.
+  const size_t result_size = dim * num_vectors + num_vectors;
+  const size_t num_blocks = get_num_parallel_threads(parallel_settings);
+  std::vector<Double> partial_results(num_blocks * result_size, 0.);
+
+  parallel_for("multiply_by_scatter_matrix", 0, num_blocks, [&](const size_t first_block, const size_t end_block, int) {
+    std::vector<Double> row_products(num_vectors);
+    for (size_t block = first_block; block < end_block; ++block)
+    {
+      Double* const partial_result = &partial_results[block * result_size];
+      for (IndexPointerType row = data.num_rows * block / num_blocks; row < data.num_rows * (block + 1) / num_blocks; ++row)
+      {
+        const IndexType* const indices = data.indices_in_row(row);
+        const IndexType num_non_zero_in_row = data.num_indices_in_row(row);
+        IndexType num_effective = 0;
+        while (num_effective < num_non_zero_in_row && indices[num_effective] < dim)
+          ++num_effective;
+
+        // Product of the centered row with every vector
+        for (size_t j = 0; j < num_vectors; ++j)
+        {
+          Double product = -mean_products[j];
+          for (IndexType i = 0; i < num_effective; ++i)
+            product += vectors[j * dim + indices[i]];
+          row_products[j] = product;
+          partial_result[dim * num_vectors + j] += product;
+        }
+        for (size_t j = 0; j < num_vectors; ++j)
+          for (IndexType i = 0; i < num_effective; ++i)
+            partial_result[j * dim + indices[i]] += row_products[j];
+      }
+    }
+  }, parallel_settings);
+
+  std::vector<Double> result(result_size, 0.);
+  for (size_t block = 0; block < num_blocks; ++block)
+    for (size_t i = 0; i < result_size; ++i)
+      result[i] += partial_results[block * result_size + i];
+  all_reduce_sum(result.data(), result.size());
+
+  for (size_t j = 0; j < num_vectors; ++j)
+    for (size_t i = 0; i < dim; ++i)
+      result[j * dim + i] -= mean[i] * result[dim * num_vectors + j];
+  result.resize(dim * num_vectors);
+  return result;
 }
 
 
-void Codebook::save_to_file(const std::string& filename) const
+// Eigenvalues and eigenvectors (as columns) of a small symmetric `n` x `n` matrix with the Jacobi method
+static void symmetric_eigen_decomposition(std::vector<Double> matrix, const size_t n, std::vector<Double>& eigenvalues, std::vector<Double>& eigenvectors)
+{
+  eigenvectors.assign(n * n, 0.);
+  for (size_t i = 0; i < n; ++i)
+    eigenvectors[i * n + i] = 1.;
+
+  for (int sweep = 0; sweep < 50; ++sweep)
+  {
+    Double off_diagonal = 0.;
+    for (size_t p = 0; p < n; ++p)
+      for (size_t q = p + 1; q < n; ++q)
+        off_diagonal += matrix[p * n + q] * matrix[p * n + q];
+    if (off_diagonal < 1e-30)
+      break;
+
+    for (size_t p = 0; p < n; ++p)
+    for (size_t q = p + 1; q < n; ++q)
+    {
+      if (matrix[p * n + q] == 0.)
+        continue;
+      // Rotate rows and columns p and q, such that the entry (p, q) vanishes
+      const Double theta = (matrix[q * n + q] - matrix[p * n + p]) / (2. * matrix[p * n + q]);
+      const Double t = (theta >= 0. ? 1. : -1.) / (std::abs(theta) + std::sqrt(theta * theta + 1.));
+      const Double c = 1. / std::sqrt(t * t + 1.);
+      const Double s = t * c;
+      for (size_t k = 0; k < n; ++k)
+      {
+        const Double a_kp = matrix[k * n + p];
+        const Double a_kq = matrix[k * n + q];
+        matrix[k * n + p] = c * a_kp - s * a_kq;
+        matrix[k * n + q] = s * a_kp + c * a_kq;
+      }
+      for (size_t k = 0; k < n; ++k)
+      {
+        const Double a_pk = matrix[p * n + k];
+        const Double a_qk = matrix[q * n + k];
+        matrix[p * n + k] = c * a_pk - s * a_qk;
+        matrix[q * n + k] = s * a_pk + c * a_qk;
+      }
+      for (size_t k = 0; k < n; ++k)
+      {
+        const Double v_kp = eigenvectors[k * n + p];
+        const Double v_kq = eigenvectors[k * n + q];
+        eigenvectors[k * n + p] = c * v_kp - s * v_kq;
+        eigenvectors[k * n + q] = s * v_kp + c * v_kq;
+      }
+    }
+  }
+
+  eigenvalues.resize(n);
+  for (size_t i = 0; i < n; ++i)
+    eigenvalues[i] = matrix[i * n + i];
+}
+
+
+void Codebook::init_from_principal_components(const CorpusDataset& data, const int seed, const IndexType effective_input_dim)
+{
+  std::cout << "Initializing codebook with principal components" << std::endl;
+  if (data.num_total_rows == 0)
+    std::__throw_invalid_argument("Cannot compute principal components of an empty corpus");
+
+  const size_t dim = effective_input_dim;
+  const size_t num_vectors = 2 + PCA_NUM_EXTRA_VECTORS;
+
+  // Mean of the binary rows
+  std::vector<uint64_t> counts(dim, 0);
+  for (IndexPointerType row = 0; row < data.num_rows; ++row)
+  {
+    const IndexType* const indices = data.indices_in_row(row);
+    const IndexType num_non_zero_in_row = data.num_indices_in_row(row);
+    for (IndexType i = 0; i < num_non_zero_in_row && indices[i] < dim; ++i)
+      ++counts[indices[i]];
+  }
+  all_reduce_sum(counts.data(), dim);
+  std::vector<Double> mean(dim);
+  for (size_t i = 0; i < dim; ++i)
+    mean[i] = static_cast<Double>(counts[i]) / data.num_total_rows;
+
+  // Randomized subspace iteration (Halko et al., DOI 10.1137/090771806), which needs only
+  // a few passes over the sparse corpus. All processes draw the same start vectors.
+  std::default_random_engine random_number_generator(seed);
+  std::normal_distribution<Double> normal(0., 1.);
+  std::vector<Double> vectors(dim * num_vectors);
+  for (auto& value : vectors)
+    value = normal(random_number_generator);
+  for (int iteration = 0; iteration < PCA_NUM_ITERATIONS; ++iteration)
+  {
+    orthonormalize(vectors, dim, num_vectors);
+    vectors = multiply_by_scatter_matrix(data, mean, vectors, dim, num_vectors, this->parallel_settings);
+  }
+  orthonormalize(vectors, dim, num_vectors);
+
+  // Rayleigh-Ritz: the eigenvectors of the scatter matrix projected onto the subspace
+  const std::vector<Double> products = multiply_by_scatter_matrix(data, mean, vectors, dim, num_vectors, this->parallel_settings);
+  std::vector<Double> projection(num_vectors * num_vectors, 0.);
+  for (size_t j = 0; j < num_vectors; ++j)
+    for (size_t k = 0; k < num_vectors; ++k)
+      for (size_t i = 0; i < dim; ++i)
+        projection[j * num_vectors + k] += vectors[j * dim + i] * products[k * dim + i];
+  std::vector<Double> eigenvalues, eigenvectors;
+  symmetric_eigen_decomposition(projection, num_vectors, eigenvalues, eigenvectors);
+
+  std::vector<size_t> order(num_vectors);
+  for (size_t j = 0; j < num_vectors; ++j)
+    order[j] = j;
+  std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return eigenvalues[a] > eigenvalues[b]; });
+
+  // Principal components scaled to PCA_GRID_SPAN standard deviations
+  std::vector<Double> components(2 * dim, 0.);
+  for (size_t c = 0; c < 2; ++c)
+  {
+    const Double standard_deviation = std::sqrt(std::max(0., eigenvalues[order[c]]) / data.num_total_rows);
+    for (size_t j = 0; j < num_vectors; ++j)
+    {
+      const Double coefficient = PCA_GRID_SPAN * standard_deviation * eigenvectors[j * num_vectors + order[c]];
+      for (size_t i = 0; i < dim; ++i)
+        components[c * dim + i] += coefficient * vectors[j * dim + i];
+    }
+  }
+
+  // The first component runs along the longer side of the map
+  const bool is_first_component_horizontal = this->width >= this->height;
+  this->array.assign(this->size, 0.f);
+
+  parallel_for("Codebook::init_from_principal_components", 0, this->num_local_cells, [&](const size_t first_cell, const size_t end_cell, int) {
+    for (CellIndexType local_cell = first_cell; local_cell < end_cell; ++local_cell)
+    {
+      const CellIndexType cell = this->first_cell + local_cell;
+      const Double x = 2. * (cell % this->width + 0.5) / this->width - 1.;
+      const Double y = 2. * (cell / this->width + 0.5) / this->height - 1.;
+      const Double a = is_first_component_horizontal ? x : y;
+      const Double b = is_first_component_horizontal ? y : x;
+
+      // Stay within the range of the binary inputs
+      Float* const w = &this->array[static_cast<size_t>(local_cell) * this->input_dim];
+      for (size_t i = 0; i < dim; ++i)
+        w[i] = static_cast<Float>(std::min(1., std::max(0., mean[i] + a * components[i] + b * components[dim + i])));
+    }
+  }, this->parallel_settings);
+
+  // All row shards start from the codebook of the first one
+  broadcast(this->array.data(), this->size);
+}
+
+
+std::string Codebook::get_file_header(const bool is_compressed, const bool has_checksums) const
+{
+  std::ostringstream header;
+  // Format 0 stores the raw values, format 1 the output of `compress_codebook_values`,
+  // and formats 2 and 3 are the same followed by the trailer of `get_checksum_trailer`
+  const uint8_t format = (is_compressed ? 1 : 0) + (has_checksums ? 2 : 0);
+  write_uint8(header, format);
+  write_uint64(header, this->height);
+  write_uint64(header, this->width);
+  write_uint64(header, this->input_dim);
+  return header.str();
+}
+
+
+void Codebook::save_to_file(const std::string& filename, const bool is_compressed) const
 {
   std::cout << "Saving codebook to '" << filename << "'" << std::endl;
+  if (are_cells_distributed() && is_compressed)
+    std::__throw_invalid_argument("Compressed codebooks are not supported with cell shards");
+  if (are_cells_distributed())
+  {
+    // Each cell shard writes its own cells
+    write_cell_shards_to_file(filename, this->get_file_header(false, true), this->array.data(), this->size * sizeof(Float));
+    return;
+  }
+
   std::ofstream file;
   file.open(filename, std::ios::binary);
 
   if (!file.is_open())
     std::__throw_runtime_error("Unable to save codebook to file");
 
-  uint8_t format = 0;
-
-  write_uint8(file, format);
-  write_uint64(file, this->height);
-  write_uint64(file, this->width);
-  write_uint64(file, this->input_dim);
-  file.write(reinterpret_cast<const char*>(this->array.data()), this->size * sizeof(Float));
+  const std::string header = this->get_file_header(is_compressed);
+  file.write(header.data(), header.size());
+  if (is_compressed)
+  {
+    const auto bytes = compress_codebook_values(this->array.data(), this->num_local_cells, this->input_dim);
+    file.write(bytes.data(), bytes.size());
+    const std::string trailer = get_checksum_trailer(header, bytes.data(), bytes.size());
+    file.write(trailer.data(), trailer.size());
+  }
+  else
+  {
+    file.write(reinterpret_cast<const char*>(this->array.data()), this->size * sizeof(Float));
+    const std::string trailer = get_checksum_trailer(header, this->array.data(), this->size * sizeof(Float));
+    file.write(trailer.data(), trailer.size());
+  }
 
   file.close();
 }
 
 
+void Codebook::save_to_file(const std::string& filename, AsyncWriter& writer, const bool is_compressed) const
+{
+  // Writing the cell shards is a collective operation
+  if (are_cells_distributed())
+  {
+    this->save_to_file(filename, is_compressed);
+    return;
+  }
+
+  std::cout << "Saving codebook to '" << filename << "' in the background" << std::endl;
+  const std::string header = this->get_file_header(is_compressed);
+  if (is_compressed)
+  {
+    // The writer compresses a copy of the values, so the caller does not wait for the compression
+    std::vector<Float> values(this->array.data(), this->array.data() + this->size);
+    const uint64_t num_cells = this->num_local_cells;
+    const uint64_t input_dim = this->input_dim;
+    writer.write(filename, this->size * sizeof(Float), [header, values = std::move(values), num_cells, input_dim]() mutable {
+      const auto bytes = compress_codebook_values(values.data(), num_cells, input_dim);
+      std::vector<Float>().swap(values);
+      return make_snapshot(header, bytes.data(), bytes.size(), get_checksum_trailer(header, bytes.data(), bytes.size()));
+    });
+  }
+  else
+    writer.write(filename, make_snapshot(header, this->array.data(), this->size * sizeof(Float), get_checksum_trailer(header, this->array.data(), this->size * sizeof(Float))));
+}
+
+
 void Codebook::load_from_file(const std::string& filename)
 {
   std::ifstream file;
@@ -304,13 +812,21 @@ void Codebook::load_from_file(const std::string& filename)
     std::__throw_runtime_error("Unable to load codebook from file");
 
   uint8_t format = read_uint8(file);
-  if (format != 0)
+  if (format > 3)
     std::__throw_runtime_error("Stored codebook has unknown format");
-  this->height = static_cast<CellIndexType>(read_uint64(file));
-  this->width = static_cast<CellIndexType>(read_uint64(file));
+  const bool is_compressed = format % 2 == 1;
+  // The contents of formats 2 and 3 end where their checksums begin
+  const bool has_checksums = format >= 2;
+  std::unique_ptr<std::streambuf> verifying_buffer;  // With --verify, checks the blocks that the loader reads
+  const uint64_t num_content_bytes = has_checksums ? check_checksummed_file(filename, file, verifying_buffer) : 0;
+  const uint64_t height = read_uint64(file);
+  const uint64_t width = read_uint64(file);
+  this->num_cells = get_num_map_cells(height, width);
+  this->height = static_cast<CellIndexType>(height);
+  this->width = static_cast<CellIndexType>(width);
   this->input_dim = static_cast<IndexType>(read_uint64(file));
-  this->num_cells = this->height * this->width;
-  this->size = this->num_cells * this->input_dim;
+  this->init_cell_range();
+  this->size = static_cast<size_t>(this->num_local_cells) * this->input_dim;
   this->array.clear();
   size_t required_bytes = this->size * sizeof(Float);
   try {
@@ -322,17 +838,46 @@ void Codebook::load_from_file(const std::string& filename)
   }
 
   try {
-    file.read((char*) this->array.data(), this->size * sizeof(Float));
-  } catch ( std::exception const & e ) {
+    const uint64_t begin = file.tellg();
+    if (is_compressed)
+    {
+      // Decompress the cells of this process straight into the codebook
+      file.seekg(0, std::ios::end);
+      const uint64_t end = has_checksums ? num_content_bytes : static_cast<uint64_t>(file.tellg());
+      if (end < begin)
+        std::__throw_runtime_error("Codebook file is truncated");
+      std::vector<char> bytes(end - begin);
+      file.seekg(begin);
+      file.read(bytes.data(), bytes.size());
+      if (!file)
+        std::__throw_runtime_error("Codebook file is truncated");
+      decompress_codebook_values(bytes.data(), bytes.size(), this->num_cells, this->input_dim, this->array.data(), this->first_cell, this->first_cell + this->num_local_cells);
+    }
+    else
+    {
+      if (has_checksums && num_content_bytes != begin + static_cast<uint64_t>(this->num_cells) * this->input_dim * sizeof(Float))
+        std::__throw_runtime_error("Codebook file does not match its header");
+      file.seekg(static_cast<std::streamoff>(this->first_cell) * this->input_dim * sizeof(Float), std::ios::cur);
+      file.read((char*) this->array.data(), this->size * sizeof(Float));
+      if (!file)
+        std::__throw_runtime_error("Codebook file is truncated");
+    }
+  } catch ( std::exception const & ) {
     this->array.clear();
     file.close();
-    throw e;
+    throw;  // Keep the type and message of the error
   }
 
   file.close();
 }
 
 
+void Codebook::place_on_numa_nodes() const
+{
+  interleave_on_numa_nodes(this->array.data(), this->array.size() * sizeof(Float));
+}
+
+
 Float Codebook::get_value(IndexPointerType index)
 {
   if (index < this->size) {
@@ -343,6 +888,14 @@ Float Codebook::get_value(IndexPointerType index)
 }
 
 
+void Codebook::set_values(const std::vector<Float>& values)
+{
+  if (values.size() != this->size)
+    std::__throw_length_error("Codebook values have the wrong size");
+  this->array.assign(values.begin(), values.end());
+}
+
+
 // static Float product_with_weights(const IndexType* const indices, const IndexType num_non_zero, const Float* const values, const WeightType* const weights)
 // {
 //     Float result = 0.;
@@ -365,7 +918,7 @@ static Float product_with_weights(const IndexType* const indices, const IndexTyp
       const IndexType idx = indices[it];
       if (idx < effective_input_dim)
       {
-        result += values[idx] * weights[idx];
+        result += values[idx] * weights[it];
       } 
       else 
       {
@@ -421,15 +974,15 @@ void Codebook::find_best_matching_units(
   std::fill_n(best_matching_units, data.num_rows, 0);
   std::fill_n(distances, data.num_rows, MAX_REAL_DISTANCE);
   
-  for (size_t cell_index = 0; cell_index < this->num_cells; ++cell_index)
+  for (size_t cell_index = this->first_cell; cell_index < this->first_cell + this->num_local_cells; ++cell_index)
   {
     // See https://stackoverflow.com/a/34488841
-    const Float* const w = &this->array[cell_index * this->input_dim];
+    const Float* const w = &this->array[static_cast<size_t>(cell_index - this->first_cell) * this->input_dim];
 
     const Float w_squared = vec_squared(w, this->input_dim);
 
-    #pragma omp parallel for
-    for (IndexPointerType row = 0; row < data.num_rows; ++row)
+    parallel_for("find_best_matching_units", 0, data.num_rows, [&](const size_t first_row, const size_t end_row, int) {
+    for (IndexPointerType row = first_row; row < end_row; ++row)
     {
       const IndexType* const x = data.indices_in_row(row);     // Address of the beginning of the array of columns-with-value-indices
       const WeightType* const weights = data.weights_in_row(row);     // Address of the beginning of the array of weight-indices
@@ -455,16 +1008,39 @@ void Codebook::find_best_matching_units(
         distances[row] = distance;
       }
     }
+    }, this->parallel_settings);
   }
+  merge_best_matching_units(best_matching_units, distances, nullptr, nullptr, data.num_rows);
 
   if (need_correct_distances)
   {
-    #pragma omp parallel for
-    for (IndexType row = 0; row < static_cast<IndexType>(data.num_rows); ++row)
+    parallel_for("find_best_matching_units", 0, data.num_rows, [&](const size_t first_row, const size_t end_row, int) {
+      for (IndexPointerType row = first_row; row < end_row; ++row)
+      {
+        distances[row] = std::max(0.f, distances[row] + data._sum_of_squares[row]);
+      }
+    }, this->parallel_settings);
+  }
+}
+
+
+// Clamp the squared distances of the best and next-best matching units, which rounding can make 
+// negative, at zero. The searches compare the unclamped distances, also across the cell shards, 
+// so that ties resolve the same way, and only the reported distances are clamped.
+static void clamp_distances(
+  Float* const distances, 
+  Float* const next_distances, 
+  const IndexPointerType num_rows, 
+  const ParallelSettings& parallel_settings
+)
+{
+  parallel_for("clamp_distances", 0, num_rows, [&](const size_t first_row, const size_t end_row, int) {
+    for (size_t row = first_row; row < end_row; ++row)
     {
-      distances[row] = std::max(0.f, distances[row] + data._sum_of_squares[row]);
+      distances[row] = std::max(0.f, distances[row]);
+      next_distances[row] = std::max(0.f, next_distances[row]);
     }
-  }
+  }, parallel_settings);
 }
 
 
@@ -486,15 +1062,15 @@ void Codebook::find_best_and_next_best_matching_units(
 
   const auto effective_input_dim = (train_vocab_cutoff > 0 ? train_vocab_cutoff : this->input_dim);
   
-  for (CellIndexType cell_index = 0; cell_index < this->num_cells; ++cell_index)
+  for (CellIndexType cell_index = this->first_cell; cell_index < this->first_cell + this->num_local_cells; ++cell_index)
   {
     // See https://stackoverflow.com/a/34488841
-    const Float* const w = &this->array[cell_index * effective_input_dim];
+    const Float* const w = &this->array[static_cast<size_t>(cell_index - this->first_cell) * this->input_dim];
 
     const Float w_squared = vec_squared(w, effective_input_dim);
 
-    #pragma omp parallel for
-    for (IndexPointerType row = 0; row < data.num_rows; ++row)
+    parallel_for("find_best_and_next_best_matching_units", 0, data.num_rows, [&](const size_t first_row, const size_t end_row, int) {
+    for (IndexPointerType row = first_row; row < end_row; ++row)
     {
       const IndexType* const indices = data.indices_in_row(row);     // Address of the beginning of the array of columns-with-value-indices
       const WeightType* const weights = data.weights_in_row(row);     // Address of the beginning of the array of weight-indices
@@ -524,160 +1100,505 @@ void Codebook::find_best_and_next_best_matching_units(
         next_best_matching_units[row] = best_matching_units[row];
         next_distances[row] = distances[row];
         best_matching_units[row] = cell_index;
-        distances[row] = std::max(0.f, distance);
+        distances[row] = distance;
       }
     }
+    }, this->parallel_settings);
   }
+  merge_best_matching_units(best_matching_units, distances, next_best_matching_units, next_distances, data.num_rows);
+  clamp_distances(distances, next_distances, data.num_rows, this->parallel_settings);
 }
 
 
-void Codebook::apply_batch_som_update(
+void find_best_and_next_best_matching_units(
+    const BinarySparseMatrix& data,
+    const std::vector<BestMatchingUnitSearch>& searches,
+    const ParallelSettings& parallel_settings
+  )
+{
+  assert (data._sum_of_squares);
+
+  // The squared norms of the cells do not depend on the rows
+  std::vector<std::vector<Float>> w_squared(searches.size());
+  for (size_t s = 0; s < searches.size(); ++s)
+  {
+    const auto& search = searches[s];
+    const Codebook& codebook = *search.codebook;
+    assert (codebook.get_input_dim() == data.num_cols);
+
+    std::fill_n(search.best_matching_units, data.num_rows, 0);
+    std::fill_n(search.next_best_matching_units, data.num_rows, 0);
+    std::fill_n(search.distances, data.num_rows, MAX_REAL_DISTANCE);
+    std::fill_n(search.next_distances, data.num_rows, MAX_REAL_DISTANCE);
+
+    const auto effective_input_dim = (search.train_vocab_cutoff > 0 ? search.train_vocab_cutoff : codebook.get_input_dim());
+    w_squared[s].resize(codebook.get_num_local_cells());
+    for (CellIndexType local_cell = 0; local_cell < codebook.get_num_local_cells(); ++local_cell)
+      w_squared[s][local_cell] = vec_squared(&codebook.get_values()[static_cast<size_t>(local_cell) * codebook.get_input_dim()], effective_input_dim);
+  }
+
+  const IndexPointerType num_blocks = (data.num_rows + MULTI_CODEBOOK_ROW_BLOCK_SIZE - 1) / MULTI_CODEBOOK_ROW_BLOCK_SIZE;
+
+  // Blocks take longer the more non-zero entries their rows have, which the thread pool balances by stealing
+  ParallelSettings block_settings = parallel_settings;
+  if (block_settings.grain_size == 0)
+    block_settings.grain_size = 1;
+
+  parallel_for("find_best_and_next_best_matching_units", 0, num_blocks, [&](const size_t first_block, const size_t end_block, int) {
+  for (IndexPointerType block = first_block; block < end_block; ++block)
+  {
+    const IndexPointerType first_row = block * MULTI_CODEBOOK_ROW_BLOCK_SIZE;
+    const IndexPointerType end_row = std::min<IndexPointerType>(first_row + MULTI_CODEBOOK_ROW_BLOCK_SIZE, data.num_rows);
+
+    for (size_t s = 0; s < searches.size(); ++s)
+    {
+      const auto& search = searches[s];
+      const Codebook& codebook = *search.codebook;
+      const IndexType input_dim = codebook.get_input_dim();
+      const auto effective_input_dim = (search.train_vocab_cutoff > 0 ? search.train_vocab_cutoff : input_dim);
+
+      // Same order of cells for every row as in `Codebook::find_best_and_next_best_matching_units`
+      for (CellIndexType local_cell = 0; local_cell < codebook.get_num_local_cells(); ++local_cell)
+      {
+        const CellIndexType cell_index = codebook.get_first_cell() + local_cell;
+        const Float* const w = &codebook.get_values()[static_cast<size_t>(local_cell) * input_dim];
+
+        for (IndexPointerType row = first_row; row < end_row; ++row)
+        {
+          const IndexType* const indices = data.indices_in_row(row);
+          const WeightType* const weights = data.weights_in_row(row);
+          const IndexType num_non_zero_in_row = data.num_indices_in_row(row);
+
+          if (num_non_zero_in_row == 0)
+            continue;
+
+          if (indices[0] >= effective_input_dim)
+            continue;
+
+          Float distance;
+          if (data.has_weights())
+          {
+            distance = w_squared[s][local_cell] - 2 * product_with_weights(indices, num_non_zero_in_row, w, weights, effective_input_dim) + data._sum_of_squares[row];
+          } else {
+            distance = w_squared[s][local_cell] - 2 * product(indices, num_non_zero_in_row, w, effective_input_dim) + data._sum_of_squares[row];
+          }
+
+          if (distance < search.distances[row])
+          {
+            search.next_best_matching_units[row] = search.best_matching_units[row];
+            search.next_distances[row] = search.distances[row];
+            search.best_matching_units[row] = cell_index;
+            search.distances[row] = distance;
+          }
+        }
+      }
+    }
+  }
+  }, block_settings);
+
+  for (const auto& search : searches)
+  {
+    merge_best_matching_units(search.best_matching_units, search.distances, search.next_best_matching_units, search.next_distances, data.num_rows);
+    clamp_distances(search.distances, search.next_distances, data.num_rows, parallel_settings);
+  }
+}
+
+
+// Add the influence of all rows on `cell_index` to `numerator` and `denominator`, and return the latter
+static inline Float accumulate_batch_som_update(
   const BinarySparseMatrix& data, 
   const Neighbourhood& neighbourhood,
   const CellIndexType* const best_matching_units,
-  const IndexType train_vocab_cutoff
+  const CellIndexType cell_index,
+  const IndexType effective_input_dim,
+  Float* const numerator,
+  Float denominator
 )
 {
-  #pragma omp parallel
+  for (IndexPointerType row = 0; row < data.num_rows; ++row)
   {
-    const auto effective_input_dim = (train_vocab_cutoff > 0 ? train_vocab_cutoff : this->input_dim);
-    auto* const numerator = new Float[this->input_dim];
+    const IndexType* indices = data.indices_in_row(row);
+    const IndexType num_non_zero_in_row = data.num_indices_in_row(row);
 
-    #pragma omp for
-    for (CellIndexType cell_index = 0; cell_index < this->num_cells; ++cell_index) 
-    {      
-      Float denominator = 0.f;
-      std::fill_n(numerator, this->input_dim, 0.f);
+    const Float learning_rate = neighbourhood.influence(best_matching_units[row], cell_index);
 
-      for (IndexPointerType row = 0; row < data.num_rows; ++row)
-      {
-        const IndexType* indices = data.indices_in_row(row);
-        const IndexType num_non_zero_in_row = data.num_indices_in_row(row);
+    if (learning_rate <= 0.)
+      continue;
 
-        const Float learning_rate = neighbourhood.influence(best_matching_units[row], cell_index);
+    denominator += learning_rate;
+    for (size_t i = 0; i < num_non_zero_in_row; ++i)
+    {
+      if (indices[i] >= effective_input_dim)
+        break;
+      numerator[indices[i]] += learning_rate;  // * 1.0 (input data is binary)
+    }
+  }
+  return denominator;
+}
 
-        if (learning_rate <= 0.)
-          continue;
 
-        denominator += learning_rate;
-        for (size_t i = 0; i < num_non_zero_in_row; ++i)
-        {
-          if (indices[i] >= effective_input_dim)
-            break;
-          numerator[indices[i]] += learning_rate;  // * 1.0 (input data is binary)
-        }
-      }
+void Codebook::apply_batch_som_update(
+  const BinarySparseMatrix& data, 
+  const Neighbourhood& neighbourhood,
+  const CellIndexType* const best_matching_units,
+  const IndexType train_vocab_cutoff
+)
+{
+  if (are_rows_distributed())
+  {
+    this->apply_distributed_batch_som_update(data, neighbourhood, best_matching_units, train_vocab_cutoff);
+    return;
+  }
+
+  const auto effective_input_dim = (train_vocab_cutoff > 0 ? train_vocab_cutoff : this->input_dim);
+  Float* const numerators = this->update_scratch.get(get_num_parallel_threads(this->parallel_settings) * static_cast<size_t>(this->input_dim));
+
+  parallel_for("apply_batch_som_update", this->first_cell, this->first_cell + this->num_local_cells, [&](const size_t first_cell, const size_t end_cell, const int thread) {
+    Float* const numerator = &numerators[thread * static_cast<size_t>(this->input_dim)];
+    for (CellIndexType cell_index = first_cell; cell_index < end_cell; ++cell_index) 
+    {      
+      std::fill_n(numerator, this->input_dim, 0.f);
+      const Float denominator = accumulate_batch_som_update(data, neighbourhood, best_matching_units, cell_index, effective_input_dim, numerator, 0.f);
 
       if (denominator != 0)
       {
-        Float * const w = &this->array[cell_index * this->input_dim];
+        Float * const w = &this->array[static_cast<size_t>(cell_index - this->first_cell) * this->input_dim];
         for (IndexType i = 0; i < this->input_dim; ++i)
         {
           w[i] = numerator[i] / denominator;
         }
       }
     }
-    delete [] numerator;
-  }
+  }, this->parallel_settings);
 }
 
 
-Float Codebook::quantization_error(
-  Float* const distances, 
-  IndexPointerType const num_rows
-) const
+void Codebook::apply_distributed_batch_som_update(
+  const BinarySparseMatrix& data, 
+  const Neighbourhood& neighbourhood,
+  const CellIndexType* const best_matching_units,
+  const IndexType train_vocab_cutoff
+)
 {
-  Float error = 0;
-  for (IndexPointerType row = 0; row < num_rows; ++row)
+  const auto effective_input_dim = (train_vocab_cutoff > 0 ? train_vocab_cutoff : this->input_dim);
+
+  // Floating-point sums depend on their order, so an allreduce of the partial sums would not
+  // reproduce the single-process result. Instead, each process continues the numerators and 
+  // denominators of the previous process with its own rows. The cells are split into blocks, 
+  // such that process k can work on one block while process k+1 works on the previous one.
+  const int num_row_shards = get_num_row_shards();
+  const size_t values_per_cell = static_cast<size_t>(this->input_dim) + 1;
+  const auto cells_per_block = static_cast<CellIndexType>(std::max<size_t>(1, std::min<size_t>(
+    MAX_DISTRIBUTED_UPDATE_BLOCK_SIZE / values_per_cell, 
+    (this->num_local_cells + 4 * num_row_shards - 1) / (4 * num_row_shards)
+  )));
+  std::vector<Float> sums(cells_per_block * values_per_cell);
+  const bool is_last_row_shard = get_row_shard() == num_row_shards - 1;
+
+  for (size_t first_block_cell = 0; first_block_cell < this->num_local_cells; first_block_cell += cells_per_block)
   {
-    assert (distances[row] >= 0.f);
-    error += squared(distances[row]);
-  }
-  error = std::sqrt(error) / num_rows;
-  return error;
-}
+    const auto num_block_cells = static_cast<CellIndexType>(std::min<size_t>(cells_per_block, this->num_local_cells - first_block_cell));
+    const size_t num_block_values = num_block_cells * values_per_cell;
 
+    if (get_row_shard() == 0)
+      std::fill_n(sums.data(), num_block_values, 0.f);
+    receive_from_previous_process(sums.data(), num_block_values);
 
-Float Codebook::gap_error(CellIndexType* const best_matching_units, const IndexPointerType num_rows) const
-{
-  auto* cell_in_use = new bool[this->num_cells];
-  std::fill_n(cell_in_use, this->num_cells, false);
-  CellIndexType num_cells_used = 0;
-  for (IndexPointerType row = 0; row < num_rows && num_cells_used < this->num_cells; ++row)
-  {
-    if (!cell_in_use[best_matching_units[row]])
+    parallel_for("apply_batch_som_update", 0, num_block_cells, [&](const size_t first, const size_t end, int) {
+    for (CellIndexType block_cell = first; block_cell < end; ++block_cell)
     {
-      cell_in_use[best_matching_units[row]] = true;
-      num_cells_used += 1;
+      Float* const numerator = &sums[block_cell * values_per_cell];
+      numerator[this->input_dim] = accumulate_batch_som_update(
+        data, neighbourhood, best_matching_units, static_cast<CellIndexType>(this->first_cell + first_block_cell + block_cell), 
+        effective_input_dim, numerator, numerator[this->input_dim]
+      );
     }
+    }, this->parallel_settings);
+
+    send_to_next_process(sums.data(), num_block_values);
+
+    if (!is_last_row_shard)
+      continue;
+
+    // The last row shard has the sums over all rows
+    parallel_for("apply_batch_som_update", 0, num_block_cells, [&](const size_t first, const size_t end, int) {
+      for (size_t block_cell = first; block_cell < end; ++block_cell)
+      {
+        const Float* const numerator = &sums[block_cell * values_per_cell];
+        const Float denominator = numerator[this->input_dim];
+        if (denominator != 0)
+        {
+          Float * const w = &this->array[(first_block_cell + block_cell) * this->input_dim];
+          for (IndexType i = 0; i < this->input_dim; ++i)
+          {
+            w[i] = numerator[i] / denominator;
+          }
+        }
+      }
+    }, this->parallel_settings);
   }
-  delete [] cell_in_use;
-  return static_cast<Float>(this->num_cells - num_cells_used) / this->num_cells;
+
+  broadcast(this->array.data(), this->size, num_row_shards - 1);
 }
 
 
-Float Codebook::assign_dead_cells(CellIndexType* best_matching_units, Float* const distances, const IndexPointerType num_rows) const
+size_t Codebook::get_metrics_scratch_bytes(const bool with_dead_cells) const
 {
-  auto* cell_in_use = new bool[this->num_cells];
-  std::fill_n(cell_in_use, this->num_cells, false);
-  CellIndexType num_cells_used = 0;
+  const size_t num_threads = get_num_parallel_threads(this->parallel_settings);
+  return num_threads * this->num_cells * sizeof(char) + this->num_cells * sizeof(bool)
+    + (with_dead_cells ? num_threads * 2 * this->num_cells * sizeof(Float) : 0) + 3 * ARENA_ALIGNMENT;
+}
 
-  // Find unused cells
-  for (IndexPointerType row = 0; row < num_rows && num_cells_used < this->num_cells; ++row)
-  {
-    if (!cell_in_use[best_matching_units[row]])
-    {
-      cell_in_use[best_matching_units[row]] = true;
-      num_cells_used += 1;
-    }
-  }
 
-  const CellIndexType num_cells_unused = this->num_cells - num_cells_used;
-  if (num_cells_unused == 0 || num_cells_unused > num_rows)
-  {
-    delete [] cell_in_use;
-    return 0.f;
-  }
+MetricsScratch Codebook::allocate_metrics_scratch(Arena& arena, const bool with_dead_cells) const
+{
+  MetricsScratch scratch;
+  scratch.num_threads = get_num_parallel_threads(this->parallel_settings);
+  scratch.cells_in_use = arena.allocate<char>(static_cast<size_t>(scratch.num_threads) * this->num_cells);
+  scratch.cell_in_use = arena.allocate<bool>(this->num_cells);
+  // Every block of rows keeps the largest distances of its rows in a buffer for twice as many distances
+  // as there are cells, which it prunes with nth_element whenever it is full
+  if (with_dead_cells)
+    scratch.largest_distances = arena.allocate<Float>(static_cast<size_t>(scratch.num_threads) * 2 * this->num_cells);
+  return scratch;
+}
 
-  std::cout << "    Found " << num_cells_unused << " dead units" << std::endl;
 
-  // Find worst matching inputs (those with the largest distances)
-  auto* largest_distances = new Float[num_cells_unused];
-  std::partial_sort_copy(
-    distances, distances + num_rows, 
-    largest_distances, largest_distances + num_cells_unused, 
-    std::greater<Float>()
+EpochMetrics Codebook::compute_metrics(
+  const CellIndexType* const best_matching_units, 
+  const Float* const distances,
+  const CellIndexType* const previous_best_matching_units,
+  const IndexPointerType num_rows,
+  const IndexPointerType sample_strides,
+  const IndexPointerType sample_offset,
+  bool* const cell_in_use,
+  const MetricsScratch* const scratch
+) const
+{
+  return this->compute_fused_metrics(
+    best_matching_units, nullptr, distances, previous_best_matching_units, num_rows, sample_strides, sample_offset, cell_in_use, scratch
   );
-  const Float distance_threshold = largest_distances[num_cells_unused - 1];
-  delete [] largest_distances;
-  std::cout << "    Distance threshold: " << distance_threshold << std::endl;
+}
 
-  auto* worst_matching_inputs = new IndexPointerType[num_cells_unused];
-  CellIndexType i = 0;
-  for (IndexPointerType row = 0; row < num_rows && i < num_cells_unused; ++row)
-  {
-    if (distances[row] >= distance_threshold)
+
+EpochMetrics Codebook::compute_metrics_and_assign_dead_cells(
+  CellIndexType* const best_matching_units, 
+  const Float* const distances,
+  const CellIndexType* const previous_best_matching_units,
+  const IndexPointerType num_rows,
+  const IndexPointerType sample_strides,
+  const IndexPointerType sample_offset,
+  const MetricsScratch* const scratch
+) const
+{
+  return this->compute_fused_metrics(
+    best_matching_units, best_matching_units, distances, previous_best_matching_units, num_rows, sample_strides, sample_offset, nullptr, scratch
+  );
+}
+
+
+EpochMetrics Codebook::compute_fused_metrics(
+  const CellIndexType* const best_matching_units, 
+  CellIndexType* const reassigned_best_matching_units,
+  const Float* const distances,
+  const CellIndexType* const previous_best_matching_units,
+  const IndexPointerType num_rows,
+  const IndexPointerType sample_strides,
+  const IndexPointerType sample_offset,
+  bool* const cell_in_use,
+  const MetricsScratch* const scratch
+) const
+{
+  const bool assigns_dead_cells = reassigned_best_matching_units != nullptr;
+  assert (!assigns_dead_cells || (best_matching_units == reassigned_best_matching_units && distances));
+  // Calls outside of the training allocate their own scratch
+  Arena arena(scratch ? 0 : this->get_metrics_scratch_bytes(assigns_dead_cells));
+  const MetricsScratch own_scratch = scratch ? MetricsScratch() : this->allocate_metrics_scratch(arena, assigns_dead_cells);
+  const MetricsScratch& buffers = scratch ? *scratch : own_scratch;
+  if (assigns_dead_cells && !buffers.largest_distances)
+    std::__throw_invalid_argument("The metrics scratch has no space to assign dead cells");
+
+  // Every block of rows is summed with its own buffers, and the sums of the blocks are added in order,
+  // so the result depends neither on the scheduling nor on the parallel backend
+  const int num_threads = buffers.num_threads;
+  const bool has_diffusion = best_matching_units && previous_best_matching_units;
+  const auto is_sampled = [&](const IndexPointerType row) { return sample_strides <= 1 || row % sample_strides == sample_offset; };
+  const auto get_cell_distance = [&](const CellIndexType source_cell, const CellIndexType target_cell) -> uint64_t {
+    if (source_cell == target_cell)
+      return 0;
+    return this->distance(source_cell / this->width, source_cell % this->width, target_cell / this->width, target_cell % this->width, this->width, this->height);
+  };
+  std::vector<Double> squared_distances(num_threads, 0.);
+  std::vector<uint64_t> totals(2 * num_threads, 0);  // Diffusion distance and number of sampled rows per block
+  std::vector<size_t> num_largest_distances(num_threads, 0);
+  if (best_matching_units)
+    std::fill_n(buffers.cells_in_use, static_cast<size_t>(num_threads) * this->num_cells, 0);
+
+  parallel_for("Codebook::compute_metrics", 0, num_threads, [&](const size_t first_block, const size_t end_block, int) {
+    for (size_t block = first_block; block < end_block; ++block)
     {
-      worst_matching_inputs[i++] = row;
+      char* const block_cells_in_use = best_matching_units ? &buffers.cells_in_use[block * this->num_cells] : nullptr;
+      Float* const block_largest_distances = assigns_dead_cells ? &buffers.largest_distances[block * 2 * this->num_cells] : nullptr;
+      size_t num_block_largest_distances = 0;
+      Double block_squared_distances = 0.;
+      uint64_t total_distance = 0;
+      uint64_t num_sampled_rows = 0;
+
+      for (IndexPointerType row = num_rows * block / num_threads; row < num_rows * (block + 1) / num_threads; ++row)
+      {
+        if (best_matching_units)
+          block_cells_in_use[best_matching_units[row]] = 1;
+        // No more cells than the map has can be dead
+        if (block_largest_distances)
+        {
+          block_largest_distances[num_block_largest_distances++] = distances[row];
+          if (num_block_largest_distances == 2 * this->num_cells)
+          {
+            std::nth_element(block_largest_distances, block_largest_distances + this->num_cells - 1, block_largest_distances + num_block_largest_distances, std::greater<Float>());
+            num_block_largest_distances = this->num_cells;
+          }
+        }
+        if (!is_sampled(row))
+          continue;
+
+        ++num_sampled_rows;
+        if (distances)
+        {
+          assert (distances[row] >= 0.f);
+          block_squared_distances += squared(distances[row]);
+        }
+        if (has_diffusion)
+          total_distance += get_cell_distance(previous_best_matching_units[row], best_matching_units[row]);
+      }
+      squared_distances[block] = block_squared_distances;
+      totals[2 * block] = total_distance;
+      totals[2 * block + 1] = num_sampled_rows;
+      num_largest_distances[block] = num_block_largest_distances;
     }
+  }, this->parallel_settings);
+
+  for (int thread = 1; thread < num_threads; ++thread)
+  {
+    squared_distances[0] += squared_distances[thread];
+    totals[0] += totals[2 * thread];
+    totals[1] += totals[2 * thread + 1];
   }
 
-  // Assign unused cells to one of the worst matching inputs
-  i = 0;
-  for (CellIndexType cell = 0; cell < this->num_cells && i < num_cells_unused; ++cell)
+  EpochMetrics metrics;
+  if (best_matching_units)
   {
-    if (!cell_in_use[cell])
+    bool* const is_used = cell_in_use ? cell_in_use : buffers.cell_in_use;
+    parallel_for("Codebook::compute_metrics", 0, this->num_cells, [&](const size_t first_cell, const size_t end_cell, int) {
+      for (CellIndexType cell = first_cell; cell < end_cell; ++cell)
+      {
+        bool is_cell_used = false;
+        for (int thread = 0; thread < num_threads && !is_cell_used; ++thread)
+          is_cell_used = buffers.cells_in_use[static_cast<size_t>(thread) * this->num_cells + cell];
+        is_used[cell] = is_cell_used;
+      }
+    }, this->parallel_settings);
+    if (are_rows_distributed())
+      all_reduce_or(is_used, this->num_cells);
+    const auto num_cells_used = std::count(is_used, is_used + this->num_cells, true);
+    metrics.gap_error = static_cast<Float>(this->num_cells - num_cells_used) / this->num_cells;
+
+    uint64_t num_total_rows = num_rows;
+    if (assigns_dead_cells)
+      all_reduce_sum(&num_total_rows, 1);
+    const CellIndexType num_cells_unused = this->num_cells - static_cast<CellIndexType>(num_cells_used);
+    if (assigns_dead_cells && num_cells_unused > 0 && num_cells_unused <= num_total_rows)
     {
-      const IndexPointerType row = worst_matching_inputs[i++];
-      best_matching_units[row] = cell;
+      std::cout << "    Found " << num_cells_unused << " dead units" << std::endl;
+
+      // Find worst matching inputs (those with the largest distances) among the candidates of all threads
+      Float* const largest_distances = buffers.largest_distances;
+      size_t num_candidates = 0;
+      for (int thread = 0; thread < num_threads; ++thread)
+      {
+        const Float* const thread_largest_distances = &largest_distances[static_cast<size_t>(thread) * 2 * this->num_cells];
+        std::copy(thread_largest_distances, thread_largest_distances + num_largest_distances[thread], largest_distances + num_candidates);
+        num_candidates += num_largest_distances[thread];
+      }
+      if (num_candidates >= num_cells_unused)
+      {
+        std::nth_element(largest_distances, largest_distances + num_cells_unused - 1, largest_distances + num_candidates, std::greater<Float>());
+        num_candidates = num_cells_unused;
+      }
+      Float distance_threshold = largest_distances[num_cells_unused - 1];
+      if (are_rows_distributed())
+      {
+        // The largest distances of all rows are among the largest distances of the individual processes
+        auto all_largest_distances = all_gather(std::vector<Float>(largest_distances, largest_distances + num_candidates));
+        std::nth_element(
+          all_largest_distances.begin(), 
+          all_largest_distances.begin() + num_cells_unused - 1, 
+          all_largest_distances.end(), 
+          std::greater<Float>()
+        );
+        distance_threshold = all_largest_distances[num_cells_unused - 1];
+      }
+      std::cout << "    Distance threshold: " << distance_threshold << std::endl;
+
+      std::vector<IndexPointerType> worst_matching_inputs;
+      worst_matching_inputs.reserve(num_cells_unused);
+      for (IndexPointerType row = 0; row < num_rows && worst_matching_inputs.size() < num_cells_unused; ++row)
+      {
+        if (distances[row] >= distance_threshold)
+          worst_matching_inputs.push_back(row);
+      }
+
+      // Assign unused cells to one of the worst matching inputs, where the inputs 
+      // of processes with a lower rank come first
+      const uint64_t first_unused_cell = exclusive_prefix_sum(worst_matching_inputs.size());
+      uint64_t unused_cell = 0;
+      size_t i = 0;
+      for (CellIndexType cell = 0; cell < this->num_cells && i < worst_matching_inputs.size(); ++cell)
+      {
+        if (!is_used[cell] && unused_cell++ >= first_unused_cell)
+        {
+          const IndexPointerType row = worst_matching_inputs[i++];
+          // The diffusion error is the one after the assignment
+          if (has_diffusion && is_sampled(row))
+            totals[0] = totals[0] - get_cell_distance(previous_best_matching_units[row], best_matching_units[row]) + get_cell_distance(previous_best_matching_units[row], cell);
+          reassigned_best_matching_units[row] = cell;
+        }
+      }
     }
   }
 
-  delete [] worst_matching_inputs;
-  delete [] cell_in_use;
+  uint64_t row_totals[3] = {totals[0], totals[1], num_rows};
+  all_reduce_sum(row_totals, 3);
+  all_reduce_sum(squared_distances.data(), 1);
+  if (distances && row_totals[1] > 0)
+  {
+    // Scale the sum of the sampled rows up to all rows
+    const Double sum = squared_distances[0] * row_totals[2] / row_totals[1];
+    metrics.quantization_error = static_cast<Float>(std::sqrt(sum) / row_totals[2]);
+  }
+  if (has_diffusion && row_totals[1] > 0)
+    metrics.diffusion_error = static_cast<Float>(row_totals[0]) / static_cast<Float>(row_totals[1]);
+  return metrics;
+}
+
+
+Float Codebook::quantization_error(
+  Float* const distances, 
+  IndexPointerType const num_rows
+) const
+{
+  return this->compute_metrics(nullptr, distances, nullptr, num_rows).quantization_error;
+}
+
+
+Float Codebook::gap_error(CellIndexType* const best_matching_units, const IndexPointerType num_rows) const
+{
+  return this->compute_metrics(best_matching_units, nullptr, nullptr, num_rows).gap_error;
+}
+
 
-  // Return gap error
-  return static_cast<Float>(num_cells_unused) / this->num_cells;
+Float Codebook::assign_dead_cells(CellIndexType* best_matching_units, Float* const distances, const IndexPointerType num_rows) const
+{
+  return this->compute_metrics_and_assign_dead_cells(best_matching_units, distances, nullptr, num_rows).gap_error;
 }
 
 
@@ -687,21 +1608,7 @@ Float Codebook::diffusion_error(
     const IndexPointerType num_rows
   ) const
 {
-  IndexPointerType total_distance = 0;
-  for (IndexPointerType row = 0; row < num_rows; ++row)
-  {
-    const CellIndexType source_cell = previous_best_matching_units[row];
-    const CellIndexType target_cell = best_matching_units[row];
-    if (source_cell != target_cell)
-    {
-      CellIndexType y1 = source_cell / this->width,
-                x1 = source_cell % this->width,
-                y2 = target_cell / this->width,
-                x2 = target_cell % this->width;
-      total_distance += this->distance(y1, x1, y2, x2, this->width, this->height);
-    }
-  }
-  return static_cast<Float>(total_distance) / static_cast<Float>(num_rows);
+  return this->compute_metrics(best_matching_units, nullptr, previous_best_matching_units, num_rows).diffusion_error;
 }
 
 
@@ -712,100 +1619,337 @@ TopographicDiscontinuity::TopographicDiscontinuity(CellIndexType cell1, CellInde
 {}
 
 
-void train(
-  Codebook& codebook,
-  Neighbourhood& neighbourhood,
-  CorpusDataset& data,
-  const unsigned int num_epochs,
-  std::ofstream& convergence_log_stream,
-  const std::string& directory,
-  const bool respect_lower_bound,
-  const IndexType train_vocab_cutoff,
-  const unsigned int dead_cell_update_strides
-)
+Trainer::Trainer(
+    Codebook& codebook,
+    Neighbourhood& neighbourhood,
+    const CorpusDataset& data,
+    const unsigned int num_epochs,
+    std::ofstream& convergence_log_stream,
+    const std::string& directory,
+    const bool respect_lower_bound,
+    const IndexType train_vocab_cutoff,
+    const unsigned int dead_cell_update_strides,
+    TrainingProfiler* const profiler,
+    const TrainingCheckpoint* const resume_checkpoint,
+    Checkpointer* const checkpointer,
+    const unsigned int first_epoch,
+    EarlyStopping* const early_stopping,
+    AsyncWriter* const writer,
+    const IndexPointerType metrics_sample_strides
+  ) :
+  codebook(codebook),
+  neighbourhood(neighbourhood),
+  data(data),
+  num_epochs(num_epochs),
+  convergence_log_stream(convergence_log_stream),
+  directory(directory),
+  respect_lower_bound(respect_lower_bound),
+  train_vocab_cutoff(train_vocab_cutoff),
+  dead_cell_update_strides(dead_cell_update_strides),
+  checkpointer(checkpointer),
+  early_stopping(early_stopping),
+  writer(writer),
+  metrics_sample_strides(std::max<IndexPointerType>(1, metrics_sample_strides)),
+  default_profiler(default_timer),
+  profiler(profiler ? *profiler : default_profiler),
+  epoch(first_epoch),
+  has_previous_best_matching_units(false),
+  arena(data.num_rows * (3 * sizeof(CellIndexType) + 2 * sizeof(Float)) + 5 * ARENA_ALIGNMENT + codebook.get_metrics_scratch_bytes(dead_cell_update_strides > 0)),
+  best_matching_units(arena.allocate<CellIndexType>(data.num_rows)),
+  previous_best_matching_units(arena.allocate<CellIndexType>(data.num_rows)),
+  distances(arena.allocate<Float>(data.num_rows)),
+  next_best_matching_units(arena.allocate<CellIndexType>(data.num_rows)),
+  next_distances(arena.allocate<Float>(data.num_rows)),
+  metrics_scratch(codebook.allocate_metrics_scratch(arena, dead_cell_update_strides > 0)),
+  diffusion_error(0.f),
+  gap_error(0.f),
+  quantization_error(0.f),
+  topographic_error(0.f)
 {
   std::cout << "Training adaptive self-organizing map" << std::endl;
   assert (num_epochs > 1);
-  assert (convergence_log_stream.is_open());
+  assert (convergence_log_stream.is_open() || !is_root_process());
 
-  auto* best_matching_units = new CellIndexType[data.num_rows];
-  auto* previous_best_matching_units = new CellIndexType[data.num_rows];
-  auto* distances = new Float[data.num_rows];
-  auto* next_best_matching_units = new CellIndexType[data.num_rows];
-  auto* next_distances = new Float[data.num_rows];
-  Float diffusion_error = 0.f;
-  Float gap_error = 0.f;
-
-  convergence_log_stream << "Epoch\tUnixTime\tRadiusMin\tRadiusMax\tQuantizationError\tTopographicError\tGapError\tDiffusionError" << std::endl;
+  if (is_numa_placement_enabled())
+  {
+    // Each thread of the loops over the rows writes the entries of its own rows
+    codebook.place_on_numa_nodes();
+    split_over_numa_nodes(this->best_matching_units, data.num_rows, sizeof(CellIndexType));
+    split_over_numa_nodes(this->previous_best_matching_units, data.num_rows, sizeof(CellIndexType));
+    split_over_numa_nodes(this->distances, data.num_rows, sizeof(Float));
+    split_over_numa_nodes(this->next_best_matching_units, data.num_rows, sizeof(CellIndexType));
+    split_over_numa_nodes(this->next_distances, data.num_rows, sizeof(Float));
+  }
 
-  for (unsigned int epoch = 1; epoch <= num_epochs; ++epoch)
+  if (resume_checkpoint)
   {
-    std::cout << "Epoch " << epoch << " of " << num_epochs << std::endl;
+    std::cout << "Resuming after epoch " << resume_checkpoint->epoch << std::endl;
+    if (resume_checkpoint->previous_best_matching_units.size() != data.num_rows)
+      std::__throw_runtime_error("Checkpoint does not match the training data");
+    resume_checkpoint->restore(codebook, neighbourhood, this->previous_best_matching_units);
+    this->epoch = resume_checkpoint->epoch + 1;
+    // Early stopping may have shortened the training before the checkpoint
+    if (resume_checkpoint->num_scheduled_epochs > 0)
+      this->num_epochs = resume_checkpoint->num_scheduled_epochs;
+    if (early_stopping)
+      early_stopping->restore(resume_checkpoint->early_stopping);
+    this->has_previous_best_matching_units = true;
+  }
+
+  // When resuming, the logs already have their headers
+  if (this->epoch == 1)
+    convergence_log_stream << "Epoch\tUnixTime\tRadiusMin\tRadiusMax\tQuantizationError\tTopographicError\tGapError\tDiffusionError" << std::endl;
+  this->profiler.begin_training(data, codebook.get_num_cells(), codebook.get_input_dim(), this->epoch == 1);
+}
+
+
+Trainer::~Trainer()
+{
+  this->profiler.end_training();
+}
 
+
+BestMatchingUnitSearch Trainer::get_search() const
+{
+  return {
+    &this->codebook,
+    this->best_matching_units,
+    this->distances,
+    this->next_best_matching_units,
+    this->next_distances,
+    this->train_vocab_cutoff
+  };
+}
+
+
+void Trainer::begin_epoch()
+{
+  assert (!this->is_done());
+  // The epoch after the last one only evaluates the final error metrics
+  if (this->epoch <= this->num_epochs)
+    std::cout << "Epoch " << this->epoch << " of " << this->num_epochs << std::endl;
+  this->profiler.begin_epoch(this->epoch);
+}
+
+
+void Trainer::find_best_matching_units()
+{
+  if (this->epoch <= this->num_epochs)
     std::cout << "  Find best matching units" << std::endl;
-    codebook.find_best_and_next_best_matching_units(data, best_matching_units, distances, next_best_matching_units, next_distances, train_vocab_cutoff);
-    if (dead_cell_update_strides > 0 && epoch % dead_cell_update_strides == 0)
-    {
-      std::cout << "  Assign dead units" << std::endl;
-      gap_error = codebook.assign_dead_cells(best_matching_units, distances, data.num_rows);
-    } else {
-      gap_error = codebook.gap_error(best_matching_units, data.num_rows);
-    }
+  this->profiler.begin_phase(TrainingPhase::BEST_MATCHING_UNITS);
+  this->codebook.find_best_and_next_best_matching_units(
+    this->data, 
+    this->best_matching_units, 
+    this->distances, 
+    this->next_best_matching_units, 
+    this->next_distances, 
+    this->train_vocab_cutoff
+  );
+  this->profiler.end_phase();
+}
 
-    if (epoch > 1)
-    {
-      diffusion_error = codebook.diffusion_error(best_matching_units, previous_best_matching_units, data.num_rows);
-    }
-    std::copy(best_matching_units, best_matching_units + data.num_rows, previous_best_matching_units);
 
-    if (directory.length() > 0)
-    {
-      std::ofstream file;
-      std::stringstream preliminary_r_filename;
-      preliminary_r_filename << directory << "prelim-" << epoch - 1 << ".neighbourhood.bin";
-      neighbourhood.save_to_file(preliminary_r_filename.str());
-    }
+void Trainer::find_best_matching_units(const std::vector<Trainer*>& trainers)
+{
+  if (trainers.empty())
+    return;
 
-    std::cout << "  Apply batch-som update" << std::endl;
-    if (epoch < num_epochs)
-    {
-      codebook.apply_batch_som_update(data, neighbourhood, best_matching_units, train_vocab_cutoff);
-    } else {
-      codebook.apply_batch_som_update(data, neighbourhood, best_matching_units);
-    }
+  std::cout << "  Find best matching units of " << trainers.size() << " maps" << std::endl;
+  std::vector<BestMatchingUnitSearch> searches;
+  for (auto* trainer : trainers)
+  {
+    assert (&trainer->data == &trainers[0]->data);
+    searches.push_back(trainer->get_search());
+    // Every map accounts for the whole shared search
+    trainer->profiler.begin_phase(TrainingPhase::BEST_MATCHING_UNITS);
+  }
+  find_best_and_next_best_matching_units(trainers[0]->data, searches, trainers[0]->codebook.parallel_settings);
+  for (auto* trainer : trainers)
+    trainer->profiler.end_phase();
+}
 
-    std::cout << "  Update neighbourhoods" << std::endl;
-    Float topographic_error = neighbourhood.update(best_matching_units, next_best_matching_units, data.num_rows, respect_lower_bound);
-
-    // Log the current error metrics      
-    convergence_log_stream << epoch - 1 
-      << "\t" << get_unix_time() 
-      << "\t" << neighbourhood.get_radius_min()
-      << "\t" << neighbourhood.get_radius_max()
-      << "\t" << codebook.quantization_error(distances, data.num_rows) 
-      << "\t" << topographic_error 
-      << "\t" << gap_error
-      << "\t" << diffusion_error
-      << std::endl;
-  }
-
-  // Log the final error metrics
-  codebook.find_best_and_next_best_matching_units(data, best_matching_units, distances, next_best_matching_units, next_distances, train_vocab_cutoff);
-  gap_error = codebook.gap_error(best_matching_units,data.num_rows);
-  Float topographic_error = neighbourhood.update(best_matching_units, next_best_matching_units, data.num_rows, respect_lower_bound);
-  diffusion_error = codebook.diffusion_error(best_matching_units, previous_best_matching_units, data.num_rows);
-  convergence_log_stream << num_epochs 
-      << "\t" << get_unix_time() 
-      << "\t" << neighbourhood.get_radius_min()
-      << "\t" << neighbourhood.get_radius_max()
-      << "\t" << codebook.quantization_error(distances, data.num_rows) 
-      << "\t" << topographic_error 
-      << "\t" << gap_error
-      << "\t" << diffusion_error
-      << std::endl;
-  
-  delete [] best_matching_units;
-  delete [] distances;
-  delete [] next_best_matching_units;
-  delete [] next_distances;
+
+void Trainer::end_epoch()
+{
+  assert (!this->is_done());
+  const auto num_rows = this->data.num_rows;
+
+  if (this->epoch > this->num_epochs)
+  {
+    // Log the final error metrics, which are always exact
+    this->profiler.begin_phase(TrainingPhase::NEIGHBOURHOOD_UPDATE);
+    this->topographic_error = this->neighbourhood.update(this->best_matching_units, this->next_best_matching_units, num_rows, this->respect_lower_bound);
+    this->profiler.end_phase();
+    this->profiler.begin_phase(TrainingPhase::ERROR_METRICS);
+    const EpochMetrics metrics = this->codebook.compute_metrics(
+      this->best_matching_units, this->distances, this->has_previous_best_matching_units ? this->previous_best_matching_units : nullptr, num_rows,
+      1, 0, nullptr, &this->metrics_scratch
+    );
+    this->gap_error = metrics.gap_error;
+    if (this->has_previous_best_matching_units)
+      this->diffusion_error = metrics.diffusion_error;
+    this->quantization_error = metrics.quantization_error;
+    this->profiler.end_phase();
+    this->convergence_log_stream << this->num_epochs 
+        << "\t" << get_unix_time() 
+        << "\t" << this->neighbourhood.get_radius_min()
+        << "\t" << this->neighbourhood.get_radius_max()
+        << "\t" << this->quantization_error
+        << "\t" << this->topographic_error 
+        << "\t" << this->gap_error
+        << "\t" << this->diffusion_error
+        << std::endl;
+    this->profiler.record_errors(
+      this->num_epochs, this->neighbourhood.get_radius_min(), this->neighbourhood.get_radius_max(),
+      this->quantization_error, this->topographic_error, this->gap_error, this->diffusion_error
+    );
+    this->profiler.end_epoch();
+    ++this->epoch;
+    return;
+  }
+
+  const bool is_dead_cell_epoch = this->dead_cell_update_strides > 0 && this->epoch % this->dead_cell_update_strides == 0;
+  // The best matching units of a coarser map (before the map grew) are not comparable
+  const bool has_diffusion_error = this->has_previous_best_matching_units;
+  EpochMetrics metrics;
+  if (is_dead_cell_epoch)
+  {
+    // The pass of the error metrics also selects the rows that the dead cells are assigned to
+    this->profiler.begin_phase(TrainingPhase::DEAD_CELLS);
+    std::cout << "  Assign dead units" << std::endl;
+    metrics = this->codebook.compute_metrics_and_assign_dead_cells(
+      this->best_matching_units, this->distances, has_diffusion_error ? this->previous_best_matching_units : nullptr, num_rows,
+      this->metrics_sample_strides, this->epoch % this->metrics_sample_strides, &this->metrics_scratch
+    );
+  }
+  else
+  {
+    this->profiler.begin_phase(TrainingPhase::ERROR_METRICS);
+    metrics = this->codebook.compute_metrics(
+      this->best_matching_units, this->distances, has_diffusion_error ? this->previous_best_matching_units : nullptr, num_rows,
+      this->metrics_sample_strides, this->epoch % this->metrics_sample_strides, nullptr, &this->metrics_scratch
+    );
+  }
+  // The gap error before the dead cells were assigned
+  this->gap_error = metrics.gap_error;
+  if (has_diffusion_error)
+    this->diffusion_error = metrics.diffusion_error;
+  this->quantization_error = metrics.quantization_error;
+  std::copy(this->best_matching_units, this->best_matching_units + num_rows, this->previous_best_matching_units);
+  this->has_previous_best_matching_units = true;
+  this->profiler.end_phase();
+
+  if (this->directory.length() > 0 && is_root_process())
+  {
+    this->profiler.begin_phase(TrainingPhase::SNAPSHOT_IO);
+    std::stringstream preliminary_r_filename;
+    preliminary_r_filename << this->directory << "prelim-" << this->epoch - 1 << ".neighbourhood.bin";
+    if (this->writer)
+      this->neighbourhood.save_to_file(preliminary_r_filename.str(), *this->writer);
+    else
+      this->neighbourhood.save_to_file(preliminary_r_filename.str());
+    this->profiler.end_phase();
+  }
+
+  std::cout << "  Apply batch-som update" << std::endl;
+  this->profiler.begin_phase(TrainingPhase::BATCH_UPDATE);
+  if (this->epoch < this->num_epochs)
+  {
+    this->codebook.apply_batch_som_update(this->data, this->neighbourhood, this->best_matching_units, this->train_vocab_cutoff);
+  } else {
+    this->codebook.apply_batch_som_update(this->data, this->neighbourhood, this->best_matching_units);
+  }
+  this->profiler.end_phase();
+
+  std::cout << "  Update neighbourhoods" << std::endl;
+  this->profiler.begin_phase(TrainingPhase::NEIGHBOURHOOD_UPDATE);
+  this->topographic_error = this->neighbourhood.update(this->best_matching_units, this->next_best_matching_units, num_rows, this->respect_lower_bound);
+  this->profiler.end_phase();
+
+  // Log the current error metrics      
+  this->convergence_log_stream << this->epoch - 1 
+    << "\t" << get_unix_time() 
+    << "\t" << this->neighbourhood.get_radius_min()
+    << "\t" << this->neighbourhood.get_radius_max()
+    << "\t" << this->quantization_error
+    << "\t" << this->topographic_error 
+    << "\t" << this->gap_error
+    << "\t" << this->diffusion_error
+    << std::endl;
+  this->profiler.record_errors(
+    this->num_epochs, this->neighbourhood.get_radius_min(), this->neighbourhood.get_radius_max(),
+    this->quantization_error, this->topographic_error, this->gap_error, this->diffusion_error
+  );
+  this->profiler.end_epoch();
+
+  // Once the codebook has converged, shrink the radii to their final target within a few more epochs
+  if (
+    this->early_stopping && has_diffusion_error && this->epoch < this->num_epochs &&
+    this->early_stopping->update(this->epoch, this->diffusion_error, this->topographic_error, this->gap_error)
+  )
+  {
+    const unsigned int num_epochs = std::min(this->num_epochs, this->epoch + this->early_stopping->get_settings().num_final_epochs);
+    std::cout << "Converged after epoch " << this->epoch << ", stopping after epoch " << num_epochs << " of " << this->num_epochs << std::endl
+              << "  " << this->early_stopping->get_reason() << std::endl;
+    const Float radius_min = this->neighbourhood.get_radius_min() * this->neighbourhood.get_radius_scale();
+    this->neighbourhood.set_update_exponent(
+      this->early_stopping->get_update_exponent(radius_min, num_epochs - this->epoch, this->neighbourhood.get_update_exponent())
+    );
+    this->num_epochs = num_epochs;
+  }
+
+  if (this->checkpointer)
+  {
+    this->checkpointer->checkpoint(this->epoch, this->codebook, this->neighbourhood, this->previous_best_matching_units, num_rows, this->num_epochs, this->early_stopping);
+    if (this->epoch == this->num_epochs)
+      this->checkpointer->wait();
+  }
+  ++this->epoch;
+}
+
+
+void train(
+  Codebook& codebook,
+  Neighbourhood& neighbourhood,
+  CorpusDataset& data,
+  const unsigned int num_epochs,
+  std::ofstream& convergence_log_stream,
+  const std::string& directory,
+  const bool respect_lower_bound,
+  const IndexType train_vocab_cutoff,
+  const unsigned int dead_cell_update_strides,
+  TrainingProfiler* const profiler,
+  const TrainingCheckpoint* const resume_checkpoint,
+  Checkpointer* const checkpointer,
+  const unsigned int first_epoch,
+  const unsigned int last_epoch,
+  EarlyStopping* const early_stopping,
+  AsyncWriter* const writer,
+  const IndexPointerType metrics_sample_strides
+)
+{
+  Trainer trainer(
+    codebook,
+    neighbourhood,
+    data,
+    num_epochs,
+    convergence_log_stream,
+    directory,
+    respect_lower_bound,
+    train_vocab_cutoff,
+    dead_cell_update_strides,
+    profiler,
+    resume_checkpoint,
+    checkpointer,
+    first_epoch,
+    early_stopping,
+    writer,
+    metrics_sample_strides
+  );
+  while (!trainer.is_done() && (last_epoch == 0 || trainer.get_epoch() <= last_epoch))
+  {
+    trainer.begin_epoch();
+    trainer.find_best_matching_units();
+    trainer.end_epoch();
+  }
 }
@@ -2,8 +2,16 @@
 #pragma once
 
 #include <string>
+#include <vector>
 #include "data.hpp"
 #include "topo.hpp"
+#include "profile.hpp"
+#include "writer.hpp"
+#include "parallel.hpp"
+#include "arena.hpp"
+
+
+#define MAX_DISTRIBUTED_UPDATE_BLOCK_SIZE (1 << 24)  // Number of floats summed over all processes at once in the batch update
 
 
 struct TopographicDiscontinuity
@@ -23,7 +31,14 @@ public:
     const GlobalTopology golbal_topology, 
     const LocalTopology local_topology, 
     const Float update_exponent,
-    const CellIndexType initial_radius
+    const CellIndexType initial_radius,
+    const Float radius_scale = 1.f
+  );
+  // Neighbourhood of a finer map grown from `coarse`, with interpolated radii in units of the finer cells
+  Neighbourhood(
+    const Neighbourhood& coarse,
+    const CellIndexType height, 
+    const CellIndexType width
   );
   ~Neighbourhood();
 
@@ -34,11 +49,23 @@ public:
     const bool respect_lower_bound = true
   );
   void save_to_file(const std::string& filename) const;
+  // Queue a snapshot of the radii, which `writer` saves in the background
+  void save_to_file(const std::string& filename, AsyncWriter& writer) const;
   Float influence(const CellIndexType source_cell, const CellIndexType target_cell) const;
   inline Float get_radius_min() { return this->radius_min; }
   inline Float get_radius_max() { return this->radius_max; }
+  inline Float get_update_exponent() const { return this->update_exponent; }
+  inline void set_update_exponent(const Float update_exponent) { this->update_exponent = update_exponent; }
+  inline CellIndexType get_num_cells() const { return this->num_cells; }
+  inline Float get_radius_scale() const { return this->radius_scale; }
+  inline const Float* get_values() const { return this->values; }
+  void set_values(const Float* const values);
+
+  // Parallel loop of `update`
+  ParallelSettings parallel_settings;
 
 private:
+  std::string get_file_header() const;
   std::vector<TopographicDiscontinuity> topographic_discontinuities(
     const CellIndexType* best_matching_units,
     const CellIndexType* next_best_matching_units,
@@ -51,18 +78,59 @@ private:
 
 private:
   CellIndexType height, width, num_cells;
+  GlobalTopology global_topology;
+  LocalTopology local_topology;
   DistanceFunction distance;
   Float update_exponent;
   CellIndexType initial_radius;
+  // Cells of the final map per cell of this map when the map grows during the training.
+  // The radii shrink as if they were measured on the final map.
+  Float radius_scale;
   Float radius_min, radius_max;
   Float* values;
 };
 
 
+// Values of all cells of a codebook, on huge pages
+typedef std::vector<Float, HugePageAllocator<Float>> CodebookValues;
+
+
+// Error metrics of the best matching units of one epoch
+struct EpochMetrics
+{
+  Float quantization_error = 0.f;
+  Float gap_error = 0.f;
+  Float diffusion_error = 0.f;
+};
+
+
+// Per-thread buffers of `Codebook::compute_metrics`, which the training allocates once in its arena
+struct MetricsScratch
+{
+  int num_threads = 0;                 // Blocks of rows, one per thread of the parallel settings
+  char* cells_in_use = nullptr;        // Of every block
+  bool* cell_in_use = nullptr;         // Of all blocks
+  Float* largest_distances = nullptr;  // Candidates of every block to assign dead cells, if allocated
+};
+
+
+// Initial values of the codebook cells
+enum CodebookInitialization
+{
+  RANDOM_UNIFORM=0,        // Independent uniform random numbers in [0, 1]
+  SAMPLED_ROWS=1,          // Randomly sampled snippets of the corpus
+  PRINCIPAL_COMPONENTS=2   // Grid on the plane of the two principal components of the corpus, through its mean
+};
+
+
 class Codebook
 {
 public:
-  Codebook(const std::string& filename);
+  Codebook(
+    const std::string& filename,
+    GlobalTopology global_topology = GlobalTopology::PLANE,
+    LocalTopology local_topology = LocalTopology::CIRC
+  );
   Codebook(
     CellIndexType height, 
     CellIndexType width, 
@@ -70,13 +138,31 @@ public:
     GlobalTopology global_topology,
     LocalTopology local_topology
   );
+  // Codebook of a finer map with the same topology, interpolated from the cells of `coarse`
+  Codebook(
+    const Codebook& coarse,
+    CellIndexType height, 
+    CellIndexType width
+  );
   ~Codebook();
 
 public:
   void init();
   void init(int _seed, bool _increment_seed_by_thread_number);
+  // Data-driven initialization, which starts closer to the inputs than random values.
+  // Only the vocab indices below `train_vocab_cutoff` (if not zero) are initialized, the rest is zero.
+  // With MPI, this is a collective operation over the row shards.
+  void init(
+    const CorpusDataset& data,
+    const CodebookInitialization initialization,
+    int _seed,
+    const IndexType train_vocab_cutoff = 0
+  );
 
-  void save_to_file(const std::string& filename) const;
+  // With `is_compressed`, save the values losslessly compressed with `compress_codebook_values`
+  void save_to_file(const std::string& filename, const bool is_compressed = false) const;
+  // Queue a snapshot of the values, which `writer` compresses and saves in the background
+  void save_to_file(const std::string& filename, AsyncWriter& writer, const bool is_compressed = false) const;
 
   void find_best_matching_units(
     const BinarySparseMatrix& data, 
@@ -95,6 +181,8 @@ public:
     const IndexType train_vocab_cutoff
   ) const;
 
+  // The following methods are collective operations with MPI: the rows are distributed over 
+  // all processes, and every process gets the result for all rows.
   void apply_batch_som_update(
     const BinarySparseMatrix& data, 
     const Neighbourhood& neighbourhood,
@@ -102,6 +190,36 @@ public:
     const IndexType train_vocab_cutoff = 0
   );
 
+  // All error metrics in one parallel pass over the rows. Each of the arrays may be null, which
+  // skips the metrics that need it. If `sample_strides` is greater than one, the quantization 
+  // and diffusion errors are estimated from every `sample_strides`-th row, starting at row
+  // `sample_offset`. If given, `cell_in_use` receives whether each cell is a best matching unit.
+  // Without a `scratch`, the per-thread buffers are allocated for this call.
+  EpochMetrics compute_metrics(
+    const CellIndexType* const best_matching_units, 
+    const Float* const distances,
+    const CellIndexType* const previous_best_matching_units,
+    const IndexPointerType num_rows,
+    const IndexPointerType sample_strides = 1,
+    const IndexPointerType sample_offset = 0,
+    bool* const cell_in_use = nullptr,
+    const MetricsScratch* const scratch = nullptr
+  ) const;
+  // The same, where the pass also selects the largest distances, and then `assign_dead_cells`.
+  // The gap error is the one before, and the diffusion error the one after the assignment.
+  EpochMetrics compute_metrics_and_assign_dead_cells(
+    CellIndexType* const best_matching_units, 
+    const Float* const distances,
+    const CellIndexType* const previous_best_matching_units,
+    const IndexPointerType num_rows,
+    const IndexPointerType sample_strides = 1,
+    const IndexPointerType sample_offset = 0,
+    const MetricsScratch* const scratch = nullptr
+  ) const;
+  // Bytes of the scratch of `compute_metrics`, with the candidates of `assign_dead_cells` if `with_dead_cells`
+  size_t get_metrics_scratch_bytes(const bool with_dead_cells) const;
+  MetricsScratch allocate_metrics_scratch(Arena& arena, const bool with_dead_cells) const;
+
   Float quantization_error(
     Float* const distances, 
     IndexPointerType const num_rows
@@ -125,6 +243,13 @@ public:
   ) const;
 
   Float get_value(IndexPointerType index);
+  // Interleave the cells over the NUMA nodes, since the threads of all nodes read all cells
+  void place_on_numa_nodes() const;
+
+  inline const CodebookValues& get_values() const {
+    return this->array;
+  }
+  void set_values(const std::vector<Float>& values);
 
   inline IndexType get_input_dim() const {
     return this->input_dim;
@@ -142,22 +267,164 @@ public:
     return this->width;
   }
 
+  inline CellIndexType get_first_cell() const {
+    return this->first_cell;
+  }
+
+  inline CellIndexType get_num_local_cells() const {
+    return this->num_local_cells;
+  }
+
+  // Parallel loops of the best-matching-unit search and the batch update
+  ParallelSettings parallel_settings;
+
 protected:
+  std::string get_file_header(const bool is_compressed = false, const bool has_checksums = true) const;
   void load_from_file(const std::string& filename);
+  void init_cell_range();
+  void init_from_sampled_rows(const CorpusDataset& data, const int seed, const IndexType effective_input_dim);
+  void init_from_principal_components(const CorpusDataset& data, const int seed, const IndexType effective_input_dim);
+  void apply_distributed_batch_som_update(
+    const BinarySparseMatrix& data, 
+    const Neighbourhood& neighbourhood,
+    const CellIndexType* const best_matching_units,
+    const IndexType train_vocab_cutoff
+  );
+  // `compute_metrics`, which assigns the dead cells in `reassigned_best_matching_units` (the same
+  // array as `best_matching_units`) unless it is null
+  EpochMetrics compute_fused_metrics(
+    const CellIndexType* const best_matching_units, 
+    CellIndexType* const reassigned_best_matching_units,
+    const Float* const distances,
+    const CellIndexType* const previous_best_matching_units,
+    const IndexPointerType num_rows,
+    const IndexPointerType sample_strides,
+    const IndexPointerType sample_offset,
+    bool* const cell_in_use,
+    const MetricsScratch* const scratch
+  ) const;
 
   CellIndexType width;
   CellIndexType height;
   IndexType input_dim;
 
   CellIndexType num_cells;
-  IndexPointerType size;
+  // With MPI, each process stores only the cells [first_cell, first_cell + num_local_cells)
+  CellIndexType first_cell;
+  CellIndexType num_local_cells;
+  size_t size;
 
   GlobalTopology global_topology;
   LocalTopology local_topology;
 
   DistanceFunction distance;
   
-  std::vector<Float> array;
+  CodebookValues array;
+  // Per-thread numerators of the batch update
+  ScratchBuffer<Float> update_scratch;
+};
+
+
+// Buffers of a search for the best and next-best matching units of all rows in one codebook
+struct BestMatchingUnitSearch
+{
+  const Codebook* codebook;
+  CellIndexType* best_matching_units;
+  Float* distances;
+  CellIndexType* next_best_matching_units;
+  Float* next_distances;
+  IndexType train_vocab_cutoff;
+};
+
+
+// Same as `Codebook::find_best_and_next_best_matching_units` for several codebooks at once.
+// Every block of rows is compared with the cells of all codebooks while it is in cache,
+// so the corpus is read from memory only once for all of them.
+void find_best_and_next_best_matching_units(
+  const BinarySparseMatrix& data,
+  const std::vector<BestMatchingUnitSearch>& searches,
+  const ParallelSettings& parallel_settings = ParallelSettings()
+);
+
+
+class TrainingCheckpoint;
+class Checkpointer;
+class EarlyStopping;
+
+
+// Runs `train()` one epoch at a time, so several maps can share the search for the best matching units.
+// Every epoch, and the final evaluation after the last epoch, consists of `begin_epoch()`,
+// `find_best_matching_units()` (or the shared `find_best_matching_units(trainers)`), and `end_epoch()`.
+class Trainer
+{
+public:
+  Trainer(
+    Codebook& codebook,
+    Neighbourhood& neighbourhood,
+    const CorpusDataset& data,
+    const unsigned int num_epochs,
+    std::ofstream& convergence_log_stream,
+    const std::string& directory = "",
+    const bool respect_lower_bound = true,
+    const IndexType train_vocab_cutoff = 0,
+    const unsigned int dead_cell_update_strides = 0,
+    TrainingProfiler* const profiler = nullptr,
+    const TrainingCheckpoint* const resume_checkpoint = nullptr,
+    Checkpointer* const checkpointer = nullptr,
+    const unsigned int first_epoch = 1,
+    EarlyStopping* const early_stopping = nullptr,
+    AsyncWriter* const writer = nullptr,
+    const IndexPointerType metrics_sample_strides = 1
+  );
+  ~Trainer();
+
+  void begin_epoch();
+  void find_best_matching_units();
+  // Search the best matching units of all trainers, which must train on the same data, in one pass
+  static void find_best_matching_units(const std::vector<Trainer*>& trainers);
+  void end_epoch();
+
+  inline bool is_done() const { return this->epoch > this->num_epochs + 1; }
+  inline unsigned int get_epoch() const { return this->epoch; }
+  // With early stopping, the number of epochs can shrink during the training
+  inline unsigned int get_num_epochs() const { return this->num_epochs; }
+  inline Float get_quantization_error() const { return this->quantization_error; }
+  inline Float get_topographic_error() const { return this->topographic_error; }
+
+private:
+  BestMatchingUnitSearch get_search() const;
+
+  Codebook& codebook;
+  Neighbourhood& neighbourhood;
+  const CorpusDataset& data;
+  unsigned int num_epochs;
+  std::ofstream& convergence_log_stream;
+  const std::string directory;
+  const bool respect_lower_bound;
+  const IndexType train_vocab_cutoff;
+  const unsigned int dead_cell_update_strides;
+  Checkpointer* const checkpointer;
+  EarlyStopping* const early_stopping;
+  AsyncWriter* const writer;
+  const IndexPointerType metrics_sample_strides;
+
+  HierarchicalTimer default_timer;
+  TrainingProfiler default_profiler;
+  TrainingProfiler& profiler;
+
+  unsigned int epoch;
+  bool has_previous_best_matching_units;
+  Arena arena;  // Of the following per-row arrays
+  CellIndexType* best_matching_units;
+  CellIndexType* previous_best_matching_units;
+  Float* distances;
+  CellIndexType* next_best_matching_units;
+  Float* next_distances;
+  MetricsScratch metrics_scratch;
+  Float diffusion_error;
+  Float gap_error;
+  Float quantization_error;
+  Float topographic_error;
 };
 
 
@@ -170,5 +437,13 @@ void train(
   const std::string& directory_name = "",
   const bool respect_lower_bound = true,
   const IndexType train_vocab_cutoff = 0,
-  const unsigned int dead_cell_update_strides = 0
+  const unsigned int dead_cell_update_strides = 0,
+  TrainingProfiler* const profiler = nullptr,
+  const TrainingCheckpoint* const resume_checkpoint = nullptr,
+  Checkpointer* const checkpointer = nullptr,
+  const unsigned int first_epoch = 1,    // With a growing map, train only the epochs [first_epoch, last_epoch] of this map size
+  const unsigned int last_epoch = 0,     // If zero, train until the end and evaluate the final error metrics
+  EarlyStopping* const early_stopping = nullptr,
+  AsyncWriter* const writer = nullptr,   // If given, save the preliminary outputs in the background
+  const IndexPointerType metrics_sample_strides = 1  // If greater than one, estimate the quantization and diffusion errors from every nth row, except after the final epoch
 );
@@ -0,0 +1,64 @@
+#include <cmath>
+#include <sstream>
+#include "stopping.hpp"
+
+
+EarlyStopping::EarlyStopping(const EarlyStoppingSettings& settings) :
+  settings(settings),
+  best_diffusion_error(MAX_REAL_DISTANCE),
+  num_converged_epochs(0),
+  stopped_epoch(0)
+{}
+
+
+bool EarlyStopping::update(const unsigned int epoch, const Float diffusion_error, const Float topographic_error, const Float gap_error)
+{
+  if (!this->is_enabled() || this->has_stopped())
+    return false;
+
+  const bool is_plateau = diffusion_error > this->best_diffusion_error * (1.f - this->settings.min_relative_improvement);
+  const bool is_below_thresholds =
+    diffusion_error <= this->settings.max_diffusion_error &&
+    topographic_error <= this->settings.max_topographic_error &&
+    gap_error <= this->settings.max_gap_error;
+  this->best_diffusion_error = std::min(this->best_diffusion_error, diffusion_error);
+
+  this->num_converged_epochs = is_plateau && is_below_thresholds ? this->num_converged_epochs + 1 : 0;
+  if (this->num_converged_epochs < this->settings.patience)
+    return false;
+
+  this->stopped_epoch = epoch;
+  std::stringstream reason;
+  reason << "The diffusion error improved by less than " << 100.f * this->settings.min_relative_improvement
+         << "% for " << this->num_converged_epochs << " epochs"
+         << " (diffusion error " << diffusion_error
+         << ", topographic error " << topographic_error
+         << ", gap error " << gap_error << " after epoch " << epoch << ")";
+  this->reason = reason.str();
+  return true;
+}
+
+
+EarlyStoppingState EarlyStopping::get_state() const
+{
+  return {this->best_diffusion_error, this->num_converged_epochs, this->stopped_epoch, this->reason};
+}
+
+
+void EarlyStopping::restore(const EarlyStoppingState& state)
+{
+  this->best_diffusion_error = state.best_diffusion_error;
+  this->num_converged_epochs = state.num_converged_epochs;
+  this->stopped_epoch = state.stopped_epoch;
+  this->reason = state.reason;
+}
+
+
+Float EarlyStopping::get_update_exponent(const Float radius, const unsigned int num_epochs, const Float update_exponent) const
+{
+  // The radius after n updates is radius^(exponent^n)
+  if (num_epochs == 0 || radius <= this->settings.final_radius || this->settings.final_radius <= 1.f)
+    return update_exponent;
+  const Float exponent = std::pow(std::log(this->settings.final_radius) / std::log(radius), 1.f / num_epochs);
+  return std::min(exponent, update_exponent);
+}
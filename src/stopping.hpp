@@ -0,0 +1,56 @@
+#pragma once
+
+#include <string>
+#include "data.hpp"
+
+
+struct EarlyStoppingSettings
+{
+  unsigned int patience = 0;                    // Number of consecutive converged epochs before stopping (0 to disable)
+  Float min_relative_improvement = 0.01f;       // An epoch is converged if it lowers the best diffusion error by less than this fraction,
+  Float max_diffusion_error = MAX_REAL_DISTANCE;    // and if its error metrics do not exceed these thresholds
+  Float max_topographic_error = MAX_REAL_DISTANCE;
+  Float max_gap_error = MAX_REAL_DISTANCE;
+  unsigned int num_final_epochs = 3;            // Epochs after the decision to stop, in which the radii shrink to their final target
+  Float final_radius = 1.5f;                    // Smallest radius reached at the last epoch, measured on the final map
+};
+
+
+// Progress of the early stopping, which checkpoints store to resume it
+struct EarlyStoppingState
+{
+  Float best_diffusion_error = MAX_REAL_DISTANCE;
+  unsigned int num_converged_epochs = 0;
+  unsigned int stopped_epoch = 0;
+  std::string reason;
+};
+
+
+// Decides from the error metrics of every epoch whether the codebook has converged
+class EarlyStopping
+{
+public:
+  EarlyStopping(const EarlyStoppingSettings& settings);
+
+  // Record the metrics of `epoch`, and return whether the training should stop now
+  bool update(const unsigned int epoch, const Float diffusion_error, const Float topographic_error, const Float gap_error);
+
+  // Update exponent that shrinks `radius` to the final radius within `num_epochs` updates
+  Float get_update_exponent(const Float radius, const unsigned int num_epochs, const Float update_exponent) const;
+
+  inline bool is_enabled() const { return this->settings.patience > 0; }
+  inline bool has_stopped() const { return this->stopped_epoch > 0; }
+  inline unsigned int get_stopped_epoch() const { return this->stopped_epoch; }
+  inline const std::string& get_reason() const { return this->reason; }
+  inline const EarlyStoppingSettings& get_settings() const { return this->settings; }
+
+  EarlyStoppingState get_state() const;
+  void restore(const EarlyStoppingState& state);
+
+private:
+  EarlyStoppingSettings settings;
+  Float best_diffusion_error;
+  unsigned int num_converged_epochs;
+  unsigned int stopped_epoch;
+  std::string reason;
+};
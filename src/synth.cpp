@@ -0,0 +1,291 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <cmath>
+#include <cstring>
+#include <assert.h>
+
+#if defined(_OPENMP)
+  #include <omp.h>
+#endif
+
+#include "synth.hpp"
+#include "utils.hpp"
+#include "checksum.hpp"
+
+
+// Number of snippets that are generated from the same random number sequence.
+// Generating chunks independently keeps the output identical for any number of threads.
+#define ROWS_PER_CHUNK 16384
+
+
+// SplitMix64 followed by xoshiro256** (see https://prng.di.unimi.it/)
+class RandomNumberGenerator
+{
+public:
+  RandomNumberGenerator(uint64_t seed)
+  {
+    for (int i = 0; i < 4; ++i)
+    {
+      seed += 0x9e3779b97f4a7c15ULL;
+      uint64_t z = seed;
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+      this->state[i] = z ^ (z >> 31);
+    }
+  }
+
+  inline uint64_t next()
+  {
+    const uint64_t result = rotl(this->state[1] * 5, 7) * 9;
+    const uint64_t t = this->state[1] << 17;
+    this->state[2] ^= this->state[0];
+    this->state[3] ^= this->state[1];
+    this->state[1] ^= this->state[2];
+    this->state[0] ^= this->state[3];
+    this->state[2] ^= t;
+    this->state[3] = rotl(this->state[3], 45);
+    return result;
+  }
+
+  // Uniform number in [0, 1)
+  inline Double operator()()
+  {
+    return (this->next() >> 11) * 0x1.0p-53;
+  }
+
+  // Uniform integer in [0, n)
+  inline uint64_t below(uint64_t n)
+  {
+    return static_cast<uint64_t>((*this)() * n);
+  }
+
+private:
+  static inline uint64_t rotl(const uint64_t x, int k)
+  {
+    return (x << k) | (x >> (64 - k));
+  }
+
+  uint64_t state[4];
+};
+
+
+static Double helper1(const Double x)
+{
+  // log(1 + x) / x
+  return std::abs(x) > 1e-8 ? std::log1p(x) / x : 1. - x * (0.5 - x * (1. / 3. - 0.25 * x));
+}
+
+
+static Double helper2(const Double x)
+{
+  // (exp(x) - 1) / x
+  return std::abs(x) > 1e-8 ? std::expm1(x) / x : 1. + x * 0.5 * (1. + x * 1. / 3. * (1. + 0.25 * x));
+}
+
+
+ZipfDistribution::ZipfDistribution(const IndexType num_elements, const Double exponent) :
+  num_elements(num_elements),
+  exponent(exponent)
+{
+  if (num_elements < 1)
+    std::__throw_invalid_argument("The Zipf distribution needs at least one element");
+  if (exponent <= 0.)
+    std::__throw_invalid_argument("The Zipf exponent must be positive");
+  this->h_integral_x1 = this->h_integral(1.5) - 1.;
+  this->h_integral_num_elements = this->h_integral(num_elements + 0.5);
+  this->s = 2. - this->h_integral_inverse(this->h_integral(2.5) - this->h(2.));
+}
+
+
+Double ZipfDistribution::h(const Double x) const
+{
+  return std::exp(-this->exponent * std::log(x));
+}
+
+
+Double ZipfDistribution::h_integral(const Double x) const
+{
+  const Double log_x = std::log(x);
+  return helper2((1. - this->exponent) * log_x) * log_x;
+}
+
+
+Double ZipfDistribution::h_integral_inverse(const Double x) const
+{
+  Double t = x * (1. - this->exponent);
+  if (t < -1.)
+    t = -1.;
+  return std::exp(helper1(t) * x);
+}
+
+
+static IndexType draw_row_length(RandomNumberGenerator& random, const SyntheticCorpusSettings& settings)
+{
+  const Double mean = settings.mean_row_length;
+  IndexType length = 0;
+  switch (settings.row_length_distribution)
+  {
+  case RowLengthDistribution::POISSON:
+    if (mean < 30.)
+    {
+      // Knuth's multiplication method
+      const Double limit = std::exp(-mean);
+      Double product = random();
+      while (product > limit)
+      {
+        ++length;
+        product *= random();
+      }
+    }
+    else
+    {
+      // Normal approximation (Box-Muller)
+      const Double normal = std::sqrt(-2. * std::log(1. - random())) * std::cos(2. * M_PI * random());
+      length = static_cast<IndexType>(std::max(0., std::round(mean + std::sqrt(mean) * normal)));
+    }
+    break;
+  case RowLengthDistribution::GEOMETRIC:
+    // Number of trials until the first success with success probability 1 / mean
+    length = mean <= 1. ? 1 : 1 + static_cast<IndexType>(std::log(1. - random()) / std::log(1. - 1. / mean));
+    break;
+  case RowLengthDistribution::UNIFORM:
+    length = 1 + random.below(2 * settings.mean_row_length - 1);
+    break;
+  default:
+    std::__throw_invalid_argument("Unknown row length distribution");
+  }
+  return std::max<IndexType>(1, std::min({length, settings.max_row_length, settings.vocab_size}));
+}
+
+
+// Append the binary representation of all snippets in one chunk to the buffer
+static uint64_t generate_chunk(
+  const uint64_t chunk_index,
+  const IndexPointerType num_rows,
+  const SyntheticCorpusSettings& settings,
+  const ZipfDistribution& term_distribution,
+  const ZipfDistribution* const cluster_term_distribution,
+  std::vector<char>& buffer
+)
+{
+  RandomNumberGenerator random(settings.seed * 0x2545f4914f6cdd1dULL + chunk_index);
+  std::vector<IndexType> row;
+  uint64_t num_tokens = 0;
+  buffer.clear();
+
+  for (IndexPointerType i = 0; i < num_rows; ++i)
+  {
+    const IndexType length = draw_row_length(random, settings);
+    const IndexType cluster = settings.num_clusters > 0 ? random.below(settings.num_clusters) : 0;
+
+    // Draw distinct terms; frequent terms are drawn repeatedly, so limit the number of attempts
+    row.clear();
+    for (IndexType attempt = 0; row.size() < length && attempt < 4 * length + 16; ++attempt)
+    {
+      IndexType term;
+      if (cluster_term_distribution && random() < settings.cluster_strength)
+      {
+        // Cluster c owns the terms c, c + K, c + 2K, ..., so every cluster has frequent and rare terms
+        term = ((*cluster_term_distribution)(random) - 1) * settings.num_clusters + cluster;
+        if (term >= settings.vocab_size)
+          continue;
+      }
+      else
+      {
+        term = term_distribution(random) - 1;
+      }
+      if (std::find(row.begin(), row.end(), term) == row.end())
+        row.push_back(term);
+    }
+    std::sort(row.begin(), row.end());
+
+    const uint32_t row_length = row.size();
+    const size_t offset = buffer.size();
+    buffer.resize(offset + sizeof(row_length) + row_length * (sizeof(IndexType) + (settings.with_weights ? sizeof(WeightType) : 0)));
+    char* out = &buffer[offset];
+    std::memcpy(out, &row_length, sizeof(row_length));
+    out += sizeof(row_length);
+    std::memcpy(out, row.data(), row_length * sizeof(IndexType));
+    out += row_length * sizeof(IndexType);
+    if (settings.with_weights)
+    {
+      for (uint32_t j = 0; j < row_length; ++j)
+      {
+        // Heading classes follow `text_to_binary.py`: 6 for document titles down to 2, and 1 for body text
+        out[j] = random() < settings.heading_probability ? static_cast<WeightType>(2 + random.below(5)) : 1;
+      }
+    }
+    num_tokens += row_length;
+  }
+  return num_tokens;
+}
+
+
+uint64_t write_synthetic_corpus(const std::string& filename, const SyntheticCorpusSettings& settings)
+{
+  if (settings.num_rows < 1 || settings.vocab_size < 1)
+    std::__throw_invalid_argument("The synthetic corpus needs at least one row and one term");
+  if (settings.mean_row_length < 1 || settings.max_row_length < 1)
+    std::__throw_invalid_argument("The row length must be at least 1");
+  if (settings.num_clusters > settings.vocab_size)
+    std::__throw_invalid_argument("There cannot be more clusters than terms");
+  if (settings.cluster_strength < 0. || settings.cluster_strength > 1.)
+    std::__throw_invalid_argument("The cluster strength must be between 0 and 1");
+  // The number of tokens is only known after writing, so bound it by the longest possible rows
+  if (static_cast<uint64_t>(settings.num_rows) * std::min(settings.max_row_length, settings.vocab_size) > MAX_INDEX_POINTER_SIZE)
+    std::__throw_invalid_argument("The corpus could have more tokens than `smap create` can load, so reduce the rows or the maximum row length");
+
+  std::ofstream file(filename, std::ios::binary);
+  if (!file.is_open())
+    std::__throw_runtime_error("Unable to write synthetic corpus");
+
+  const ZipfDistribution term_distribution(settings.vocab_size, settings.zipf_exponent);
+  std::unique_ptr<ZipfDistribution> cluster_term_distribution;
+  if (settings.num_clusters > 0)
+    cluster_term_distribution.reset(new ZipfDistribution(settings.vocab_size / settings.num_clusters, settings.zipf_exponent));
+
+  // The number of tokens is written once all rows are generated
+  write_uint8(file, settings.with_weights ? 4 : 5);
+  write_uint64(file, 0);
+  const uint32_t header[2] = {settings.num_rows, settings.vocab_size};
+  file.write((const char*) header, sizeof(header));
+
+  const uint64_t num_chunks = (static_cast<uint64_t>(settings.num_rows) + ROWS_PER_CHUNK - 1) / ROWS_PER_CHUNK;
+  #if defined(_OPENMP)
+  const uint64_t chunks_per_batch = 4 * omp_get_max_threads();
+  #else
+  const uint64_t chunks_per_batch = 1;
+  #endif
+  std::vector<std::vector<char>> buffers(chunks_per_batch);
+  uint64_t num_tokens = 0;
+
+  for (uint64_t first_chunk = 0; first_chunk < num_chunks; first_chunk += chunks_per_batch)
+  {
+    const uint64_t last_chunk = std::min(num_chunks, first_chunk + chunks_per_batch);
+
+    #pragma omp parallel for schedule(dynamic, 1) reduction(+:num_tokens)
+    for (uint64_t chunk = first_chunk; chunk < last_chunk; ++chunk)
+    {
+      const uint64_t first_row = chunk * ROWS_PER_CHUNK;
+      const auto num_rows = static_cast<IndexPointerType>(std::min<uint64_t>(ROWS_PER_CHUNK, settings.num_rows - first_row));
+      num_tokens += generate_chunk(chunk, num_rows, settings, term_distribution, cluster_term_distribution.get(), buffers[chunk - first_chunk]);
+    }
+
+    for (uint64_t chunk = first_chunk; chunk < last_chunk; ++chunk)
+    {
+      const auto& buffer = buffers[chunk - first_chunk];
+      file.write(buffer.data(), buffer.size());
+    }
+  }
+
+  file.seekp(1);
+  write_uint64(file, num_tokens);
+  file.close();
+  if (!file)
+    std::__throw_runtime_error("Unable to write synthetic corpus");
+  append_checksum_trailer(filename);
+  return num_tokens;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <string>
+#include "data.hpp"
+
+
+enum RowLengthDistribution
+{
+  POISSON=0, GEOMETRIC=1, UNIFORM=2
+};
+
+
+struct SyntheticCorpusSettings
+{
+  IndexPointerType num_rows = 100000;
+  IndexType vocab_size = 10000;
+  uint64_t seed = 1;
+  Double zipf_exponent = 1.0;                   // Exponent s of the term frequency distribution p(rank) ~ rank^-s
+  RowLengthDistribution row_length_distribution = RowLengthDistribution::POISSON;
+  IndexType mean_row_length = 20;               // Mean number of distinct terms per snippet
+  IndexType max_row_length = 200;
+  IndexType num_clusters = 0;                   // Number of planted topical clusters (0 to disable)
+  Double cluster_strength = 0.5;                // Probability that a term is drawn from the snippet's cluster
+  bool with_weights = true;                     // Write format version 2 (with weights) instead of 3
+  Double heading_probability = 0.1;             // Probability that a term carries a heading weight class (2 to 6)
+};
+
+
+// Zipf distribution over the ranks 1..N, sampled in constant time by rejection-inversion
+// See W. Hörmann and G. Derflinger (DOI 10.1145/235025.235029)
+class ZipfDistribution
+{
+public:
+  ZipfDistribution(const IndexType num_elements, const Double exponent);
+
+  // Draw a rank in [1, num_elements] given a function returning uniform numbers in [0, 1)
+  template<class UniformGenerator>
+  IndexType operator()(UniformGenerator& uniform) const
+  {
+    while (true)
+    {
+      const Double u = this->h_integral_num_elements + uniform() * (this->h_integral_x1 - this->h_integral_num_elements);
+      const Double x = this->h_integral_inverse(u);
+      IndexType k = static_cast<IndexType>(x + 0.5);
+      if (k < 1)
+        k = 1;
+      else if (k > this->num_elements)
+        k = this->num_elements;
+      if (k - x <= this->s || u >= this->h_integral(k + 0.5) - this->h(k))
+        return k;
+    }
+  }
+
+private:
+  Double h(const Double x) const;
+  Double h_integral(const Double x) const;
+  Double h_integral_inverse(const Double x) const;
+
+  IndexType num_elements;
+  Double exponent;
+  Double h_integral_x1;
+  Double h_integral_num_elements;
+  Double s;
+};
+
+
+// Write a random corpus in format version 4 or 5 (with checksums) and return the total number of tokens
+uint64_t write_synthetic_corpus(const std::string& filename, const SyntheticCorpusSettings& settings);
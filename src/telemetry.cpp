@@ -0,0 +1,331 @@
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <cstring>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "telemetry.hpp"
+#include "writer.hpp"
+#include "utils.hpp"
+
+
+#define TELEMETRY_POLL_MS 100  // Longest delay until the telemetry thread notices a connection or the end of the training
+
+
+// Resident set size of this process in bytes, or zero if unknown
+static uint64_t get_resident_memory_bytes()
+{
+  std::ifstream statm("/proc/self/statm");
+  uint64_t num_pages = 0, num_resident_pages = 0;
+  if (!(statm >> num_pages >> num_resident_pages))
+    return 0;
+  return num_resident_pages * static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+}
+
+
+Telemetry::Telemetry(const std::string& filename, const int port, const Double interval_seconds) :
+  filename(filename),
+  port(port),
+  interval_seconds(interval_seconds),
+  start_unix_time(get_unix_time()),
+  listen_socket(-1),
+  should_stop(false)
+{
+  if (interval_seconds <= 0.)
+    std::__throw_invalid_argument("The telemetry interval must be positive");
+
+  if (port > 0)
+  {
+    // Only serve the local machine; a reverse proxy or an agent can forward the metrics
+    this->listen_socket = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (this->listen_socket < 0)
+      std::__throw_runtime_error("Unable to create the telemetry socket");
+    const int reuse = 1;
+    ::setsockopt(this->listen_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    sockaddr_in address;
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(static_cast<uint16_t>(port));
+    if (::bind(this->listen_socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || ::listen(this->listen_socket, 8) != 0)
+    {
+      ::close(this->listen_socket);
+      std::__throw_runtime_error(("Unable to serve telemetry on port " + std::to_string(port)).c_str());
+    }
+    std::cout << "Serving telemetry on http://127.0.0.1:" << port << "/metrics" << std::endl;
+  }
+  this->thread = std::thread(&Telemetry::run, this);
+}
+
+
+Telemetry::~Telemetry()
+{
+  {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->should_stop = true;
+  }
+  this->stop_requested.notify_one();
+  this->thread.join();
+  if (this->listen_socket >= 0)
+    ::close(this->listen_socket);
+}
+
+
+Telemetry::MapState& Telemetry::get_state(const std::string& map)
+{
+  MapState& state = this->states[map];
+  state.last_update_unix_time = get_unix_time();
+  return state;
+}
+
+
+void Telemetry::begin_training(const std::string& map, const IndexPointerType num_rows)
+{
+  std::unique_lock<std::mutex> lock(this->mutex);
+  MapState& state = this->get_state(map);
+  state.num_rows = num_rows;
+  state.is_done = false;
+  if (state.training_start_ns == 0)
+    state.training_start_ns = get_nanoseconds();
+}
+
+
+void Telemetry::begin_epoch(const std::string& map, const unsigned int epoch)
+{
+  std::unique_lock<std::mutex> lock(this->mutex);
+  this->get_state(map).epoch = epoch;
+}
+
+
+void Telemetry::begin_phase(const std::string& map, const TrainingPhase phase)
+{
+  std::unique_lock<std::mutex> lock(this->mutex);
+  this->get_state(map).phase = phase;
+}
+
+
+void Telemetry::end_phase(const std::string& map)
+{
+  std::unique_lock<std::mutex> lock(this->mutex);
+  this->get_state(map).phase = TrainingPhase::NUM_TRAINING_PHASES;
+}
+
+
+void Telemetry::end_epoch(const std::string& map, const int64_t epoch_ns, const int64_t* const phase_ns)
+{
+  std::unique_lock<std::mutex> lock(this->mutex);
+  MapState& state = this->get_state(map);
+  state.num_completed_epochs += 1;
+  state.last_epoch_ns = epoch_ns;
+  state.total_epoch_ns += epoch_ns;
+  for (int phase = 0; phase < TrainingPhase::NUM_TRAINING_PHASES; ++phase)
+  {
+    state.last_phase_ns[phase] = phase_ns[phase];
+    state.total_phase_ns[phase] += phase_ns[phase];
+  }
+}
+
+
+void Telemetry::record_errors(
+  const std::string& map,
+  const unsigned int num_epochs,
+  const Float radius_min,
+  const Float radius_max,
+  const Float quantization_error,
+  const Float topographic_error,
+  const Float gap_error,
+  const Float diffusion_error
+)
+{
+  std::unique_lock<std::mutex> lock(this->mutex);
+  MapState& state = this->get_state(map);
+  state.num_epochs = num_epochs;
+  state.radius_min = radius_min;
+  state.radius_max = radius_max;
+  state.quantization_error = quantization_error;
+  state.topographic_error = topographic_error;
+  state.gap_error = gap_error;
+  state.diffusion_error = diffusion_error;
+}
+
+
+void Telemetry::end_training(const std::string& map)
+{
+  std::unique_lock<std::mutex> lock(this->mutex);
+  MapState& state = this->get_state(map);
+  state.is_done = true;
+  state.phase = TrainingPhase::NUM_TRAINING_PHASES;
+}
+
+
+// Label value with backslashes, double quotes and line feeds escaped as in the Prometheus text format
+static std::string escape_label_value(const std::string& value)
+{
+  std::string escaped;
+  escaped.reserve(value.size());
+  for (const char c : value)
+  {
+    if (c == '\\')
+      escaped += "\\\\";
+    else if (c == '"')
+      escaped += "\\\"";
+    else if (c == '\n')
+      escaped += "\\n";
+    else
+      escaped += c;
+  }
+  return escaped;
+}
+
+
+std::string Telemetry::render()
+{
+  std::unique_lock<std::mutex> lock(this->mutex);
+  std::ostringstream os;
+  os.precision(9);
+
+  auto write_header = [&](const char* name, const char* type, const char* help) {
+    os << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n";
+  };
+  auto write_map_metric = [&](const char* name, const char* type, const char* help, auto value_of) {
+    write_header(name, type, help);
+    for (const auto& entry : this->states)
+      os << name << "{map=\"" << escape_label_value(entry.first) << "\"} " << value_of(entry.second) << "\n";
+  };
+  auto write_phase_metric = [&](const char* name, const char* type, const char* help, auto value_of) {
+    write_header(name, type, help);
+    for (const auto& entry : this->states)
+      for (int phase = 0; phase < TrainingPhase::NUM_TRAINING_PHASES; ++phase)
+        os << name << "{map=\"" << escape_label_value(entry.first) << "\",phase=\"" << get_training_phase_string(static_cast<TrainingPhase>(phase)) << "\"} "
+           << value_of(entry.second, phase) << "\n";
+  };
+
+  write_header("smap_start_time_seconds", "gauge", "Unix time when the process started training");
+  os << "smap_start_time_seconds " << this->start_unix_time << "\n";
+  write_header("smap_resident_memory_bytes", "gauge", "Resident set size of the process");
+  os << "smap_resident_memory_bytes " << get_resident_memory_bytes() << "\n";
+
+  write_map_metric("smap_epoch", "gauge", "Epoch in progress, where the epoch after the last one evaluates the final errors",
+    [](const MapState& s) { return s.epoch; });
+  write_map_metric("smap_epochs", "gauge", "Number of training epochs, which early stopping can reduce",
+    [](const MapState& s) { return s.num_epochs; });
+  write_map_metric("smap_completed_epochs_total", "counter", "Completed epochs",
+    [](const MapState& s) { return s.num_completed_epochs; });
+  write_map_metric("smap_done", "gauge", "Whether the training has ended",
+    [](const MapState& s) { return s.is_done ? 1 : 0; });
+  write_map_metric("smap_last_update_timestamp_seconds", "gauge", "Unix time of the last progress of the training",
+    [](const MapState& s) { return s.last_update_unix_time; });
+  write_map_metric("smap_epoch_seconds", "gauge", "Duration of the last epoch",
+    [](const MapState& s) { return s.last_epoch_ns * 1e-9; });
+  write_map_metric("smap_rows_per_second", "gauge", "Snippets processed per second in the last epoch",
+    [](const MapState& s) { return s.last_epoch_ns > 0 ? s.num_rows / (s.last_epoch_ns * 1e-9) : 0.; });
+  write_map_metric("smap_eta_seconds", "gauge", "Estimated time until the end of the training, from the mean epoch duration",
+    [](const MapState& s) {
+      const unsigned int num_remaining = s.is_done ? 0 : s.num_epochs + 1 - std::min(s.num_epochs + 1, s.num_completed_epochs);
+      return s.num_completed_epochs > 0 ? num_remaining * s.total_epoch_ns * 1e-9 / s.num_completed_epochs : 0.;
+    });
+  write_map_metric("smap_radius_min", "gauge", "Smallest neighbourhood radius", [](const MapState& s) { return s.radius_min; });
+  write_map_metric("smap_radius_max", "gauge", "Largest neighbourhood radius", [](const MapState& s) { return s.radius_max; });
+  write_map_metric("smap_quantization_error", "gauge", "Quantization error of the last epoch", [](const MapState& s) { return s.quantization_error; });
+  write_map_metric("smap_topographic_error", "gauge", "Topographic error of the last epoch", [](const MapState& s) { return s.topographic_error; });
+  write_map_metric("smap_gap_error", "gauge", "Fraction of dead cells in the last epoch", [](const MapState& s) { return s.gap_error; });
+  write_map_metric("smap_diffusion_error", "gauge", "Diffusion error of the last epoch", [](const MapState& s) { return s.diffusion_error; });
+
+  write_phase_metric("smap_phase_active", "gauge", "Whether the training is in this phase",
+    [](const MapState& s, int phase) { return s.phase == phase ? 1 : 0; });
+  write_phase_metric("smap_phase_seconds", "gauge", "Duration of the phase in the last epoch",
+    [](const MapState& s, int phase) { return s.last_phase_ns[phase] * 1e-9; });
+  write_phase_metric("smap_phase_seconds_total", "counter", "Total duration of the phase",
+    [](const MapState& s, int phase) { return s.total_phase_ns[phase] * 1e-9; });
+  return os.str();
+}
+
+
+void Telemetry::serve(const int socket)
+{
+  // Read the request line; a client that sends nothing within a second is dropped
+  timeval timeout = {1, 0};
+  ::setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  char request[1024];
+  const ssize_t num_read = ::recv(socket, request, sizeof(request) - 1, 0);
+  if (num_read <= 0)
+    return;
+  request[num_read] = '\0';
+
+  const bool is_metrics = std::strncmp(request, "GET /metrics", 12) == 0 || std::strncmp(request, "GET / ", 6) == 0;
+  const std::string body = is_metrics ? this->render() : "Not found\n";
+  std::ostringstream response;
+  response << (is_metrics ? "HTTP/1.1 200 OK\r\n" : "HTTP/1.1 404 Not Found\r\n")
+           << "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+           << "Content-Length: " << body.size() << "\r\n"
+           << "Connection: close\r\n\r\n"
+           << body;
+  const std::string bytes = response.str();
+  size_t offset = 0;
+  while (offset < bytes.size())
+  {
+    const ssize_t num_written = ::send(socket, bytes.data() + offset, bytes.size() - offset, MSG_NOSIGNAL);
+    if (num_written <= 0)
+      return;
+    offset += num_written;
+  }
+}
+
+
+void Telemetry::run()
+{
+  // Yield to the training threads (Linux applies the nice value per thread)
+  ::setpriority(PRIO_PROCESS, static_cast<id_t>(::syscall(SYS_gettid)), 19);
+
+  const int64_t interval_ns = static_cast<int64_t>(this->interval_seconds * 1e9);
+  int64_t next_write_ns = get_nanoseconds();
+  while (true)
+  {
+    bool is_stopping;
+    {
+      std::unique_lock<std::mutex> lock(this->mutex);
+      if (this->listen_socket < 0 && !this->should_stop)
+      {
+        const int64_t wait_ns = std::max<int64_t>(0, next_write_ns - get_nanoseconds());
+        this->stop_requested.wait_for(lock, std::chrono::nanoseconds(wait_ns), [&]() { return this->should_stop; });
+      }
+      is_stopping = this->should_stop;
+    }
+
+    if (this->listen_socket >= 0 && !is_stopping)
+    {
+      pollfd poll_fd = {this->listen_socket, POLLIN, 0};
+      const int64_t wait_ms = std::max<int64_t>(0, std::min<int64_t>(TELEMETRY_POLL_MS, (next_write_ns - get_nanoseconds()) / 1000000));
+      if (::poll(&poll_fd, 1, static_cast<int>(wait_ms)) > 0)
+      {
+        const int socket = ::accept4(this->listen_socket, nullptr, nullptr, SOCK_CLOEXEC);
+        if (socket >= 0)
+        {
+          this->serve(socket);
+          ::close(socket);
+        }
+      }
+    }
+
+    // The final state is always written
+    if (!this->filename.empty() && (is_stopping || get_nanoseconds() >= next_write_ns))
+    {
+      const std::string metrics = this->render();
+      try {
+        // The file is replaced every interval, so it is not flushed to disk
+        write_file(this->filename, metrics.data(), metrics.size(), FsyncPolicy::NO_FSYNC, true, false);
+      } catch (const std::exception& e) {
+        std::cerr << "WARNING: Failed to write telemetry (" << e.what() << ")" << std::endl;
+      }
+    }
+    if (get_nanoseconds() >= next_write_ns)
+      next_write_ns += interval_ns * ((get_nanoseconds() - next_write_ns) / interval_ns + 1);
+    if (is_stopping)
+      return;
+  }
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <string>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "data.hpp"
+#include "profile.hpp"
+
+
+// Live metrics of one or several trainings in the Prometheus text format, for monitoring.
+// A background thread with the lowest scheduling priority writes them atomically to `filename`
+// every `interval_seconds`, and/or serves them on http://127.0.0.1:<port>/metrics.
+// An empty filename or a zero port disables the respective output.
+// The training threads only copy a few numbers under a lock.
+class Telemetry
+{
+public:
+  Telemetry(const std::string& filename, const int port = 0, const Double interval_seconds = 5.);
+  ~Telemetry();
+
+  // All methods take the name of the map, which labels its metrics
+  void begin_training(const std::string& map, const IndexPointerType num_rows);
+  void begin_epoch(const std::string& map, const unsigned int epoch);
+  void begin_phase(const std::string& map, const TrainingPhase phase);
+  void end_phase(const std::string& map);
+  void end_epoch(const std::string& map, const int64_t epoch_ns, const int64_t* const phase_ns);
+  void record_errors(
+    const std::string& map,
+    const unsigned int num_epochs,
+    const Float radius_min,
+    const Float radius_max,
+    const Float quantization_error,
+    const Float topographic_error,
+    const Float gap_error,
+    const Float diffusion_error
+  );
+  void end_training(const std::string& map);
+
+  // Current metrics in the Prometheus text exposition format
+  std::string render();
+  inline int get_port() const { return this->port; }
+
+private:
+  struct MapState
+  {
+    IndexPointerType num_rows = 0;
+    unsigned int epoch = 0;
+    unsigned int num_epochs = 0;
+    unsigned int num_completed_epochs = 0;
+    int phase = TrainingPhase::NUM_TRAINING_PHASES;  // NUM_TRAINING_PHASES outside of a phase
+    bool is_done = false;
+    int64_t training_start_ns = 0;
+    int64_t last_update_unix_time = 0;
+    int64_t last_epoch_ns = 0;
+    int64_t total_epoch_ns = 0;
+    int64_t last_phase_ns[TrainingPhase::NUM_TRAINING_PHASES] = {};
+    int64_t total_phase_ns[TrainingPhase::NUM_TRAINING_PHASES] = {};
+    Float radius_min = 0.f;
+    Float radius_max = 0.f;
+    Float quantization_error = 0.f;
+    Float topographic_error = 0.f;
+    Float gap_error = 0.f;
+    Float diffusion_error = 0.f;
+  };
+
+  MapState& get_state(const std::string& map);
+  void run();
+  void serve(const int socket);
+
+  const std::string filename;
+  int port;
+  const Double interval_seconds;
+  const int64_t start_unix_time;
+  int listen_socket;
+  std::map<std::string, MapState> states;
+  bool should_stop;
+  std::mutex mutex;
+  std::condition_variable stop_requested;
+  std::thread thread;
+};
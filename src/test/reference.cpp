@@ -0,0 +1,267 @@
+#include <cmath>
+#include <algorithm>
+#include "reference.hpp"
+#include "../utils.hpp"
+
+
+#define SQRT_E 1.6487212707001281468486507878142
+
+
+ReferenceNeighbourhood::ReferenceNeighbourhood(
+    const CellIndexType height,
+    const CellIndexType width,
+    const GlobalTopology global_topology,
+    const LocalTopology local_topology,
+    const Float update_exponent,
+    const Float radius_scale,
+    const std::vector<Float>& radii
+  ) :
+  height(height),
+  width(width),
+  num_cells(height * width),
+  distance(distance_function(global_topology, local_topology)),
+  update_exponent(update_exponent),
+  radius_scale(radius_scale),
+  radii(radii)
+{}
+
+
+Float ReferenceNeighbourhood::influence(const CellIndexType source_cell, const CellIndexType target_cell) const
+{
+  CellIndexType y1 = source_cell / this->width,
+                x1 = source_cell % this->width,
+                y2 = target_cell / this->width,
+                x2 = target_cell % this->width;
+  // Known defect of the baseline, kept until it is fixed in `Neighbourhood::influence`: the width
+  // and height are swapped
+  const CellIndexType d = this->distance(y1, x1, y2, x2, this->width, this->height);
+  const Float r = this->radii[target_cell];
+  // Equation (3) of Kiviluoto (DOI 10.1109/ICNN.1996.548907)
+  return d < r ? (1. - SQRT_E * std::exp(-0.5 * squared(d) / squared(r))) / (r * (1. - SQRT_E)) : 0.f;
+}
+
+
+Float ReferenceNeighbourhood::update(
+    const CellIndexType* const best_matching_units,
+    const CellIndexType* const next_best_matching_units,
+    const IndexPointerType num_rows,
+    const bool respect_lower_bound
+  )
+{
+  std::vector<TopographicDiscontinuity> discontinuities;
+  for (IndexPointerType row = 0; row < num_rows; ++row)
+  {
+    const CellIndexType cell1 = best_matching_units[row];
+    const CellIndexType cell2 = next_best_matching_units[row];
+    const CellIndexType distance = this->distance(cell1 / this->width, cell1 % this->width, cell2 / this->width, cell2 % this->width, this->height, this->width);
+    if (distance > 1)
+      discontinuities.push_back(TopographicDiscontinuity(cell1, cell2, distance));
+  }
+
+  for (CellIndexType cell_index = 0; cell_index < this->num_cells; ++cell_index)
+  {
+    Float radius_lower_bound = 1.f;
+    for (const auto& discontinuity : discontinuities)
+    {
+      // Equation (5) of Kiviluoto
+      const CellIndexType y = cell_index / this->width,
+                          x = cell_index % this->width;
+      const CellIndexType d1 = this->distance(y, x, discontinuity.cell1 / this->width, discontinuity.cell1 % this->width, this->height, this->width);
+      const CellIndexType d2 = this->distance(y, x, discontinuity.cell2 / this->width, discontinuity.cell2 % this->width, this->height, this->width);
+      CellIndexType radius = 1;
+      if (std::max(d1, d2) <= discontinuity.distance)
+        radius = discontinuity.distance;
+      else if (std::min(d1, d2) < discontinuity.distance)
+        radius = discontinuity.distance - std::min(d1, d2);
+      radius_lower_bound = std::max(radius_lower_bound, static_cast<Float>(radius));
+    }
+
+    const Float radius = std::pow(this->radii[cell_index] * this->radius_scale, this->update_exponent) / this->radius_scale;
+    this->radii[cell_index] = respect_lower_bound ? std::max(radius_lower_bound, radius) : radius;
+  }
+  return static_cast<Float>(discontinuities.size() + 1) / num_rows;
+}
+
+
+ReferenceCodebook::ReferenceCodebook(
+    const CellIndexType height,
+    const CellIndexType width,
+    const IndexType input_dim,
+    const GlobalTopology global_topology,
+    const LocalTopology local_topology,
+    const std::vector<Float>& values
+  ) :
+  height(height),
+  width(width),
+  num_cells(height * width),
+  input_dim(input_dim),
+  distance(distance_function(global_topology, local_topology)),
+  values(values)
+{}
+
+
+// Dot product of a cell with the (weighted) binary row, up to the cutoff
+static Float reference_product(const BinarySparseMatrix& data, const IndexPointerType row, const Float* const w, const IndexType effective_input_dim)
+{
+  const IndexType* const indices = data.indices_in_row(row);
+  const WeightType* const weights = data.weights_in_row(row);
+  Float result = 0.;
+  for (IndexType i = 0; i < data.num_indices_in_row(row) && indices[i] < effective_input_dim; ++i)
+    result += data.has_weights() ? w[indices[i]] * weights[i] : w[indices[i]];
+  return result;
+}
+
+
+static bool is_row_empty(const BinarySparseMatrix& data, const IndexPointerType row, const IndexType effective_input_dim)
+{
+  return data.num_indices_in_row(row) == 0 || data.indices_in_row(row)[0] >= effective_input_dim;
+}
+
+
+void ReferenceCodebook::find_best_matching_units(
+    const BinarySparseMatrix& data,
+    CellIndexType* const best_matching_units,
+    Float* const distances,
+    const IndexType train_vocab_cutoff,
+    const bool need_correct_distances
+  ) const
+{
+  const auto effective_input_dim = (train_vocab_cutoff > 0 ? train_vocab_cutoff : data.num_cols);
+  for (IndexPointerType row = 0; row < data.num_rows; ++row)
+  {
+    best_matching_units[row] = 0;
+    distances[row] = MAX_REAL_DISTANCE;
+    if (is_row_empty(data, row, effective_input_dim))
+      continue;
+    for (CellIndexType cell_index = 0; cell_index < this->num_cells; ++cell_index)
+    {
+      // The squared norm covers all dimensions here, unlike in the search for the next best units
+      const Float* const w = &this->values[cell_index * this->input_dim];
+      const Float distance = vec_squared(w, this->input_dim) - 2 * reference_product(data, row, w, effective_input_dim);
+      if (distance < distances[row])
+      {
+        best_matching_units[row] = cell_index;
+        distances[row] = distance;
+      }
+    }
+  }
+
+  if (need_correct_distances)
+  {
+    for (IndexPointerType row = 0; row < data.num_rows; ++row)
+      distances[row] = std::max(0.f, distances[row] + data._sum_of_squares[row]);
+  }
+}
+
+
+void ReferenceCodebook::find_best_and_next_best_matching_units(
+    const BinarySparseMatrix& data,
+    CellIndexType* const best_matching_units,
+    Float* const distances,
+    CellIndexType* const next_best_matching_units,
+    Float* const next_distances,
+    const IndexType train_vocab_cutoff
+  ) const
+{
+  const auto effective_input_dim = (train_vocab_cutoff > 0 ? train_vocab_cutoff : this->input_dim);
+  for (IndexPointerType row = 0; row < data.num_rows; ++row)
+  {
+    best_matching_units[row] = 0;
+    next_best_matching_units[row] = 0;
+    distances[row] = MAX_REAL_DISTANCE;
+    next_distances[row] = MAX_REAL_DISTANCE;
+    if (is_row_empty(data, row, effective_input_dim))
+      continue;
+    for (CellIndexType cell_index = 0; cell_index < this->num_cells; ++cell_index)
+    {
+      const Float* const w = &this->values[cell_index * this->input_dim];
+      const Float distance = vec_squared(w, effective_input_dim) - 2 * reference_product(data, row, w, effective_input_dim) + data._sum_of_squares[row];
+      // Only a strictly better cell moves the best one to the next best, and the distance of
+      // the best cell is clamped at zero, but the one that it passes on is not clamped again
+      if (distance < distances[row])
+      {
+        next_best_matching_units[row] = best_matching_units[row];
+        next_distances[row] = distances[row];
+        best_matching_units[row] = cell_index;
+        distances[row] = std::max(0.f, distance);
+      }
+    }
+  }
+}
+
+
+void ReferenceCodebook::apply_batch_som_update(
+    const BinarySparseMatrix& data,
+    const ReferenceNeighbourhood& neighbourhood,
+    const CellIndexType* const best_matching_units,
+    const IndexType train_vocab_cutoff
+  )
+{
+  const auto effective_input_dim = (train_vocab_cutoff > 0 ? train_vocab_cutoff : this->input_dim);
+  std::vector<Float> numerator(this->input_dim);
+  for (CellIndexType cell_index = 0; cell_index < this->num_cells; ++cell_index)
+  {
+    std::fill(numerator.begin(), numerator.end(), 0.f);
+    Float denominator = 0.f;
+    for (IndexPointerType row = 0; row < data.num_rows; ++row)
+    {
+      const Float learning_rate = neighbourhood.influence(best_matching_units[row], cell_index);
+      if (learning_rate <= 0.)
+        continue;
+      denominator += learning_rate;
+      const IndexType* const indices = data.indices_in_row(row);
+      for (IndexType i = 0; i < data.num_indices_in_row(row) && indices[i] < effective_input_dim; ++i)
+        numerator[indices[i]] += learning_rate;
+    }
+
+    if (denominator != 0)
+    {
+      for (IndexType i = 0; i < this->input_dim; ++i)
+        this->values[cell_index * this->input_dim + i] = numerator[i] / denominator;
+    }
+  }
+}
+
+
+EpochMetrics ReferenceCodebook::compute_metrics(
+    const CellIndexType* const best_matching_units,
+    const Float* const distances,
+    const CellIndexType* const previous_best_matching_units,
+    const IndexPointerType num_rows
+  ) const
+{
+  Double squared_distances = 0.;
+  uint64_t total_distance = 0;
+  std::vector<bool> is_used(this->num_cells, false);
+  for (IndexPointerType row = 0; row < num_rows; ++row)
+  {
+    squared_distances += squared(distances[row]);
+    is_used[best_matching_units[row]] = true;
+    const CellIndexType source_cell = previous_best_matching_units[row];
+    const CellIndexType target_cell = best_matching_units[row];
+    // The same known defect as in `influence`
+    total_distance += this->distance(source_cell / this->width, source_cell % this->width, target_cell / this->width, target_cell % this->width, this->width, this->height);
+  }
+
+  EpochMetrics metrics;
+  metrics.quantization_error = static_cast<Float>(std::sqrt(squared_distances) / num_rows);
+  metrics.gap_error = static_cast<Float>(std::count(is_used.begin(), is_used.end(), false)) / this->num_cells;
+  metrics.diffusion_error = static_cast<Float>(total_distance) / static_cast<Float>(num_rows);
+  return metrics;
+}
+
+
+std::vector<CountType> reference_build_counts(
+    const BinarySparseMatrix& data,
+    const CellIndexType* const best_matching_units,
+    const CellIndexType num_cells
+  )
+{
+  std::vector<CountType> counts(static_cast<size_t>(num_cells) * data.num_cols, 0);
+  for (IndexPointerType row = 0; row < data.num_rows; ++row)
+  {
+    for (IndexType i = 0; i < data.num_indices_in_row(row); ++i)
+      counts[static_cast<size_t>(num_cells) * data.indices_in_row(row)[i] + best_matching_units[row]] += 1;
+  }
+  return counts;
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <vector>
+#include "../data.hpp"
+#include "../topo.hpp"
+#include "../som.hpp"
+
+
+// Frozen, sequential copies of the training kernels as they were before they were parallelized
+// and optimized. The differential tests (`make difftest`) compare every optimized variant with
+// them, so they must stay simple and must not change along with the kernels in `som.cpp`.
+
+
+// Radii of all cells and the neighbourhood function, like `Neighbourhood`
+struct ReferenceNeighbourhood
+{
+  ReferenceNeighbourhood(
+    const CellIndexType height,
+    const CellIndexType width,
+    const GlobalTopology global_topology,
+    const LocalTopology local_topology,
+    const Float update_exponent,
+    const Float radius_scale,
+    const std::vector<Float>& radii
+  );
+
+  Float influence(const CellIndexType source_cell, const CellIndexType target_cell) const;
+  // Shrink the radii, respecting the lower bounds from the topographic discontinuities,
+  // and return the topographic error
+  Float update(
+    const CellIndexType* const best_matching_units,
+    const CellIndexType* const next_best_matching_units,
+    const IndexPointerType num_rows,
+    const bool respect_lower_bound = true
+  );
+
+  CellIndexType height, width, num_cells;
+  DistanceFunction distance;
+  Float update_exponent;
+  Float radius_scale;
+  std::vector<Float> radii;
+};
+
+
+// Cells of a codebook, like `Codebook`
+struct ReferenceCodebook
+{
+  ReferenceCodebook(
+    const CellIndexType height,
+    const CellIndexType width,
+    const IndexType input_dim,
+    const GlobalTopology global_topology,
+    const LocalTopology local_topology,
+    const std::vector<Float>& values
+  );
+
+  void find_best_matching_units(
+    const BinarySparseMatrix& data,
+    CellIndexType* const best_matching_units,
+    Float* const distances,
+    const IndexType train_vocab_cutoff,
+    const bool need_correct_distances = true
+  ) const;
+
+  void find_best_and_next_best_matching_units(
+    const BinarySparseMatrix& data,
+    CellIndexType* const best_matching_units,
+    Float* const distances,
+    CellIndexType* const next_best_matching_units,
+    Float* const next_distances,
+    const IndexType train_vocab_cutoff
+  ) const;
+
+  void apply_batch_som_update(
+    const BinarySparseMatrix& data,
+    const ReferenceNeighbourhood& neighbourhood,
+    const CellIndexType* const best_matching_units,
+    const IndexType train_vocab_cutoff = 0
+  );
+
+  EpochMetrics compute_metrics(
+    const CellIndexType* const best_matching_units,
+    const Float* const distances,
+    const CellIndexType* const previous_best_matching_units,
+    const IndexPointerType num_rows
+  ) const;
+
+  CellIndexType height, width, num_cells;
+  IndexType input_dim;
+  DistanceFunction distance;
+  std::vector<Float> values;
+};
+
+
+// Association counts of the semantic map, indexed by `num_cells * vocab_index + cell`
+std::vector<CountType> reference_build_counts(
+  const BinarySparseMatrix& data,
+  const CellIndexType* const best_matching_units,
+  const CellIndexType num_cells
+);
@@ -0,0 +1,56 @@
+#include <vector>
+#include <cstdint>
+#include "catch.hpp"
+#include "../arena.hpp"
+
+
+TEST_CASE("Huge-page allocations are aligned and usable with every policy")
+{
+  const auto policy = GENERATE(HugePagePolicy::NO_HUGE_PAGES, HugePagePolicy::TRANSPARENT_HUGE_PAGES, HugePagePolicy::RESERVED_HUGE_PAGES);
+  set_huge_page_policy(policy);
+
+  for (const size_t num_bytes : {size_t(1), size_t(1000), HUGE_PAGE_SIZE, 3 * HUGE_PAGE_SIZE + 5})
+  {
+    auto* const data = static_cast<char*>(allocate_huge_pages(num_bytes));
+    REQUIRE(reinterpret_cast<uintptr_t>(data) % ARENA_ALIGNMENT == 0);
+    if (num_bytes >= HUGE_PAGE_SIZE && policy != HugePagePolicy::RESERVED_HUGE_PAGES)
+      REQUIRE(reinterpret_cast<uintptr_t>(data) % HUGE_PAGE_SIZE == 0);
+    for (size_t i = 0; i < num_bytes; ++i)
+      data[i] = static_cast<char>(i);
+    REQUIRE(data[num_bytes - 1] == static_cast<char>(num_bytes - 1));
+    free_huge_pages(data, num_bytes);
+  }
+
+  std::vector<float, HugePageAllocator<float>> values(HUGE_PAGE_SIZE, 1.f);
+  values.resize(2 * HUGE_PAGE_SIZE, 2.f);
+  REQUIRE(values.front() == 1.f);
+  REQUIRE(values.back() == 2.f);
+  set_huge_page_policy(HugePagePolicy::TRANSPARENT_HUGE_PAGES);
+}
+
+
+TEST_CASE("An arena hands out disjoint aligned arrays")
+{
+  Arena arena(1000);
+  auto* const first = arena.allocate<uint16_t>(100);
+  auto* const second = arena.allocate<float>(100);
+  auto* const large = arena.allocate<double>(1000);
+  REQUIRE(reinterpret_cast<uintptr_t>(second) % ARENA_ALIGNMENT == 0);
+  REQUIRE(reinterpret_cast<char*>(second) >= reinterpret_cast<char*>(first + 100));
+  for (int i = 0; i < 100; ++i)
+  {
+    first[i] = 1;
+    second[i] = 2.f;
+  }
+  for (int i = 0; i < 1000; ++i)
+    large[i] = 3.;
+  REQUIRE(first[99] == 1);
+  REQUIRE(second[0] == 2.f);
+  arena.reset();
+  REQUIRE(arena.allocate<uint16_t>(100) == first);
+
+  ScratchBuffer<float> scratch;
+  float* const small = scratch.get(10);
+  REQUIRE(scratch.get(5) == small);
+  REQUIRE(scratch.get(1 << 20) != nullptr);
+}
@@ -0,0 +1,279 @@
+#include <fstream>
+#include <sstream>
+#include "catch.hpp"
+#include "../checkpoint.hpp"
+#include "../synth.hpp"
+
+
+TEST_CASE("Saving and loading a training checkpoint restores the state")
+{
+  std::string filename = std::tmpnam(nullptr);
+  const CellIndexType height = 3;
+  const CellIndexType width = 4;
+  const IndexType input_dim = 5;
+  const IndexPointerType num_rows = 7;
+
+  Codebook codebook(height, width, input_dim, GlobalTopology::TORUS, LocalTopology::HEXA);
+  codebook.init(3, false);
+  Neighbourhood neighbourhood(height, width, GlobalTopology::TORUS, LocalTopology::HEXA, 0.25f, 2);
+  std::vector<CellIndexType> best_matching_units(num_rows);
+  for (IndexPointerType row = 0; row < num_rows; ++row)
+    best_matching_units[row] = static_cast<CellIndexType>(row % (height * width));
+
+  TrainingCheckpoint checkpoint;
+  checkpoint.arguments = {"create", "corpus.bin", "3", "4"};
+  checkpoint.seed = 42;
+  checkpoint.num_epochs = 10;
+  checkpoint.is_codebook_compressed = GENERATE(false, true);
+  EarlyStoppingSettings stopping_settings;
+  stopping_settings.patience = 1;
+  EarlyStopping early_stopping(stopping_settings);
+  early_stopping.update(5, 2.f, 0.f, 0.f);
+  early_stopping.update(6, 2.f, 0.f, 0.f);
+  checkpoint.capture(6, codebook, neighbourhood, best_matching_units.data(), num_rows, 8, &early_stopping);
+  checkpoint.save_to_file(filename);
+
+  TrainingCheckpoint loaded(filename);
+  REQUIRE(loaded.arguments == checkpoint.arguments);
+  REQUIRE(loaded.seed == 42);
+  REQUIRE(loaded.epoch == 6);
+  REQUIRE(loaded.num_epochs == 10);
+  REQUIRE(loaded.update_exponent == 0.25f);
+  REQUIRE(loaded.is_codebook_compressed == checkpoint.is_codebook_compressed);
+  REQUIRE(loaded.num_scheduled_epochs == 8);
+  REQUIRE(loaded.early_stopping.best_diffusion_error == 2.f);
+  REQUIRE(loaded.early_stopping.stopped_epoch == 6);
+  REQUIRE(loaded.early_stopping.reason == early_stopping.get_reason());
+
+  Codebook restored_codebook(height, width, input_dim, GlobalTopology::TORUS, LocalTopology::HEXA);
+  Neighbourhood restored_neighbourhood(height, width, GlobalTopology::TORUS, LocalTopology::HEXA, 0.25f, 1);
+  std::vector<CellIndexType> restored_best_matching_units(num_rows, 0);
+  loaded.restore(restored_codebook, restored_neighbourhood, restored_best_matching_units.data());
+  REQUIRE(restored_codebook.get_values() == codebook.get_values());
+  for (CellIndexType cell = 0; cell < height * width; ++cell)
+    REQUIRE(restored_neighbourhood.get_values()[cell] == neighbourhood.get_values()[cell]);
+  REQUIRE(restored_best_matching_units == best_matching_units);
+
+  Codebook other_codebook(width, height, input_dim, GlobalTopology::TORUS, LocalTopology::HEXA);
+  REQUIRE_THROWS(loaded.restore(other_codebook, restored_neighbourhood, restored_best_matching_units.data()));
+  std::remove(filename.c_str());
+}
+
+
+TEST_CASE("Resuming from a checkpoint continues the training bit for bit")
+{
+  const std::string corpus_filename = std::tmpnam(nullptr);
+  const std::string checkpoint_filename = std::tmpnam(nullptr);
+  const std::string log_filename = std::tmpnam(nullptr);
+  SyntheticCorpusSettings corpus_settings;
+  corpus_settings.num_rows = 400;
+  corpus_settings.vocab_size = 60;
+  corpus_settings.mean_row_length = 8;
+  corpus_settings.num_clusters = 4;
+  write_synthetic_corpus(corpus_filename, corpus_settings);
+  CorpusDataset data(corpus_filename);
+  data.init_sum_of_squares();
+
+  const CellIndexType height = 5;
+  const CellIndexType width = 6;
+  const unsigned int num_epochs = 6;
+  const unsigned int dead_cell_update_strides = GENERATE(0, 2);
+  TrainingCheckpoint settings;
+  settings.seed = 3;
+  settings.num_epochs = num_epochs;
+  settings.is_codebook_compressed = GENERATE(false, true);
+  std::ofstream log(log_filename);
+
+  // Train all epochs at once, with a checkpoint after the fourth
+  Codebook codebook(height, width, data.num_cols, GlobalTopology::TORUS, LocalTopology::HEXA);
+  codebook.init(data, CodebookInitialization::SAMPLED_ROWS, 3);
+  Neighbourhood neighbourhood(height, width, GlobalTopology::TORUS, LocalTopology::HEXA, 0.5f, 3);
+  {
+    AsyncWriter writer;
+    Checkpointer checkpointer(checkpoint_filename, settings, 4, writer);
+    train(codebook, neighbourhood, data, num_epochs, log, "", true, 0, dead_cell_update_strides, nullptr, nullptr, &checkpointer);
+  }
+
+  // Resume the last two epochs from the checkpoint
+  const TrainingCheckpoint checkpoint(checkpoint_filename);
+  REQUIRE(checkpoint.epoch == 4);
+  Codebook resumed_codebook(height, width, data.num_cols, GlobalTopology::TORUS, LocalTopology::HEXA);
+  Neighbourhood resumed_neighbourhood(height, width, GlobalTopology::TORUS, LocalTopology::HEXA, checkpoint.update_exponent, 3);
+  train(resumed_codebook, resumed_neighbourhood, data, num_epochs, log, "", true, 0, dead_cell_update_strides, nullptr, &checkpoint);
+
+  REQUIRE(resumed_codebook.get_values() == codebook.get_values());
+  for (CellIndexType cell = 0; cell < height * width; ++cell)
+    REQUIRE(resumed_neighbourhood.get_values()[cell] == neighbourhood.get_values()[cell]);
+  std::vector<CellIndexType> best_matching_units(data.num_rows), resumed_best_matching_units(data.num_rows);
+  std::vector<Float> distances(data.num_rows);
+  codebook.find_best_matching_units(data, best_matching_units.data(), distances.data(), 0);
+  resumed_codebook.find_best_matching_units(data, resumed_best_matching_units.data(), distances.data(), 0);
+  REQUIRE(resumed_best_matching_units == best_matching_units);
+
+  std::remove(corpus_filename.c_str());
+  std::remove(checkpoint_filename.c_str());
+  std::remove(log_filename.c_str());
+}
+
+
+TEST_CASE("Resuming a growth stage from a checkpoint continues the training bit for bit")
+{
+  const std::string corpus_filename = std::tmpnam(nullptr);
+  const std::string checkpoint_filename = std::tmpnam(nullptr);
+  const std::string log_filename = std::tmpnam(nullptr);
+  SyntheticCorpusSettings corpus_settings;
+  corpus_settings.num_rows = 400;
+  corpus_settings.vocab_size = 60;
+  corpus_settings.mean_row_length = 8;
+  corpus_settings.num_clusters = 4;
+  write_synthetic_corpus(corpus_filename, corpus_settings);
+  CorpusDataset data(corpus_filename);
+  data.init_sum_of_squares();
+
+  // A 4 x 3 map grows to 8 x 6 after three of six epochs
+  const unsigned int num_epochs = 6;
+  const Float radius_scale = 0.5f;
+  TrainingCheckpoint settings;
+  settings.seed = 3;
+  settings.num_epochs = num_epochs;
+  std::ofstream log(log_filename);
+
+  // Train all epochs at once, with a checkpoint after the second epoch of the small map
+  Codebook small_codebook(4, 3, data.num_cols, GlobalTopology::TORUS, LocalTopology::HEXA);
+  small_codebook.init(data, CodebookInitialization::SAMPLED_ROWS, 3);
+  Neighbourhood small_neighbourhood(4, 3, GlobalTopology::TORUS, LocalTopology::HEXA, 0.5f, 2, radius_scale);
+  {
+    AsyncWriter writer;
+    Checkpointer checkpointer(checkpoint_filename, settings, 2, writer);
+    checkpointer.set_growth_stage(0);
+    train(small_codebook, small_neighbourhood, data, num_epochs, log, "", true, 0, 0, nullptr, nullptr, &checkpointer, 1, 3);
+  }
+  Codebook codebook(small_codebook, 8, 6);
+  Neighbourhood neighbourhood(small_neighbourhood, 8, 6);
+  train(codebook, neighbourhood, data, num_epochs, log, "", true, 0, 0, nullptr, nullptr, nullptr, 4);
+
+  // Resume the small map from the checkpoint, then grow it
+  const TrainingCheckpoint checkpoint(checkpoint_filename);
+  REQUIRE(checkpoint.epoch == 2);
+  REQUIRE(checkpoint.growth_stage == 0);
+  REQUIRE(checkpoint.radius_scale == radius_scale);
+  Codebook resumed_small_codebook(4, 3, data.num_cols, GlobalTopology::TORUS, LocalTopology::HEXA);
+  Neighbourhood resumed_small_neighbourhood(4, 3, GlobalTopology::TORUS, LocalTopology::HEXA, checkpoint.update_exponent, 2, checkpoint.radius_scale);
+  train(resumed_small_codebook, resumed_small_neighbourhood, data, num_epochs, log, "", true, 0, 0, nullptr, &checkpoint, nullptr, 1, 3);
+  Codebook resumed_codebook(resumed_small_codebook, 8, 6);
+  Neighbourhood resumed_neighbourhood(resumed_small_neighbourhood, 8, 6);
+  train(resumed_codebook, resumed_neighbourhood, data, num_epochs, log, "", true, 0, 0, nullptr, nullptr, nullptr, 4);
+
+  REQUIRE(resumed_codebook.get_values() == codebook.get_values());
+  for (CellIndexType cell = 0; cell < 8 * 6; ++cell)
+    REQUIRE(resumed_neighbourhood.get_values()[cell] == neighbourhood.get_values()[cell]);
+
+  // A neighbourhood of another radius scale belongs to another growth stage
+  Neighbourhood full_size_neighbourhood(4, 3, GlobalTopology::TORUS, LocalTopology::HEXA, checkpoint.update_exponent, 2);
+  std::vector<CellIndexType> best_matching_units(data.num_rows);
+  REQUIRE_THROWS_AS(checkpoint.restore(resumed_small_codebook, full_size_neighbourhood, best_matching_units.data()), std::runtime_error);
+
+  std::remove(corpus_filename.c_str());
+  std::remove(checkpoint_filename.c_str());
+  std::remove(log_filename.c_str());
+}
+
+
+TEST_CASE("Resuming from a checkpoint continues the early stopping")
+{
+  const std::string corpus_filename = std::tmpnam(nullptr);
+  const std::string checkpoint_filename = std::tmpnam(nullptr);
+  const std::string log_filename = std::tmpnam(nullptr);
+  SyntheticCorpusSettings corpus_settings;
+  corpus_settings.num_rows = 400;
+  corpus_settings.vocab_size = 60;
+  corpus_settings.mean_row_length = 8;
+  corpus_settings.num_clusters = 4;
+  write_synthetic_corpus(corpus_filename, corpus_settings);
+  CorpusDataset data(corpus_filename);
+  data.init_sum_of_squares();
+
+  const CellIndexType height = 6;
+  const CellIndexType width = 6;
+  const unsigned int num_epochs = 12;
+  EarlyStoppingSettings stopping_settings;
+  stopping_settings.patience = 2;
+  stopping_settings.min_relative_improvement = 0.5f;
+  TrainingCheckpoint settings;
+  settings.seed = 3;
+  settings.num_epochs = num_epochs;
+  std::ofstream log(log_filename);
+
+  // Train all epochs at once
+  Codebook codebook(height, width, data.num_cols, GlobalTopology::TORUS, LocalTopology::HEXA);
+  codebook.init(data, CodebookInitialization::SAMPLED_ROWS, 3);
+  Neighbourhood neighbourhood(height, width, GlobalTopology::TORUS, LocalTopology::HEXA, 0.9f, 3);
+  EarlyStopping early_stopping(stopping_settings);
+  train(codebook, neighbourhood, data, num_epochs, log, "", true, 0, 0, nullptr, nullptr, nullptr, 1, 0, &early_stopping);
+  REQUIRE(early_stopping.has_stopped());
+  REQUIRE(early_stopping.get_stopped_epoch() + stopping_settings.num_final_epochs < num_epochs);
+
+  // Interrupt the training after a checkpoint before or after the decision to stop
+  const unsigned int checkpoint_epoch = GENERATE(2, 4);
+  {
+    Codebook interrupted_codebook(height, width, data.num_cols, GlobalTopology::TORUS, LocalTopology::HEXA);
+    interrupted_codebook.init(data, CodebookInitialization::SAMPLED_ROWS, 3);
+    Neighbourhood interrupted_neighbourhood(height, width, GlobalTopology::TORUS, LocalTopology::HEXA, 0.9f, 3);
+    EarlyStopping interrupted_early_stopping(stopping_settings);
+    AsyncWriter writer;
+    Checkpointer checkpointer(checkpoint_filename, settings, checkpoint_epoch, writer);
+    train(interrupted_codebook, interrupted_neighbourhood, data, num_epochs, log, "", true, 0, 0, nullptr, nullptr, &checkpointer, 1, checkpoint_epoch, &interrupted_early_stopping);
+  }
+
+  const TrainingCheckpoint checkpoint(checkpoint_filename);
+  REQUIRE(checkpoint.epoch == checkpoint_epoch);
+  Codebook resumed_codebook(height, width, data.num_cols, GlobalTopology::TORUS, LocalTopology::HEXA);
+  Neighbourhood resumed_neighbourhood(height, width, GlobalTopology::TORUS, LocalTopology::HEXA, checkpoint.update_exponent, 3);
+  EarlyStopping resumed_early_stopping(stopping_settings);
+  train(resumed_codebook, resumed_neighbourhood, data, num_epochs, log, "", true, 0, 0, nullptr, &checkpoint, nullptr, 1, 0, &resumed_early_stopping);
+
+  REQUIRE(resumed_early_stopping.get_stopped_epoch() == early_stopping.get_stopped_epoch());
+  REQUIRE(resumed_early_stopping.get_reason() == early_stopping.get_reason());
+  REQUIRE(resumed_codebook.get_values() == codebook.get_values());
+  for (CellIndexType cell = 0; cell < height * width; ++cell)
+    REQUIRE(resumed_neighbourhood.get_values()[cell] == neighbourhood.get_values()[cell]);
+
+  std::remove(corpus_filename.c_str());
+  std::remove(checkpoint_filename.c_str());
+  std::remove(log_filename.c_str());
+}
+
+
+TEST_CASE("A failed checkpoint is reported, while other failed files are rethrown")
+{
+  Codebook codebook(3, 4, 5, GlobalTopology::TORUS, LocalTopology::HEXA);
+  codebook.init(3, false);
+  Neighbourhood neighbourhood(3, 4, GlobalTopology::TORUS, LocalTopology::HEXA, 0.25f, 2);
+  std::vector<CellIndexType> best_matching_units(7, 0);
+
+  AsyncWriter writer;
+  Checkpointer checkpointer("/nonexistent-directory/checkpoint.bin", TrainingCheckpoint(), 1, writer);
+  checkpointer.checkpoint(1, codebook, neighbourhood, best_matching_units.data(), best_matching_units.size());
+  REQUIRE_NOTHROW(checkpointer.wait());
+
+  neighbourhood.save_to_file("/nonexistent-directory/neighbourhood.bin", writer);
+  checkpointer.checkpoint(2, codebook, neighbourhood, best_matching_units.data(), best_matching_units.size());
+  REQUIRE_THROWS_WITH(checkpointer.wait(), Catch::Contains("neighbourhood.bin") && !Catch::Contains("checkpoint.bin"));
+}
+
+
+TEST_CASE("Truncating a training log keeps the header and earlier epochs")
+{
+  std::string filename = std::tmpnam(nullptr);
+  std::ofstream log(filename);
+  log << "Epoch\tValue" << std::endl << "0\ta" << std::endl << "1\tb" << std::endl << "2\tc" << std::endl << "3\td" << std::endl;
+  log.close();
+
+  truncate_training_log(filename, 2);
+
+  std::ifstream input(filename);
+  std::stringstream content;
+  content << input.rdbuf();
+  REQUIRE(content.str() == "Epoch\tValue\n0\ta\n1\tb\n");
+  std::remove(filename.c_str());
+}
@@ -0,0 +1,198 @@
+#include <cstdio>
+#include <random>
+#include <fstream>
+#include <iterator>
+#include "catch.hpp"
+#include "../checksum.hpp"
+#include "../data.hpp"
+#include "../som.hpp"
+#include "../synth.hpp"
+
+
+static std::vector<char> read_bytes(const std::string& filename)
+{
+  std::ifstream file(filename, std::ios::binary);
+  return std::vector<char>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+
+static void write_bytes(const std::string& filename, const std::vector<char>& bytes)
+{
+  std::ofstream(filename, std::ios::binary).write(bytes.data(), bytes.size());
+}
+
+
+// The contents of a checksummed file from byte `offset` on, read like the loaders do
+static std::vector<char> read_contents(const std::string& filename, const uint64_t offset = 0)
+{
+  std::ifstream file(filename, std::ios::binary);
+  std::unique_ptr<std::streambuf> verifying_buffer;
+  const uint64_t num_content_bytes = check_checksummed_file(filename, file, verifying_buffer);
+  file.seekg(offset);
+  std::vector<char> contents(num_content_bytes - offset);
+  file.read(contents.data(), contents.size());
+  REQUIRE(static_cast<uint64_t>(file.tellg()) == num_content_bytes);
+  return contents;
+}
+
+
+TEST_CASE("CRC32C matches the standard check value with and without SSE4.2")
+{
+  const std::string check = "123456789";
+  REQUIRE(crc32c(check.data(), check.size()) == 0xe3069283u);
+  REQUIRE(crc32c_without_hardware(check.data(), check.size()) == 0xe3069283u);
+  REQUIRE(crc32c(nullptr, 0) == 0);
+
+  std::mt19937 generator(1);
+  std::vector<char> bytes(100003);
+  for (auto& byte : bytes)
+    byte = static_cast<char>(generator());
+  const uint32_t crc = crc32c(bytes.data(), bytes.size());
+  REQUIRE(crc32c_without_hardware(bytes.data(), bytes.size()) == crc);
+  // The checksum of a prefix continues over the rest
+  const size_t split = GENERATE(0, 1, 7, 4096, 100003);
+  REQUIRE(crc32c(bytes.data() + split, bytes.size() - split, crc32c(bytes.data(), split)) == crc);
+  REQUIRE(crc32c_without_hardware(bytes.data() + split, bytes.size() - split, crc32c_without_hardware(bytes.data(), split)) == crc);
+  // The checksums of a prefix and the rest combine without the bytes
+  REQUIRE(crc32c_combine(crc32c(bytes.data(), split), crc32c(bytes.data() + split, bytes.size() - split), bytes.size() - split) == crc);
+}
+
+
+TEST_CASE("The block checksums of consecutive parts combine into the trailer of the whole")
+{
+  const std::string header = "header of 19 bytes.";
+  std::vector<char> data(3 * CHECKSUM_BLOCK_SIZE + 11);
+  std::mt19937 generator(3);
+  for (auto& byte : data)
+    byte = static_cast<char>(generator());
+
+  // Parts as written by cell shards, where only the first one has the header
+  const std::vector<size_t> ends = {0, 100, CHECKSUM_BLOCK_SIZE / 2, 2 * CHECKSUM_BLOCK_SIZE - 19, 2 * CHECKSUM_BLOCK_SIZE + 1, data.size()};
+  std::vector<uint32_t> checksums;
+  uint64_t offset = 0;
+  for (size_t part = 0; part + 1 < ends.size(); ++part)
+  {
+    const std::string part_header = part == 0 ? header : "";
+    const size_t num_bytes = ends[part + 1] - ends[part];
+    const auto part_checksums = get_partial_block_checksums(part_header, data.data() + ends[part], num_bytes, offset);
+    const uint64_t end = offset + part_header.size() + num_bytes;
+    for (size_t i = 0; i < part_checksums.size(); ++i)
+    {
+      const uint64_t block = offset / CHECKSUM_BLOCK_SIZE + i;
+      const uint64_t begin = std::max<uint64_t>(block * CHECKSUM_BLOCK_SIZE, offset);
+      const uint64_t block_end = std::min<uint64_t>((block + 1) * CHECKSUM_BLOCK_SIZE, end);
+      if (block < checksums.size())
+        checksums[block] = crc32c_combine(checksums[block], part_checksums[i], block_end - begin);
+      else
+        checksums.push_back(part_checksums[i]);
+    }
+    offset = end;
+  }
+  REQUIRE(checksums.size() == 4);
+  REQUIRE(make_checksum_trailer(checksums, offset) == get_checksum_trailer(header, data.data(), data.size()));
+}
+
+
+TEST_CASE("Checksummed files detect truncation always and corruption with verification")
+{
+  const std::string filename = std::tmpnam(nullptr);
+  const std::string header = "header of 19 bytes.";
+  const size_t num_bytes = GENERATE(0, 100, CHECKSUM_BLOCK_SIZE - 19, 2 * CHECKSUM_BLOCK_SIZE + 5);
+  std::vector<char> data(num_bytes);
+  std::mt19937 generator(2);
+  for (auto& byte : data)
+    byte = static_cast<char>(generator());
+
+  const std::string trailer = get_checksum_trailer(header, data.data(), data.size());
+  std::vector<char> contents(header.begin(), header.end());
+  contents.insert(contents.end(), data.begin(), data.end());
+  std::vector<char> file = contents;
+  file.insert(file.end(), trailer.begin(), trailer.end());
+  write_bytes(filename, file);
+  set_checksum_verification(true);
+  REQUIRE(check_checksummed_file(filename) == contents.size());
+  REQUIRE(read_contents(filename) == contents);
+  const uint64_t offset = contents.size() / 3;
+  REQUIRE(read_contents(filename, offset) == std::vector<char>(contents.begin() + offset, contents.end()));
+
+  // The trailer of a file written in a stream is the same
+  write_bytes(filename, contents);
+  append_checksum_trailer(filename);
+  REQUIRE(read_bytes(filename) == file);
+
+  // Truncated files fail without reading their contents
+  set_checksum_verification(false);
+  write_bytes(filename, std::vector<char>(file.begin(), file.end() - 1));
+  REQUIRE_THROWS_AS(check_checksummed_file(filename), std::runtime_error);
+  write_bytes(filename, std::vector<char>(file.begin(), file.begin() + contents.size()));
+  REQUIRE_THROWS_AS(check_checksummed_file(filename), std::runtime_error);
+
+  // A flipped bit in the contents fails only with verification, when its block is read
+  auto corrupt = file;
+  corrupt[contents.size() / 2] ^= 0x10;
+  write_bytes(filename, corrupt);
+  REQUIRE(read_contents(filename).size() == contents.size());
+  set_checksum_verification(true);
+  REQUIRE(check_checksummed_file(filename) == contents.size());
+  REQUIRE_THROWS_WITH(read_contents(filename), Catch::Contains("is corrupt"));
+  set_checksum_verification(false);
+  std::remove(filename.c_str());
+}
+
+
+TEST_CASE("Truncated corpora, codebooks and best matching units fail to load")
+{
+  const std::string filename = std::tmpnam(nullptr);
+  SyntheticCorpusSettings settings;
+  settings.num_rows = 500;
+  settings.vocab_size = 100;
+  settings.with_weights = GENERATE(true, false);
+  write_synthetic_corpus(filename, settings);
+  set_checksum_verification(true);
+  CorpusDataset corpus(filename);
+  REQUIRE(corpus.num_rows == 500);
+  set_checksum_verification(false);
+
+  // A corpus of text_to_binary.py gets its checksums in place
+  const auto bytes = read_bytes(filename);
+  const uint64_t num_content_bytes = check_checksummed_file(filename);
+  std::vector<char> unchecked(bytes.begin(), bytes.begin() + num_content_bytes);
+  unchecked[0] -= 2;
+  write_bytes(filename, unchecked);
+  CorpusDataset unchecked_corpus(filename);
+  REQUIRE(unchecked_corpus.num_non_zero == corpus.num_non_zero);
+  add_corpus_checksums(filename);
+  REQUIRE(read_bytes(filename) == bytes);
+  REQUIRE_THROWS_AS(add_corpus_checksums(filename), std::invalid_argument);
+
+  write_bytes(filename, std::vector<char>(bytes.begin(), bytes.end() - 10));
+  REQUIRE_THROWS_AS(CorpusDataset(filename), std::runtime_error);
+  auto corrupt = bytes;
+  corrupt[num_content_bytes - 1] ^= 0x10;
+  write_bytes(filename, corrupt);
+  set_checksum_verification(true);
+  REQUIRE_THROWS_WITH(CorpusDataset(filename), Catch::Contains("is corrupt"));
+  set_checksum_verification(false);
+  // Without checksums, the missing rows are found as well
+  write_bytes(filename, std::vector<char>(unchecked.begin(), unchecked.end() - 10));
+  REQUIRE_THROWS_AS(CorpusDataset(filename), std::runtime_error);
+
+  const bool is_compressed = GENERATE(false, true);
+  Codebook codebook(4, 5, 30, GlobalTopology::PLANE, LocalTopology::CIRC);
+  codebook.init(3, false);
+  codebook.save_to_file(filename, is_compressed);
+  const auto codebook_bytes = read_bytes(filename);
+  REQUIRE(codebook_bytes[0] == (is_compressed ? 3 : 2));
+  REQUIRE(Codebook(filename).get_values() == codebook.get_values());
+  write_bytes(filename, std::vector<char>(codebook_bytes.begin(), codebook_bytes.end() - 1));
+  REQUIRE_THROWS_AS(Codebook(filename), std::runtime_error);
+
+  // Corrupt values fail to load with verification
+  auto corrupt_codebook_bytes = codebook_bytes;
+  corrupt_codebook_bytes[40] ^= 0x10;
+  write_bytes(filename, corrupt_codebook_bytes);
+  set_checksum_verification(true);
+  REQUIRE_THROWS_WITH(Codebook(filename), Catch::Contains("is corrupt"));
+  set_checksum_verification(false);
+  std::remove(filename.c_str());
+}
@@ -0,0 +1,124 @@
+#include <cmath>
+#include <cstring>
+#include <cstdio>
+#include <random>
+#include <limits>
+#include "catch.hpp"
+#include "../compress.hpp"
+#include "../som.hpp"
+
+
+// Values of a trained map: smooth over the cells, with exact zeros and some special values
+static std::vector<Float> make_codebook_values(const uint64_t num_cells, const uint64_t input_dim, const int seed)
+{
+  std::mt19937 generator(seed);
+  std::uniform_real_distribution<Float> noise(0, 1e-4f);
+  std::vector<Float> values(num_cells * input_dim);
+  for (uint64_t cell = 0; cell < num_cells; ++cell)
+    for (uint64_t column = 0; column < input_dim; ++column)
+      values[cell * input_dim + column] = column % 7 == 0 ? 0.f : static_cast<Float>(0.5 + 0.4 * std::sin(0.01 * cell + column)) + noise(generator);
+  if (values.size() > 3)
+  {
+    values[1] = -std::numeric_limits<Float>::infinity();
+    values[2] = std::numeric_limits<Float>::denorm_min();
+    values[3] = -0.f;
+  }
+  return values;
+}
+
+
+static bool have_same_bits(const Float* const a, const Float* const b, const size_t size)
+{
+  return std::memcmp(a, b, size * sizeof(Float)) == 0;
+}
+
+
+TEST_CASE("Compressed codebook values decompress to the same bits")
+{
+  const uint64_t num_cells = GENERATE(1, 7, 300);
+  const uint64_t input_dim = GENERATE(1, 5, 5000);
+  auto values = make_codebook_values(num_cells, input_dim, 1);
+  values[0] = std::numeric_limits<Float>::quiet_NaN();
+  const auto bytes = compress_codebook_values(values.data(), num_cells, input_dim);
+
+  std::vector<Float> decompressed(values.size(), 1.f);
+  decompress_codebook_values(bytes.data(), bytes.size(), num_cells, input_dim, decompressed.data(), 0, num_cells);
+  REQUIRE(have_same_bits(decompressed.data(), values.data(), values.size()));
+
+  // The cells of one process
+  const uint64_t first_cell = num_cells / 3;
+  const uint64_t end_cell = num_cells - num_cells / 4;
+  std::vector<Float> part((end_cell - first_cell) * input_dim);
+  decompress_codebook_values(bytes.data(), bytes.size(), num_cells, input_dim, part.data(), first_cell, end_cell);
+  REQUIRE(have_same_bits(part.data(), values.data() + first_cell * input_dim, part.size()));
+}
+
+
+TEST_CASE("Smooth codebooks compress well and random bytes do not grow much")
+{
+  const uint64_t num_cells = 256;
+  const uint64_t input_dim = 2000;
+  const auto values = make_codebook_values(num_cells, input_dim, 2);
+  const auto bytes = compress_codebook_values(values.data(), num_cells, input_dim);
+  REQUIRE(bytes.size() < 0.6 * values.size() * sizeof(Float));
+
+  std::mt19937 generator(3);
+  std::vector<Float> random_values(values.size());
+  for (auto& value : random_values)
+  {
+    const uint32_t bits = generator();
+    std::memcpy(&value, &bits, sizeof(bits));
+  }
+  const auto random_bytes = compress_codebook_values(random_values.data(), num_cells, input_dim);
+  REQUIRE(random_bytes.size() < 1.01 * random_values.size() * sizeof(Float));
+  std::vector<Float> decompressed(random_values.size());
+  decompress_codebook_values(random_bytes.data(), random_bytes.size(), num_cells, input_dim, decompressed.data(), 0, num_cells);
+  REQUIRE(have_same_bits(decompressed.data(), random_values.data(), random_values.size()));
+}
+
+
+TEST_CASE("Corrupt compressed codebooks are rejected")
+{
+  const uint64_t num_cells = 64;
+  const uint64_t input_dim = 100;
+  const auto values = make_codebook_values(num_cells, input_dim, 4);
+  const auto bytes = compress_codebook_values(values.data(), num_cells, input_dim);
+  std::vector<Float> decompressed(values.size());
+
+  REQUIRE_THROWS_AS(decompress_codebook_values(bytes.data(), bytes.size() - 1, num_cells, input_dim, decompressed.data(), 0, num_cells), std::runtime_error);
+  REQUIRE_THROWS_AS(decompress_codebook_values(bytes.data(), bytes.size(), num_cells, input_dim + 1000000, decompressed.data(), 0, num_cells), std::runtime_error);
+  REQUIRE_THROWS_AS(decompress_codebook_values(bytes.data(), bytes.size(), num_cells, input_dim, decompressed.data(), 0, num_cells + 1), std::invalid_argument);
+  // Flipping a byte of the code either fails or changes the values, but never reads out of bounds
+  auto corrupt = bytes;
+  corrupt[corrupt.size() / 2] ^= 0x5a;
+  try {
+    decompress_codebook_values(corrupt.data(), corrupt.size(), num_cells, input_dim, decompressed.data(), 0, num_cells);
+    REQUIRE_FALSE(have_same_bits(decompressed.data(), values.data(), values.size()));
+  } catch (const std::runtime_error&) {}
+}
+
+
+TEST_CASE("Saving and loading a compressed codebook keeps its values")
+{
+  const std::string filename = std::tmpnam(nullptr);
+  Codebook codebook(6, 5, 40, GlobalTopology::TORUS, LocalTopology::CIRC);
+  codebook.init(7, false);
+  codebook.save_to_file(filename, true);
+
+  Codebook loaded(filename, GlobalTopology::TORUS, LocalTopology::CIRC);
+  REQUIRE(loaded.get_height() == 6);
+  REQUIRE(loaded.get_width() == 5);
+  REQUIRE(loaded.get_input_dim() == 40);
+  REQUIRE(loaded.get_values() == codebook.get_values());
+
+  // The writer compresses the values when they were queued
+  AsyncWriter writer;
+  const auto values = codebook.get_values();
+  codebook.save_to_file(filename, writer, true);
+  codebook.init(8, false);
+  writer.flush();
+  Codebook loaded_in_background(filename, GlobalTopology::TORUS, LocalTopology::CIRC);
+  REQUIRE(loaded_in_background.get_values() == values);
+  REQUIRE(loaded_in_background.get_values() != codebook.get_values());
+  std::remove(filename.c_str());
+}
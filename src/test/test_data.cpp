@@ -1,6 +1,11 @@
 
+#include <set>
+#include <sstream>
+#include <algorithm>
+#include <functional>
 #include "catch.hpp"
 #include "../data.hpp"
+#include "../synth.hpp"
 
 
 TEST_CASE("Dummy data loads without problems")
@@ -17,3 +22,161 @@ TEST_CASE("Dummy data loads without problems")
   REQUIRE( dataset->num_rows == 8 );
   REQUIRE( dataset->num_cols == 12 );
 }
+
+
+TEST_CASE("The shards of a corpus contain all its rows in order")
+{
+  const std::string filename = std::tmpnam(nullptr);
+  SyntheticCorpusSettings settings;
+  settings.num_rows = 301;
+  settings.vocab_size = 200;
+  settings.with_weights = GENERATE(true, false);
+  write_synthetic_corpus(filename, settings);
+  const IndexPointerType num_shards = GENERATE(1, 2, 3, 7);
+
+  CorpusDataset full(filename);
+  IndexPointerType next_row = 0;
+  IndexPointerType num_non_zero = 0;
+  for (IndexPointerType shard = 0; shard < num_shards; ++shard)
+  {
+    CorpusDataset part(filename, shard, num_shards);
+    REQUIRE(part.first_row == next_row);
+    REQUIRE(part.num_total_rows == full.num_rows);
+    REQUIRE(part.num_cols == full.num_cols);
+    for (IndexPointerType row = 0; row < part.num_rows; ++row)
+    {
+      const IndexPointerType full_row = part.first_row + row;
+      REQUIRE(part.num_indices_in_row(row) == full.num_indices_in_row(full_row));
+      for (IndexType i = 0; i < part.num_indices_in_row(row); ++i)
+      {
+        REQUIRE(part.indices_in_row(row)[i] == full.indices_in_row(full_row)[i]);
+        if (full.has_weights())
+          REQUIRE(part.weights_in_row(row)[i] == full.weights_in_row(full_row)[i]);
+      }
+    }
+    next_row += part.num_rows;
+    num_non_zero += part.num_non_zero;
+  }
+  REQUIRE(next_row == full.num_rows);
+  REQUIRE(num_non_zero == full.num_non_zero);
+  std::remove(filename.c_str());
+}
+
+
+TEST_CASE("Hashing the columns folds every term into its buckets")
+{
+  const std::string filename = std::tmpnam(nullptr);
+  SyntheticCorpusSettings settings;
+  settings.num_rows = 300;
+  settings.vocab_size = 500;
+  settings.with_weights = GENERATE(true, false);
+  write_synthetic_corpus(filename, settings);
+  CorpusDataset full(filename);
+  CorpusDataset hashed(filename);
+  std::remove(filename.c_str());
+
+  FeatureHashing hashing;
+  hashing.num_buckets = 64;
+  hashing.num_probes = GENERATE(1, 2, 4);
+  hashing.num_exact_columns = GENERATE(0, 20);
+  hashed.hash_columns(hashing);
+  REQUIRE(hashed.num_cols == hashing.num_buckets);
+  REQUIRE(hashed.num_rows == full.num_rows);
+  REQUIRE(hashed.num_non_zero == hashed.index_pointers[hashed.num_rows]);
+
+  IndexType buckets[MAX_HASH_PROBES];
+  for (IndexPointerType row = 0; row < full.num_rows; ++row)
+  {
+    const IndexType* const indices = hashed.indices_in_row(row);
+    const IndexType row_length = hashed.num_indices_in_row(row);
+    REQUIRE(std::adjacent_find(indices, indices + row_length, std::greater_equal<IndexType>()) == indices + row_length);
+    // The bucket of every term, with at least the weight of the term
+    for (IndexType i = 0; i < full.num_indices_in_row(row); ++i)
+    {
+      const IndexType column = full.indices_in_row(row)[i];
+      const IndexType num_buckets = get_hashed_columns(hashing, column, buckets);
+      REQUIRE(num_buckets >= 1);
+      REQUIRE(num_buckets <= hashing.num_probes);
+      if (column < hashing.num_exact_columns)
+        REQUIRE(buckets[0] == column);
+      for (IndexType j = 0; j < num_buckets; ++j)
+      {
+        REQUIRE(buckets[j] >= (column < hashing.num_exact_columns ? 0 : hashing.num_exact_columns));
+        REQUIRE(buckets[j] < hashing.num_buckets);
+        const auto position = std::lower_bound(indices, indices + row_length, buckets[j]) - indices;
+        REQUIRE(indices[position] == buckets[j]);
+        if (full.has_weights())
+          REQUIRE(hashed.weights_in_row(row)[position] >= full.weights_in_row(row)[i]);
+      }
+    }
+  }
+
+  // The sums of squares are computed from the hashed columns
+  hashed.init_sum_of_squares();
+  REQUIRE_THROWS_AS(hashed.hash_columns(hashing), std::logic_error);
+}
+
+
+TEST_CASE("More hash probes leave fewer terms with the same buckets")
+{
+  FeatureHashing hashing;
+  hashing.num_buckets = 256;
+  std::vector<size_t> num_collisions;
+  for (const IndexType num_probes : {1, 2, 3})
+  {
+    hashing.num_probes = num_probes;
+    std::set<std::vector<IndexType>> distinct_buckets;
+    IndexType buckets[MAX_HASH_PROBES];
+    for (IndexType column = 0; column < 2000; ++column)
+    {
+      const IndexType num_buckets = get_hashed_columns(hashing, column, buckets);
+      distinct_buckets.insert(std::vector<IndexType>(buckets, buckets + num_buckets));
+    }
+    num_collisions.push_back(2000 - distinct_buckets.size());
+  }
+  REQUIRE(num_collisions[0] > 1500);
+  REQUIRE(num_collisions[1] < num_collisions[0] / 2);
+  REQUIRE(num_collisions[2] < num_collisions[1]);
+
+  // The training vocabulary needs its own columns
+  const std::string filename = std::tmpnam(nullptr);
+  SyntheticCorpusSettings settings;
+  settings.num_rows = 4;
+  settings.vocab_size = 50;
+  settings.mean_row_length = 5;
+  write_synthetic_corpus(filename, settings);
+  CorpusDataset data(filename);
+  std::remove(filename.c_str());
+  hashing.num_exact_columns = hashing.num_buckets;
+  REQUIRE_THROWS_AS(data.hash_columns(hashing), std::invalid_argument);
+  hashing.num_exact_columns = 0;
+  hashing.num_probes = MAX_HASH_PROBES + 1;
+  REQUIRE_THROWS_AS(data.hash_columns(hashing), std::invalid_argument);
+}
+
+
+TEST_CASE("Cell indices are stored with 2 bytes where they fit and 4 bytes otherwise")
+{
+  REQUIRE(get_cell_index_file_size(256 * 255) == 2);
+  REQUIRE(get_cell_index_file_size(256 * 256) == 4);
+
+  const std::vector<CellIndexType> cell_indices = {0, 1, 255, 256, 65534};
+  const uint8_t index_size = GENERATE(2, 4);
+  std::stringstream file;
+  write_cell_indices(file, cell_indices.data(), cell_indices.size(), index_size);
+  REQUIRE(file.str().size() == cell_indices.size() * index_size);
+
+  std::vector<CellIndexType> read_indices(cell_indices.size());
+  read_cell_indices(file, read_indices.data(), read_indices.size(), index_size);
+  REQUIRE(read_indices == cell_indices);
+
+  // Files of maps with more cells than this build supports are rejected
+  if (sizeof(CellIndexType) == 2)
+  {
+    const uint32_t large_cell_index = 70000;
+    std::stringstream large_file;
+    large_file.write((const char*) &large_cell_index, sizeof(large_cell_index));
+    CellIndexType cell_index;
+    REQUIRE_THROWS(read_cell_indices(large_file, &cell_index, 1, 4));
+  }
+}
@@ -0,0 +1,141 @@
+#include <cstdio>
+#include <sstream>
+#include "catch.hpp"
+#include "../memory.hpp"
+#include "../arena.hpp"
+#include "../synth.hpp"
+
+
+static MemoryPlanSettings get_test_settings()
+{
+  MemoryPlanSettings settings;
+  settings.num_rows = 1000000;
+  settings.num_total_rows = settings.num_rows;
+  settings.num_non_zero = 50 * settings.num_rows;
+  settings.num_cols = 10000;
+  settings.has_weights = true;
+  settings.num_cells = 64 * 64;
+  settings.num_local_cells = settings.num_cells;
+  settings.num_threads = 8;
+  settings.write_queue_bytes = uint64_t(1) << 30;
+  return settings;
+}
+
+
+static uint64_t get_item_bytes(const MemoryPlan& plan, const std::string& name)
+{
+  for (const auto& item : plan.items)
+  {
+    if (item.name == name)
+      return item.num_bytes;
+  }
+  return 0;
+}
+
+
+TEST_CASE("The header of a corpus is read without loading it")
+{
+  const std::string filename = std::tmpnam(nullptr);
+  SyntheticCorpusSettings settings;
+  settings.num_rows = 200;
+  settings.vocab_size = 150;
+  settings.with_weights = GENERATE(true, false);
+  const auto num_tokens = write_synthetic_corpus(filename, settings);
+
+  const CorpusHeader header = read_corpus_header(filename);
+  std::remove(filename.c_str());
+  REQUIRE(header.has_weights == settings.with_weights);
+  REQUIRE(header.num_non_zero == num_tokens);
+  REQUIRE(header.num_rows == settings.num_rows);
+  REQUIRE(header.num_cols == settings.vocab_size);
+  REQUIRE_THROWS_AS(read_corpus_header(filename), std::runtime_error);
+}
+
+
+TEST_CASE("Without a budget, the memory plan keeps the requested layouts")
+{
+  const auto settings = get_test_settings();
+  const MemoryPlan plan = plan_memory(settings, 0);
+  REQUIRE(plan.fits());
+  REQUIRE(plan.with_counts);
+  REQUIRE(plan.write_queue_bytes == settings.write_queue_bytes);
+  REQUIRE(get_item_bytes(plan, "Association counts") >= settings.num_cells * settings.num_cols * sizeof(CountType));
+  REQUIRE(get_item_bytes(plan, "Corpus") == 50000000 * 5 + 1000001 * 4 + 1000000 * 4);
+
+  // The peak is the largest sum over the structures that are alive at the same time
+  REQUIRE(plan.get_peak_bytes() == std::max({plan.get_phase_bytes(TRAINING_PHASE), plan.get_phase_bytes(SEMANTIC_MAP_PHASE), plan.get_phase_bytes(SAVING_PHASE)}));
+  REQUIRE(plan.get_peak_bytes() < plan.get_phase_bytes(TRAINING_PHASE | SEMANTIC_MAP_PHASE | SAVING_PHASE));
+  // The corpus is freed before the outputs are saved
+  REQUIRE(plan.get_phase_bytes(SAVING_PHASE) + get_item_bytes(plan, "Corpus") <= plan.get_phase_bytes(SEMANTIC_MAP_PHASE) + get_item_bytes(plan, "Final best matching units"));
+}
+
+
+TEST_CASE("The memory plan leaves out the counts and shrinks the write queue to fit the budget")
+{
+  // Only outputs during the training can fill the queue
+  auto settings = get_test_settings();
+  settings.has_preliminary_outputs = true;
+  const MemoryPlan unlimited_plan = plan_memory(settings, 0);
+
+  // Just below the peak with the counts
+  const MemoryPlan plan_without_counts = plan_memory(settings, unlimited_plan.get_peak_bytes() - 1);
+  REQUIRE(plan_without_counts.fits());
+  REQUIRE_FALSE(plan_without_counts.with_counts);
+  REQUIRE(get_item_bytes(plan_without_counts, "Association counts") == 0);
+  REQUIRE(plan_without_counts.write_queue_bytes == settings.write_queue_bytes);
+  REQUIRE(plan_without_counts.get_peak_bytes() < unlimited_plan.get_peak_bytes());
+
+  // Half of the write queue over the peak without the counts
+  const uint64_t budget = plan_without_counts.get_peak_bytes() - settings.write_queue_bytes / 2;
+  const MemoryPlan plan_with_smaller_queue = plan_memory(settings, budget);
+  REQUIRE(plan_with_smaller_queue.fits());
+  REQUIRE_FALSE(plan_with_smaller_queue.with_counts);
+  REQUIRE(plan_with_smaller_queue.write_queue_bytes == settings.write_queue_bytes / 2);
+  REQUIRE(plan_with_smaller_queue.get_peak_bytes() == budget);
+
+  // Not even the corpus fits
+  const MemoryPlan failed_plan = plan_memory(settings, get_item_bytes(unlimited_plan, "Corpus"));
+  REQUIRE_FALSE(failed_plan.fits());
+  std::ostringstream breakdown;
+  failed_plan.print(breakdown);
+  REQUIRE(breakdown.str().find("- Corpus: ") != std::string::npos);
+  REQUIRE(breakdown.str().find("Peak memory:") != std::string::npos);
+}
+
+
+TEST_CASE("The memory plan covers the structures of the enabled features")
+{
+  auto settings = get_test_settings();
+  const MemoryPlan plan = plan_memory(settings, 0);
+  // Without outputs during the training, the queue holds at most the final radii
+  REQUIRE(get_item_bytes(plan, "Write queue") == settings.num_cells * sizeof(Float));
+  settings.num_growth_cells = 32 * 32;
+  settings.has_checkpoints = true;
+  settings.has_dead_cell_updates = true;
+  settings.trace_bytes = 1000;
+  const MemoryPlan full_plan = plan_memory(settings, 0);
+  // Rounded up to huge pages
+  REQUIRE(get_item_bytes(full_plan, "Growth stage codebook") >= 32 * 32 * settings.num_cols * sizeof(Float));
+  REQUIRE(get_item_bytes(full_plan, "Growth stage codebook") < 32 * 32 * settings.num_cols * sizeof(Float) + HUGE_PAGE_SIZE);
+  REQUIRE(get_item_bytes(full_plan, "Checkpoint snapshot") > 0);
+  REQUIRE(get_item_bytes(full_plan, "Trace buffers") == 1000);
+  REQUIRE(get_item_bytes(full_plan, "Error metrics") > get_item_bytes(plan, "Error metrics"));
+  REQUIRE(full_plan.get_peak_bytes() > plan.get_peak_bytes());
+
+  // The compression of the checkpoints and of the final codebook
+  REQUIRE(get_item_bytes(full_plan, "Codebook compression") == 0);
+  settings.is_codebook_compressed = true;
+  const MemoryPlan compressed_plan = plan_memory(settings, 0);
+  const uint64_t compression_bytes = 2 * settings.num_local_cells * settings.num_cols * sizeof(Float);
+  REQUIRE(get_item_bytes(compressed_plan, "Codebook compression") == compression_bytes);
+  REQUIRE(compressed_plan.get_phase_bytes(TRAINING_PHASE) == full_plan.get_phase_bytes(TRAINING_PHASE) + compression_bytes);
+  REQUIRE(compressed_plan.get_phase_bytes(SAVING_PHASE) == full_plan.get_phase_bytes(SAVING_PHASE) + compression_bytes);
+}
+
+
+TEST_CASE("The memory limit of this process is known")
+{
+  #if defined(__linux__)
+    REQUIRE(get_memory_limit() > 0);
+  #endif
+}
@@ -0,0 +1,33 @@
+#include <vector>
+#include "catch.hpp"
+#include "../numa.hpp"
+
+
+TEST_CASE("The NUMA topology covers the CPUs and splits items by node")
+{
+  const int num_nodes = get_num_numa_nodes();
+  REQUIRE(num_nodes >= 1);
+  REQUIRE(!get_cpus_by_numa_node().empty());
+
+  for (const size_t count : {0, 1, 7, 1000})
+  {
+    const auto boundaries = split_by_numa_node(count);
+    REQUIRE(boundaries.size() == static_cast<size_t>(num_nodes + 1));
+    REQUIRE(boundaries.front() == 0);
+    REQUIRE(boundaries.back() == count);
+    for (int node = 0; node < num_nodes; ++node)
+      REQUIRE(boundaries[node] <= boundaries[node + 1]);
+  }
+}
+
+
+TEST_CASE("Pages moved to a NUMA node are placed there")
+{
+  const size_t num_bytes = 64 << 12;
+  std::vector<char> buffer(2 * num_bytes, 1);
+  // The whole pages in the middle of the buffer
+  const char* const middle = buffer.data() + num_bytes / 2;
+  if (move_to_numa_node(middle, num_bytes, 0))
+    REQUIRE(get_numa_node_of_address(middle + num_bytes / 2) == 0);
+  REQUIRE(!move_to_numa_node(middle, 16, 0));
+}
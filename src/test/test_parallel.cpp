@@ -0,0 +1,133 @@
+#include <vector>
+#include <utility>
+#include <numeric>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <stdexcept>
+#include "catch.hpp"
+#include "../parallel.hpp"
+#include "../som.hpp"
+#include "../smap.hpp"
+#include "../synth.hpp"
+
+
+TEST_CASE("Parallel loops run every iteration exactly once")
+{
+  ParallelSettings settings;
+  settings.backend = GENERATE(ParallelBackend::OPENMP_BACKEND, ParallelBackend::THREAD_POOL_BACKEND);
+  settings.num_threads = GENERATE(1, 3, 8);
+  settings.grain_size = GENERATE(0, 1, 7);
+  const size_t begin = 5, end = 1000;
+
+  // Catch assertions are not thread-safe, so every thread records its ranges, which are checked afterwards
+  const int num_threads = get_num_parallel_threads(settings);
+  std::vector<std::vector<std::pair<size_t, size_t>>> ranges(num_threads);
+  std::atomic<bool> has_unknown_thread(false);
+  parallel_for("test", begin, end, [&](const size_t first, const size_t last, const int thread) {
+    if (thread < 0 || thread >= num_threads)
+      has_unknown_thread = true;
+    else
+      ranges[thread].emplace_back(first, last);
+  }, settings);
+
+  REQUIRE_FALSE(has_unknown_thread);
+  std::vector<int> num_runs(end, 0);
+  for (const auto& thread_ranges : ranges)
+  {
+    for (const auto& range : thread_ranges)
+    {
+      REQUIRE(range.first < range.second);
+      for (size_t i = range.first; i < range.second; ++i)
+        num_runs[i] += 1;
+    }
+  }
+  for (size_t i = 0; i < end; ++i)
+    REQUIRE(num_runs[i] == (i >= begin ? 1 : 0));
+}
+
+
+TEST_CASE("Parallel loops rethrow exceptions and run nested loops sequentially")
+{
+  ParallelSettings settings;
+  settings.backend = GENERATE(ParallelBackend::OPENMP_BACKEND, ParallelBackend::THREAD_POOL_BACKEND);
+  settings.num_threads = 4;
+
+  REQUIRE_THROWS_AS(parallel_for("test", 0, 100, [](const size_t first, const size_t, int) {
+    if (first == 0)
+      throw std::runtime_error("failed");
+  }, settings), std::runtime_error);
+
+  // The threads of the outer loop record the threads and iterations of their inner loops
+  std::vector<std::vector<int>> inner_threads(get_num_parallel_threads(settings));
+  std::vector<int> num_inner(inner_threads.size(), 0);
+  parallel_for("test", 0, 8, [&](const size_t first, const size_t last, const int outer_thread) {
+    for (size_t i = first; i < last; ++i)
+      parallel_for("inner", 0, 10, [&](const size_t inner_first, const size_t inner_last, const int thread) {
+        inner_threads[outer_thread].push_back(thread);
+        num_inner[outer_thread] += static_cast<int>(inner_last - inner_first);
+      }, settings);
+  }, settings);
+  for (const auto& threads : inner_threads)
+    REQUIRE(std::all_of(threads.begin(), threads.end(), [](const int thread) { return thread == 0; }));
+  REQUIRE(std::accumulate(num_inner.begin(), num_inner.end(), 0) == 80);
+
+  REQUIRE(parse_cpu_list("0-2,5") == std::vector<int>{0, 1, 2, 5});
+  REQUIRE_THROWS(parse_cpu_list("3-1"));
+}
+
+
+TEST_CASE("The thread pool trains the same map as OpenMP")
+{
+  const std::string filename = std::tmpnam(nullptr);
+  SyntheticCorpusSettings corpus_settings;
+  corpus_settings.num_rows = 500;
+  corpus_settings.vocab_size = 40;
+  write_synthetic_corpus(filename, corpus_settings);
+  CorpusDataset data(filename);
+  data.init_sum_of_squares();
+
+  std::vector<Float> values[2];
+  std::vector<Float> radii[2];
+  std::vector<CountType> counts[2];
+  for (int backend = 0; backend < 2; ++backend)
+  {
+    ParallelSettings settings;
+    settings.backend = static_cast<ParallelBackend>(backend);
+    settings.num_threads = 3;
+    settings.grain_size = 5;
+    Codebook codebook(4, 5, data.num_cols, GlobalTopology::TORUS, LocalTopology::HEXA);
+    codebook.init(1, false);
+    codebook.parallel_settings = settings;
+    Neighbourhood neighbourhood(4, 5, GlobalTopology::TORUS, LocalTopology::HEXA, 0.9f, 3);
+    neighbourhood.parallel_settings = settings;
+
+    std::vector<CellIndexType> best(data.num_rows), next_best(data.num_rows);
+    std::vector<Float> distances(data.num_rows), next_distances(data.num_rows);
+    for (int epoch = 0; epoch < 2; ++epoch)
+    {
+      codebook.find_best_and_next_best_matching_units(data, best.data(), distances.data(), next_best.data(), next_distances.data(), 0);
+      neighbourhood.update(best.data(), next_best.data(), data.num_rows);
+      codebook.apply_batch_som_update(data, neighbourhood, best.data());
+    }
+    values[backend].assign(codebook.get_values().begin(), codebook.get_values().end());
+    radii[backend].assign(neighbourhood.get_values(), neighbourhood.get_values() + neighbourhood.get_num_cells());
+
+    SemanticMap map;
+    map.parallel_settings = settings;
+    map.build(data, best.data(), 4, 5);
+    for (IndexType vocab_index = 0; vocab_index < data.num_cols; ++vocab_index)
+      counts[backend].insert(counts[backend].end(), map.get_counts(vocab_index), map.get_counts(vocab_index) + 20);
+
+    std::vector<CountType> expected_counts(20 * data.num_cols, 0);
+    for (IndexPointerType row = 0; row < data.num_rows; ++row)
+      for (IndexType i = 0; i < data.num_indices_in_row(row); ++i)
+        expected_counts[20 * data.indices_in_row(row)[i] + best[row]] += 1;
+    REQUIRE(counts[backend] == expected_counts);
+  }
+
+  REQUIRE(values[0] == values[1]);
+  REQUIRE(radii[0] == radii[1]);
+  REQUIRE(counts[0] == counts[1]);
+  std::remove(filename.c_str());
+}
@@ -0,0 +1,128 @@
+#include <cstdio>
+#include <fstream>
+#include <algorithm>
+#include "catch.hpp"
+#include "../reorder.hpp"
+#include "../synth.hpp"
+
+
+TEST_CASE("The column order is a permutation that keeps the training prefix")
+{
+  const std::string filename = std::tmpnam(nullptr);
+  SyntheticCorpusSettings corpus_settings;
+  corpus_settings.num_rows = 2000;
+  corpus_settings.vocab_size = 500;
+  corpus_settings.num_clusters = 8;
+  corpus_settings.cluster_strength = 0.8;
+  write_synthetic_corpus(filename, corpus_settings);
+  CorpusDataset data(filename);
+  std::remove(filename.c_str());
+
+  ColumnOrderSettings settings;
+  settings.train_vocab_cutoff = GENERATE(0, 1, 137, 500);
+  settings.window_size = GENERATE(1, 16);
+  const auto new_columns = compute_column_order(data, settings);
+  REQUIRE(new_columns.size() == data.num_cols);
+  const auto original_columns = invert_permutation(new_columns);
+  for (IndexType column = 0; column < data.num_cols; ++column)
+  {
+    REQUIRE(new_columns[original_columns[column]] == column);
+    REQUIRE((column < settings.train_vocab_cutoff) == (new_columns[column] < settings.train_vocab_cutoff));
+  }
+  // The order only depends on the corpus and the settings
+  REQUIRE(compute_column_order(data, settings) == new_columns);
+}
+
+
+TEST_CASE("Reordering the columns of a clustered corpus touches fewer cache lines")
+{
+  const std::string filename = std::tmpnam(nullptr);
+  SyntheticCorpusSettings corpus_settings;
+  corpus_settings.num_rows = 5000;
+  corpus_settings.vocab_size = 4000;
+  corpus_settings.num_clusters = 32;
+  corpus_settings.cluster_strength = 0.8;
+  write_synthetic_corpus(filename, corpus_settings);
+  CorpusDataset data(filename);
+  std::remove(filename.c_str());
+
+  const auto new_columns = compute_column_order(data, ColumnOrderSettings());
+  const std::vector<IndexType> original_columns;
+  REQUIRE(get_mean_blocks_per_row(data, new_columns, 16) < 0.8 * get_mean_blocks_per_row(data, original_columns, 16));
+  // Every column in its own block
+  REQUIRE(get_mean_blocks_per_row(data, original_columns, 1) == Approx(static_cast<Double>(data.num_non_zero) / data.num_rows));
+}
+
+
+TEST_CASE("The reordered corpus and vocabulary keep every snippet and term")
+{
+  const std::string filename = std::tmpnam(nullptr);
+  const std::string reordered_filename = std::tmpnam(nullptr);
+  const std::string vocabulary_filename = std::tmpnam(nullptr);
+  const std::string reordered_vocabulary_filename = std::tmpnam(nullptr);
+  SyntheticCorpusSettings corpus_settings;
+  corpus_settings.num_rows = 300;
+  corpus_settings.vocab_size = 200;
+  corpus_settings.num_clusters = 4;
+  corpus_settings.with_weights = GENERATE(true, false);
+  write_synthetic_corpus(filename, corpus_settings);
+  CorpusDataset data(filename);
+  {
+    std::ofstream vocabulary(vocabulary_filename);
+    for (IndexType column = 0; column < data.num_cols; ++column)
+      vocabulary << "term" << column << "\n";
+  }
+
+  ColumnOrderSettings settings;
+  settings.train_vocab_cutoff = 50;
+  const auto new_columns = compute_column_order(data, settings);
+  write_permuted_corpus(reordered_filename, data, new_columns, settings.train_vocab_cutoff);
+  write_permuted_vocabulary(vocabulary_filename, reordered_vocabulary_filename, new_columns);
+  CorpusDataset reordered(reordered_filename);
+
+  // The corpus records the cutoff of its order
+  REQUIRE_FALSE(data.is_reordered);
+  REQUIRE(reordered.is_reordered);
+  REQUIRE(reordered.reordered_train_vocab_cutoff == 50);
+  const CorpusHeader header = read_corpus_header(reordered_filename);
+  REQUIRE(header.is_reordered);
+  REQUIRE(header.reordered_train_vocab_cutoff == 50);
+  REQUIRE(header.num_rows == data.num_rows);
+  REQUIRE(header.num_cols == data.num_cols);
+  REQUIRE(header.has_weights == data.has_weights());
+  REQUIRE(reordered.num_rows == data.num_rows);
+  REQUIRE(reordered.num_cols == data.num_cols);
+  REQUIRE(reordered.num_non_zero == data.num_non_zero);
+  REQUIRE(reordered.has_weights() == data.has_weights());
+  for (IndexPointerType row = 0; row < data.num_rows; ++row)
+  {
+    REQUIRE(reordered.num_indices_in_row(row) == data.num_indices_in_row(row));
+    const IndexType* const indices = reordered.indices_in_row(row);
+    REQUIRE(std::is_sorted(indices, indices + reordered.num_indices_in_row(row)));
+    for (IndexType i = 0; i < data.num_indices_in_row(row); ++i)
+    {
+      const IndexType column = new_columns[data.indices_in_row(row)[i]];
+      const auto position = std::lower_bound(indices, indices + reordered.num_indices_in_row(row), column) - indices;
+      REQUIRE(indices[position] == column);
+      if (data.has_weights())
+        REQUIRE(reordered.weights_in_row(row)[position] == data.weights_in_row(row)[i]);
+    }
+  }
+
+  // Every term moves along with its column
+  std::ifstream vocabulary(reordered_vocabulary_filename);
+  std::string term;
+  for (IndexType column = 0; column < data.num_cols; ++column)
+  {
+    REQUIRE(std::getline(vocabulary, term));
+    REQUIRE(new_columns[std::stoul(term.substr(4))] == column);
+  }
+  REQUIRE_FALSE(std::getline(vocabulary, term));
+
+  // A vocabulary of another corpus
+  std::ofstream(vocabulary_filename) << "term0\n";
+  REQUIRE_THROWS_AS(write_permuted_vocabulary(vocabulary_filename, reordered_vocabulary_filename, new_columns), std::invalid_argument);
+
+  for (const auto& name : {filename, reordered_filename, vocabulary_filename, reordered_vocabulary_filename})
+    std::remove(name.c_str());
+}
@@ -1,6 +1,8 @@
 
 #include "catch.hpp"
 #include "../som.hpp"
+#include "../synth.hpp"
+#include "../utils.hpp"
 
 
 SCENARIO("The codebook is correctly created, initialized, and cleaned up")
@@ -42,3 +44,365 @@ TEST_CASE("Saving and loading a codebook to file works")
   REQUIRE(v23 == codebook->get_value(23));
   delete codebook;
 }
+
+
+TEST_CASE("Training on a weighted corpus finds the best matching units with the weights of each row")
+{
+  const std::string filename = std::tmpnam(nullptr);
+  const std::string log_filename = std::tmpnam(nullptr);
+  SyntheticCorpusSettings settings;
+  settings.num_rows = 300;
+  settings.vocab_size = 40;
+  settings.mean_row_length = 8;
+  settings.heading_probability = 0.5;
+  write_synthetic_corpus(filename, settings);
+  CorpusDataset data(filename);
+  data.init_sum_of_squares();
+  REQUIRE(data.has_weights());
+
+  Codebook codebook(4, 4, data.num_cols, GlobalTopology::TORUS, LocalTopology::HEXA);
+  codebook.init(1, false);
+  Neighbourhood neighbourhood(4, 4, GlobalTopology::TORUS, LocalTopology::HEXA, 0.25f, 2);
+  std::ofstream log(log_filename);
+  train(codebook, neighbourhood, data, 3, log);
+
+  std::vector<CellIndexType> best(data.num_rows), next_best(data.num_rows);
+  std::vector<Float> distances(data.num_rows), next_distances(data.num_rows);
+  codebook.find_best_and_next_best_matching_units(data, best.data(), distances.data(), next_best.data(), next_distances.data(), 0);
+
+  // Squared distances to the dense rows, whose entries are the weights of their terms
+  const auto& values = codebook.get_values();
+  for (IndexPointerType row = 0; row < data.num_rows; ++row)
+  {
+    std::vector<Double> x(data.num_cols, 0.);
+    for (IndexType i = 0; i < data.num_indices_in_row(row); ++i)
+      x[data.indices_in_row(row)[i]] = data.weights_in_row(row)[i];
+    std::vector<Double> row_distances(codebook.get_num_cells(), 0.);
+    for (CellIndexType cell = 0; cell < codebook.get_num_cells(); ++cell)
+      for (IndexType i = 0; i < data.num_cols; ++i)
+        row_distances[cell] += (values[cell * data.num_cols + i] - x[i]) * (values[cell * data.num_cols + i] - x[i]);
+    const Double min_distance = *std::min_element(row_distances.begin(), row_distances.end());
+    REQUIRE(distances[row] == Approx(row_distances[best[row]]).margin(1e-3));
+    REQUIRE(row_distances[best[row]] == Approx(min_distance).margin(1e-3));
+  }
+  std::remove(filename.c_str());
+  std::remove(log_filename.c_str());
+}
+
+
+TEST_CASE("The best matching units with a training vocabulary cutoff only compare the vocabulary below it")
+{
+  const std::string filename = std::tmpnam(nullptr);
+  SyntheticCorpusSettings settings;
+  settings.num_rows = 300;
+  settings.vocab_size = 40;
+  settings.with_weights = false;
+  write_synthetic_corpus(filename, settings);
+  CorpusDataset data(filename);
+  data.init_sum_of_squares();
+  const IndexType train_vocab_cutoff = 15;
+
+  Codebook codebook(3, 4, data.num_cols, GlobalTopology::PLANE, LocalTopology::RECT);
+  codebook.init(1, false);
+  std::vector<CellIndexType> best(data.num_rows), next_best(data.num_rows);
+  std::vector<Float> distances(data.num_rows), next_distances(data.num_rows);
+  codebook.find_best_and_next_best_matching_units(data, best.data(), distances.data(), next_best.data(), next_distances.data(), train_vocab_cutoff);
+
+  // Every cell starts at a multiple of the full vocabulary size, also when only its beginning is compared
+  const auto& values = codebook.get_values();
+  for (IndexPointerType row = 0; row < data.num_rows; ++row)
+  {
+    if (data.num_indices_in_row(row) == 0 || data.indices_in_row(row)[0] >= train_vocab_cutoff)
+      continue;
+    std::vector<Double> x(data.num_cols, 0.);
+    for (IndexType i = 0; i < data.num_indices_in_row(row); ++i)
+      x[data.indices_in_row(row)[i]] = 1.;
+    std::vector<Double> row_distances(codebook.get_num_cells(), 0.);
+    for (CellIndexType cell = 0; cell < codebook.get_num_cells(); ++cell)
+    {
+      for (IndexType i = 0; i < train_vocab_cutoff; ++i)
+        row_distances[cell] += (values[cell * data.num_cols + i] - x[i]) * (values[cell * data.num_cols + i] - x[i]);
+      for (IndexType i = train_vocab_cutoff; i < data.num_cols; ++i)
+        row_distances[cell] += x[i];
+    }
+    const Double min_distance = *std::min_element(row_distances.begin(), row_distances.end());
+    REQUIRE(distances[row] == Approx(row_distances[best[row]]).margin(1e-3));
+    REQUIRE(row_distances[best[row]] == Approx(min_distance).margin(1e-3));
+  }
+  std::remove(filename.c_str());
+}
+
+
+TEST_CASE("A loaded codebook measures distances in its topology")
+{
+  const std::string filename = std::tmpnam(nullptr);
+  Codebook codebook(4, 6, 3, GlobalTopology::TORUS, LocalTopology::HEXA);
+  codebook.init(1, false);
+  codebook.save_to_file(filename);
+
+  // The last cell of the first row is a neighbour of the first cell on the torus
+  const std::vector<CellIndexType> previous_best_matching_units = {0, 0, 7};
+  const std::vector<CellIndexType> best_matching_units = {5, 23, 7};
+  const Float expected_error = codebook.diffusion_error(best_matching_units.data(), previous_best_matching_units.data(), 3);
+
+  Codebook loaded(filename, GlobalTopology::TORUS, LocalTopology::HEXA);
+  REQUIRE(loaded.get_values() == codebook.get_values());
+  REQUIRE(loaded.diffusion_error(best_matching_units.data(), previous_best_matching_units.data(), 3) == expected_error);
+  Codebook plane(filename);
+  REQUIRE(plane.diffusion_error(best_matching_units.data(), previous_best_matching_units.data(), 3) > expected_error);
+  std::remove(filename.c_str());
+}
+
+
+TEST_CASE("Searching several codebooks at once finds the same best matching units as searching each")
+{
+  const std::string filename = std::tmpnam(nullptr);
+  SyntheticCorpusSettings settings;
+  settings.num_rows = 700;
+  settings.vocab_size = 60;
+  settings.with_weights = GENERATE(true, false);
+  write_synthetic_corpus(filename, settings);
+  CorpusDataset data(filename);
+  data.init_sum_of_squares();
+
+  Codebook small(3, 4, data.num_cols, GlobalTopology::PLANE, LocalTopology::CIRC);
+  Codebook large(6, 6, data.num_cols, GlobalTopology::TORUS, LocalTopology::HEXA);
+  small.init(1, false);
+  large.init(2, false);
+  const std::vector<const Codebook*> codebooks = {&small, &large};
+  const std::vector<IndexType> train_vocab_cutoffs = {0, 30};
+
+  std::vector<std::vector<CellIndexType>> best(2, std::vector<CellIndexType>(data.num_rows)), next_best = best;
+  std::vector<std::vector<Float>> distances(2, std::vector<Float>(data.num_rows)), next_distances = distances;
+  std::vector<BestMatchingUnitSearch> searches;
+  for (size_t i = 0; i < codebooks.size(); ++i)
+    searches.push_back({codebooks[i], best[i].data(), distances[i].data(), next_best[i].data(), next_distances[i].data(), train_vocab_cutoffs[i]});
+  find_best_and_next_best_matching_units(data, searches);
+
+  for (size_t i = 0; i < codebooks.size(); ++i)
+  {
+    std::vector<CellIndexType> expected_best(data.num_rows), expected_next_best(data.num_rows);
+    std::vector<Float> expected_distances(data.num_rows), expected_next_distances(data.num_rows);
+    codebooks[i]->find_best_and_next_best_matching_units(
+      data, expected_best.data(), expected_distances.data(), expected_next_best.data(), expected_next_distances.data(), train_vocab_cutoffs[i]
+    );
+    REQUIRE(best[i] == expected_best);
+    REQUIRE(next_best[i] == expected_next_best);
+    REQUIRE(distances[i] == expected_distances);
+    REQUIRE(next_distances[i] == expected_next_distances);
+  }
+  std::remove(filename.c_str());
+}
+
+
+TEST_CASE("Data-driven codebook initializations start close to the snippets")
+{
+  const std::string filename = std::tmpnam(nullptr);
+  SyntheticCorpusSettings settings;
+  settings.num_rows = 2000;
+  settings.vocab_size = 300;
+  settings.num_clusters = 8;
+  settings.cluster_strength = 0.8;
+  settings.with_weights = false;
+  write_synthetic_corpus(filename, settings);
+  CorpusDataset data(filename);
+  data.init_sum_of_squares();
+  const IndexType train_vocab_cutoff = 250;
+
+  std::vector<CellIndexType> best_matching_units(data.num_rows);
+  std::vector<Float> distances(data.num_rows);
+  auto initial_error = [&](const CodebookInitialization initialization) {
+    Codebook codebook(6, 6, data.num_cols, GlobalTopology::PLANE, LocalTopology::CIRC);
+    codebook.init(data, initialization, 7);
+    codebook.find_best_matching_units(data, best_matching_units.data(), distances.data(), 0, true);
+    return codebook.quantization_error(distances.data(), data.num_rows);
+  };
+  const Float uniform_error = initial_error(CodebookInitialization::RANDOM_UNIFORM);
+  REQUIRE(initial_error(CodebookInitialization::SAMPLED_ROWS) < uniform_error);
+  REQUIRE(initial_error(CodebookInitialization::PRINCIPAL_COMPONENTS) < uniform_error);
+
+  SECTION("Every cell is a sampled snippet below the vocab cutoff")
+  {
+    Codebook codebook(4, 5, data.num_cols, GlobalTopology::TORUS, LocalTopology::HEXA);
+    codebook.init(data, CodebookInitialization::SAMPLED_ROWS, 7, train_vocab_cutoff);
+    for (CellIndexType cell = 0; cell < codebook.get_num_cells(); ++cell)
+    {
+      std::vector<Float> expected(data.num_cols), w(&codebook.get_values()[cell * data.num_cols], &codebook.get_values()[(cell + 1) * data.num_cols]);
+      bool is_found = false;
+      for (IndexPointerType row = 0; row < data.num_rows && !is_found; ++row)
+      {
+        std::fill(expected.begin(), expected.end(), 0.f);
+        for (IndexType i = 0; i < data.num_indices_in_row(row); ++i)
+          if (data.indices_in_row(row)[i] < train_vocab_cutoff)
+            expected[data.indices_in_row(row)[i]] = 1.f;
+        is_found = expected == w;
+      }
+      REQUIRE(is_found);
+    }
+  }
+
+  SECTION("The principal components give reproducible values between 0 and 1")
+  {
+    Codebook codebook(4, 6, data.num_cols, GlobalTopology::PLANE, LocalTopology::HEXA);
+    Codebook other(4, 6, data.num_cols, GlobalTopology::PLANE, LocalTopology::HEXA);
+    codebook.init(data, CodebookInitialization::PRINCIPAL_COMPONENTS, 7, train_vocab_cutoff);
+    other.init(data, CodebookInitialization::PRINCIPAL_COMPONENTS, 7, train_vocab_cutoff);
+    REQUIRE(codebook.get_values() == other.get_values());
+    for (IndexPointerType i = 0; i < codebook.get_values().size(); ++i)
+    {
+      REQUIRE(0.f <= codebook.get_values()[i]);
+      REQUIRE(codebook.get_values()[i] <= 1.f);
+      if (i % data.num_cols >= train_vocab_cutoff)
+        REQUIRE(codebook.get_values()[i] == 0.f);
+    }
+    // Opposite corners of the map differ along the first principal component
+    REQUIRE(codebook.get_values()[0] != codebook.get_values()[(codebook.get_num_cells() - 1) * data.num_cols]);
+  }
+  std::remove(filename.c_str());
+}
+
+
+TEST_CASE("The fused error metrics match their definitions")
+{
+  const CellIndexType height = 4;
+  const CellIndexType width = 4;
+  const IndexPointerType num_rows = 1000;
+  Codebook codebook(height, width, 3, GlobalTopology::TORUS, LocalTopology::RECT);
+  std::vector<CellIndexType> best_matching_units(num_rows), previous_best_matching_units(num_rows);
+  std::vector<Float> distances(num_rows);
+  for (IndexPointerType row = 0; row < num_rows; ++row)
+  {
+    // Cells 13 to 15 are never used
+    best_matching_units[row] = static_cast<CellIndexType>((row * 7) % 13);
+    previous_best_matching_units[row] = static_cast<CellIndexType>((row * 3) % 16);
+    distances[row] = static_cast<Float>((row * 37) % 101) / 10;
+  }
+
+  Double squared_distances = 0.;
+  uint64_t total_distance = 0;
+  for (IndexPointerType row = 0; row < num_rows; ++row)
+  {
+    squared_distances += squared(distances[row]);
+    const CellIndexType source = previous_best_matching_units[row], target = best_matching_units[row];
+    total_distance += distance_function(GlobalTopology::TORUS, LocalTopology::RECT)(source / width, source % width, target / width, target % width, width, height);
+  }
+
+  const EpochMetrics metrics = codebook.compute_metrics(best_matching_units.data(), distances.data(), previous_best_matching_units.data(), num_rows);
+  REQUIRE(metrics.quantization_error == Approx(std::sqrt(squared_distances) / num_rows));
+  REQUIRE(metrics.gap_error == Approx(3.f / 16));
+  REQUIRE(metrics.diffusion_error == Approx(static_cast<Float>(total_distance) / num_rows));
+  REQUIRE(codebook.quantization_error(distances.data(), num_rows) == metrics.quantization_error);
+  REQUIRE(codebook.gap_error(best_matching_units.data(), num_rows) == metrics.gap_error);
+
+  SECTION("A sample estimates the quantization and diffusion errors from every nth row")
+  {
+    const EpochMetrics sampled = codebook.compute_metrics(best_matching_units.data(), distances.data(), previous_best_matching_units.data(), num_rows, 10, 3);
+    Double sampled_squared_distances = 0.;
+    for (IndexPointerType row = 3; row < num_rows; row += 10)
+      sampled_squared_distances += squared(distances[row]);
+    REQUIRE(sampled.quantization_error == Approx(std::sqrt(sampled_squared_distances * 10) / num_rows));
+    REQUIRE(sampled.gap_error == metrics.gap_error);
+  }
+
+  SECTION("Dead cells are assigned to the rows with the largest distances")
+  {
+    const Float gap_error = codebook.assign_dead_cells(best_matching_units.data(), distances.data(), num_rows);
+    REQUIRE(gap_error == metrics.gap_error);
+    std::vector<IndexPointerType> reassigned_rows;
+    for (IndexPointerType row = 0; row < num_rows; ++row)
+      if (best_matching_units[row] >= 13)
+        reassigned_rows.push_back(row);
+    REQUIRE(reassigned_rows.size() == 3);
+    const Float largest_distance = *std::max_element(distances.begin(), distances.end());
+    for (const auto row : reassigned_rows)
+      REQUIRE(distances[row] == largest_distance);
+    REQUIRE(codebook.gap_error(best_matching_units.data(), num_rows) == 0.f);
+  }
+
+  SECTION("Assigning dead cells in the pass of the metrics gives the metrics after the assignment")
+  {
+    const IndexPointerType sample_strides = GENERATE(1, 10);
+    Arena arena(codebook.get_metrics_scratch_bytes(true));
+    const MetricsScratch scratch = codebook.allocate_metrics_scratch(arena, true);
+    auto fused_best_matching_units = best_matching_units;
+    const EpochMetrics fused = codebook.compute_metrics_and_assign_dead_cells(
+      fused_best_matching_units.data(), distances.data(), previous_best_matching_units.data(), num_rows, sample_strides, 3, &scratch
+    );
+    const Float gap_error = codebook.assign_dead_cells(best_matching_units.data(), distances.data(), num_rows);
+    const EpochMetrics after = codebook.compute_metrics(best_matching_units.data(), distances.data(), previous_best_matching_units.data(), num_rows, sample_strides, 3);
+    REQUIRE(fused_best_matching_units == best_matching_units);
+    REQUIRE(fused.gap_error == gap_error);
+    REQUIRE(fused.quantization_error == after.quantization_error);
+    REQUIRE(fused.diffusion_error == after.diffusion_error);
+  }
+}
+
+
+TEST_CASE("A grown codebook interpolates the cells of the coarse codebook")
+{
+  // The first value of coarse cell (row, col) is 2 * row + col, the second is always one
+  const GlobalTopology global_topology = GENERATE(GlobalTopology::PLANE, GlobalTopology::TORUS);
+  Codebook coarse(2, 2, 2, global_topology, LocalTopology::RECT);
+  coarse.set_values({0.f, 1.f, 1.f, 1.f, 2.f, 1.f, 3.f, 1.f});
+  const Codebook grown(coarse, 4, 4);
+  REQUIRE(grown.get_height() == 4);
+  REQUIRE(grown.get_width() == 4);
+  REQUIRE(grown.get_input_dim() == 2);
+
+  // The interpolation weights of every cell sum to one
+  const auto& values = grown.get_values();
+  for (CellIndexType cell = 0; cell < 16; ++cell)
+    REQUIRE(values[2 * cell + 1] == Approx(1.f));
+
+  // The centre of the finer cell (1, 1) lies a quarter of the way from coarse cell (0, 0) to (1, 1)
+  REQUIRE(values[2 * 5] == Approx(0.75f));
+  REQUIRE(values[2 * 10] == Approx(2.25f));
+
+  if (global_topology == GlobalTopology::PLANE)
+  {
+    // The corners extend the corners of the coarse map
+    REQUIRE(values[2 * 0] == Approx(0.f));
+    REQUIRE(values[2 * 3] == Approx(1.f));
+    REQUIRE(values[2 * 12] == Approx(2.f));
+    REQUIRE(values[2 * 15] == Approx(3.f));
+  } else {
+    // The corners mix in the coarse cells across the wrap
+    REQUIRE(values[2 * 0] == Approx(0.75f));
+    REQUIRE(values[2 * 15] == Approx(2.25f));
+  }
+}
+
+
+TEST_CASE("A grown neighbourhood interpolates the radii in units of the finer cells")
+{
+  Neighbourhood coarse(2, 2, GlobalTopology::PLANE, LocalTopology::RECT, 0.5f, 3);
+  const Float radii[4] = {1.f, 2.f, 3.f, 4.f};
+  coarse.set_values(radii);
+
+  // The map grows by 2 in height and 3 in width, so a radius of r coarse cells spans 2.5 r finer cells
+  Neighbourhood grown(coarse, 4, 6);
+  REQUIRE(grown.get_num_cells() == 24);
+  REQUIRE(grown.get_update_exponent() == 0.5f);
+  REQUIRE(grown.get_radius_scale() == Approx(1.f / 2.5f));
+  REQUIRE(grown.get_values()[0] == Approx(2.5f));
+  REQUIRE(grown.get_values()[5] == Approx(5.f));
+  REQUIRE(grown.get_values()[18] == Approx(7.5f));
+  REQUIRE(grown.get_values()[23] == Approx(10.f));
+  REQUIRE(grown.get_radius_min() == Approx(2.5f));
+  REQUIRE(grown.get_radius_max() == Approx(10.f));
+
+  // The scales of several growth stages multiply
+  const Neighbourhood twice(grown, 8, 12);
+  REQUIRE(twice.get_radius_scale() == Approx(1.f / 5.f));
+  REQUIRE(twice.get_values()[0] == Approx(5.f));
+}
+
+
+// Known defect: `Neighbourhood::influence` passes the width as the height to the distance function.
+// Catch reports this test as failed once the defect is fixed, so the mark can be removed.
+TEST_CASE("The influence on a non-square torus uses the sides of the map", "[!shouldfail]")
+{
+  Neighbourhood neighbourhood(2, 6, GlobalTopology::TORUS, LocalTopology::RECT, 0.5f, 2);
+  // Cell 3 is three columns away from cell 0 in both directions, which is beyond the radius
+  REQUIRE(neighbourhood.influence(0, 3) == 0.f);
+}
@@ -0,0 +1,62 @@
+#include "catch.hpp"
+#include "../stopping.hpp"
+
+
+TEST_CASE("Early stopping waits for the diffusion error to settle")
+{
+  EarlyStoppingSettings settings;
+  settings.patience = 2;
+  settings.min_relative_improvement = 0.1f;
+
+  SECTION("Without patience, the training never stops")
+  {
+    settings.patience = 0;
+    EarlyStopping early_stopping(settings);
+    for (unsigned int epoch = 2; epoch < 10; ++epoch)
+      REQUIRE_FALSE(early_stopping.update(epoch, 1.f, 0.f, 0.f));
+    REQUIRE_FALSE(early_stopping.has_stopped());
+  }
+
+  SECTION("The training stops after the diffusion error improves too little for `patience` epochs")
+  {
+    EarlyStopping early_stopping(settings);
+    REQUIRE_FALSE(early_stopping.update(2, 4.f, 0.5f, 0.f));
+    REQUIRE_FALSE(early_stopping.update(3, 2.f, 0.5f, 0.f));
+    REQUIRE_FALSE(early_stopping.update(4, 1.9f, 0.5f, 0.f));
+    // A large improvement resets the patience
+    REQUIRE_FALSE(early_stopping.update(5, 1.f, 0.5f, 0.f));
+    REQUIRE_FALSE(early_stopping.update(6, 0.95f, 0.5f, 0.f));
+    REQUIRE(early_stopping.update(7, 1.2f, 0.5f, 0.f));
+    REQUIRE(early_stopping.has_stopped());
+    REQUIRE(early_stopping.get_stopped_epoch() == 7);
+    REQUIRE_FALSE(early_stopping.get_reason().empty());
+    REQUIRE_FALSE(early_stopping.update(8, 1.2f, 0.5f, 0.f));
+  }
+
+  SECTION("The training does not stop while an error metric exceeds its threshold")
+  {
+    settings.max_topographic_error = 0.2f;
+    EarlyStopping early_stopping(settings);
+    for (unsigned int epoch = 2; epoch < 10; ++epoch)
+      REQUIRE_FALSE(early_stopping.update(epoch, 1.f, 0.3f, 0.f));
+    REQUIRE_FALSE(early_stopping.update(10, 1.f, 0.1f, 0.f));
+    REQUIRE(early_stopping.update(11, 1.f, 0.1f, 0.f));
+  }
+}
+
+
+TEST_CASE("After early stopping, the radii still shrink to their final target")
+{
+  EarlyStoppingSettings settings;
+  settings.final_radius = 1.5f;
+  EarlyStopping early_stopping(settings);
+
+  const Float radius = 9.f;
+  const unsigned int num_epochs = GENERATE(1, 2, 5);
+  const Float exponent = early_stopping.get_update_exponent(radius, num_epochs, 0.99f);
+  REQUIRE(std::pow(radius, std::pow(exponent, num_epochs)) == Approx(1.5f));
+
+  // The radii never shrink slower than scheduled
+  REQUIRE(early_stopping.get_update_exponent(radius, num_epochs, 0.1f) == 0.1f);
+  REQUIRE(early_stopping.get_update_exponent(1.2f, num_epochs, 0.99f) == 0.99f);
+}
@@ -0,0 +1,55 @@
+#include <cstdio>
+#include <fstream>
+#include "catch.hpp"
+#include "../synth.hpp"
+
+
+TEST_CASE("The Zipf distribution only draws valid ranks")
+{
+  const IndexType num_elements = GENERATE(1, 2, 100);
+  const Double exponent = GENERATE(0.5, 1.0, 2.0);
+  ZipfDistribution zipf(num_elements, exponent);
+  Double state = 0.;
+  auto uniform = [&state]() { state = std::fmod(state + 0.618033988749895, 1.); return state; };
+  for (int i = 0; i < 1000; ++i)
+  {
+    const IndexType rank = zipf(uniform);
+    REQUIRE(1 <= rank);
+    REQUIRE(rank <= num_elements);
+  }
+}
+
+
+TEST_CASE("A synthetic corpus can be loaded and is reproducible")
+{
+  const std::string filename = std::tmpnam(nullptr);
+  SyntheticCorpusSettings settings;
+  settings.num_rows = 500;
+  settings.vocab_size = 300;
+  settings.num_clusters = 4;
+  settings.with_weights = GENERATE(true, false);
+
+  const auto num_tokens = write_synthetic_corpus(filename, settings);
+  auto* dataset = new CorpusDataset(filename);
+  REQUIRE(dataset->num_rows == settings.num_rows);
+  REQUIRE(dataset->num_cols == settings.vocab_size);
+  REQUIRE(dataset->num_non_zero == num_tokens);
+  REQUIRE(dataset->has_weights() == settings.with_weights);
+  for (IndexPointerType row = 0; row < dataset->num_rows; ++row)
+  {
+    const IndexType* const indices = dataset->indices_in_row(row);
+    REQUIRE(dataset->num_indices_in_row(row) > 0);
+    for (IndexType i = 1; i < dataset->num_indices_in_row(row); ++i)
+      REQUIRE(indices[i - 1] < indices[i]);
+  }
+  delete dataset;
+
+  REQUIRE(write_synthetic_corpus(filename, settings) == num_tokens);
+  std::remove(filename.c_str());
+
+  // Too many possible tokens are rejected before the file is created
+  settings.num_rows = 50000000;
+  settings.max_row_length = 100;
+  REQUIRE_THROWS_AS(write_synthetic_corpus(filename, settings), std::invalid_argument);
+  REQUIRE_FALSE(std::ifstream(filename).is_open());
+}
@@ -0,0 +1,50 @@
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include "catch.hpp"
+#include "../telemetry.hpp"
+
+
+TEST_CASE("The telemetry exposes the training progress in the Prometheus format")
+{
+  const std::string filename = std::tmpnam(nullptr);
+  {
+    Telemetry telemetry(filename, 0, 60.);
+    telemetry.begin_training("map", 1000);
+    telemetry.begin_epoch("map", 1);
+    telemetry.begin_phase("map", TrainingPhase::BEST_MATCHING_UNITS);
+    const int64_t phase_ns[TrainingPhase::NUM_TRAINING_PHASES] = {};
+    telemetry.end_phase("map");
+    telemetry.end_epoch("map", 2000000000, phase_ns);
+    telemetry.record_errors("map", 4, 0.5f, 2.f, 0.25f, 0.125f, 0.f, 0.f);
+
+    const std::string metrics = telemetry.render();
+    REQUIRE(metrics.find("# TYPE smap_epoch gauge") != std::string::npos);
+    REQUIRE(metrics.find("smap_epoch{map=\"map\"} 1\n") != std::string::npos);
+    REQUIRE(metrics.find("smap_epochs{map=\"map\"} 4\n") != std::string::npos);
+    REQUIRE(metrics.find("smap_completed_epochs_total{map=\"map\"} 1\n") != std::string::npos);
+    REQUIRE(metrics.find("smap_rows_per_second{map=\"map\"} 500\n") != std::string::npos);
+    REQUIRE(metrics.find("smap_eta_seconds{map=\"map\"} 8\n") != std::string::npos);
+    REQUIRE(metrics.find("smap_quantization_error{map=\"map\"} 0.25\n") != std::string::npos);
+    telemetry.end_training("map");
+    REQUIRE(telemetry.render().find("smap_done{map=\"map\"} 1\n") != std::string::npos);
+  }
+
+  // Stopping writes the final metrics atomically
+  std::ifstream input(filename);
+  std::stringstream content;
+  content << input.rdbuf();
+  REQUIRE(content.str().find("smap_done{map=\"map\"} 1\n") != std::string::npos);
+  REQUIRE(!std::ifstream(filename + ".tmp").good());
+  std::remove(filename.c_str());
+}
+
+
+TEST_CASE("The telemetry escapes the names of the maps in its labels")
+{
+  Telemetry telemetry("", 0, 60.);
+  telemetry.begin_training("dir\\\"map\"\nname", 1000);
+  const std::string metrics = telemetry.render();
+  REQUIRE(metrics.find("smap_epoch{map=\"dir\\\\\\\"map\\\"\\nname\"} ") != std::string::npos);
+  REQUIRE(metrics.find("map\"\n") == std::string::npos);
+}
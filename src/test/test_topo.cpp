@@ -147,3 +147,91 @@ SCENARIO("Distances on the hexagonal grid are correct")
     }
   }
 }
+
+
+SCENARIO("Upsampling interpolates between the closest cells of the coarser map")
+{
+  GIVEN("Any topology on the plane or the torus")
+  {
+    const auto global_topology = GENERATE(GlobalTopology::PLANE, GlobalTopology::TORUS);
+    const auto local_topology = GENERATE(LocalTopology::CIRC, LocalTopology::HEXA, LocalTopology::RECT);
+    CellIndexType cells[4];
+    Float weights[4];
+
+    WHEN("The map does not grow")
+    {
+      THEN("Every cell is its own interpolation")
+      {
+        for (CellIndexType row = 0; row < 6; ++row)
+        for (CellIndexType col = 0; col < 5; ++col)
+        {
+          upsampling_weights(row, col, 6, 5, 6, 5, global_topology, local_topology, cells, weights);
+          Float weight = 0.f;
+          for (int k = 0; k < 4; ++k)
+            weight += cells[k] == row * 5 + col ? weights[k] : 0.f;
+          REQUIRE(weight == Approx(1.f));
+        }
+      }
+    }
+
+    WHEN("The map doubles in size")
+    {
+      THEN("The weights are non-negative, sum to one, and refer to cells of the coarser map")
+      {
+        for (CellIndexType row = 0; row < 8; ++row)
+        for (CellIndexType col = 0; col < 10; ++col)
+        {
+          upsampling_weights(row, col, 8, 10, 4, 5, global_topology, local_topology, cells, weights);
+          Float sum = 0.f;
+          for (int k = 0; k < 4; ++k)
+          {
+            REQUIRE(weights[k] >= 0.f);
+            REQUIRE(cells[k] < 4 * 5);
+            sum += weights[k];
+          }
+          REQUIRE(sum == Approx(1.f));
+        }
+      }
+    }
+  }
+
+  GIVEN("A rectangular map")
+  {
+    CellIndexType cells[4];
+    Float weights[4];
+
+    WHEN("The top left cell of a doubled torus is interpolated")
+    {
+      upsampling_weights(0, 0, 8, 8, 4, 4, GlobalTopology::TORUS, LocalTopology::RECT, cells, weights);
+      THEN("It wraps around to the bottom right cells")
+      {
+        REQUIRE(cells[0] == 15);
+        REQUIRE(weights[0] == Approx(1.f / 16));
+        REQUIRE(cells[3] == 0);
+        REQUIRE(weights[3] == Approx(9.f / 16));
+      }
+    }
+
+    WHEN("The top left cell of a doubled plane is interpolated")
+    {
+      upsampling_weights(0, 0, 8, 8, 4, 4, GlobalTopology::PLANE, LocalTopology::RECT, cells, weights);
+      THEN("It only depends on the top left cell")
+      {
+        for (int k = 0; k < 4; ++k)
+          REQUIRE((cells[k] == 0 || weights[k] == 0.f));
+      }
+    }
+  }
+}
+
+
+TEST_CASE("Maps are limited to the cells that CellIndexType can enumerate")
+{
+  REQUIRE(get_num_map_cells(255, 256) == 65280);
+  REQUIRE(get_num_map_cells(1, MAX_NUM_CELLS) == MAX_NUM_CELLS);
+  REQUIRE_THROWS_AS(get_num_map_cells(MAX_NUM_CELLS, 2), std::invalid_argument);
+  if (sizeof(CellIndexType) == 2)
+    REQUIRE_THROWS_AS(get_num_map_cells(256, 256), std::invalid_argument);
+  else
+    REQUIRE(get_num_map_cells(512, 512) == 262144);
+}
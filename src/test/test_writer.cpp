@@ -0,0 +1,82 @@
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include "catch.hpp"
+#include "../writer.hpp"
+#include "../som.hpp"
+
+
+static std::string read_file(const std::string& filename)
+{
+  std::ifstream input(filename, std::ios::binary);
+  std::stringstream content;
+  content << input.rdbuf();
+  return content.str();
+}
+
+
+TEST_CASE("The background writer saves snapshots of the queued bytes in order")
+{
+  const std::string filename = std::tmpnam(nullptr);
+  // A queue smaller than the files makes every write wait for the previous one
+  AsyncWriter writer(16, FsyncPolicy::FSYNC_FILES);
+
+  std::string text = "first";
+  writer.write(filename, make_snapshot(text, nullptr, 0));
+  text = "changed after queuing";
+  std::vector<char> large(3 * WRITE_CHUNK_SIZE / 2 + 7);
+  for (size_t i = 0; i < large.size(); ++i)
+    large[i] = static_cast<char>(i * 31);
+  writer.write(filename + ".large", make_snapshot("header", large.data(), large.size()), true);
+  writer.write(filename, make_snapshot("second", nullptr, 0));
+  writer.flush();
+
+  REQUIRE(read_file(filename) == "second");
+  REQUIRE(read_file(filename + ".large") == "header" + std::string(large.begin(), large.end()));
+  REQUIRE(!std::ifstream(filename + ".large.tmp").good());
+  std::remove(filename.c_str());
+  std::remove((filename + ".large").c_str());
+}
+
+
+TEST_CASE("The background writer reports failed writes on flush")
+{
+  AsyncWriter writer;
+  writer.write("/nonexistent-directory/file.bin", make_snapshot("bytes", nullptr, 0));
+  REQUIRE_THROWS(writer.flush());
+  REQUIRE_NOTHROW(writer.flush());
+}
+
+
+TEST_CASE("The background writer keeps the errors of every file")
+{
+  AsyncWriter writer;
+  writer.write("/nonexistent-directory/first.bin", make_snapshot("bytes", nullptr, 0));
+  writer.write("/nonexistent-directory/second.bin", 5, []() { return make_snapshot("bytes", nullptr, 0); });
+  writer.wait();
+  REQUIRE(writer.take_error("/nonexistent-directory/first.bin").find("first.bin") != std::string::npos);
+  REQUIRE(writer.take_error("/nonexistent-directory/first.bin").empty());
+  REQUIRE_THROWS_WITH(writer.flush(), Catch::Contains("second.bin") && !Catch::Contains("first.bin"));
+  REQUIRE_NOTHROW(writer.flush());
+}
+
+
+TEST_CASE("Saving a codebook in the background writes the same file")
+{
+  const std::string filename = std::tmpnam(nullptr);
+  Codebook codebook(3, 4, 5, GlobalTopology::TORUS, LocalTopology::HEXA);
+  codebook.init(3, false);
+  Neighbourhood neighbourhood(3, 4, GlobalTopology::TORUS, LocalTopology::HEXA, 0.25f, 2);
+
+  AsyncWriter writer;
+  codebook.save_to_file(filename + ".async", writer);
+  neighbourhood.save_to_file(filename + ".async.radii", writer);
+  codebook.save_to_file(filename);
+  neighbourhood.save_to_file(filename + ".radii");
+  writer.flush();
+
+  REQUIRE(read_file(filename + ".async") == read_file(filename));
+  REQUIRE(read_file(filename + ".async.radii") == read_file(filename + ".radii"));
+  for (const auto* suffix : {"", ".async", ".radii", ".async.radii"})
+    std::remove((filename + suffix).c_str());
+}
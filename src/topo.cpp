@@ -1,5 +1,7 @@
 
 #include <stdexcept>      // std::invalid_argument
+#include <string>
+#include <algorithm>
 #include <assert.h>
 #include "topo.hpp"
 #include "utils.hpp"
@@ -117,3 +119,65 @@ DistanceFunction distance_function(GlobalTopology global_topology, LocalTopology
     break;
   }
 }
+
+
+CellIndexType get_num_map_cells(const uint64_t height, const uint64_t width)
+{
+  if (height > MAX_NUM_CELLS || width > MAX_NUM_CELLS || height * width > MAX_NUM_CELLS)
+    throw std::invalid_argument(
+      "A map can have at most " + std::to_string(MAX_NUM_CELLS) + " cells, for larger maps build smap with CELL_INDEX_BITS=32"
+    );
+  return static_cast<CellIndexType>(height * width);
+}
+
+
+// Upsampling /////////////////////////////////////////////////////////////////////
+
+
+static int wrap_or_clamp(const int index, const int size, const GlobalTopology global_topology)
+{
+  if (global_topology == GlobalTopology::TORUS)
+    return ((index % size) + size) % size;
+  return std::min(std::max(index, 0), size - 1);
+}
+
+
+void upsampling_weights(
+  const CellIndexType row,
+  const CellIndexType col,
+  const CellIndexType height,
+  const CellIndexType width,
+  const CellIndexType coarse_height,
+  const CellIndexType coarse_width,
+  const GlobalTopology global_topology,
+  const LocalTopology local_topology,
+  CellIndexType* const coarse_cells,
+  Float* const weights
+)
+{
+  if (global_topology != GlobalTopology::TORUS && global_topology != GlobalTopology::PLANE)
+    throw std::invalid_argument("Invalid topology specification");
+
+  const bool is_hexagonal = local_topology == LocalTopology::HEXA;
+  // Centre of the cell in the continuous coordinates of the coarse map, where cell (i, j) is centred at (i, j)
+  const double x = (col + (is_hexagonal ? 0.5 * (row & 1) : 0.) + 0.5) * coarse_width / width - 0.5;
+  const double y = (row + 0.5) * coarse_height / height - 0.5;
+
+  const int row0 = static_cast<int>(std::floor(y));
+  const double fraction_y = y - row0;
+  for (int i = 0; i < 2; ++i)
+  {
+    const int coarse_row = wrap_or_clamp(row0 + i, coarse_height, global_topology);
+    // Columns of a shifted hexagonal row start half a cell further east
+    const double row_x = x - (is_hexagonal ? 0.5 * (coarse_row & 1) : 0.);
+    const int col0 = static_cast<int>(std::floor(row_x));
+    const double fraction_x = row_x - col0;
+    const double weight_y = i == 0 ? 1. - fraction_y : fraction_y;
+    for (int j = 0; j < 2; ++j)
+    {
+      const int coarse_col = wrap_or_clamp(col0 + j, coarse_width, global_topology);
+      coarse_cells[2 * i + j] = coarse_row * coarse_width + coarse_col;
+      weights[2 * i + j] = static_cast<Float>(weight_y * (j == 0 ? 1. - fraction_x : fraction_x));
+    }
+  }
+}
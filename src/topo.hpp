@@ -57,4 +57,24 @@ inline std::string get_global_topology_string(GlobalTopology global_topology)
 
 typedef CellIndexType (*DistanceFunction) (int, int, int, int, int, int);
 
+// Number of cells of a `height` x `width` map, which throws if `CellIndexType` cannot enumerate them
+CellIndexType get_num_map_cells(const uint64_t height, const uint64_t width);
+
 DistanceFunction distance_function(GlobalTopology global_topology, LocalTopology local_topology);
+
+// The up to four cells of a `coarse_height` x `coarse_width` map around the centre of cell (`row`, `col`)
+// of a finer `height` x `width` map with the same topology, and their bilinear interpolation weights.
+// On a hexagonal grid, the odd rows of both maps are shifted by half a cell. On a torus the
+// neighbours wrap around, on a plane the cells at the border are extended.
+void upsampling_weights(
+  const CellIndexType row,
+  const CellIndexType col,
+  const CellIndexType height,
+  const CellIndexType width,
+  const CellIndexType coarse_height,
+  const CellIndexType coarse_width,
+  const GlobalTopology global_topology,
+  const LocalTopology local_topology,
+  CellIndexType* const coarse_cells,
+  Float* const weights
+);
@@ -0,0 +1,135 @@
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <unistd.h>
+#include "trace.hpp"
+
+
+std::atomic<bool> _tracing_enabled(false);
+
+static std::atomic<TraceBuffer*> trace_buffers[MAX_TRACE_THREADS];
+static std::atomic<int> num_trace_buffers(0);
+static std::atomic<int> trace_generation(0);
+static size_t trace_events_per_thread = 0;
+static int64_t trace_start_ns = 0;
+
+// Buffer of the calling thread, valid as long as `local_trace_generation` matches `trace_generation`
+static thread_local TraceBuffer* local_trace_buffer = nullptr;
+static thread_local int local_trace_generation = -1;
+
+
+TraceBuffer::TraceBuffer(size_t capacity) :
+  capacity(capacity),
+  events(new TraceEvent[capacity]),
+  num_recorded(0)
+{}
+
+
+TraceBuffer::~TraceBuffer()
+{
+  delete [] this->events;
+}
+
+
+void enable_tracing(size_t events_per_thread)
+{
+  if (events_per_thread < 1)
+    std::__throw_invalid_argument("The trace buffer needs room for at least one event");
+  disable_tracing();
+  trace_events_per_thread = events_per_thread;
+  trace_start_ns = get_nanoseconds();
+  _tracing_enabled.store(true);
+}
+
+
+void disable_tracing()
+{
+  // Only call this when no other thread records events
+  _tracing_enabled.store(false);
+  trace_generation.fetch_add(1);
+  const int num_buffers = std::min(num_trace_buffers.exchange(0), MAX_TRACE_THREADS);
+  for (int i = 0; i < num_buffers; ++i)
+  {
+    delete trace_buffers[i].exchange(nullptr);
+  }
+}
+
+
+void record_trace_event(const char* name, const int64_t start_ns, const int64_t end_ns)
+{
+  const int generation = trace_generation.load(std::memory_order_acquire);
+  if (local_trace_generation != generation)
+  {
+    // First event of this thread: claim a slot without locking
+    local_trace_generation = generation;
+    local_trace_buffer = nullptr;
+    const int slot = num_trace_buffers.fetch_add(1);
+    if (slot < MAX_TRACE_THREADS)
+    {
+      local_trace_buffer = new TraceBuffer(trace_events_per_thread);
+      trace_buffers[slot].store(local_trace_buffer, std::memory_order_release);
+    }
+  }
+  if (local_trace_buffer)
+    local_trace_buffer->record(name, start_ns, end_ns);
+}
+
+
+static void write_json_string(std::ostream& os, const char* text)
+{
+  os << '"';
+  for (const char* c = text; *c; ++c)
+  {
+    if (*c == '"' || *c == '\\')
+      os << '\\';
+    os << *c;
+  }
+  os << '"';
+}
+
+
+void save_trace_to_file(const std::string& filename)
+{
+  std::cout << "Saving trace to '" << filename << "'" << std::endl;
+  std::ofstream file;
+  file.open(filename, std::ios::out);
+
+  if (!file.is_open())
+    std::__throw_runtime_error("Unable to save trace to file");
+
+  const int pid = getpid();
+  const int num_buffers = std::min(num_trace_buffers.load(), MAX_TRACE_THREADS);
+  uint64_t num_dropped = 0;
+
+  file << std::fixed << std::setprecision(3);
+  file << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [" << std::endl;
+  file << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": " << pid << ", \"args\": {\"name\": \"smap\"}}";
+  for (int tid = 0; tid < num_buffers; ++tid)
+  {
+    const TraceBuffer* const buffer = trace_buffers[tid].load(std::memory_order_acquire);
+    if (!buffer)
+      continue;
+
+    file << "," << std::endl
+         << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": " << pid << ", \"tid\": " << tid
+         << ", \"args\": {\"name\": \"thread " << tid << "\"}}";
+
+    const uint64_t num_recorded = buffer->num_recorded.load(std::memory_order_acquire);
+    const uint64_t first = num_recorded > buffer->capacity ? num_recorded - buffer->capacity : 0;
+    num_dropped += first;
+    for (uint64_t i = first; i < num_recorded; ++i)
+    {
+      const TraceEvent& event = buffer->events[i % buffer->capacity];
+      file << "," << std::endl << "{\"name\": ";
+      write_json_string(file, event.name);
+      file << ", \"ph\": \"X\", \"pid\": " << pid << ", \"tid\": " << tid
+           << ", \"ts\": " << (event.start_ns - trace_start_ns) * 1e-3
+           << ", \"dur\": " << (event.end_ns - event.start_ns) * 1e-3 << "}";
+    }
+  }
+  file << std::endl << "]}" << std::endl;
+  file.close();
+
+  if (num_dropped > 0)
+    std::cout << "WARNING: The trace buffers overflowed; dropped the " << num_dropped << " oldest events" << std::endl;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <string>
+#include <atomic>
+#include "data.hpp"
+#include "utils.hpp"
+
+
+// Maximal number of threads that can record trace events
+#define MAX_TRACE_THREADS 1024
+
+
+// One span of work on one thread, written as a "complete" event ("ph": "X") to the trace
+struct TraceEvent
+{
+  const char* name;  // Must be a string literal, since only the pointer is stored
+  int64_t start_ns;
+  int64_t end_ns;
+};
+
+
+// Ring buffer of trace events that is only written by its owning thread.
+// When the buffer is full, the oldest events are overwritten.
+class TraceBuffer
+{
+public:
+  TraceBuffer(size_t capacity);
+  ~TraceBuffer();
+
+  inline void record(const char* name, const int64_t start_ns, const int64_t end_ns)
+  {
+    const uint64_t count = this->num_recorded.load(std::memory_order_relaxed);
+    this->events[count % this->capacity] = {name, start_ns, end_ns};
+    this->num_recorded.store(count + 1, std::memory_order_release);
+  }
+
+  size_t capacity;
+  TraceEvent* events;
+  std::atomic<uint64_t> num_recorded;
+};
+
+
+extern std::atomic<bool> _tracing_enabled;
+
+inline bool is_tracing_enabled()
+{
+  return _tracing_enabled.load(std::memory_order_relaxed);
+}
+
+// Start recording up to `events_per_thread` most recent events on every thread
+void enable_tracing(size_t events_per_thread);
+// Stop recording and discard all events
+void disable_tracing();
+void record_trace_event(const char* name, const int64_t start_ns, const int64_t end_ns);
+// Write all recorded events in the Chrome trace-event JSON format (readable by chrome://tracing and Perfetto)
+void save_trace_to_file(const std::string& filename);
+
+
+// Records the time between construction and destruction on the calling thread
+class TraceScope
+{
+public:
+  inline TraceScope(const char* name) :
+    name(name),
+    start_ns(is_tracing_enabled() ? get_nanoseconds() : 0)
+  {}
+
+  inline ~TraceScope()
+  {
+    if (this->start_ns != 0 && is_tracing_enabled())
+      record_trace_event(this->name, this->start_ns, get_nanoseconds());
+  }
+
+private:
+  const char* name;
+  const int64_t start_ns;
+};
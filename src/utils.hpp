@@ -37,6 +37,13 @@ inline int64_t get_unix_time()
 }
 
 
+// Monotonic time with nanosecond resolution, for measuring durations
+inline int64_t get_nanoseconds()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
 template<class T> 
 inline T squared(T x)
 {
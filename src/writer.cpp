@@ -0,0 +1,204 @@
+#include <iostream>
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include "writer.hpp"
+
+
+static void sync_directory_of(const std::string& filename)
+{
+  const size_t separator = filename.find_last_of('/');
+  const std::string directory = separator == std::string::npos ? "." : filename.substr(0, separator + 1);
+  const int file_descriptor = ::open(directory.c_str(), O_RDONLY);
+  if (file_descriptor >= 0)
+  {
+    ::fsync(file_descriptor);
+    ::close(file_descriptor);
+  }
+}
+
+
+void write_file(const std::string& filename, const char* const data, const size_t size, const FsyncPolicy fsync_policy, const bool is_atomic, const bool is_durable)
+{
+  const std::string target_filename = is_atomic ? filename + ".tmp" : filename;
+  const int file_descriptor = ::open(target_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (file_descriptor < 0)
+    std::__throw_runtime_error(("Unable to open '" + target_filename + "' for writing").c_str());
+
+  size_t offset = 0;
+  while (offset < size)
+  {
+    const ssize_t num_written = ::write(file_descriptor, data + offset, std::min<size_t>(size - offset, WRITE_CHUNK_SIZE));
+    if (num_written < 0 && errno == EINTR)
+      continue;
+    if (num_written <= 0)
+    {
+      const std::string reason = std::strerror(errno);
+      ::close(file_descriptor);
+      std::__throw_runtime_error(("Failed writing '" + target_filename + "' (" + reason + ")").c_str());
+    }
+    offset += num_written;
+  }
+
+  // A durable atomic file must be on disk before the rename makes it visible
+  if (((is_atomic && is_durable) || fsync_policy != FsyncPolicy::NO_FSYNC) && ::fsync(file_descriptor) != 0)
+  {
+    ::close(file_descriptor);
+    std::__throw_runtime_error(("Failed flushing '" + target_filename + "' to disk").c_str());
+  }
+  if (::close(file_descriptor) != 0)
+    std::__throw_runtime_error(("Failed closing '" + target_filename + "'").c_str());
+
+  if (is_atomic && std::rename(target_filename.c_str(), filename.c_str()) != 0)
+    std::__throw_runtime_error(("Unable to replace '" + filename + "'").c_str());
+  if (fsync_policy == FsyncPolicy::FSYNC_FILES_AND_DIRECTORIES)
+    sync_directory_of(filename);
+}
+
+
+std::vector<char> make_snapshot(const std::string& header, const void* const data, const size_t num_bytes, const std::string& trailer)
+{
+  std::vector<char> bytes(header.size() + num_bytes + trailer.size());
+  std::memcpy(bytes.data(), header.data(), header.size());
+  if (num_bytes > 0)
+    std::memcpy(bytes.data() + header.size(), data, num_bytes);
+  std::memcpy(bytes.data() + header.size() + num_bytes, trailer.data(), trailer.size());
+  return bytes;
+}
+
+
+AsyncWriter::AsyncWriter(const size_t max_queued_bytes, const FsyncPolicy fsync_policy) :
+  max_queued_bytes(max_queued_bytes),
+  fsync_policy(fsync_policy),
+  queued_bytes(0),
+  is_writing(false),
+  should_stop(false)
+{
+  this->thread = std::thread(&AsyncWriter::run, this);
+}
+
+
+AsyncWriter::~AsyncWriter()
+{
+  {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->should_stop = true;
+  }
+  this->has_work.notify_one();
+  this->thread.join();
+  for (const auto& error : this->errors)
+    std::cerr << "WARNING: " << error.second << std::endl;
+}
+
+
+void AsyncWriter::write(const std::string& filename, std::vector<char>&& bytes, const bool is_atomic)
+{
+  const size_t num_bytes = bytes.size();
+  this->push({filename, std::move(bytes), nullptr, num_bytes, is_atomic});
+}
+
+
+void AsyncWriter::write(const std::string& filename, const size_t num_bytes, std::function<std::vector<char>()>&& serialize, const bool is_atomic)
+{
+  this->push({filename, std::vector<char>(), std::move(serialize), num_bytes, is_atomic});
+}
+
+
+void AsyncWriter::push(Job&& job)
+{
+  {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    // A file larger than the queue is queued as soon as the queue is empty
+    this->has_space.wait(lock, [&]() {
+      return this->queued_bytes == 0 || this->queued_bytes + job.num_queued_bytes <= this->max_queued_bytes;
+    });
+    this->queued_bytes += job.num_queued_bytes;
+    this->queue.push_back(std::move(job));
+  }
+  this->has_work.notify_one();
+}
+
+
+void AsyncWriter::wait()
+{
+  std::unique_lock<std::mutex> lock(this->mutex);
+  this->has_space.wait(lock, [&]() { return this->queue.empty() && !this->is_writing; });
+}
+
+
+std::string AsyncWriter::take_error(const std::string& filename)
+{
+  std::unique_lock<std::mutex> lock(this->mutex);
+  for (auto error = this->errors.begin(); error != this->errors.end(); ++error)
+  {
+    if (error->first == filename)
+    {
+      const std::string message = error->second;
+      this->errors.erase(error);
+      return message;
+    }
+  }
+  return "";
+}
+
+
+void AsyncWriter::flush()
+{
+  this->wait();
+  std::unique_lock<std::mutex> lock(this->mutex);
+  if (this->errors.empty())
+    return;
+
+  std::string message;
+  for (const auto& error : this->errors)
+    message += (message.empty() ? "" : "; ") + error.second;
+  this->errors.clear();
+  std::__throw_runtime_error(message.c_str());
+}
+
+
+void AsyncWriter::run()
+{
+  std::unique_lock<std::mutex> lock(this->mutex);
+  while (true)
+  {
+    this->has_work.wait(lock, [&]() { return !this->queue.empty() || this->should_stop; });
+    if (this->queue.empty())
+      return;
+
+    Job job = std::move(this->queue.front());
+    this->queue.pop_front();
+    this->is_writing = true;
+    lock.unlock();
+
+    std::string error;
+    try {
+      if (job.serialize)
+        job.bytes = job.serialize();
+      write_file(job.filename, job.bytes.data(), job.bytes.size(), this->fsync_policy, job.is_atomic);
+    } catch (const std::exception& e) {
+      error = e.what();
+    }
+    const size_t num_bytes = job.num_queued_bytes;
+    // Free the bytes and the snapshot before the next file
+    job.bytes = std::vector<char>();
+    job.serialize = nullptr;
+
+    lock.lock();
+    this->is_writing = false;
+    this->queued_bytes -= num_bytes;
+    // Every file keeps the error of its last failed write
+    if (!error.empty())
+    {
+      auto previous = std::find_if(this->errors.begin(), this->errors.end(), [&](const std::pair<std::string, std::string>& other) { return other.first == job.filename; });
+      if (previous != this->errors.end())
+        previous->second = error;
+      else
+        this->errors.emplace_back(job.filename, error);
+    }
+    this->has_space.notify_all();
+  }
+}
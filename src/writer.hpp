@@ -0,0 +1,79 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+
+#define WRITE_CHUNK_SIZE (1 << 22)  // Number of bytes per write() call, at offsets that are multiples of it
+
+
+enum FsyncPolicy
+{
+  NO_FSYNC=0, FSYNC_FILES=1, FSYNC_FILES_AND_DIRECTORIES=2
+};
+
+
+// Write `size` bytes at `data` to `filename` in large chunks. If `is_atomic`, write a temporary
+// file, flush it to disk, and rename it, so the file is always complete. Without `is_durable`, the
+// temporary file is only flushed by the `fsync_policy`, so readers still never see a partial file,
+// but it may not survive a crash of the system.
+void write_file(const std::string& filename, const char* const data, const size_t size, const FsyncPolicy fsync_policy, const bool is_atomic = false, const bool is_durable = true);
+
+
+// Copy of `header` followed by `num_bytes` bytes at `data` and `trailer`, to be written later
+std::vector<char> make_snapshot(const std::string& header, const void* const data, const size_t num_bytes, const std::string& trailer = "");
+
+
+// Writes files on a background thread, so the training does not wait for the disk.
+// Every file is a snapshot of its bytes when it was queued, and the files are written in order.
+// Queuing blocks only while the queue holds more than `max_queued_bytes`.
+class AsyncWriter
+{
+public:
+  AsyncWriter(const size_t max_queued_bytes = 1ul << 30, const FsyncPolicy fsync_policy = FsyncPolicy::NO_FSYNC);
+  ~AsyncWriter();
+
+  void write(const std::string& filename, std::vector<char>&& bytes, const bool is_atomic = false);
+  // Queue a file whose bytes `serialize` produces on the background thread, e.g. from a snapshot
+  // that it owns. The `num_bytes` of the snapshot count against the queue until the file is written.
+  void write(const std::string& filename, const size_t num_bytes, std::function<std::vector<char>()>&& serialize, const bool is_atomic = false);
+  // Wait until all queued files are written
+  void wait();
+  // Error of the last failed write of `filename` since its last report, or an empty string, which
+  // `flush` then no longer reports
+  std::string take_error(const std::string& filename);
+  // Wait until all queued files are written, and throw the errors of all files whose writes failed
+  void flush();
+
+private:
+  struct Job
+  {
+    std::string filename;
+    std::vector<char> bytes;
+    std::function<std::vector<char>()> serialize;  // Produces the bytes if set
+    size_t num_queued_bytes;
+    bool is_atomic;
+  };
+
+  void push(Job&& job);
+
+  void run();
+
+  const size_t max_queued_bytes;
+  const FsyncPolicy fsync_policy;
+  std::deque<Job> queue;
+  size_t queued_bytes;
+  bool is_writing;
+  bool should_stop;
+  std::vector<std::pair<std::string, std::string>> errors;  // Filename and error of every failed file
+  std::mutex mutex;
+  std::condition_variable has_work;
+  std::condition_variable has_space;
+  std::thread thread;
+};